@@ -1,4 +1,24 @@
 #include "render3d.h"
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <cmath>
+#include <cfloat>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dlfcn.h>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define R3D_SIMD_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define R3D_SIMD_NEON
+#endif
 
 namespace render3d
 {
@@ -6,71 +26,370 @@ namespace render3d
     {
         return c == '\n' || c == '\r';
     }
+
+    // ---- obj tokenizer ----
+    // 与locale无关的数值解析, 直接在[ptr, end)上工作, 不要求'\0'结尾, 也不改写输入.
+    // 解析失败(该位置不是数字)时输出0并原地返回, 和行尾遇到缺省分量时的处理一致.
+    static inline bool IsObjSpace(char c)
+    {
+        return c == ' ' || c == '\t';
+    }
+
+    static inline bool IsDigitChar(char c)
+    {
+        return (unsigned)(c - '0') < 10u;
+    }
+
+    static inline const char* SkipObjSpaces(const char* ptr, const char* end)
+    {
+        while (ptr < end && IsObjSpace(*ptr))
+        {
+            ptr++;
+        }
+        return ptr;
+    }
+
+    static const char* ParseObjInt(const char* ptr, const char* end, int* out)
+    {
+        ptr = SkipObjSpaces(ptr, end);
+        bool negative = false;
+        if (ptr < end && (*ptr == '-' || *ptr == '+'))
+        {
+            negative = (*ptr == '-');
+            ptr++;
+        }
+
+        int value = 0;
+        while (ptr < end && IsDigitChar(*ptr))
+        {
+            value = value * 10 + (*ptr - '0');
+            ptr++;
+        }
+        *out = negative ? -value : value;
+        return ptr;
+    }
+
+    static const char* ParseObjFloat(const char* ptr, const char* end, float* out)
+    {
+        // 10^0 ~ 10^22 在double里都是精确值
+        static const double POW10[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+        };
+
+        ptr = SkipObjSpaces(ptr, end);
+        bool negative = false;
+        if (ptr < end && (*ptr == '-' || *ptr == '+'))
+        {
+            negative = (*ptr == '-');
+            ptr++;
+        }
+
+        // 最多累计19位有效数字, 超出部分只影响指数
+        uint64_t mantissa = 0;
+        int exponent = 0;
+        while (ptr < end && IsDigitChar(*ptr))
+        {
+            if (mantissa < 1000000000000000000ULL)
+                mantissa = mantissa * 10 + (*ptr - '0');
+            else
+                exponent++;
+            ptr++;
+        }
+
+        if (ptr < end && *ptr == '.')
+        {
+            ptr++;
+            while (ptr < end && IsDigitChar(*ptr))
+            {
+                if (mantissa < 1000000000000000000ULL)
+                {
+                    mantissa = mantissa * 10 + (*ptr - '0');
+                    exponent--;
+                }
+                ptr++;
+            }
+        }
+
+        if (ptr < end && (*ptr == 'e' || *ptr == 'E'))
+        {
+            int exp_value = 0;
+            ptr = ParseObjInt(ptr + 1, end, &exp_value);
+            exponent += exp_value;
+        }
+
+        double value = (double)mantissa;
+        if (exponent < 0)
+        {
+            value = (-exponent <= 22) ? value / POW10[-exponent] : value * std::pow(10.0, exponent);
+        }
+        else if (exponent > 0)
+        {
+            value = (exponent <= 22) ? value * POW10[exponent] : value * std::pow(10.0, exponent);
+        }
+        *out = (float)(negative ? -value : value);
+        return ptr;
+    }
+
+    // 解析一个面顶点: v, v/t, v//n, v/t/n
+    static const char* ParseObjFaceVertex(const char* ptr, const char* end, int* v, int* t, int* n)
+    {
+        ptr = ParseObjInt(ptr, end, v);
+        if (ptr < end && *ptr == '/')
+        {
+            ptr++;
+            if (ptr < end && *ptr == '/')
+            {
+                ptr = ParseObjInt(ptr + 1, end, n);
+            }
+            else
+            {
+                ptr = ParseObjInt(ptr, end, t);
+                if (ptr < end && *ptr == '/')
+                {
+                    ptr = ParseObjInt(ptr + 1, end, n);
+                }
+            }
+        }
+        return ptr;
+    }
     
-    std::string ReadTextFile(const std::string& text_file)
+    FileView::FileView()
+    {
+    }
+
+    FileView::~FileView()
+    {
+        Close();
+    }
+
+    bool FileView::Open(const std::string& file, MapMode mode, bool sequential)
     {
-        auto statusOr = PathToResourceAsFile(text_file);
+        Close();
+
+        auto statusOr = PathToResourceAsFile(file);
         if (statusOr.status() != render3d::OkStatus())
         {
-            return "";
+            return false;
         }
-        std::string abs_model_file = statusOr.ValueOrDie();
-        FILE* file = fopen(abs_model_file.c_str(), "r");
-        if (file == nullptr)
+        std::string abs_file = statusOr.ValueOrDie();
+        int fd = open(abs_file.c_str(), O_RDONLY);
+        if (fd < 0)
         {
-            return "";
+            return false;
         }
-        
-        // read it to a memory chunk
-        fseek(file, 0, SEEK_END);
-        int file_size = ftell(file);
 
-        fseek(file, 0, SEEK_SET);
-        char* content = new char[file_size + 1];
-        fread(content, file_size, 1, file);
-        fclose(file);
-        content[file_size] = 0;
-        std::string res(content);
-        delete []content;
-        content = nullptr;
-        return res;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0)
+        {
+            close(fd);
+            return false;
+        }
+        size_t size = (size_t)st.st_size;
+
+        int prot = mode == MAP_COPY_ON_WRITE ? (PROT_READ | PROT_WRITE) : PROT_READ;
+        void* addr = mmap(nullptr, size, prot, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED)
+        {
+            if (sequential)
+            {
+                madvise(addr, size, MADV_SEQUENTIAL);
+            }
+            m_data = (char*)addr;
+            m_mapped = true;
+        }
+        else
+        {
+            // 回退: 整块读入
+            char* content = new char[size];
+            size_t read_size = 0;
+            while (read_size < size)
+            {
+                ssize_t n = read(fd, content + read_size, size - read_size);
+                if (n <= 0)
+                    break;
+                read_size += n;
+            }
+            if (read_size != size)
+            {
+                delete[] content;
+                close(fd);
+                return false;
+            }
+            m_data = content;
+            m_mapped = false;
+        }
+        close(fd);
+
+        m_size = size;
+        m_mode = mode;
+        return true;
+    }
+
+    void FileView::Close()
+    {
+        if (m_data != nullptr)
+        {
+            if (m_mapped)
+                munmap(m_data, m_size);
+            else
+                delete[] m_data;
+        }
+        m_data = nullptr;
+        m_size = 0;
+        m_mapped = false;
+    }
+
+    const char* FileView::GetData() const
+    {
+        return m_data;
+    }
+
+    char* FileView::GetMutableData()
+    {
+        return m_mode == MAP_COPY_ON_WRITE ? m_data : nullptr;
+    }
+
+    size_t FileView::GetSize() const
+    {
+        return m_size;
+    }
+
+    bool FileView::IsOpen() const
+    {
+        return m_data != nullptr;
+    }
+
+    std::string ReadTextFile(const std::string& text_file)
+    {
+        FileView view;
+        if (!view.Open(text_file))
+        {
+            return "";
+        }
+        // 和原来按C字符串读入一样, 到第一个'\0'为止
+        return std::string(view.GetData(), strnlen(view.GetData(), view.GetSize()));
     }
     
     // 这里内部new了一块内存, 需在外部用完后释放
+    // 只需要读的场合直接用FileView, 可以省掉这次拷贝
     unsigned char* AllocateBinaryFileBuffer(const std::string& shader_file, size_t &buf_size)
     {
-        std::string abs_model_file = PathToResourceAsFile(shader_file).ValueOrDie();
-        FILE* file = fopen(abs_model_file.c_str(), "r");
-        // read it to a memory chunk
-        fseek(file, 0, SEEK_END);
-        int file_size = ftell(file);
-        fseek(file, 0, SEEK_SET);
-        char* content = new char[file_size];
-        fread(content, file_size, 1, file);
-        fclose(file);
-        buf_size = file_size;
-        return (unsigned char*)content;
+        FileView view;
+        if (!view.Open(shader_file))
+        {
+            buf_size = 0;
+            return nullptr;
+        }
+        unsigned char* content = new unsigned char[view.GetSize()];
+        memcpy(content, view.GetData(), view.GetSize());
+        buf_size = view.GetSize();
+        return content;
+    }
+
+    // 注入到每个顶点shader前面的解码宏. shader里用
+    // R3D_DECODE_POSITION(a_position) / R3D_DECODE_NORMAL(a_normal) 取得模型空间的值.
+    // uv不需要解码: half float和unorm16在顶点获取阶段就已经转成了float
+    static const char* VERTEX_DECODE_GLSL =
+        "#ifdef R3D_QUANTIZED_POSITION\n"
+        "uniform mat4 matPosDequant;\n"
+        "#define R3D_DECODE_POSITION(p) ((matPosDequant * vec4((p).xyz, 1.0)).xyz)\n"
+        "#else\n"
+        "#define R3D_DECODE_POSITION(p) ((p).xyz)\n"
+        "#endif\n"
+        "#ifdef R3D_OCT_NORMAL\n"
+        "vec3 r3dOctDecode(vec2 e)\n"
+        "{\n"
+        "    vec3 v = vec3(e.xy, 1.0 - abs(e.x) - abs(e.y));\n"
+        "    float t = max(-v.z, 0.0);\n"
+        "    v.x += v.x >= 0.0 ? -t : t;\n"
+        "    v.y += v.y >= 0.0 ? -t : t;\n"
+        "    return normalize(v);\n"
+        "}\n"
+        "#define R3D_DECODE_NORMAL(n) r3dOctDecode((n).xy)\n"
+        "#else\n"
+        "#define R3D_DECODE_NORMAL(n) ((n).xyz)\n"
+        "#endif\n"
+        "#ifdef R3D_INSTANCED\n"
+        "#if __VERSION__ >= 130\n"
+        "in mat4 a_instance_world;\n"
+        "#else\n"
+        "attribute mat4 a_instance_world;\n"
+        "#endif\n"
+        "#define R3D_MAT_WORLD a_instance_world\n"
+        "#define R3D_MAT_WORLD_VIEW (matView * a_instance_world)\n"
+        "#define R3D_MAT_WVP (matViewProjection * a_instance_world)\n"
+        "#else\n"
+        "#define R3D_MAT_WORLD matWorld\n"
+        "#define R3D_MAT_WORLD_VIEW matWorldView\n"
+        "#define R3D_MAT_WVP matWVP\n"
+        "#endif\n";
+
+    // 以多段源码提交编译, 省去拼接macros和文件内容的拷贝. 不等待结果, 驱动支持时可以并行编译
+    static GLuint SubmitShaderSources(GLenum type, const GLchar** sources, const GLint* lengths, int count)
+    {
+        GLuint shader = glCreateShader(type);
+        if (shader == 0)
+        {
+            return 0;
+        }
+        glShaderSource(shader, count, sources, lengths);
+        glCompileShader(shader);
+        return shader;
+    }
+
+    // 编译或链接失败时打印驱动给的日志
+    static void PrintInfoLog(GLuint object, bool is_program)
+    {
+        GLchar    buff[1024];
+        GLsizei     length;
+        if (is_program)
+            glGetProgramInfoLog(object, 1024, &length, buff);
+        else
+            glGetShaderInfoLog(object, 1024, &length, buff);
+        printf("length:%i\nlog:'%s'\n", length, buff);
+    }
+
+    static bool CheckShaderCompiled(GLuint shader)
+    {
+        GLint status = GL_FALSE;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+        if (!status)
+        {
+            PrintInfoLog(shader, false);
+            return false;
+        }
+        return true;
     }
     
-    // shader内置的会被系统自动更新的uniform.
-    std::list<std::string>& Program::GetAvailableBuiltinUniforms()
-    {
-        static std::list<std::string> AVAILABLE_BUILTIN_UNIFORMS =
-        {
-            "matWorld",
-            "matView",
-            "matProjection",
-            "matWorldView",
-            "matViewProjection",
-            "matWVP",
-            "diffuseEnvMap",
-            "specularEnvMap",
-            "iblBrdfLutMap",
-            "iblDiffuseEnvMap",
-            "iblSpecularEnvMap",
-            // 需要什么自行添加实现
-        };
-        return AVAILABLE_BUILTIN_UNIFORMS;
+    // shader内置的会被系统自动更新的uniform, 按BuiltinUniform下标
+    static constexpr const char* BUILTIN_UNIFORM_NAMES[BUILTIN_UNIFORM_COUNT] =
+    {
+        "matWorld",
+        "matView",
+        "matProjection",
+        "matWorldView",
+        "matViewProjection",
+        "matWVP",
+        "diffuseEnvMap",
+        "specularEnvMap",
+        "iblBrdfLutMap",
+        "iblDiffuseEnvMap",
+        "iblSpecularEnvMap",
+        // 需要什么自行添加实现
+    };
+
+    // 内置uniform block的绑定点, 见FrameConstants/ObjectConstants/Material
+    static const GLuint FRAME_UNIFORM_BINDING = 0;
+    static const GLuint OBJECT_UNIFORM_BINDING = 1;
+    static const GLuint MATERIAL_UNIFORM_BINDING = 2;
+
+    static const char* VERTEX_ATTRIB_NAMES[VERTEX_ATTRIB_SLOT_COUNT] =
+    {
+        "a_position",
+        "a_texcoord",
+        "a_normal",
+        "a_instance_world",
     };
     
     Program::Program()
@@ -79,6 +398,8 @@ namespace render3d
     
     Program::~Program()
     {
+        if (m_vert_shader) glDeleteShader(m_vert_shader);
+        if (m_frag_shader) glDeleteShader(m_frag_shader);
         if (m_gl_program > 0)
         {
             glDeleteProgram(m_gl_program);
@@ -88,50 +409,174 @@ namespace render3d
 
     bool Program::LoadAndCompile(const std::string& vert_file, const std::string& frag_file, const std::string& macros)
     {
-        GLuint vert_shader = 0;
-        GLuint frag_shader = 0;
-        GLint ok = GL_TRUE;
-        
+        return BeginCompile(vert_file, frag_file, macros) && FinishCompile();
+    }
+
+    // 文件开头#version行(含换行)的长度, 没有时为0. #version必须在所有宏之前
+    static size_t GetShaderVersionLength(const char* src, size_t size)
+    {
+        size_t pos = 0;
+        while (pos < size && (src[pos] == ' ' || src[pos] == '\t' || src[pos] == '\r' || src[pos] == '\n'))
+            pos++;
+        static const char VERSION_DIRECTIVE[] = "#version";
+        if (size - pos < sizeof(VERSION_DIRECTIVE) - 1 || memcmp(src + pos, VERSION_DIRECTIVE, sizeof(VERSION_DIRECTIVE) - 1) != 0)
+            return 0;
+        while (pos < size && src[pos] != '\n')
+            pos++;
+        return pos < size ? pos + 1 : pos;
+    }
+
+    bool Program::BeginCompile(const std::string& vert_file, const std::string& frag_file, const std::string& macros)
+    {
+        // 源码直接从映射的文件里提交给驱动: [#version行, macros, "\n", (解码宏), 文件其余内容]
+        std::string shader_prefix = macros + "\n";
+        FileView vert_src, frag_src;
+        if (!vert_src.Open(vert_file) || !frag_src.Open(frag_file))
+        {
+            return false;
+        }
+
         GLuint program = glCreateProgram();
         if (program == 0) {
             return false;
         }
         
-        std::string shader_prefix = macros + "\n";
-        std::string vert_src = ReadTextFile(vert_file);
-        std::string full_vert_src = shader_prefix + vert_src;
-        ok = ok && GlhCompileShader(GL_VERTEX_SHADER, full_vert_src.c_str(), &vert_shader);
-            
-        std::string frag_src = ReadTextFile(frag_file);
-        std::string full_frag_src = shader_prefix + frag_src;
-        ok = ok && GlhCompileShader(GL_FRAGMENT_SHADER, full_frag_src.c_str(), &frag_shader);
-        
-        if (ok) {
-            glAttachShader(program, vert_shader);
-            glAttachShader(program, frag_shader);
-            
+        // 顶点shader额外带上顶点格式的解码宏
+        size_t vert_version = GetShaderVersionLength(vert_src.GetData(), vert_src.GetSize());
+        const GLchar* vert_sources[4] = { vert_src.GetData(), shader_prefix.c_str(), VERTEX_DECODE_GLSL, vert_src.GetData() + vert_version };
+        const GLint vert_lengths[4] = { (GLint)vert_version, (GLint)shader_prefix.length(), (GLint)strlen(VERTEX_DECODE_GLSL), (GLint)(vert_src.GetSize() - vert_version) };
+        m_vert_shader = SubmitShaderSources(GL_VERTEX_SHADER, vert_sources, vert_lengths, 4);
+
+        size_t frag_version = GetShaderVersionLength(frag_src.GetData(), frag_src.GetSize());
+        const GLchar* frag_sources[3] = { frag_src.GetData(), shader_prefix.c_str(), frag_src.GetData() + frag_version };
+        const GLint frag_lengths[3] = { (GLint)frag_version, (GLint)shader_prefix.length(), (GLint)(frag_src.GetSize() - frag_version) };
+        m_frag_shader = SubmitShaderSources(GL_FRAGMENT_SHADER, frag_sources, frag_lengths, 3);
+
+        if (m_vert_shader == 0 || m_frag_shader == 0)
+        {
+            if (m_vert_shader) glDeleteShader(m_vert_shader);
+            if (m_frag_shader) glDeleteShader(m_frag_shader);
+            m_vert_shader = m_frag_shader = 0;
+            glDeleteProgram(program);
+            return false;
+        }
+
+        // 编译失败时链接也会失败, 在FinishCompile里统一检查
+        glAttachShader(program, m_vert_shader);
+        glAttachShader(program, m_frag_shader);
+        if (m_binary_retrievable)
+        {
+            glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        }
+        glLinkProgram(program);
+        m_gl_program = program;
+        return true;
+    }
+
+    bool Program::IsCompileComplete() const
+    {
+        GLint complete = GL_TRUE;
+        glGetProgramiv(m_gl_program, GL_COMPLETION_STATUS_KHR, &complete);
+        return complete == GL_TRUE;
+    }
+
+    bool Program::FinishCompile()
+    {
+        GLuint program = m_gl_program;
+        m_gl_program = 0;
+        bool ok = CheckShaderCompiled(m_vert_shader) && CheckShaderCompiled(m_frag_shader);
+        if (ok)
+        {
             GLint status;
-            glLinkProgram(program);
             glGetProgramiv(program, GL_LINK_STATUS, &status);
             if (!status)
             {
-                GLchar    buff[1024];
-                GLsizei     length;
-                glGetProgramInfoLog(program, 1024, &length, buff);
-                printf("length:%i\nlog:'%s'\n", length, buff);
-                return false;
+                PrintInfoLog(program, true);
+                ok = false;
             }
         }
         
-        if (vert_shader) glDeleteShader(vert_shader);
-        if (frag_shader) glDeleteShader(frag_shader);
+        glDeleteShader(m_vert_shader);
+        glDeleteShader(m_frag_shader);
+        m_vert_shader = m_frag_shader = 0;
         
         if (!ok) {
             glDeleteProgram(program);
-            program = 0;
             return false;
         }
 
+        ExtractActiveVariables(program);
+        m_gl_program = program;
+        return true;
+    }
+
+    bool Program::LoadFromBinary(GLenum binary_format, const void* binary, GLsizei length)
+    {
+        GLuint program = glCreateProgram();
+        if (program == 0) {
+            return false;
+        }
+        // 驱动升级后旧的binary会被拒绝, 由调用方回退到源码编译
+        glProgramBinary(program, binary_format, binary, length);
+        GLint status = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if (!status)
+        {
+            glDeleteProgram(program);
+            return false;
+        }
+
+        ExtractActiveVariables(program);
+        m_gl_program = program;
+        return true;
+    }
+
+    bool Program::GetBinary(GLenum* out_binary_format, std::string* out_binary) const
+    {
+        GLint length = 0;
+        glGetProgramiv(m_gl_program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+        {
+            return false;
+        }
+        out_binary->resize(length);
+        GLsizei written = 0;
+        glGetProgramBinary(m_gl_program, length, &written, out_binary_format, &(*out_binary)[0]);
+        out_binary->resize(written);
+        return written > 0;
+    }
+
+    void Program::SetBinaryRetrievable(bool retrievable)
+    {
+        m_binary_retrievable = retrievable;
+    }
+
+    static int GetUniformComponentCount(GLenum type)
+    {
+        switch (type)
+        {
+        case GL_FLOAT_VEC2:
+        case GL_INT_VEC2:
+            return 2;
+        case GL_FLOAT_VEC3:
+        case GL_INT_VEC3:
+            return 3;
+        case GL_FLOAT_VEC4:
+        case GL_INT_VEC4:
+        case GL_FLOAT_MAT2:
+            return 4;
+        case GL_FLOAT_MAT3:
+            return 9;
+        case GL_FLOAT_MAT4:
+            return 16;
+        default:
+            // float, int, bool, sampler
+            return 1;
+        }
+    }
+
+    void Program::ExtractActiveVariables(GLuint program)
+    {
         // extract all available uniforms and attribs
         char buf[1024];
         int active_attribs = 0;
@@ -145,6 +590,22 @@ namespace render3d
             attrib.name = buf;
             attrib.location = glGetAttribLocation(program, buf);
             m_attribs[attrib.name] = attrib;
+
+            for (int slot=0; slot<VERTEX_ATTRIB_SLOT_COUNT; slot++)
+            {
+                if (attrib.name == VERTEX_ATTRIB_NAMES[slot])
+                {
+                    m_attrib_slot_locations[slot] = attrib.location;
+                }
+            }
+        }
+
+        // 材质参数可以放在R3DMaterial block里, 由Material整块上传
+        GLuint material_block = glGetUniformBlockIndex(program, "R3DMaterial");
+        if (material_block != GL_INVALID_INDEX)
+        {
+            glGetActiveUniformBlockiv(program, material_block, GL_UNIFORM_BLOCK_DATA_SIZE, &m_material_block_size);
+            glUniformBlockBinding(program, material_block, MATERIAL_UNIFORM_BINDING);
         }
 
         int active_uniforms = 0;
@@ -157,18 +618,52 @@ namespace render3d
             buf[name_len] = 0;
             uniform.name = buf;
             uniform.location = glGetUniformLocation(program, buf);
+            GLuint uniform_index = i;
+            GLint block_index = -1;
+            glGetActiveUniformsiv(program, 1, &uniform_index, GL_UNIFORM_BLOCK_INDEX, &block_index);
+            if (block_index >= 0 && (GLuint)block_index == material_block)
+            {
+                glGetActiveUniformsiv(program, 1, &uniform_index, GL_UNIFORM_OFFSET, &uniform.block_offset);
+                glGetActiveUniformsiv(program, 1, &uniform_index, GL_UNIFORM_ARRAY_STRIDE, &uniform.array_stride);
+            }
             m_uniforms[uniform.name] = uniform;
+
+            if (uniform.location >= 0)
+            {
+                if (uniform.location >= (int)m_uniform_shadows.size())
+                {
+                    m_uniform_shadows.resize(uniform.location + 1);
+                }
+                UniformShadow& shadow = m_uniform_shadows[uniform.location];
+                shadow.offset = (int)m_uniform_shadow_values.size();
+                shadow.count = GetUniformComponentCount(uniform.type) * uniform.size;
+                m_uniform_shadow_values.resize(m_uniform_shadow_values.size() + shadow.count);
+            }
             
-            // 是否是builtin uniform?
-            auto& all_builtin_uniforms = GetAvailableBuiltinUniforms();
-            if (std::find(all_builtin_uniforms.begin(), all_builtin_uniforms.end(), uniform.name) != all_builtin_uniforms.end())
+            // 是否是builtin uniform? 链接时解析一次, 绘制时按id分发.
+            // block里的成员location为-1, 由uniform buffer提供
+            for (int id=0; id<BUILTIN_UNIFORM_COUNT && uniform.location >= 0; id++)
             {
-                m_builtin_uniforms.push_back(uniform.name);
+                if (uniform.name == BUILTIN_UNIFORM_NAMES[id])
+                {
+                    BuiltinUniformSlot builtin;
+                    builtin.id = (BuiltinUniform)id;
+                    builtin.location = uniform.location;
+                    m_builtin_uniforms.push_back(builtin);
+                }
             }
         }
 
-        m_gl_program = program;
-        return true;
+        GLuint frame_block = glGetUniformBlockIndex(program, "R3DFrame");
+        if (frame_block != GL_INVALID_INDEX)
+        {
+            glUniformBlockBinding(program, frame_block, FRAME_UNIFORM_BINDING);
+        }
+        GLuint object_block = glGetUniformBlockIndex(program, "R3DObject");
+        if (object_block != GL_INVALID_INDEX)
+        {
+            glUniformBlockBinding(program, object_block, OBJECT_UNIFORM_BINDING);
+        }
     }
 
     GLuint Program::GetGLProgramId() const
@@ -190,6 +685,32 @@ namespace render3d
         }
     }
 
+    bool Program::UpdateUniformShadow(uint32_t epoch, int location, const void* values, int count)
+    {
+        if (location < 0)
+        {
+            return true;
+        }
+        if (location >= (int)m_uniform_shadows.size() || count > m_uniform_shadows[location].count)
+        {
+            return false;
+        }
+        UniformShadow& shadow = m_uniform_shadows[location];
+        float* stored = &m_uniform_shadow_values[shadow.offset];
+        if (shadow.epoch == epoch && memcmp(stored, values, sizeof(float) * count) == 0)
+        {
+            return true;
+        }
+        memcpy(stored, values, sizeof(float) * count);
+        shadow.epoch = epoch;
+        return false;
+    }
+
+    int Program::GetAttribLocation(VertexAttribSlot slot) const
+    {
+        return m_attrib_slot_locations[slot];
+    }
+
     int Program::GetUniformLocation(const std::string& uniform_name)
     {
         auto iter = m_uniforms.find(uniform_name);
@@ -209,22 +730,215 @@ namespace render3d
         glUseProgram(m_gl_program);
     }
 
-    Texture::Texture()
+    // ---- GL state cache ----
+    static const GLuint UNKNOWN_GL_STATE = 0xFFFFFFFF;
+    // 所有GLStateCache共用, 每次Invalidate取一个新值, 不同cache之间也不会重复
+    static uint32_t s_uniform_epoch = 0;
+
+    GLStateCache::GLStateCache()
     {
+        Invalidate();
     }
 
-    Texture::~Texture()
+    void GLStateCache::Invalidate()
     {
-        if (m_gl_texture > 0)
+        m_program = UNKNOWN_GL_STATE;
+        m_active_unit = -1;
+        for (int i=0; i<MAX_TEXTURE_UNITS; i++)
         {
-            glDeleteTextures(1, &m_gl_texture);
-            m_gl_texture = 0;
+            m_texture_2d[i] = UNKNOWN_GL_STATE;
+            m_texture_cube[i] = UNKNOWN_GL_STATE;
         }
+        m_vao = UNKNOWN_GL_STATE;
+        InvalidateBuffers();
+        m_depth_test = -1;
+        m_blend = -1;
+        m_depth_mask = -1;
+        m_depth_func = UNKNOWN_GL_STATE;
+        m_blend_src = UNKNOWN_GL_STATE;
+        m_blend_dst = UNKNOWN_GL_STATE;
+        // 外部可能直接用glUniform*改过值, 所有program的uniform影子一起作废, 不用逐个program清
+        m_uniform_epoch = ++s_uniform_epoch;
     }
 
-    int Texture::GetWidth() const
+    void GLStateCache::InvalidateBuffers()
     {
-        return m_width;
+        m_array_buffer = UNKNOWN_GL_STATE;
+        m_element_buffer = UNKNOWN_GL_STATE;
+        m_uniform_buffer = UNKNOWN_GL_STATE;
+        for (int i=0; i<MAX_UNIFORM_BINDINGS; i++)
+        {
+            m_uniform_bindings[i] = UNKNOWN_GL_STATE;
+        }
+    }
+
+    bool GLStateCache::Elide(bool same)
+    {
+        if (same)
+            m_stats.elided++;
+        else
+            m_stats.issued++;
+        return same;
+    }
+
+    void GLStateCache::UseProgram(GLuint program)
+    {
+        if (Elide(m_program == program))
+            return;
+        glUseProgram(program);
+        m_program = program;
+    }
+
+    void GLStateCache::BindTexture(int unit, GLenum target, GLuint texture)
+    {
+        GLuint* bound = nullptr;
+        if (unit < MAX_TEXTURE_UNITS)
+        {
+            bound = target == GL_TEXTURE_CUBE_MAP ? &m_texture_cube[unit] : &m_texture_2d[unit];
+        }
+        if (Elide(bound != nullptr && *bound == texture))
+            return;
+        if (!Elide(m_active_unit == unit))
+        {
+            glActiveTexture(GL_TEXTURE0 + unit);
+            m_active_unit = unit;
+        }
+        glBindTexture(target, texture);
+        if (bound != nullptr)
+        {
+            *bound = texture;
+        }
+    }
+
+    void GLStateCache::BindVertexArray(GLuint vao)
+    {
+        if (Elide(m_vao == vao))
+            return;
+        glBindVertexArray(vao);
+        m_vao = vao;
+        m_element_buffer = UNKNOWN_GL_STATE;
+    }
+
+    void GLStateCache::BindBuffer(GLenum target, GLuint buffer)
+    {
+        GLuint* bound = target == GL_ARRAY_BUFFER ? &m_array_buffer
+                      : target == GL_ELEMENT_ARRAY_BUFFER ? &m_element_buffer
+                      : target == GL_UNIFORM_BUFFER ? &m_uniform_buffer : nullptr;
+        if (Elide(bound != nullptr && *bound == buffer))
+            return;
+        glBindBuffer(target, buffer);
+        if (bound != nullptr)
+        {
+            *bound = buffer;
+        }
+    }
+
+    void GLStateCache::BindUniformBuffer(GLuint index, GLuint buffer)
+    {
+        if (Elide(index < MAX_UNIFORM_BINDINGS && m_uniform_bindings[index] == buffer))
+            return;
+        glBindBufferBase(GL_UNIFORM_BUFFER, index, buffer);
+        if (index < MAX_UNIFORM_BINDINGS)
+        {
+            m_uniform_bindings[index] = buffer;
+        }
+        m_uniform_buffer = buffer;
+    }
+
+    void GLStateCache::SetCapability(GLenum capability, bool enabled)
+    {
+        int* state = capability == GL_DEPTH_TEST ? &m_depth_test : capability == GL_BLEND ? &m_blend : nullptr;
+        if (Elide(state != nullptr && *state == (int)enabled))
+            return;
+        if (enabled)
+            glEnable(capability);
+        else
+            glDisable(capability);
+        if (state != nullptr)
+        {
+            *state = enabled;
+        }
+    }
+
+    void GLStateCache::DepthMask(bool write)
+    {
+        if (Elide(m_depth_mask == (int)write))
+            return;
+        glDepthMask(write ? GL_TRUE : GL_FALSE);
+        m_depth_mask = write;
+    }
+
+    void GLStateCache::DepthFunc(GLenum func)
+    {
+        if (Elide(m_depth_func == func))
+            return;
+        glDepthFunc(func);
+        m_depth_func = func;
+    }
+
+    void GLStateCache::BlendFunc(GLenum src, GLenum dst)
+    {
+        if (Elide(m_blend_src == src && m_blend_dst == dst))
+            return;
+        glBlendFunc(src, dst);
+        m_blend_src = src;
+        m_blend_dst = dst;
+    }
+
+    void GLStateCache::Uniform1i(Program* program, int location, int value)
+    {
+        if (Elide(program->UpdateUniformShadow(m_uniform_epoch, location, &value, 1)))
+            return;
+        glUniform1i(location, value);
+    }
+
+    void GLStateCache::Uniform1f(Program* program, int location, float value)
+    {
+        if (Elide(program->UpdateUniformShadow(m_uniform_epoch, location, &value, 1)))
+            return;
+        glUniform1f(location, value);
+    }
+
+    void GLStateCache::Uniform3fv(Program* program, int location, int count, const float* values)
+    {
+        if (Elide(program->UpdateUniformShadow(m_uniform_epoch, location, values, count * 3)))
+            return;
+        glUniform3fv(location, count, values);
+    }
+
+    void GLStateCache::UniformMatrix4fv(Program* program, int location, const float* matrix)
+    {
+        if (Elide(program->UpdateUniformShadow(m_uniform_epoch, location, matrix, 16)))
+            return;
+        glUniformMatrix4fv(location, 1, GL_FALSE, matrix);
+    }
+
+    void GLStateCache::ResetStats()
+    {
+        m_stats = GLStateStats();
+    }
+
+    const GLStateStats& GLStateCache::GetStats() const
+    {
+        return m_stats;
+    }
+
+    Texture::Texture()
+    {
+    }
+
+    Texture::~Texture()
+    {
+        if (m_gl_texture > 0)
+        {
+            glDeleteTextures(1, &m_gl_texture);
+            m_gl_texture = 0;
+        }
+    }
+
+    int Texture::GetWidth() const
+    {
+        return m_width;
     }
 
     int Texture::GetHeight() const
@@ -250,101 +964,228 @@ namespace render3d
     Material::Material(SubMesh* submesh, Program* program)
     : m_submesh(submesh), m_program(program)
     {
+        if (m_program != nullptr)
+        {
+            BuildParamLayout();
+        }
     }
     
     Material::~Material()
     {
-        // delete all params
-        for (auto iter = m_params.begin(); iter != m_params.end(); iter++)
+        if (m_block_ubo != 0)
         {
-            delete iter->second;
+            glDeleteBuffers(1, &m_block_ubo);
+            m_block_ubo = 0;
         }
-        m_params.clear();
     }
-    
-    void Material::UpdateBuiltinUniforms()
+
+    // 按program的反射结果一次性排好所有参数的存储, 之后设置和绘制都不再分配内存
+    void Material::BuildParamLayout()
     {
-        // 简单起见, 没有使用key-value方式hash查找handler
-        // 不过bultin量不多,应该不是什么问题. 后续有时间可稍优化下
-        for (auto builtin_uniform : m_program->m_builtin_uniforms)
+        int data_size = 0;
+        for (auto& iter : m_program->m_uniforms)
         {
-            if (builtin_uniform == "matWorld")
-            {
-                auto matWorld = this->m_submesh->GetMesh()->GetTransform();
-                SetMatrix4fParam(builtin_uniform, matWorld);
-            }
-            else if (builtin_uniform == "matView")
-            {
-                auto matView = this->m_submesh->GetMesh()->GetRenderer()->GetCamera()->GetViewMatrix();
-                SetMatrix4fParam(builtin_uniform, matView);
-            }
-            else if (builtin_uniform == "matProjection")
-            {
-                auto matProjection = this->m_submesh->GetMesh()->GetRenderer()->GetCamera()->GetProjectionMatrix();
-                SetMatrix4fParam(builtin_uniform, matProjection);
-            }
-            else if (builtin_uniform == "matWorldView")
-            {
-                auto matWorld = this->m_submesh->GetMesh()->GetTransform();
-                auto matView = this->m_submesh->GetMesh()->GetRenderer()->GetCamera()->GetViewMatrix();
-                SetMatrix4fParam(builtin_uniform, matView * matWorld);
-            }
-            else if (builtin_uniform == "matViewProjection")
-            {
-                auto matViewProjection = this->m_submesh->GetMesh()->GetRenderer()->GetCamera()->GetViewProjectionMatrix();
-                SetMatrix4fParam(builtin_uniform, matViewProjection);
-            }
-            else if (builtin_uniform == "matWVP")
-            {
-                auto matWorld = this->m_submesh->GetMesh()->GetTransform();
-                auto matViewProjection = this->m_submesh->GetMesh()->GetRenderer()->GetCamera()->GetViewProjectionMatrix();
-                SetMatrix4fParam(builtin_uniform, matViewProjection * matWorld);
-            }
-            else if (builtin_uniform == "diffuseEnvMap")
+            const Uniform& uniform = iter.second;
+            ParamSlot slot;
+            slot.name = uniform.name.substr(0, uniform.name.find('['));
+            if (uniform.type == GL_FLOAT && uniform.size == 1)
+                slot.type = PARAM_FLOAT;
+            else if (uniform.type == GL_FLOAT_MAT4 && uniform.size == 1)
+                slot.type = PARAM_MATRIX4F;
+            else if (uniform.type == GL_FLOAT_VEC3 && uniform.size == SH_COEFFICIENT_COUNT)
+                slot.type = PARAM_SH;
+            else if (uniform.type == GL_SAMPLER_2D || uniform.type == GL_SAMPLER_CUBE)
+                slot.type = PARAM_TEXTURE;
+            else
+                continue;
+
+            // 内置uniform由UpdateBuiltinUniforms负责, 其它block里的成员不归材质管
+            if (uniform.location < 0 && uniform.block_offset < 0)
+                continue;
+            if (std::find(std::begin(BUILTIN_UNIFORM_NAMES), std::end(BUILTIN_UNIFORM_NAMES), slot.name) != std::end(BUILTIN_UNIFORM_NAMES))
+                continue;
+
+            slot.location = uniform.location;
+            slot.array_stride = uniform.array_stride;
+            if (uniform.block_offset >= 0)
             {
-                SetTextureParam(builtin_uniform, m_submesh->GetMesh()->GetRenderer()->GetDiffuseEnvTexture());
+                slot.offset = uniform.block_offset;
             }
-            else if (builtin_uniform == "specularEnvMap")
+            else if (slot.type == PARAM_TEXTURE)
             {
-                SetTextureParam(builtin_uniform, m_submesh->GetMesh()->GetRenderer()->GetSpecularEnvTexture());
+                slot.offset = (int)m_textures.size();
+                m_textures.push_back(nullptr);
             }
-            else if (builtin_uniform == "iblBrdfLutMap")
+            else
             {
-                SetTextureParam(builtin_uniform, m_submesh->GetMesh()->GetRenderer()->GetIblBrdfLutTexture());
+                slot.offset = data_size;
+                data_size += slot.type == PARAM_FLOAT ? 1 : slot.type == PARAM_MATRIX4F ? 16 : SH_COEFFICIENT_COUNT * 3;
             }
-            else if (builtin_uniform == "iblDiffuseEnvMap")
+            m_param_slots.push_back(slot);
+        }
+        m_param_data.assign(data_size, 0.0f);
+        m_block_data.assign(m_program->m_material_block_size, 0);
+    }
+
+    Material::ParamSlot* Material::FindParamSlot(const std::string& name, ParamType type)
+    {
+        for (auto& slot : m_param_slots)
+        {
+            if (slot.type == type && slot.name == name)
+                return &slot;
+        }
+        return nullptr;
+    }
+
+    void Material::WriteParam(ParamSlot* slot, const float* values, int count, int stride_floats)
+    {
+        slot->assigned = true;
+        if (slot->location >= 0)
+        {
+            memcpy(&m_param_data[slot->offset], values, sizeof(float) * count);
+            return;
+        }
+
+        // R3DMaterial里的成员: SH数组按block的步长展开, 其余按std140紧密排列
+        size_t begin = slot->offset;
+        size_t end = begin;
+        if (slot->type == PARAM_SH)
+        {
+            for (int i=0; i<count / stride_floats; i++)
             {
-                SetTextureParam(builtin_uniform, m_submesh->GetMesh()->GetRenderer()->GetIblDiffuseEnvTexture());
+                memcpy(&m_block_data[begin + (size_t)i * slot->array_stride], values + i * stride_floats, sizeof(float) * stride_floats);
             }
-            else if (builtin_uniform == "iblSpecularEnvMap")
+            end = begin + (size_t)slot->array_stride * (count / stride_floats - 1) + sizeof(float) * stride_floats;
+        }
+        else
+        {
+            memcpy(&m_block_data[begin], values, sizeof(float) * count);
+            end = begin + sizeof(float) * count;
+        }
+        m_block_dirty_begin = std::min(m_block_dirty_begin, begin);
+        m_block_dirty_end = std::max(m_block_dirty_end, end);
+    }
+
+    void Material::UpdateBuiltinUniforms(Mesh* mesh)
+    {
+        // 没有用uniform block的shader: 矩阵取每帧/每个mesh算好的结果, 不再逐submesh相乘
+        Renderer* renderer = mesh->GetRenderer();
+        const FrameConstants& frame = renderer->GetFrameConstants();
+        for (auto& builtin : m_program->m_builtin_uniforms)
+        {
+            switch (builtin.id)
             {
-                SetTextureParam(builtin_uniform, m_submesh->GetMesh()->GetRenderer()->GetIblSpecularEnvTexture());
+            case BUILTIN_MAT_WORLD:
+                ApplyMatrix4f(builtin.location, mesh->GetObjectConstants().world);
+                break;
+            case BUILTIN_MAT_VIEW:
+                ApplyMatrix4f(builtin.location, frame.view);
+                break;
+            case BUILTIN_MAT_PROJECTION:
+                ApplyMatrix4f(builtin.location, frame.projection);
+                break;
+            case BUILTIN_MAT_WORLD_VIEW:
+                ApplyMatrix4f(builtin.location, mesh->GetObjectConstants().world_view);
+                break;
+            case BUILTIN_MAT_VIEW_PROJECTION:
+                ApplyMatrix4f(builtin.location, frame.view_projection);
+                break;
+            case BUILTIN_MAT_WVP:
+                ApplyMatrix4f(builtin.location, mesh->GetObjectConstants().wvp);
+                break;
+            case BUILTIN_DIFFUSE_ENV_MAP:
+                ApplyTexture(builtin.location, renderer->GetDiffuseEnvTexture());
+                break;
+            case BUILTIN_SPECULAR_ENV_MAP:
+                ApplyTexture(builtin.location, renderer->GetSpecularEnvTexture());
+                break;
+            case BUILTIN_IBL_BRDF_LUT_MAP:
+                ApplyTexture(builtin.location, renderer->GetIblBrdfLutTexture());
+                break;
+            case BUILTIN_IBL_DIFFUSE_ENV_MAP:
+                ApplyTexture(builtin.location, renderer->GetIblDiffuseEnvTexture());
+                break;
+            case BUILTIN_IBL_SPECULAR_ENV_MAP:
+                ApplyTexture(builtin.location, renderer->GetIblSpecularEnvTexture());
+                break;
+            default:
+                break;
             }
         }
     }
 
-    void Material::Apply()
+    void Material::ApplyMatrix4f(int location, const Matrix4f& matrix)
     {
-        // reset idle stage unit
-        this->ResetIdleTextureUnit();
+        m_gl_state->UniformMatrix4fv(m_program, location, matrix.data());
+    }
 
-        // use program and apply params
-        if (m_program != nullptr)
+    void Material::ApplyTexture(int location, Texture* texture)
+    {
+        if (texture == nullptr)
+            return;
+        
+        m_gl_state->BindTexture(m_idle_texture_unit, texture->GetType() == TEXTURE_2D ? GL_TEXTURE_2D : GL_TEXTURE_CUBE_MAP, texture->GetGlTextureId());
+        m_gl_state->Uniform1i(m_program, location, m_idle_texture_unit);
+        m_idle_texture_unit++;
+    }
+
+    void Material::Apply(Mesh* mesh)
+    {
+        if (m_program == nullptr)
         {
-            m_program->Use();
+            return;
         }
+
+        // reset idle stage unit
+        this->ResetIdleTextureUnit();
+        m_gl_state = m_submesh->GetMesh()->GetRenderer()->GetGLStateCache();
+        m_gl_state->UseProgram(m_program->GetGLProgramId());
         
         // update system builtin uniforms
-        this->UpdateBuiltinUniforms();
+        this->UpdateBuiltinUniforms(mesh != nullptr ? mesh : m_submesh->GetMesh());
         
-        // apply all uniforms
-        for (auto iter = m_params.begin(); iter != m_params.end(); iter++)
+        // program可能被多个material共用, 普通uniform每次都提交, 值没变的由GLStateCache跳过
+        for (auto& slot : m_param_slots)
         {
-            if (iter->second != nullptr)
+            if (!slot.assigned || slot.location < 0)
+                continue;
+            switch (slot.type)
             {
-                iter->second->Apply();
+            case PARAM_FLOAT:
+                m_gl_state->Uniform1f(m_program, slot.location, m_param_data[slot.offset]);
+                break;
+            case PARAM_MATRIX4F:
+                m_gl_state->UniformMatrix4fv(m_program, slot.location, &m_param_data[slot.offset]);
+                break;
+            case PARAM_SH:
+                m_gl_state->Uniform3fv(m_program, slot.location, SH_COEFFICIENT_COUNT, &m_param_data[slot.offset]);
+                break;
+            case PARAM_TEXTURE:
+                ApplyTexture(slot.location, m_textures[slot.offset]);
+                break;
             }
         }
+
+        // R3DMaterial只在有修改时上传修改过的范围
+        if (!m_block_data.empty())
+        {
+            if (m_block_ubo == 0)
+            {
+                glGenBuffers(1, &m_block_ubo);
+                m_gl_state->BindBuffer(GL_UNIFORM_BUFFER, m_block_ubo);
+                glBufferData(GL_UNIFORM_BUFFER, m_block_data.size(), m_block_data.data(), GL_DYNAMIC_DRAW);
+                m_block_dirty_begin = SIZE_MAX;
+                m_block_dirty_end = 0;
+            }
+            else if (m_block_dirty_begin < m_block_dirty_end)
+            {
+                m_gl_state->BindBuffer(GL_UNIFORM_BUFFER, m_block_ubo);
+                glBufferSubData(GL_UNIFORM_BUFFER, m_block_dirty_begin, m_block_dirty_end - m_block_dirty_begin, &m_block_data[m_block_dirty_begin]);
+                m_block_dirty_begin = SIZE_MAX;
+                m_block_dirty_end = 0;
+            }
+            m_gl_state->BindUniformBuffer(MATERIAL_UNIFORM_BINDING, m_block_ubo);
+        }
     }
 
     void Material::ResetIdleTextureUnit()
@@ -359,43 +1200,51 @@ namespace render3d
 
     void Material::SetFloatParam(const std::string& name, float value)
     {
-        auto iter = this->m_params.find(name);
-        if (iter != m_params.end())
-        {
-            static_cast<FloatMaterialParam*>(iter->second)->m_value = value;
-        }
-        else
+        ParamSlot* slot = FindParamSlot(name, PARAM_FLOAT);
+        if (slot != nullptr)
         {
-            auto materialParam = new FloatMaterialParam(this, name, value);
-            m_params[name] = materialParam;
+            WriteParam(slot, &value, 1, 1);
         }
     }
     
     void Material::SetMatrix4fParam(const std::string& name, Matrix4f matrix)
     {
-        auto iter = this->m_params.find(name);
-        if (iter != m_params.end())
-        {
-            static_cast<Matrix4fMaterialParam*>(iter->second)->m_matrix = matrix;
-        }
-        else
+        ParamSlot* slot = FindParamSlot(name, PARAM_MATRIX4F);
+        if (slot != nullptr)
         {
-            auto materialParam = new Matrix4fMaterialParam(this, name, matrix);
-            m_params[name] = materialParam;
+            WriteParam(slot, matrix.data(), 16, 16);
         }
     }
 
     void Material::SetTextureParam(const std::string& name, Texture* texture)
     {
-        auto iter = this->m_params.find(name);
-        if (iter != m_params.end())
+        ParamSlot* slot = FindParamSlot(name, PARAM_TEXTURE);
+        if (slot != nullptr)
         {
-            static_cast<TextureMaterialParam*>(iter->second)->m_texture = texture;
+            slot->assigned = true;
+            m_textures[slot->offset] = texture;
+
+            // 贴图组合折叠成16位, 用于排序时把相同贴图的绘制排在一起. 冲突只影响排序效果
+            uint32_t hash = 2166136261u;
+            for (Texture* bound : m_textures)
+            {
+                hash = (hash ^ (bound != nullptr ? bound->GetGlTextureId() : 0)) * 16777619u;
+            }
+            m_texture_set_key = (uint16_t)(hash ^ (hash >> 16));
         }
-        else
+    }
+
+    uint16_t Material::GetTextureSetKey() const
+    {
+        return m_texture_set_key;
+    }
+
+    void Material::SetSHParam(const std::string& name, const float* sh_params)
+    {
+        ParamSlot* slot = FindParamSlot(name, PARAM_SH);
+        if (slot != nullptr)
         {
-            auto materialParam = new TextureMaterialParam(this, name, texture);
-            m_params[name] = materialParam;
+            WriteParam(slot, sh_params, SH_COEFFICIENT_COUNT * 3, 3);
         }
     }
     
@@ -409,70 +1258,105 @@ namespace render3d
         m_translucent = translucent;
     }
 
-    MaterialParam::MaterialParam(Material* material, const std::string& name)
-    : m_material(material), m_name(name)
+    bool Material::IsDepthOnly() const
     {
+        return m_depth_only;
     }
 
-    FloatMaterialParam::FloatMaterialParam(Material* material, const std::string& name, float value)
-    : MaterialParam(material, name), m_value(value)
+    void Material::SetDepthOnly(bool depth_only)
     {
+        m_depth_only = depth_only;
     }
 
-    void FloatMaterialParam::Apply()
-    {
-        glUniform1f(m_material->GetProgram()->GetUniformLocation(m_name), m_value);
-    }
-    
-    Matrix4fMaterialParam::Matrix4fMaterialParam(Material* material, const std::string& name, Matrix4f matrix)
-    : MaterialParam(material, name), m_matrix(matrix)
-    {
-    }
-    
-    void Matrix4fMaterialParam::Apply()
+    ObjMeshParser::ObjMeshParser(Mesh* mesh, const char* data, size_t data_size, bool export_triangles)
+    : m_mesh(mesh), m_data(data), m_data_size(data_size), m_export_triangles(export_triangles)
     {
-        int uniform_loc = m_material->GetProgram()->GetUniformLocation(m_name);
-        glUniformMatrix4fv(uniform_loc, 1, GL_FALSE, (float*)&m_matrix);
     }
 
-    TextureMaterialParam::TextureMaterialParam(Material* material, const std::string& name, Texture* texture)
-    : MaterialParam(material, name), m_texture(texture)
+    // (v, t, n)三元组 -> 焊接后顶点索引的开放寻址哈希表.
+    // 面的角点很多时比std::unordered_map省内存且没有逐节点分配
+    class ObjVertexWelder
     {
-    }
+    public:
+        struct Key
+        {
+            int v, t, n;
+        };
 
-    void TextureMaterialParam::Apply()
-    {
-        if (m_texture == nullptr)
-            return;
-        
-        glActiveTexture(GL_TEXTURE0 + m_material->m_idle_texture_unit);
-        glBindTexture(m_texture->GetType() == TEXTURE_2D ? GL_TEXTURE_2D : GL_TEXTURE_CUBE_MAP, m_texture->GetGlTextureId());
-        glUniform1i(m_material->GetProgram()->GetUniformLocation(m_name), m_material->m_idle_texture_unit);
-        m_material->m_idle_texture_unit++;
-    }
+        ObjVertexWelder(size_t expected_vertex_count)
+        {
+            size_t capacity = 16;
+            while (capacity < expected_vertex_count * 2)
+            {
+                capacity <<= 1;
+            }
+            m_slots.assign(capacity, 0);
+            m_keys.reserve(expected_vertex_count);
+        }
 
+        // 返回key对应的顶点索引, 第一次出现时分配新索引
+        uint32_t Insert(const Key& key)
+        {
+            if ((m_keys.size() + 1) * 10 > m_slots.size() * 7)
+            {
+                Grow();
+            }
 
-    ObjMeshParser::ObjMeshParser(Mesh* mesh, char* data, int data_size, bool export_triangles)
-    : m_mesh(mesh), m_data(data), m_data_size(data_size), m_export_triangles(export_triangles)
-    {
-    }
+            size_t mask = m_slots.size() - 1;
+            size_t slot = Hash(key) & mask;
+            while (m_slots[slot] != 0)
+            {
+                const Key& other = m_keys[m_slots[slot] - 1];
+                if (other.v == key.v && other.t == key.t && other.n == key.n)
+                {
+                    return m_slots[slot] - 1;
+                }
+                slot = (slot + 1) & mask;
+            }
 
-    SubMesh* ObjMeshParser::GenerateSubMesh(std::vector<Vector3f> *positions, std::vector<Vector2f> *texcoords, std::vector<Vector3f> *normals, std::vector<ObjTri> *triangles)
-    {
-        SubMesh* submesh = new SubMesh(m_mesh);
-        int vertex_count = triangles->size() * 3;
-        submesh->m_vertex_count = vertex_count;
-        submesh->m_positions = new Vector3f[vertex_count];
-        
-        if (texcoords->size() > 0)
+            m_keys.push_back(key);
+            m_slots[slot] = (uint32_t)m_keys.size();
+            return (uint32_t)m_keys.size() - 1;
+        }
+
+        const std::vector<Key>& GetKeys() const
         {
-            submesh->m_texcoords = new Vector2f[vertex_count];
+            return m_keys;
         }
-        
-        if (normals->size() > 0)
+
+    private:
+        static size_t Hash(const Key& key)
         {
-            submesh->m_normals = new Vector3f[vertex_count];
+            uint64_t h = (uint64_t)(uint32_t)key.v * 0x9E3779B97F4A7C15ULL;
+            h ^= (uint64_t)(uint32_t)key.t * 0xC2B2AE3D27D4EB4FULL;
+            h ^= (uint64_t)(uint32_t)key.n * 0x165667B19E3779F9ULL;
+            return (size_t)(h ^ (h >> 29));
+        }
+
+        void Grow()
+        {
+            std::vector<uint32_t> slots(m_slots.size() * 2, 0);
+            size_t mask = slots.size() - 1;
+            for (uint32_t i=0; i<m_keys.size(); i++)
+            {
+                size_t slot = Hash(m_keys[i]) & mask;
+                while (slots[slot] != 0)
+                {
+                    slot = (slot + 1) & mask;
+                }
+                slots[slot] = i + 1;
+            }
+            m_slots.swap(slots);
         }
+
+    private:
+        std::vector<uint32_t> m_slots; // 0为空, 否则为顶点索引+1
+        std::vector<Key> m_keys;
+    };
+
+    SubMesh* ObjMeshParser::GenerateSubMesh(std::vector<Vector3f> *positions, std::vector<Vector2f> *texcoords, std::vector<Vector3f> *normals, std::vector<ObjTri> *triangles)
+    {
+        SubMesh* submesh = new SubMesh(m_mesh);
         
         if (m_export_triangles)
         {
@@ -496,150 +1380,296 @@ namespace render3d
             iter->n2 -= 1;
         }
         
+        // 焊接相同的(v, t, n), 生成索引. 唯一顶点数一般只有角点数的1/6左右
+        int index_count = (int)triangles->size() * 3;
+        ObjVertexWelder welder(index_count / 4);
+        submesh->m_indices.resize(index_count);
+        submesh->m_vertex_sources.reserve(index_count / 4);
         for (int i=0; i<triangles->size(); i++)
         {
-            ObjTri tri = (*triangles)[i];
-            submesh->m_positions[i*3 + 0] = (*positions)[tri.v0];
-            submesh->m_positions[i*3 + 1] = (*positions)[tri.v1];
-            submesh->m_positions[i*3 + 2] = (*positions)[tri.v2];
-            
-            submesh->m_texcoords[i*3 + 0] = (*texcoords)[tri.t0];
-            submesh->m_texcoords[i*3 + 1] = (*texcoords)[tri.t1];
-            submesh->m_texcoords[i*3 + 2] = (*texcoords)[tri.t2];
-            
-            submesh->m_normals[i*3 + 0] = (*normals)[tri.n0];
-            submesh->m_normals[i*3 + 1] = (*normals)[tri.n1];
-            submesh->m_normals[i*3 + 2] = (*normals)[tri.n2];
-        }
-        
-        return submesh;
-    }
-
-    std::vector<std::string> ObjMeshParser::Parse(bool* succ)
-    {
-        std::vector<Vector3f> positions; // x y z
-        std::vector<Vector2f> texcoords; // x y
-        std::vector<Vector3f> normals; // x y z
-        std::vector<ObjTri> triangles; // v0/t0/n0 v1/t1/n1 v2/t2/n2
-        bool hasNegIndex = false;
-
-        std::vector<int> lines;
-        int line_start_idx = 0;
-        lines.push_back(0);
-
-        for (int i=0; i<m_data_size; i++)
-        {
-            if (IsNewlineChar(m_data[i]))
-            {
-                m_data[i] = 0;
-                if (i + 1 < m_data_size)
-                    lines.push_back(i+1);
-            }
-            else if (m_data[i] == '/')
+            const ObjTri& tri = (*triangles)[i];
+            const ObjVertexWelder::Key corners[3] = {
+                { tri.v0, tri.t0, tri.n0 },
+                { tri.v1, tri.t1, tri.n1 },
+                { tri.v2, tri.t2, tri.n2 },
+            };
+            for (int c=0; c<3; c++)
             {
-                m_data[i] = ' '; // 方便sscanf
+                uint32_t index = welder.Insert(corners[c]);
+                if (index == submesh->m_vertex_sources.size())
+                {
+                    submesh->m_vertex_sources.push_back(i * 3 + c);
+                }
+                submesh->m_indices[i * 3 + c] = index;
             }
         }
 
-        std::vector<std::string> submesh_material_names;
-        char temp[256];
-        for (int i=0; i<lines.size(); i++)
+        const std::vector<ObjVertexWelder::Key>& vertices = welder.GetKeys();
+        int vertex_count = (int)vertices.size();
+        submesh->m_vertex_count = vertex_count;
+        submesh->m_index_count = index_count;
+        submesh->m_positions = new Vector3f[vertex_count];
+        submesh->m_bounds_min = Vector3f::Constant(vertex_count > 0 ? FLT_MAX : 0.0f);
+        submesh->m_bounds_max = Vector3f::Constant(vertex_count > 0 ? -FLT_MAX : 0.0f);
+        for (int i=0; i<vertex_count; i++)
         {
-            char* ptr = m_data + lines[i];
-            if (*ptr == 'v')
-            {
+            submesh->m_positions[i] = (*positions)[vertices[i].v];
+            submesh->m_bounds_min = submesh->m_bounds_min.cwiseMin(submesh->m_positions[i]);
+            submesh->m_bounds_max = submesh->m_bounds_max.cwiseMax(submesh->m_positions[i]);
+        }
+        submesh->UpdateBoundingSphere(submesh->m_positions, vertex_count);
+        
+        if (texcoords->size() > 0)
+        {
+            submesh->m_texcoords = new Vector2f[vertex_count];
+            for (int i=0; i<vertex_count; i++)
+            {
+                submesh->m_texcoords[i] = (*texcoords)[vertices[i].t];
+            }
+        }
+        
+        if (normals->size() > 0)
+        {
+            submesh->m_normals = new Vector3f[vertex_count];
+            for (int i=0; i<vertex_count; i++)
+            {
+                submesh->m_normals[i] = (*normals)[vertices[i].n];
+            }
+        }
+
+        m_stats.vertices += vertex_count;
+        VLOG(2) << "submesh welded: " << index_count << " corners -> " << vertex_count << " vertices, " << submesh->GetVertexReductionRatio() << "x";
+
+        if (m_optimize_submeshes)
+        {
+            submesh->Optimize();
+        }
+        
+        return submesh;
+    }
+
+    // 一段以行为边界的obj文本的解析结果.
+    // 面索引在obj里是全局的, 所以各段的顶点流按顺序拼接后索引依然有效.
+    struct ObjChunk
+    {
+        // usemtl出现时各个流已经读到的位置, 合并时据此还原顺序解析的submesh边界
+        struct Marker
+        {
+            size_t position_count;
+            size_t texcoord_count;
+            size_t normal_count;
+            size_t triangle_count;
+            std::string material_name;
+        };
+
+        std::vector<Vector3f> positions;
+        std::vector<Vector2f> texcoords;
+        std::vector<Vector3f> normals;
+        std::vector<ObjTri> triangles;
+        std::vector<Marker> markers;
+        bool has_neg_index = false;
+    };
+
+    // 单遍扫描: 逐行分派, 数值直接从原buffer里解析, 不改写输入
+    static void TokenizeObjChunk(const char* ptr, const char* end, ObjChunk* chunk)
+    {
+        while (ptr < end)
+        {
+            if (ptr[0] == 'v' && ptr + 1 < end)
+            {
                 // maybe v, vt, vn
-                if (*(ptr+1) == ' ')
+                if (IsObjSpace(ptr[1]))
                 {
-                    float x, y, z;
-                    sscanf(ptr, "%s %f %f %f", temp, &x, &y, &z);
-                    positions.push_back(Vector3f(x, y, z));
+                    Vector3f v;
+                    ptr = ParseObjFloat(ptr + 1, end, &v.x());
+                    ptr = ParseObjFloat(ptr, end, &v.y());
+                    ptr = ParseObjFloat(ptr, end, &v.z());
+                    chunk->positions.push_back(v);
                 }
-                else if (*(ptr+1) == 't')
+                else if (ptr[1] == 't')
                 {
-                    float x, y;
-                    sscanf(ptr, "%s %f %f", temp, &x, &y);
-                    texcoords.push_back(Vector2f(x, y));
+                    Vector2f vt;
+                    ptr = ParseObjFloat(ptr + 2, end, &vt.x());
+                    ptr = ParseObjFloat(ptr, end, &vt.y());
+                    chunk->texcoords.push_back(vt);
                 }
-                else if (*(ptr+1) == 'n')
+                else if (ptr[1] == 'n')
                 {
-                    float x, y, z;
-                    sscanf(ptr, "%s %f %f %f", temp, &x, &y, &z);
-                    normals.push_back(Vector3f(x, y, z));
+                    Vector3f vn;
+                    ptr = ParseObjFloat(ptr + 2, end, &vn.x());
+                    ptr = ParseObjFloat(ptr, end, &vn.y());
+                    ptr = ParseObjFloat(ptr, end, &vn.z());
+                    chunk->normals.push_back(vn);
                 }
             }
-            else if (*ptr == 'f' && *(ptr+1) == ' ')
+            else if (ptr[0] == 'f' && ptr + 1 < end && IsObjSpace(ptr[1]))
             {
-                ObjTri tri;
-                
-                if (texcoords.size() > 0 && normals.size() > 0)
-                {
-                    sscanf(ptr, "%s %d %d %d %d %d %d %d %d %d", temp, &tri.v0, &tri.t0, &tri.n0, &tri.v1, &tri.t1, &tri.n1, &tri.v2, &tri.t2, &tri.n2);
-                    if (tri.v0 < 0 || tri.v1 < 0 || tri.t0 < 0 || tri.t1 < 0 || tri.t2 < 0 || tri.n0 < 0 || tri.n1 < 0 || tri.n2 < 0) {
-                        hasNegIndex = true;
-                    }
-                }
-                else if (texcoords.size() > 0 && normals.size() == 0)
-                {
-                    sscanf(ptr, "%s %d %d %d %d %d %d", temp, &tri.v0, &tri.t0, &tri.v1, &tri.t1, &tri.v2, &tri.t2);
-                    if (tri.v0 < 0 || tri.v1 < 0 || tri.v2 < 0 || tri.t0 < 0 || tri.t1 < 0 || tri.t2 < 0) {
-                        hasNegIndex = true;
-                    }
-                }
-                else if (texcoords.size() == 0 && normals.size() > 0)
-                {
-                    sscanf(ptr, "%s %d %d %d %d %d %d", temp, &tri.v0, &tri.n0, &tri.v1, &tri.n1, &tri.v2, &tri.n2);
-                    if (tri.v0 < 0 || tri.v1 < 0 || tri.v2 < 0 || tri.t0 < 0 || tri.t1 < 0 || tri.t2 < 0) {
-                        hasNegIndex = true;
-                    }
+                // 支持 v, v/t, v//n, v/t/n 四种写法, 缺省的分量为0
+                // 多边形面只取前三个顶点, 与之前的sscanf行为一致
+                ObjTri tri = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+                ptr = ParseObjFaceVertex(ptr + 1, end, &tri.v0, &tri.t0, &tri.n0);
+                ptr = ParseObjFaceVertex(ptr, end, &tri.v1, &tri.t1, &tri.n1);
+                ptr = ParseObjFaceVertex(ptr, end, &tri.v2, &tri.t2, &tri.n2);
+                if (tri.v0 < 0 || tri.v1 < 0 || tri.v2 < 0 || tri.t0 < 0 || tri.t1 < 0 || tri.t2 < 0 || tri.n0 < 0 || tri.n1 < 0 || tri.n2 < 0) {
+                    chunk->has_neg_index = true;
+                    return;
                 }
-                else
+                chunk->triangles.push_back(tri);
+            }
+            else if (end - ptr > 6 && memcmp(ptr, "usemtl", 6) == 0 && IsObjSpace(ptr[6]))
+            {
+                // 记录材质名称, 到行尾为止
+                const char* name_start = ptr + 7;
+                ptr = name_start;
+                while (ptr < end && !IsNewlineChar(*ptr))
                 {
-                    sscanf(ptr, "%s %d %d %d", temp, &tri.v0, &tri.v1, &tri.v2);
-                    if (tri.v0 < 0 || tri.v1 < 0 || tri.v2 < 0) {
-                        hasNegIndex = true;
-                    }
+                    ptr++;
                 }
-                if (hasNegIndex) {
-                    break;
+
+                ObjChunk::Marker marker;
+                marker.position_count = chunk->positions.size();
+                marker.texcoord_count = chunk->texcoords.size();
+                marker.normal_count = chunk->normals.size();
+                marker.triangle_count = chunk->triangles.size();
+                marker.material_name.assign(name_start, ptr);
+                chunk->markers.push_back(marker);
+            }
+
+            // 跳过本行剩余部分(注释, 多边形多余的顶点等)以及换行符
+            while (ptr < end && !IsNewlineChar(*ptr))
+            {
+                ptr++;
+            }
+            while (ptr < end && IsNewlineChar(*ptr))
+            {
+                ptr++;
+            }
+        }
+    }
+
+    // 把src[from, to)追加到dst. dst为空且取整段时直接交换, 省一次拷贝
+    template<typename T>
+    static void AppendObjStream(std::vector<T>* dst, std::vector<T>* src, size_t from, size_t to)
+    {
+        // 整块被swap走之后src是空的, 后面的marker区间都为空, 不能再对它取begin() + from
+        if (from >= to)
+            return;
+        if (dst->empty() && from == 0 && to == src->size())
+        {
+            dst->swap(*src);
+            return;
+        }
+        dst->insert(dst->end(), src->begin() + from, src->begin() + to);
+    }
+
+    std::vector<std::string> ObjMeshParser::Parse(bool* succ)
+    {
+        auto parse_start = std::chrono::steady_clock::now();
+
+        m_stats = ObjParseStats();
+        m_stats.bytes = m_data_size;
+
+        // 按行边界切块. 文件太小时切块不划算, 退化为单线程
+        int chunk_count = m_thread_count > 0 ? m_thread_count : (int)std::thread::hardware_concurrency();
+        chunk_count = (int)std::max<size_t>(1, std::min<size_t>(chunk_count, m_data_size / OBJ_MIN_CHUNK_BYTES));
+
+        std::vector<const char*> bounds;
+        bounds.push_back(m_data);
+        const char* end = m_data + m_data_size;
+        for (int i=1; i<chunk_count; i++)
+        {
+            const char* ptr = std::max(bounds.back(), m_data + m_data_size * i / chunk_count);
+            while (ptr < end && !IsNewlineChar(*ptr))
+            {
+                ptr++;
+            }
+            while (ptr < end && IsNewlineChar(*ptr))
+            {
+                ptr++;
+            }
+            bounds.push_back(ptr);
+        }
+        bounds.push_back(end);
+
+        std::vector<ObjChunk> chunks(chunk_count);
+        std::vector<std::thread> workers;
+        for (int i=1; i<chunk_count; i++)
+        {
+            workers.emplace_back(TokenizeObjChunk, bounds[i], bounds[i+1], &chunks[i]);
+        }
+        TokenizeObjChunk(bounds[0], bounds[1], &chunks[0]);
+        for (auto& worker : workers)
+        {
+            worker.join();
+        }
+        m_stats.threads = chunk_count;
+
+        std::vector<std::string> submesh_material_names;
+        for (auto& chunk : chunks)
+        {
+            if (chunk.has_neg_index)
+            {
+                if (succ) {
+                    *succ = false;
                 }
-                triangles.push_back(tri);
+                return submesh_material_names;
             }
-            else if (*ptr == 'u' && *(ptr+1)=='s' && *(ptr+2) == 'e' && *(ptr+3) == 'm' && *(ptr+4) == 't' && *(ptr+5) == 'l')
+        }
+
+        // 按顺序合并各块, 在usemtl处切出submesh, 和单线程顺序解析的结果完全一致
+        std::vector<Vector3f> positions; // x y z
+        std::vector<Vector2f> texcoords; // x y
+        std::vector<Vector3f> normals; // x y z
+        std::vector<ObjTri> triangles; // v0/t0/n0 v1/t1/n1 v2/t2/n2
+        for (auto& chunk : chunks)
+        {
+            ObjChunk::Marker chunk_end;
+            chunk_end.position_count = chunk.positions.size();
+            chunk_end.texcoord_count = chunk.texcoords.size();
+            chunk_end.normal_count = chunk.normals.size();
+            chunk_end.triangle_count = chunk.triangles.size();
+
+            ObjChunk::Marker consumed = {0, 0, 0, 0, ""};
+            for (size_t i=0; i<=chunk.markers.size(); i++)
             {
-                // usemtl
-                
-                // 是否是新块? 不是的话则创建
+                const ObjChunk::Marker& marker = i < chunk.markers.size() ? chunk.markers[i] : chunk_end;
+                AppendObjStream(&positions, &chunk.positions, consumed.position_count, marker.position_count);
+                AppendObjStream(&texcoords, &chunk.texcoords, consumed.texcoord_count, marker.texcoord_count);
+                AppendObjStream(&normals, &chunk.normals, consumed.normal_count, marker.normal_count);
+                AppendObjStream(&triangles, &chunk.triangles, consumed.triangle_count, marker.triangle_count);
+                consumed = marker;
+
+                if (i == chunk.markers.size())
+                    break;
+
+                // usemtl: 是否是新块? 不是的话则创建
                 if (triangles.size() > 0)
                 {
                     // 说明不止一个子模型. 上一个模型读完了, 可以创建了
                     SubMesh* submesh = this->GenerateSubMesh(&positions, &texcoords, &normals, &triangles);
                     this->m_mesh->m_submeshes.push_back(submesh);
+                    m_stats.triangles += triangles.size();
                     
                     // 清空, 读下一个
                     triangles.clear();
                 }
-                
-                
-                // 记录材质名称
-                // 已经没有换行符, 前面统一改为0了
-                submesh_material_names.push_back(ptr+7);
-            }
-        }
-        
-        if (hasNegIndex) {
-            submesh_material_names.clear();
-            if (succ) {
-                *succ = false;
+                submesh_material_names.push_back(marker.material_name);
             }
-            return submesh_material_names;
+
+            // 释放已经合并的块
+            chunk = ObjChunk();
         }
         
         // 创建最后一个submesh
-        if (!hasNegIndex) {
-            SubMesh* submesh = this->GenerateSubMesh(&positions, &texcoords, &normals, &triangles);
-            this->m_mesh->m_submeshes.push_back(submesh);
-        }
+        SubMesh* submesh = this->GenerateSubMesh(&positions, &texcoords, &normals, &triangles);
+        this->m_mesh->m_submeshes.push_back(submesh);
+        m_stats.triangles += triangles.size();
+
+        m_stats.positions = positions.size();
+        m_stats.texcoords = texcoords.size();
+        m_stats.normals = normals.size();
+        m_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - parse_start).count();
+        VLOG(2) << "obj parsed: " << m_stats.bytes << " bytes, " << m_stats.triangles << " triangles, " << m_stats.threads << " threads, " << m_stats.GetMBPerSecond() << " MB/s";
         
         if (succ) {
             *succ = true;
@@ -647,724 +1677,5989 @@ namespace render3d
         return submesh_material_names;
     }
 
-    SubMesh::SubMesh(Mesh* mesh)
-    : m_mesh(mesh)
+    void ObjMeshParser::SetThreadCount(int thread_count)
     {
+        m_thread_count = thread_count;
     }
 
-    SubMesh::~SubMesh()
+    void ObjMeshParser::SetOptimizeSubMeshes(bool optimize)
     {
-        _SafeDeleteArray_(m_positions);
-        _SafeDeleteArray_(m_texcoords);
-        _SafeDeleteArray_(m_normals);
-        
-        if (m_vao > 0)
+        m_optimize_submeshes = optimize;
+    }
+
+    const ObjParseStats& ObjMeshParser::GetStats() const
+    {
+        return m_stats;
+    }
+
+    double ObjParseStats::GetMBPerSecond() const
+    {
+        if (seconds <= 0.0)
+            return 0.0;
+        return (double)bytes / (1024.0 * 1024.0) / seconds;
+    }
+
+    // ---- .r3dmesh ----
+    // 文件布局(本机字节序, 各数据块按16字节对齐):
+    //   MeshCacheHeader
+    //   MeshCacheSubMesh[submesh_count]
+    //   材质名: material_name_count个 [uint32 长度, 字符]
+    //   各submesh的 positions / texcoords / normals / indices / vertex_sources
+    static const char MESH_CACHE_MAGIC[4] = { 'R', '3', 'D', 'M' };
+    static const uint32_t MESH_CACHE_VERSION = 1;
+
+    enum MeshCacheFlags
+    {
+        MESH_CACHE_HAS_TEXCOORDS = 1 << 0,
+        MESH_CACHE_HAS_NORMALS = 1 << 1,
+    };
+
+    struct MeshCacheHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t submesh_count;
+        uint32_t material_name_count;
+        float bounds_min[3];
+        float bounds_max[3];
+        uint64_t material_names_offset;
+        uint64_t material_names_size;
+    };
+
+    struct MeshCacheSubMesh
+    {
+        uint32_t vertex_count;
+        uint32_t index_count;
+        uint32_t index_size; // 2 or 4
+        uint32_t flags;
+        float bounds_min[3];
+        float bounds_max[3];
+        uint64_t positions_offset;
+        uint64_t texcoords_offset;
+        uint64_t normals_offset;
+        uint64_t indices_offset;
+        uint64_t sources_offset;
+    };
+
+    std::string MeshCache::GetCachePath(const std::string& mesh_file_path)
+    {
+        size_t dot = mesh_file_path.rfind('.');
+        size_t slash = mesh_file_path.rfind('/');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
         {
-            glDeleteVertexArrays(1, &m_vao);
-            m_vao = 0;
+            return mesh_file_path + ".r3dmesh";
         }
-        
-        if (m_vbo_position > 0)
+        return mesh_file_path.substr(0, dot) + ".r3dmesh";
+    }
+
+    bool MeshCache::IsFresh(const std::string& mesh_file_path, const std::string& cache_file)
+    {
+        auto cacheStatusOr = PathToResourceAsFile(cache_file);
+        if (cacheStatusOr.status() != render3d::OkStatus())
         {
-            glDeleteBuffers(1, &m_vbo_position);
-            m_vbo_position = 0;
+            return false;
         }
-        
-        if (m_vbo_texcoords > 0)
+        struct stat cache_stat;
+        if (stat(cacheStatusOr.ValueOrDie().c_str(), &cache_stat) != 0)
         {
-            glDeleteBuffers(1, &m_vbo_texcoords);
-            m_vbo_texcoords = 0;
+            return false;
         }
-        
-        if (m_vbo_normals > 0)
+
+        // 没有obj(只发布了缓存)时直接用缓存
+        auto objStatusOr = PathToResourceAsFile(mesh_file_path);
+        struct stat obj_stat;
+        if (objStatusOr.status() != render3d::OkStatus() || stat(objStatusOr.ValueOrDie().c_str(), &obj_stat) != 0)
         {
-            glDeleteBuffers(1, &m_vbo_normals);
-            m_vbo_normals = 0;
+            return true;
         }
-        
-        if (m_material)
+        return cache_stat.st_mtime >= obj_stat.st_mtime;
+    }
+
+    static void WriteMeshCacheBlock(std::string* out, uint64_t* out_offset, const void* data, size_t size)
+    {
+        if (data == nullptr || size == 0)
         {
-            delete m_material;
-            m_material = nullptr;
+            *out_offset = 0;
+            return;
         }
+        out->resize((out->size() + 15) & ~(size_t)15, 0);
+        *out_offset = out->size();
+        out->append((const char*)data, size);
     }
-    
-    Mesh* SubMesh::GetMesh() const
+
+    static std::string EncodeMaterialNames(const std::vector<std::string>& submesh_material_names)
     {
-        return m_mesh;
+        std::string names;
+        for (auto& name : submesh_material_names)
+        {
+            uint32_t length = (uint32_t)name.length();
+            names.append((const char*)&length, sizeof(length));
+            names.append(name);
+        }
+        return names;
     }
 
-    void SubMesh::Render()
+    static bool DecodeMaterialNames(const char* data, size_t size, uint32_t name_count, std::vector<std::string>* names)
     {
-        if (this->m_material == nullptr)
+        const char* names_ptr = data;
+        const char* names_end = data + size;
+        for (uint32_t i=0; i<name_count; i++)
         {
-            //VLOG("error: failed to render submesh. no material found.")
-            return;
+            uint32_t length = 0;
+            if (names_end - names_ptr < (ptrdiff_t)sizeof(length))
+                return false;
+            memcpy(&length, names_ptr, sizeof(length));
+            names_ptr += sizeof(length);
+            if ((size_t)(names_end - names_ptr) < length)
+                return false;
+            names->push_back(std::string(names_ptr, length));
+            names_ptr += length;
         }
+        return true;
+    }
 
-        // apply material
-        this->m_material->Apply();
-        
-        // bind vao
-        if (m_vao == 0 || m_dymc)
+    // 先写临时文件再rename, 避免加载方读到写了一半的文件
+    static bool WriteFileAtomically(const std::string& file_path, const std::string& blob)
+    {
+        std::string temp_file = file_path + ".tmp";
+        FILE* file = fopen(temp_file.c_str(), "wb");
+        if (file == nullptr)
         {
-            // create vao
-            if (!m_dymc)
-            {
-                glGenVertexArrays(1, &m_vao);
-                glBindVertexArray(m_vao);
-            }
-            
-            auto drawFlag = m_dymc ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW;
-            if (this->m_positions != NULL &&  this->m_vbo_position <= 0)
+            return false;
+        }
+        bool ok = fwrite(blob.data(), 1, blob.size(), file) == blob.size();
+        ok = (fclose(file) == 0) && ok;
+        if (!ok || rename(temp_file.c_str(), file_path.c_str()) != 0)
+        {
+            remove(temp_file.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool MeshCache::WriteFromObj(const std::string& mesh_file_path, const std::string& cache_file)
+    {
+        FileView text;
+        if (!text.Open(mesh_file_path))
+        {
+            return false;
+        }
+
+        Mesh mesh(nullptr);
+        ObjMeshParser parser(&mesh, text.GetData(), text.GetSize());
+        parser.SetThreadCount(0);
+        bool succ = false;
+        std::vector<std::string> submesh_material_names = parser.Parse(&succ);
+        if (!succ)
+        {
+            return false;
+        }
+
+        MeshCacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+        header.version = MESH_CACHE_VERSION;
+        header.submesh_count = (uint32_t)mesh.m_submeshes.size();
+        header.material_name_count = (uint32_t)submesh_material_names.size();
+
+        std::vector<MeshCacheSubMesh> entries(mesh.m_submeshes.size());
+        std::string blob(sizeof(MeshCacheHeader) + sizeof(MeshCacheSubMesh) * entries.size(), 0);
+
+        std::string names = EncodeMaterialNames(submesh_material_names);
+        WriteMeshCacheBlock(&blob, &header.material_names_offset, names.data(), names.size());
+        header.material_names_size = names.size();
+
+        Vector3f mesh_min = Vector3f::Constant(FLT_MAX);
+        Vector3f mesh_max = Vector3f::Constant(-FLT_MAX);
+        for (size_t i=0; i<mesh.m_submeshes.size(); i++)
+        {
+            SubMesh* submesh = mesh.m_submeshes[i];
+            MeshCacheSubMesh& entry = entries[i];
+            memset(&entry, 0, sizeof(entry));
+            entry.vertex_count = submesh->m_vertex_count;
+            entry.index_count = submesh->m_index_count;
+            entry.flags = (submesh->m_texcoords ? MESH_CACHE_HAS_TEXCOORDS : 0) | (submesh->m_normals ? MESH_CACHE_HAS_NORMALS : 0);
+            memcpy(entry.bounds_min, submesh->m_bounds_min.data(), sizeof(entry.bounds_min));
+            memcpy(entry.bounds_max, submesh->m_bounds_max.data(), sizeof(entry.bounds_max));
+            if (submesh->m_vertex_count > 0)
             {
-                glGenBuffers(1, &m_vbo_position);
-                glBindBuffer(GL_ARRAY_BUFFER, m_vbo_position);
-                glBufferData(GL_ARRAY_BUFFER, sizeof(Vector3f) * m_vertex_count, m_positions, drawFlag);
-                _SafeDeleteArray_(m_positions);
+                mesh_min = mesh_min.cwiseMin(submesh->m_bounds_min);
+                mesh_max = mesh_max.cwiseMax(submesh->m_bounds_max);
             }
-            
-            int position_attrib_location = this->m_material->GetProgram()->GetAttribLocation("a_position");
-            glBindBuffer(GL_ARRAY_BUFFER, m_vbo_position);
-            glVertexAttribPointer(position_attrib_location, 3, GL_FLOAT, false, 0, nullptr);
-            glEnableVertexAttribArray(position_attrib_location);
-            
-            
-            if (this->m_texcoords != NULL && this->m_vbo_texcoords <= 0)
+
+            size_t vertex_count = submesh->m_vertex_count;
+            WriteMeshCacheBlock(&blob, &entry.positions_offset, submesh->m_positions, sizeof(Vector3f) * vertex_count);
+            WriteMeshCacheBlock(&blob, &entry.texcoords_offset, submesh->m_texcoords, sizeof(Vector2f) * vertex_count);
+            WriteMeshCacheBlock(&blob, &entry.normals_offset, submesh->m_normals, sizeof(Vector3f) * vertex_count);
+            // 和SubMesh::UploadIndices同样的规则选择索引宽度
+            if (vertex_count <= 65536)
             {
-                glGenBuffers(1, &m_vbo_texcoords);
-                glBindBuffer(GL_ARRAY_BUFFER, m_vbo_texcoords);
-                glBufferData(GL_ARRAY_BUFFER, sizeof(Vector2f) * m_vertex_count, m_texcoords, GL_STATIC_DRAW);
-                _SafeDeleteArray_(m_texcoords);
+                std::vector<uint16_t> indices16(submesh->m_indices.begin(), submesh->m_indices.end());
+                entry.index_size = sizeof(uint16_t);
+                WriteMeshCacheBlock(&blob, &entry.indices_offset, indices16.data(), sizeof(uint16_t) * indices16.size());
             }
-            
-            int texcoord_attrib_location = this->m_material->GetProgram()->GetAttribLocation("a_texcoord");
-            glBindBuffer(GL_ARRAY_BUFFER, m_vbo_texcoords);
-            glVertexAttribPointer(texcoord_attrib_location, 2, GL_FLOAT, false, 0, nullptr);
-            glEnableVertexAttribArray(texcoord_attrib_location);
-            
-            if (this->m_normals != NULL && this->m_vbo_normals <= 0)
+            else
             {
-                glGenBuffers(1, &m_vbo_normals);
-                glBindBuffer(GL_ARRAY_BUFFER, m_vbo_normals);
-                glBufferData(GL_ARRAY_BUFFER, sizeof(Vector3f) * m_vertex_count, m_normals, GL_STATIC_DRAW);
-                _SafeDeleteArray_(m_normals);
+                entry.index_size = sizeof(uint32_t);
+                WriteMeshCacheBlock(&blob, &entry.indices_offset, submesh->m_indices.data(), sizeof(uint32_t) * submesh->m_indices.size());
             }
-            
-            int normal_attrib_location = this->m_material->GetProgram()->GetAttribLocation("a_normal");
-            glBindBuffer(GL_ARRAY_BUFFER, m_vbo_normals);
-            glVertexAttribPointer(normal_attrib_location, 3, GL_FLOAT, false, 0, nullptr);
-            glEnableVertexAttribArray(normal_attrib_location);
-        }
-        else
-        {
-            glBindVertexArray(m_vao);
-        }
-        
-        // do rendering
-        glDrawArrays(GL_TRIANGLES, 0, m_vertex_count);
-        
-        glBindVertexArray(0);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
-        
-        if (this->m_positions != nullptr)
-        {
-            int position_attrib_location = this->m_material->GetProgram()->GetAttribLocation("a_position");
-            glDisableVertexAttribArray(position_attrib_location);
+            WriteMeshCacheBlock(&blob, &entry.sources_offset, submesh->m_vertex_sources.data(), sizeof(int) * submesh->m_vertex_sources.size());
         }
-        
-        if (this->m_texcoords != nullptr)
+        if (!entries.empty() && mesh_min.x() <= mesh_max.x())
         {
-            int texcoord_attrib_location = this->m_material->GetProgram()->GetAttribLocation("a_texcoord");
-            glDisableVertexAttribArray(texcoord_attrib_location);
+            memcpy(header.bounds_min, mesh_min.data(), sizeof(header.bounds_min));
+            memcpy(header.bounds_max, mesh_max.data(), sizeof(header.bounds_max));
         }
-        
-        if (this->m_normals != nullptr)
+
+        memcpy(&blob[0], &header, sizeof(header));
+        if (!entries.empty())
         {
-            int normal_attrib_location = this->m_material->GetProgram()->GetAttribLocation("a_normal");
-            glDisableVertexAttribArray(normal_attrib_location);
+            memcpy(&blob[sizeof(header)], entries.data(), sizeof(MeshCacheSubMesh) * entries.size());
         }
-    }
 
-    int SubMesh::GetVertexCount() const
-    {
-        return m_vertex_count;
+        return WriteFileAtomically(cache_file, blob);
     }
 
-    std::vector<Vector3f> SubMesh::GetOriPositionData()
+    static bool IsMeshCacheBlockValid(uint64_t offset, uint64_t size, size_t file_size)
     {
-        return m_ori_positions;
+        return offset <= file_size && size <= file_size - offset && (offset & 3) == 0;
     }
-    
-    std::vector<ObjTri> SubMesh::GetOriTriangleData()
+
+    // 索引必须组成完整三角形且不越过顶点数; 角点映射(UpdatePositions用)必须落在角点数以内
+    static bool IsMeshCacheTopologyValid(const MeshCacheSubMesh& entry, const char* data)
     {
-        return m_ori_triangles;
+        if (entry.index_count % 3 != 0)
+            return false;
+        const char* indices = data + entry.indices_offset;
+        for (uint32_t i=0; i<entry.index_count; i++)
+        {
+            uint32_t index;
+            if (entry.index_size == 2)
+            {
+                uint16_t index16;
+                memcpy(&index16, indices + i * 2, sizeof(index16));
+                index = index16;
+            }
+            else
+            {
+                memcpy(&index, indices + i * 4, sizeof(index));
+            }
+            if (index >= entry.vertex_count)
+                return false;
+        }
+        const int* sources = (const int*)(data + entry.sources_offset);
+        for (uint32_t i=0; i<entry.vertex_count; i++)
+        {
+            if (sources[i] < 0 || (uint32_t)sources[i] >= entry.index_count)
+                return false;
+        }
+        return true;
     }
-    
-    Material* SubMesh::GetMaterial() const
+
+    static GLuint UploadMeshCacheBuffer(GLenum target, const char* data, size_t size)
     {
-        return m_material;
+        GLuint buffer = 0;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(target, buffer);
+        glBufferData(target, size, data, GL_STATIC_DRAW);
+        return buffer;
     }
 
-    void SubMesh::MarkDymc(bool dymc)
+    Mesh* MeshCache::Load(Renderer* renderer, const std::string& cache_file, std::vector<std::string>* submesh_material_names)
     {
-        m_dymc = dymc;
-    }
+        FileView view;
+        if (!view.Open(cache_file))
+        {
+            return nullptr;
+        }
 
-    void SubMesh::UpdatePositions(Vector3f *positions)
-    {
-        if (m_dymc && m_vbo_position > 0)
+        const char* data = view.GetData();
+        size_t file_size = view.GetSize();
+        if (file_size < sizeof(MeshCacheHeader))
         {
-            glBindBuffer(GL_ARRAY_BUFFER, m_vbo_position);
-            glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(Vector3f) * m_vertex_count, positions);
+            return nullptr;
         }
-    }
-    
-    Mesh::Mesh(Renderer* renderer)
-    : m_renderer(renderer)
-    {
-    }
-    
-    Mesh::~Mesh()
-    {
-        for (auto& submesh : m_submeshes)
+        const MeshCacheHeader* header = (const MeshCacheHeader*)data;
+        if (memcmp(header->magic, MESH_CACHE_MAGIC, sizeof(header->magic)) != 0 || header->version != MESH_CACHE_VERSION)
         {
-            delete submesh;
+            return nullptr;
         }
-        m_submeshes.clear();
-        
-        for (auto& texture_path : m_associated_textures)
+        if (!IsMeshCacheBlockValid(sizeof(MeshCacheHeader), (uint64_t)sizeof(MeshCacheSubMesh) * header->submesh_count, file_size)
+            || !IsMeshCacheBlockValid(header->material_names_offset, header->material_names_size, file_size))
         {
-            auto iter = m_renderer->m_texture_cache.find(texture_path);
-            if (iter != m_renderer->m_texture_cache.end())
+            return nullptr;
+        }
+
+        // 先校验全部数据再创建GL对象, 损坏的缓存直接回退到obj
+        const MeshCacheSubMesh* entries = (const MeshCacheSubMesh*)(data + sizeof(MeshCacheHeader));
+        for (uint32_t i=0; i<header->submesh_count; i++)
+        {
+            const MeshCacheSubMesh& entry = entries[i];
+            uint64_t vertex_count = entry.vertex_count;
+            bool valid = (entry.index_size == 2 || entry.index_size == 4)
+                && IsMeshCacheBlockValid(entry.positions_offset, sizeof(Vector3f) * vertex_count, file_size)
+                && IsMeshCacheBlockValid(entry.indices_offset, (uint64_t)entry.index_size * entry.index_count, file_size)
+                && IsMeshCacheBlockValid(entry.sources_offset, sizeof(int) * vertex_count, file_size);
+            if ((entry.flags & MESH_CACHE_HAS_TEXCOORDS) != 0)
+                valid = valid && IsMeshCacheBlockValid(entry.texcoords_offset, sizeof(Vector2f) * vertex_count, file_size);
+            if ((entry.flags & MESH_CACHE_HAS_NORMALS) != 0)
+                valid = valid && IsMeshCacheBlockValid(entry.normals_offset, sizeof(Vector3f) * vertex_count, file_size);
+            valid = valid && IsMeshCacheTopologyValid(entry, data);
+            if (!valid)
             {
-                delete iter->second.texture;
-                m_renderer->m_texture_cache.erase(iter);
+                return nullptr;
             }
         }
-    }
-    
-    Renderer* Mesh::GetRenderer() const
-    {
-        return m_renderer;
-    }
 
-    void Mesh::RenderOpaqueSubMeshes()
-    {
-        for (auto& submesh : m_submeshes)
+        std::vector<std::string> names;
+        if (!DecodeMaterialNames(data + header->material_names_offset, header->material_names_size, header->material_name_count, &names))
         {
-            auto material = submesh->GetMaterial();
-            if (material && material->IsTranslucent() == false)
-                submesh->Render();
+            return nullptr;
         }
-    }
 
-    void Mesh::RenderTranslucentSubMeshes()
-    {
-        for (auto& submesh : m_submeshes)
+        // 直接从映射的文件上传到VBO, 不经过CPU侧数组
+        Mesh* mesh = new Mesh(renderer);
+        for (uint32_t i=0; i<header->submesh_count; i++)
         {
-            auto material = submesh->GetMaterial();
-            if (material && material->IsTranslucent() == true)
-                submesh->Render();
-        }
-    }
+            const MeshCacheSubMesh& entry = entries[i];
+            SubMesh* submesh = new SubMesh(mesh);
+            submesh->m_vertex_count = entry.vertex_count;
+            submesh->m_index_count = entry.index_count;
+            submesh->m_index_type = entry.index_size == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+            submesh->m_bounds_min = Vector3f(entry.bounds_min[0], entry.bounds_min[1], entry.bounds_min[2]);
+            submesh->m_bounds_max = Vector3f(entry.bounds_max[0], entry.bounds_max[1], entry.bounds_max[2]);
+            submesh->UpdateBoundingSphere(nullptr, 0);
 
-    void Mesh::replaceTexture(Texture* new_tex) {
-        for (int i = 0; i < m_submeshes.size(); ++i) {
-            auto submesh = m_submeshes[i];
-            submesh->m_material->SetTextureParam("baseMap", new_tex);
+            size_t vertex_count = entry.vertex_count;
+            submesh->m_vbo_position = UploadMeshCacheBuffer(GL_ARRAY_BUFFER, data + entry.positions_offset, sizeof(Vector3f) * vertex_count);
+            if ((entry.flags & MESH_CACHE_HAS_TEXCOORDS) != 0)
+            {
+                submesh->m_vbo_texcoords = UploadMeshCacheBuffer(GL_ARRAY_BUFFER, data + entry.texcoords_offset, sizeof(Vector2f) * vertex_count);
+            }
+            if ((entry.flags & MESH_CACHE_HAS_NORMALS) != 0)
+            {
+                submesh->m_vbo_normals = UploadMeshCacheBuffer(GL_ARRAY_BUFFER, data + entry.normals_offset, sizeof(Vector3f) * vertex_count);
+            }
+            submesh->m_ibo = UploadMeshCacheBuffer(GL_ELEMENT_ARRAY_BUFFER, data + entry.indices_offset, (size_t)entry.index_size * entry.index_count);
+            const int* sources = (const int*)(data + entry.sources_offset);
+            submesh->m_vertex_sources.assign(sources, sources + vertex_count);
+            mesh->m_submeshes.push_back(submesh);
         }
-    }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-    void Mesh::SetPosition(const Vector3f& position)
-    {
-        this->m_position = position;
-        this->m_transform_dirty = true;
+        *submesh_material_names = names;
+        return mesh;
     }
 
-    void Mesh::SetRotation(const Eigen::Quaternionf& rotation)
-    {
-        this->m_rotation = rotation;
-        this->m_transform_dirty = true;
-    }
+    // ---- .r3z ----
+    // 文件布局同.r3dmesh, 只是各数据块换成编码后的字节流, 每个块额外记录编码后的大小.
+    // 顶点流编码: 每256个顶点一个块, 块内按字节通道(0..stride-1)依次写出:
+    //   每16个顶点一组, 组头2位(0/2/4/8位宽), 4个组头一字节; 然后是各组按位宽打包的zigzag字节差分.
+    // 差分的基准是上一个顶点的同一字节, 跨块延续.
+    static const char MESH_CODEC_MAGIC[4] = { 'R', '3', 'D', 'Z' };
+    static const uint32_t MESH_CODEC_VERSION = 1;
+    static const size_t VERTEX_CODEC_BLOCK = 256;
+    static const size_t VERTEX_CODEC_GROUP = 16;
 
-    void Mesh::SetScale(const Vector3f& scale)
+    struct MeshCodecHeader
     {
-        this->m_scale = scale;
-        this->m_transform_dirty = true;
-    }
+        char magic[4];
+        uint32_t version;
+        uint32_t submesh_count;
+        uint32_t material_name_count;
+        float bounds_min[3];
+        float bounds_max[3];
+        uint64_t material_names_offset;
+        uint64_t material_names_size;
+    };
 
-    Vector3f Mesh::GetPosition() const
+    struct MeshCodecSubMesh
     {
-        return this->m_position;
-    }
+        uint32_t vertex_count;
+        uint32_t index_count;
+        uint32_t flags; // MeshCacheFlags
+        uint32_t reserved;
+        float bounds_min[3];
+        float bounds_max[3];
+        uint64_t positions_offset;
+        uint64_t positions_size;
+        uint64_t texcoords_offset;
+        uint64_t texcoords_size;
+        uint64_t normals_offset;
+        uint64_t normals_size;
+        uint64_t indices_offset;
+        uint64_t indices_size;
+        uint64_t sources_offset;
+        uint64_t sources_size;
+    };
 
-    Eigen::Quaternionf Mesh::GetRotation() const
+    static inline uint8_t ZigzagEncode8(uint8_t delta)
     {
-        return this->m_rotation;
+        return (uint8_t)((delta << 1) ^ (uint8_t)((int8_t)delta >> 7));
     }
 
-    Vector3f Mesh::GetScale() const
+    static inline uint8_t ZigzagDecode8(uint8_t value)
     {
-        return this->m_scale;
+        return (uint8_t)((value >> 1) ^ (uint8_t)-(int)(value & 1));
     }
 
-    SubMesh* Mesh::GetSubMesh(int index) const
-    {
-        if (index >= 0 && index < m_submeshes.size())
-            return m_submeshes[index];
-        return nullptr;
-    }
+    static const int VERTEX_CODEC_BITS[4] = { 0, 2, 4, 8 };
 
-    void Mesh::SetTransform(const Matrix4f& Matrix4f)
+    void MeshCodec::EncodeVertexBuffer(std::string* out, const void* vertices, size_t vertex_count, size_t stride)
     {
-        this->m_transform = Matrix4f;
-        this->m_transform_dirty = false;
+        const uint8_t* bytes = (const uint8_t*)vertices;
+        std::vector<uint8_t> last(stride, 0);
+        uint8_t deltas[VERTEX_CODEC_BLOCK];
+        for (size_t block_start=0; block_start<vertex_count; block_start+=VERTEX_CODEC_BLOCK)
+        {
+            size_t block_size = std::min(VERTEX_CODEC_BLOCK, vertex_count - block_start);
+            size_t group_count = (block_size + VERTEX_CODEC_GROUP - 1) / VERTEX_CODEC_GROUP;
+            for (size_t k=0; k<stride; k++)
+            {
+                memset(deltas, 0, sizeof(deltas));
+                uint8_t prev = last[k];
+                for (size_t i=0; i<block_size; i++)
+                {
+                    uint8_t value = bytes[(block_start + i) * stride + k];
+                    deltas[i] = ZigzagEncode8((uint8_t)(value - prev));
+                    prev = value;
+                }
+                last[k] = prev;
+
+                // 组头
+                size_t header_start = out->size();
+                out->append((group_count + 3) / 4, 0);
+                for (size_t g=0; g<group_count; g++)
+                {
+                    uint8_t max_delta = 0;
+                    for (size_t i=0; i<VERTEX_CODEC_GROUP; i++)
+                        max_delta = std::max(max_delta, deltas[g * VERTEX_CODEC_GROUP + i]);
+                    int mode = max_delta == 0 ? 0 : max_delta < 4 ? 1 : max_delta < 16 ? 2 : 3;
+                    (*out)[header_start + g / 4] |= (char)(mode << ((g % 4) * 2));
+
+                    // 组数据
+                    int bits = VERTEX_CODEC_BITS[mode];
+                    if (bits == 0)
+                        continue;
+                    const uint8_t* group = deltas + g * VERTEX_CODEC_GROUP;
+                    int per_byte = 8 / bits;
+                    for (size_t i=0; i<VERTEX_CODEC_GROUP; i+=per_byte)
+                    {
+                        uint8_t packed = 0;
+                        for (int j=0; j<per_byte; j++)
+                            packed |= (uint8_t)(group[i + j] << (j * bits));
+                        out->push_back((char)packed);
+                    }
+                }
+            }
+        }
     }
 
-    Matrix4f Mesh::GetTransform()
+    // 解一组16个差分: 按位宽解包, zigzag还原, 再从prev开始做前缀和. out写满16个值, 返回最后一个.
+    // 编码时块尾不满16个的部分差分为0, 所以最后一个值就是组内最后一个真实顶点的值
+    static inline uint8_t DecodeVertexGroup(const uint8_t* payload, int bits, uint8_t prev, uint8_t* out)
     {
-        if (m_transform_dirty)
+#if defined(R3D_SIMD_SSE2)
+        __m128i v;
+        switch (bits)
         {
-            Eigen::Translation3f translation(m_position);
-            Eigen::AlignedScaling3f scale(m_scale);
-            m_transform = (translation * m_rotation * scale).matrix();
-            m_transform_dirty = false;
+        case 0:
+            v = _mm_setzero_si128();
+            break;
+        case 2:
+        {
+            int32_t word;
+            memcpy(&word, payload, sizeof(word));
+            __m128i packed = _mm_cvtsi32_si128(word);
+            __m128i mask = _mm_set1_epi8(3);
+            __m128i a = _mm_and_si128(packed, mask);
+            __m128i b = _mm_and_si128(_mm_srli_epi16(packed, 2), mask);
+            __m128i c = _mm_and_si128(_mm_srli_epi16(packed, 4), mask);
+            __m128i d = _mm_and_si128(_mm_srli_epi16(packed, 6), mask);
+            v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(a, b), _mm_unpacklo_epi8(c, d));
+            break;
         }
-        
-        return this->m_transform;
-    }
-    
-    Camera::Camera(Renderer* renderer)
-    : m_renderer(renderer)
-    {
-        // 必须设置初始位置, 同时间接初始化view matrix
-        // eigen的矩阵是没有初始值的, 会是随机的数
-        SetPosition(Vector3f(0, 0, 1000));
-        SetRotation(Quaternion(0, 0, 0, 0));
-        
-        int width = m_renderer->GetScreenWidth();
-        int height = m_renderer->GetScreenHeight();
-        //MakeOrthographic(width, height, (float)width / (float)height, 0.1f, 5000.0f);
-        MakePerspective(60, (float)width/(float)height, 0.1f, 5000.0f);
+        case 4:
+        {
+            __m128i packed = _mm_loadl_epi64((const __m128i*)payload);
+            __m128i mask = _mm_set1_epi8(15);
+            v = _mm_unpacklo_epi8(_mm_and_si128(packed, mask), _mm_and_si128(_mm_srli_epi16(packed, 4), mask));
+            break;
+        }
+        default:
+            v = _mm_loadu_si128((const __m128i*)payload);
+            break;
+        }
+        // SSE2没有8位移位, 用16位移位再去掉相邻字节移进来的位
+        __m128i sign = _mm_sub_epi8(_mm_setzero_si128(), _mm_and_si128(v, _mm_set1_epi8(1)));
+        v = _mm_xor_si128(_mm_and_si128(_mm_srli_epi16(v, 1), _mm_set1_epi8(0x7f)), sign);
+        v = _mm_add_epi8(v, _mm_slli_si128(v, 1));
+        v = _mm_add_epi8(v, _mm_slli_si128(v, 2));
+        v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi8(v, _mm_set1_epi8((char)prev));
+        _mm_storeu_si128((__m128i*)out, v);
+        return out[VERTEX_CODEC_GROUP - 1];
+#elif defined(R3D_SIMD_NEON)
+        uint8x16_t v;
+        switch (bits)
+        {
+        case 0:
+            v = vdupq_n_u8(0);
+            break;
+        case 2:
+        {
+            uint32_t word;
+            memcpy(&word, payload, sizeof(word));
+            uint8x8_t packed = vreinterpret_u8_u32(vdup_n_u32(word));
+            uint8x8_t mask = vdup_n_u8(3);
+            uint8x8_t ab = vzip_u8(vand_u8(packed, mask), vand_u8(vshr_n_u8(packed, 2), mask)).val[0];
+            uint8x8_t cd = vzip_u8(vand_u8(vshr_n_u8(packed, 4), mask), vshr_n_u8(packed, 6)).val[0];
+            uint16x4x2_t abcd = vzip_u16(vreinterpret_u16_u8(ab), vreinterpret_u16_u8(cd));
+            v = vcombine_u8(vreinterpret_u8_u16(abcd.val[0]), vreinterpret_u8_u16(abcd.val[1]));
+            break;
+        }
+        case 4:
+        {
+            uint8x8_t packed = vld1_u8(payload);
+            uint8x8x2_t nibbles = vzip_u8(vand_u8(packed, vdup_n_u8(15)), vshr_n_u8(packed, 4));
+            v = vcombine_u8(nibbles.val[0], nibbles.val[1]);
+            break;
+        }
+        default:
+            v = vld1q_u8(payload);
+            break;
+        }
+        uint8x16_t sign = vreinterpretq_u8_s8(vnegq_s8(vreinterpretq_s8_u8(vandq_u8(v, vdupq_n_u8(1)))));
+        v = veorq_u8(vshrq_n_u8(v, 1), sign);
+        uint8x16_t zero = vdupq_n_u8(0);
+        v = vaddq_u8(v, vextq_u8(zero, v, 15));
+        v = vaddq_u8(v, vextq_u8(zero, v, 14));
+        v = vaddq_u8(v, vextq_u8(zero, v, 12));
+        v = vaddq_u8(v, vextq_u8(zero, v, 8));
+        v = vaddq_u8(v, vdupq_n_u8(prev));
+        vst1q_u8(out, v);
+        return vgetq_lane_u8(v, 15);
+#else
+        for (size_t i=0; i<VERTEX_CODEC_GROUP; i++)
+        {
+            uint8_t delta;
+            switch (bits)
+            {
+            case 0:
+                delta = 0;
+                break;
+            case 2:
+                delta = (payload[i / 4] >> ((i % 4) * 2)) & 3;
+                break;
+            case 4:
+                delta = (payload[i / 2] >> ((i % 2) * 4)) & 15;
+                break;
+            default:
+                delta = payload[i];
+                break;
+            }
+            prev = (uint8_t)(prev + ZigzagDecode8(delta));
+            out[i] = prev;
+        }
+        return prev;
+#endif
     }
-    
-    Camera::~Camera()
-    {
 
-    }
-    
-    Vector3f Camera::GetPosition() const
+    // 把一个块按字节通道存放的lanes(每个通道VERTEX_CODEC_BLOCK字节)转置回交错的顶点
+    static void TransposeVertexLanes(const uint8_t* lanes, size_t count, size_t stride, uint8_t* dst)
     {
-        return m_position;
+#if defined(R3D_SIMD_SSE2) || defined(R3D_SIMD_NEON)
+        // 本格式的流(float/int)都是4字节的倍数, 一次拼4个通道成32位字
+        if (stride % 4 == 0)
+        {
+            for (size_t k=0; k<stride; k+=4)
+            {
+                const uint8_t* l0 = lanes + k * VERTEX_CODEC_BLOCK;
+                const uint8_t* l1 = l0 + VERTEX_CODEC_BLOCK;
+                const uint8_t* l2 = l1 + VERTEX_CODEC_BLOCK;
+                const uint8_t* l3 = l2 + VERTEX_CODEC_BLOCK;
+                size_t i = 0;
+                for (; i+VERTEX_CODEC_GROUP<=count; i+=VERTEX_CODEC_GROUP)
+                {
+                    alignas(16) uint8_t words[VERTEX_CODEC_GROUP * 4];
+#if defined(R3D_SIMD_SSE2)
+                    __m128i a = _mm_loadu_si128((const __m128i*)(l0 + i));
+                    __m128i b = _mm_loadu_si128((const __m128i*)(l1 + i));
+                    __m128i c = _mm_loadu_si128((const __m128i*)(l2 + i));
+                    __m128i d = _mm_loadu_si128((const __m128i*)(l3 + i));
+                    __m128i ab_lo = _mm_unpacklo_epi8(a, b);
+                    __m128i ab_hi = _mm_unpackhi_epi8(a, b);
+                    __m128i cd_lo = _mm_unpacklo_epi8(c, d);
+                    __m128i cd_hi = _mm_unpackhi_epi8(c, d);
+                    _mm_store_si128((__m128i*)words, _mm_unpacklo_epi16(ab_lo, cd_lo));
+                    _mm_store_si128((__m128i*)words + 1, _mm_unpackhi_epi16(ab_lo, cd_lo));
+                    _mm_store_si128((__m128i*)words + 2, _mm_unpacklo_epi16(ab_hi, cd_hi));
+                    _mm_store_si128((__m128i*)words + 3, _mm_unpackhi_epi16(ab_hi, cd_hi));
+#else
+                    uint8x16x4_t quad;
+                    quad.val[0] = vld1q_u8(l0 + i);
+                    quad.val[1] = vld1q_u8(l1 + i);
+                    quad.val[2] = vld1q_u8(l2 + i);
+                    quad.val[3] = vld1q_u8(l3 + i);
+                    vst4q_u8(words, quad);
+#endif
+                    if (stride == 4)
+                    {
+                        memcpy(dst + i * 4, words, sizeof(words));
+                    }
+                    else
+                    {
+                        for (size_t j=0; j<VERTEX_CODEC_GROUP; j++)
+                            memcpy(dst + (i + j) * stride + k, words + j * 4, 4);
+                    }
+                }
+                for (; i<count; i++)
+                {
+                    uint8_t* out = dst + i * stride + k;
+                    out[0] = l0[i];
+                    out[1] = l1[i];
+                    out[2] = l2[i];
+                    out[3] = l3[i];
+                }
+            }
+            return;
+        }
+#endif
+        for (size_t i=0; i<count; i++)
+        {
+            for (size_t k=0; k<stride; k++)
+                dst[i * stride + k] = lanes[k * VERTEX_CODEC_BLOCK + i];
+        }
     }
-    
-    void Camera::SetPosition(Vector3f position)
+
+    bool MeshCodec::DecodeVertexBuffer(void* vertices, size_t vertex_count, size_t stride, const char* data, size_t size)
     {
-        m_position = position;
-        m_view_matrix_dirty = true;
-        m_view_projection_matrix_dirty = true;
+        uint8_t* bytes = (uint8_t*)vertices;
+        const uint8_t* ptr = (const uint8_t*)data;
+        const uint8_t* end = ptr + size;
+        std::vector<uint8_t> last(stride, 0);
+        // 块内先按字节通道连续解码, 再整块转置, 避免逐字节跨stride写
+        std::vector<uint8_t> lanes(stride * VERTEX_CODEC_BLOCK);
+        for (size_t block_start=0; block_start<vertex_count; block_start+=VERTEX_CODEC_BLOCK)
+        {
+            size_t block_size = std::min(VERTEX_CODEC_BLOCK, vertex_count - block_start);
+            size_t group_count = (block_size + VERTEX_CODEC_GROUP - 1) / VERTEX_CODEC_GROUP;
+            size_t header_size = (group_count + 3) / 4;
+            for (size_t k=0; k<stride; k++)
+            {
+                if ((size_t)(end - ptr) < header_size)
+                    return false;
+                const uint8_t* header = ptr;
+                ptr += header_size;
+
+                uint8_t prev = last[k];
+                uint8_t* lane = lanes.data() + k * VERTEX_CODEC_BLOCK;
+                for (size_t g=0; g<group_count; g++)
+                {
+                    int bits = VERTEX_CODEC_BITS[(header[g / 4] >> ((g % 4) * 2)) & 3];
+                    size_t payload_size = VERTEX_CODEC_GROUP * bits / 8;
+                    if ((size_t)(end - ptr) < payload_size)
+                        return false;
+                    prev = DecodeVertexGroup(ptr, bits, prev, lane + g * VERTEX_CODEC_GROUP);
+                    ptr += payload_size;
+                }
+                last[k] = prev;
+            }
+            TransposeVertexLanes(lanes.data(), block_size, stride, bytes + block_start * stride);
+        }
+        return ptr == end;
     }
-    
-    Quaternion Camera::GetRotation() const
+
+    size_t MeshCodec::GetMinVertexBufferSize(size_t vertex_count, size_t stride)
     {
-        return m_rotation;
+        // 全部是0位宽的组时只剩组头
+        size_t full_blocks = vertex_count / VERTEX_CODEC_BLOCK;
+        size_t tail = vertex_count % VERTEX_CODEC_BLOCK;
+        size_t full_header = (VERTEX_CODEC_BLOCK / VERTEX_CODEC_GROUP + 3) / 4;
+        size_t tail_header = ((tail + VERTEX_CODEC_GROUP - 1) / VERTEX_CODEC_GROUP + 3) / 4;
+        return (full_blocks * full_header + tail_header) * stride;
     }
-    
-    void Camera::SetRotation(Quaternion rotation)
+
+    void MeshCodec::EncodeIndexBuffer(std::string* out, const uint32_t* indices, size_t index_count)
     {
-        m_rotation = rotation;
-        m_view_matrix_dirty = true;
-        m_view_projection_matrix_dirty = true;
+        uint32_t prev = 0;
+        for (size_t i=0; i<index_count; i++)
+        {
+            int32_t delta = (int32_t)(indices[i] - prev);
+            uint32_t value = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+            prev = indices[i];
+            while (value >= 0x80)
+            {
+                out->push_back((char)(value | 0x80));
+                value >>= 7;
+            }
+            out->push_back((char)value);
+        }
     }
-    
-    Matrix4f Camera::GetViewMatrix()
+
+    bool MeshCodec::DecodeIndexBuffer(uint32_t* indices, size_t index_count, const char* data, size_t size)
     {
-        if (!m_view_matrix_dirty)
-            return m_view_matrix;
-        else
+        const uint8_t* ptr = (const uint8_t*)data;
+        const uint8_t* end = ptr + size;
+        uint32_t prev = 0;
+        for (size_t i=0; i<index_count; i++)
         {
-            Eigen::Translation3f translation(m_position);
-            Matrix4f camera_transform = (translation * m_rotation).matrix();
-            m_view_matrix = camera_transform.inverse();
-            m_view_matrix_dirty = false;
-            return m_view_matrix;
+            uint32_t value;
+            // 优化过的索引差值几乎都是1~2字节, 剩余字节够时不用逐字节检查边界
+            if (end - ptr >= 2 && ptr[0] < 0x80)
+            {
+                value = ptr[0];
+                ptr += 1;
+            }
+            else if (end - ptr >= 2 && ptr[1] < 0x80)
+            {
+                value = (uint32_t)(ptr[0] & 0x7f) | ((uint32_t)ptr[1] << 7);
+                ptr += 2;
+            }
+            else
+            {
+                value = 0;
+                int shift = 0;
+                while (true)
+                {
+                    if (ptr == end || shift > 28)
+                        return false;
+                    uint8_t byte = *ptr++;
+                    value |= (uint32_t)(byte & 0x7f) << shift;
+                    if (byte < 0x80)
+                        break;
+                    shift += 7;
+                }
+            }
+            prev += (value >> 1) ^ (uint32_t)-(int32_t)(value & 1);
+            indices[i] = prev;
         }
+        return ptr == end;
     }
-    
-    void Camera::SetViewMatrix(Matrix4f matrix)
+
+    std::string MeshCodec::GetCompressedPath(const std::string& mesh_file_path)
     {
-        m_view_matrix = matrix;
-        m_view_matrix_dirty = false;
-        m_view_projection_matrix_dirty = true;
+        // 扩展名和.obj同样是4个字符, Create*Mesh里按扩展名长度拼贴图路径的逻辑不用改
+        size_t dot = mesh_file_path.rfind('.');
+        size_t slash = mesh_file_path.rfind('/');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        {
+            return mesh_file_path + ".r3z";
+        }
+        return mesh_file_path.substr(0, dot) + ".r3z";
     }
-    
-    Matrix4f Camera::GetProjectionMatrix() const
+
+    bool MeshCodec::IsCompressedPath(const std::string& mesh_file_path)
     {
-        return m_projection_matrix;
+        return mesh_file_path.size() >= 4 && mesh_file_path.compare(mesh_file_path.size() - 4, 4, ".r3z") == 0;
     }
-    
-    void Camera::SetProjectionMatrix(Matrix4f matrix)
+
+    static void WriteMeshCodecBlock(std::string* out, uint64_t* out_offset, uint64_t* out_size, const std::string& encoded)
     {
-        m_projection_matrix = matrix;
-        m_view_projection_matrix_dirty = true;
+        WriteMeshCacheBlock(out, out_offset, encoded.data(), encoded.size());
+        *out_size = encoded.size();
     }
-    
-    Matrix4f Camera::GetViewProjectionMatrix()
+
+    bool MeshCodec::WriteFromObj(const std::string& mesh_file_path, const std::string& compressed_file)
     {
-        if (!m_view_projection_matrix_dirty)
-            return m_view_projection_matrix;
-        else
+        FileView text;
+        if (!text.Open(mesh_file_path))
         {
-            GetViewMatrix();  // manually update if it's dirty
-            m_view_projection_matrix =  m_projection_matrix * m_view_matrix;
-            return m_view_projection_matrix;
+            return false;
         }
-    }
-    
-    void Camera::MakeOrthographic(float width, float height, float ratio, float near, float far)
-    {
-        float half_width = width * 0.5f;
-        float half_height = height * 0.5f;
-        float left = -half_width;
-        float right = half_width;
-        float bottom = -half_height;
-        float top = half_height;
-        
-        if (m_flip_y)
+
+        // 默认会做SubMesh::Optimize, 重排后的索引和顶点差分更小
+        Mesh mesh(nullptr);
+        ObjMeshParser parser(&mesh, text.GetData(), text.GetSize());
+        parser.SetThreadCount(0);
+        bool succ = false;
+        std::vector<std::string> submesh_material_names = parser.Parse(&succ);
+        if (!succ)
         {
-            bottom = half_height;
-            top = -half_height;
-            left = half_width;
-            right = -half_width;
+            return false;
+        }
+
+        MeshCodecHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MESH_CODEC_MAGIC, sizeof(header.magic));
+        header.version = MESH_CODEC_VERSION;
+        header.submesh_count = (uint32_t)mesh.m_submeshes.size();
+        header.material_name_count = (uint32_t)submesh_material_names.size();
+
+        std::vector<MeshCodecSubMesh> entries(mesh.m_submeshes.size());
+        std::string blob(sizeof(MeshCodecHeader) + sizeof(MeshCodecSubMesh) * entries.size(), 0);
+
+        std::string names = EncodeMaterialNames(submesh_material_names);
+        WriteMeshCacheBlock(&blob, &header.material_names_offset, names.data(), names.size());
+        header.material_names_size = names.size();
+
+        Vector3f mesh_min = Vector3f::Constant(FLT_MAX);
+        Vector3f mesh_max = Vector3f::Constant(-FLT_MAX);
+        std::string encoded;
+        for (size_t i=0; i<mesh.m_submeshes.size(); i++)
+        {
+            SubMesh* submesh = mesh.m_submeshes[i];
+            MeshCodecSubMesh& entry = entries[i];
+            memset(&entry, 0, sizeof(entry));
+            entry.vertex_count = submesh->m_vertex_count;
+            entry.index_count = submesh->m_index_count;
+            entry.flags = (submesh->m_texcoords ? MESH_CACHE_HAS_TEXCOORDS : 0) | (submesh->m_normals ? MESH_CACHE_HAS_NORMALS : 0);
+            memcpy(entry.bounds_min, submesh->m_bounds_min.data(), sizeof(entry.bounds_min));
+            memcpy(entry.bounds_max, submesh->m_bounds_max.data(), sizeof(entry.bounds_max));
+            if (submesh->m_vertex_count > 0)
+            {
+                mesh_min = mesh_min.cwiseMin(submesh->m_bounds_min);
+                mesh_max = mesh_max.cwiseMax(submesh->m_bounds_max);
+            }
+
+            size_t vertex_count = submesh->m_vertex_count;
+            encoded.clear();
+            EncodeVertexBuffer(&encoded, submesh->m_positions, vertex_count, sizeof(Vector3f));
+            WriteMeshCodecBlock(&blob, &entry.positions_offset, &entry.positions_size, encoded);
+            if (submesh->m_texcoords != nullptr)
+            {
+                encoded.clear();
+                EncodeVertexBuffer(&encoded, submesh->m_texcoords, vertex_count, sizeof(Vector2f));
+                WriteMeshCodecBlock(&blob, &entry.texcoords_offset, &entry.texcoords_size, encoded);
+            }
+            if (submesh->m_normals != nullptr)
+            {
+                encoded.clear();
+                EncodeVertexBuffer(&encoded, submesh->m_normals, vertex_count, sizeof(Vector3f));
+                WriteMeshCodecBlock(&blob, &entry.normals_offset, &entry.normals_size, encoded);
+            }
+            encoded.clear();
+            EncodeIndexBuffer(&encoded, submesh->m_indices.data(), submesh->m_indices.size());
+            WriteMeshCodecBlock(&blob, &entry.indices_offset, &entry.indices_size, encoded);
+            encoded.clear();
+            EncodeVertexBuffer(&encoded, submesh->m_vertex_sources.data(), submesh->m_vertex_sources.size(), sizeof(int));
+            WriteMeshCodecBlock(&blob, &entry.sources_offset, &entry.sources_size, encoded);
+        }
+        if (!entries.empty() && mesh_min.x() <= mesh_max.x())
+        {
+            memcpy(header.bounds_min, mesh_min.data(), sizeof(header.bounds_min));
+            memcpy(header.bounds_max, mesh_max.data(), sizeof(header.bounds_max));
+        }
+
+        memcpy(&blob[0], &header, sizeof(header));
+        if (!entries.empty())
+        {
+            memcpy(&blob[sizeof(header)], entries.data(), sizeof(MeshCodecSubMesh) * entries.size());
+        }
+
+        VLOG(1) << "compressed " << mesh_file_path << ": " << text.GetSize() << " -> " << blob.size() << " bytes";
+        return WriteFileAtomically(compressed_file, blob);
+    }
+
+    Mesh* MeshCodec::Load(Renderer* renderer, const std::string& compressed_file, std::vector<std::string>* submesh_material_names)
+    {
+        FileView view;
+        if (!view.Open(compressed_file))
+        {
+            return nullptr;
+        }
+
+        auto start_time = std::chrono::steady_clock::now();
+        const char* data = view.GetData();
+        size_t file_size = view.GetSize();
+        if (file_size < sizeof(MeshCodecHeader))
+        {
+            return nullptr;
+        }
+        const MeshCodecHeader* header = (const MeshCodecHeader*)data;
+        if (memcmp(header->magic, MESH_CODEC_MAGIC, sizeof(header->magic)) != 0 || header->version != MESH_CODEC_VERSION)
+        {
+            return nullptr;
+        }
+        if (!IsMeshCacheBlockValid(sizeof(MeshCodecHeader), (uint64_t)sizeof(MeshCodecSubMesh) * header->submesh_count, file_size)
+            || !IsMeshCacheBlockValid(header->material_names_offset, header->material_names_size, file_size))
+        {
+            return nullptr;
+        }
+
+        std::vector<std::string> names;
+        if (!DecodeMaterialNames(data + header->material_names_offset, header->material_names_size, header->material_name_count, &names))
+        {
+            return nullptr;
+        }
+
+        const MeshCodecSubMesh* entries = (const MeshCodecSubMesh*)(data + sizeof(MeshCodecHeader));
+        Mesh* mesh = new Mesh(renderer);
+        bool valid = true;
+        for (uint32_t i=0; i<header->submesh_count && valid; i++)
+        {
+            const MeshCodecSubMesh& entry = entries[i];
+            valid = entry.index_count % 3 == 0
+                && IsMeshCacheBlockValid(entry.positions_offset, entry.positions_size, file_size)
+                && IsMeshCacheBlockValid(entry.texcoords_offset, entry.texcoords_size, file_size)
+                && IsMeshCacheBlockValid(entry.normals_offset, entry.normals_size, file_size)
+                && IsMeshCacheBlockValid(entry.indices_offset, entry.indices_size, file_size)
+                && IsMeshCacheBlockValid(entry.sources_offset, entry.sources_size, file_size);
+            // 数量来自文件, 分配前先确认编码数据至少有这么长. 每个索引至少1字节
+            valid = valid
+                && entry.positions_size >= GetMinVertexBufferSize(entry.vertex_count, sizeof(Vector3f))
+                && entry.sources_size >= GetMinVertexBufferSize(entry.vertex_count, sizeof(int))
+                && entry.indices_size >= entry.index_count;
+            if (valid && (entry.flags & MESH_CACHE_HAS_TEXCOORDS) != 0)
+                valid = entry.texcoords_size >= GetMinVertexBufferSize(entry.vertex_count, sizeof(Vector2f));
+            if (valid && (entry.flags & MESH_CACHE_HAS_NORMALS) != 0)
+                valid = entry.normals_size >= GetMinVertexBufferSize(entry.vertex_count, sizeof(Vector3f));
+            if (!valid)
+                break;
+
+            SubMesh* submesh = new SubMesh(mesh);
+            mesh->m_submeshes.push_back(submesh);
+            size_t vertex_count = entry.vertex_count;
+            submesh->m_vertex_count = entry.vertex_count;
+            submesh->m_index_count = entry.index_count;
+            submesh->m_bounds_min = Vector3f(entry.bounds_min[0], entry.bounds_min[1], entry.bounds_min[2]);
+            submesh->m_bounds_max = Vector3f(entry.bounds_max[0], entry.bounds_max[1], entry.bounds_max[2]);
+            submesh->UpdateBoundingSphere(nullptr, 0);
+
+            submesh->m_positions = new Vector3f[vertex_count];
+            valid = DecodeVertexBuffer(submesh->m_positions, vertex_count, sizeof(Vector3f), data + entry.positions_offset, entry.positions_size);
+            if (valid && (entry.flags & MESH_CACHE_HAS_TEXCOORDS) != 0)
+            {
+                submesh->m_texcoords = new Vector2f[vertex_count];
+                valid = DecodeVertexBuffer(submesh->m_texcoords, vertex_count, sizeof(Vector2f), data + entry.texcoords_offset, entry.texcoords_size);
+            }
+            if (valid && (entry.flags & MESH_CACHE_HAS_NORMALS) != 0)
+            {
+                submesh->m_normals = new Vector3f[vertex_count];
+                valid = DecodeVertexBuffer(submesh->m_normals, vertex_count, sizeof(Vector3f), data + entry.normals_offset, entry.normals_size);
+            }
+            if (valid)
+            {
+                submesh->m_indices.resize(entry.index_count);
+                valid = DecodeIndexBuffer(submesh->m_indices.data(), entry.index_count, data + entry.indices_offset, entry.indices_size);
+            }
+            if (valid)
+            {
+                submesh->m_vertex_sources.resize(vertex_count);
+                valid = DecodeVertexBuffer(submesh->m_vertex_sources.data(), vertex_count, sizeof(int), data + entry.sources_offset, entry.sources_size);
+            }
+            for (size_t j=0; valid && j<submesh->m_indices.size(); j++)
+            {
+                valid = submesh->m_indices[j] < vertex_count;
+            }
+            // UpdatePositions按角点映射读输入, 和.r3dmesh一样要在角点数以内
+            for (size_t j=0; valid && j<submesh->m_vertex_sources.size(); j++)
+            {
+                int source = submesh->m_vertex_sources[j];
+                valid = source >= 0 && (uint32_t)source < entry.index_count;
+            }
+        }
+        if (!valid)
+        {
+            VLOG(1) << "invalid mesh file: " << compressed_file;
+            delete mesh;
+            return nullptr;
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        VLOG(1) << "decoded " << compressed_file << ": " << file_size << " bytes in " << seconds * 1000.0 << " ms";
+
+        *submesh_material_names = names;
+        return mesh;
+    }
+
+    // 尽量把文件踢出page cache, 模拟冷启动. 平台不支持时就是热加载的数字
+    static void EvictFromPageCache(const std::string& file_path)
+    {
+        auto statusOr = PathToResourceAsFile(file_path);
+        if (statusOr.status() != render3d::OkStatus())
+            return;
+        int fd = open(statusOr.ValueOrDie().c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+#ifdef POSIX_FADV_DONTNEED
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+        close(fd);
+    }
+
+    static size_t GetResourceFileSize(const std::string& file_path)
+    {
+        auto statusOr = PathToResourceAsFile(file_path);
+        struct stat file_stat;
+        if (statusOr.status() != render3d::OkStatus() || stat(statusOr.ValueOrDie().c_str(), &file_stat) != 0)
+            return 0;
+        return (size_t)file_stat.st_size;
+    }
+
+    double MeshCodecBenchmark::GetSizeRatio() const
+    {
+        if (compressed_bytes == 0)
+            return 0.0;
+        return (double)obj_bytes / (double)compressed_bytes;
+    }
+
+    double MeshCodecBenchmark::GetSpeedup() const
+    {
+        if (decode_seconds <= 0.0)
+            return 0.0;
+        return obj_seconds / decode_seconds;
+    }
+
+    double MeshCodecBenchmark::GetVertexDecodeThroughput() const
+    {
+        if (vertex_decode_seconds <= 0.0)
+            return 0.0;
+        return vertex_decode_bytes / vertex_decode_seconds / (1024.0 * 1024.0);
+    }
+
+    double MeshCodecBenchmark::GetIndexDecodeThroughput() const
+    {
+        if (index_decode_seconds <= 0.0)
+            return 0.0;
+        return index_decode_bytes / index_decode_seconds / (1024.0 * 1024.0);
+    }
+
+    // 文件已经由MeshCodec::Load校验过. 反复解码直到累计时间足够稳定
+    static void MeasureMeshCodecThroughput(const char* data, MeshCodecBenchmark* result)
+    {
+        const MeshCodecHeader* header = (const MeshCodecHeader*)data;
+        const MeshCodecSubMesh* entries = (const MeshCodecSubMesh*)(data + sizeof(MeshCodecHeader));
+        struct Stream
+        {
+            const char* data;
+            size_t size;
+            size_t count;
+            size_t stride;
+        };
+        std::vector<Stream> vertex_streams;
+        std::vector<Stream> index_streams;
+        size_t max_bytes = 0;
+        for (uint32_t i=0; i<header->submesh_count; i++)
+        {
+            const MeshCodecSubMesh& entry = entries[i];
+            vertex_streams.push_back({ data + entry.positions_offset, entry.positions_size, entry.vertex_count, sizeof(Vector3f) });
+            if ((entry.flags & MESH_CACHE_HAS_TEXCOORDS) != 0)
+                vertex_streams.push_back({ data + entry.texcoords_offset, entry.texcoords_size, entry.vertex_count, sizeof(Vector2f) });
+            if ((entry.flags & MESH_CACHE_HAS_NORMALS) != 0)
+                vertex_streams.push_back({ data + entry.normals_offset, entry.normals_size, entry.vertex_count, sizeof(Vector3f) });
+            vertex_streams.push_back({ data + entry.sources_offset, entry.sources_size, entry.vertex_count, sizeof(int) });
+            index_streams.push_back({ data + entry.indices_offset, entry.indices_size, entry.index_count, sizeof(uint32_t) });
+            max_bytes = std::max(max_bytes, (size_t)entry.vertex_count * sizeof(Vector3f));
+            max_bytes = std::max(max_bytes, (size_t)entry.index_count * sizeof(uint32_t));
+        }
+        std::vector<uint32_t> scratch((max_bytes + sizeof(uint32_t) - 1) / sizeof(uint32_t));
+
+        const double min_seconds = 0.1;
+        const int max_rounds = 64;
+        for (int round=0; round<max_rounds && result->vertex_decode_seconds<min_seconds; round++)
+        {
+            auto start_time = std::chrono::steady_clock::now();
+            for (const Stream& stream : vertex_streams)
+            {
+                MeshCodec::DecodeVertexBuffer(scratch.data(), stream.count, stream.stride, stream.data, stream.size);
+                result->vertex_decode_bytes += stream.count * stream.stride;
+            }
+            result->vertex_decode_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        }
+        for (int round=0; round<max_rounds && result->index_decode_seconds<min_seconds; round++)
+        {
+            auto start_time = std::chrono::steady_clock::now();
+            for (const Stream& stream : index_streams)
+            {
+                MeshCodec::DecodeIndexBuffer(scratch.data(), stream.count, stream.data, stream.size);
+                result->index_decode_bytes += stream.count * stream.stride;
+            }
+            result->index_decode_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        }
+    }
+
+    bool MeshCodec::Benchmark(const std::string& mesh_file_path, const std::string& compressed_file, MeshCodecBenchmark* result)
+    {
+        *result = MeshCodecBenchmark();
+        result->obj_bytes = GetResourceFileSize(mesh_file_path);
+        result->compressed_bytes = GetResourceFileSize(compressed_file);
+
+        // obj: 和Renderer::LoadMeshGeometry的解析路径一致
+        EvictFromPageCache(mesh_file_path);
+        auto start_time = std::chrono::steady_clock::now();
+        {
+            FileView text;
+            if (!text.Open(mesh_file_path))
+            {
+                return false;
+            }
+            Mesh mesh(nullptr);
+            ObjMeshParser parser(&mesh, text.GetData(), text.GetSize());
+            bool succ = false;
+            parser.Parse(&succ);
+            if (!succ)
+            {
+                return false;
+            }
+        }
+        result->obj_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+        EvictFromPageCache(compressed_file);
+        start_time = std::chrono::steady_clock::now();
+        {
+            std::vector<std::string> names;
+            Mesh* mesh = Load(nullptr, compressed_file, &names);
+            if (mesh == nullptr)
+            {
+                return false;
+            }
+            delete mesh;
+        }
+        result->decode_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+        {
+            FileView view;
+            if (!view.Open(compressed_file))
+            {
+                return false;
+            }
+            MeasureMeshCodecThroughput(view.GetData(), result);
         }
+
+        VLOG(1) << "mesh codec benchmark " << mesh_file_path << ": " << result->GetSizeRatio() << "x smaller, "
+            << result->GetSpeedup() << "x faster (" << result->obj_seconds * 1000.0 << " ms -> " << result->decode_seconds * 1000.0 << " ms)";
+        VLOG(1) << "mesh codec decode throughput: vertex " << result->GetVertexDecodeThroughput() << " MB/s, index "
+            << result->GetIndexDecodeThroughput() << " MB/s";
+        return true;
+    }
+
+    SubMesh::SubMesh(Mesh* mesh)
+    : m_mesh(mesh)
+    {
+    }
+
+    SubMesh::~SubMesh()
+    {
+        _SafeDeleteArray_(m_positions);
+        _SafeDeleteArray_(m_texcoords);
+        _SafeDeleteArray_(m_normals);
         
-        memset(&m_projection_matrix, 0, sizeof(m_projection_matrix));
-        float* dst = (float*)&m_projection_matrix;
-        dst[0] = 2 / (right - left);
-        dst[5] = 2 / (top - bottom);
-        dst[12] = (left + right) / (left - right);
-        dst[10] = 1 / (near - far);
-        dst[13] = (top + bottom) / (bottom - top);
-        dst[14] = near / (near - far);
-        dst[15] = 1;
+        if (m_vao > 0)
+        {
+            glDeleteVertexArrays(1, &m_vao);
+            m_vao = 0;
+        }
         
-        m_view_projection_matrix_dirty = true;
+        if (m_vbo_position > 0)
+        {
+            glDeleteBuffers(1, &m_vbo_position);
+            m_vbo_position = 0;
+        }
+        
+        if (m_vbo_texcoords > 0)
+        {
+            glDeleteBuffers(1, &m_vbo_texcoords);
+            m_vbo_texcoords = 0;
+        }
+        
+        if (m_vbo_normals > 0)
+        {
+            glDeleteBuffers(1, &m_vbo_normals);
+            m_vbo_normals = 0;
+        }
+        
+        if (m_vbo_vertices > 0)
+        {
+            glDeleteBuffers(1, &m_vbo_vertices);
+            m_vbo_vertices = 0;
+        }
+        
+        if (m_ibo > 0)
+        {
+            glDeleteBuffers(1, &m_ibo);
+            m_ibo = 0;
+        }
+        
+        if (m_stream_capacity)
+        {
+            delete m_stream_capacity;
+            m_stream_capacity = nullptr;
+        }
+        
+        if (m_material)
+        {
+            delete m_material;
+            m_material = nullptr;
+        }
+    }
+    
+    Mesh* SubMesh::GetMesh() const
+    {
+        return m_mesh;
+    }
+
+    static void BindVertexAttrib(GLStateCache* state, int location, const VertexAttribLayout& layout)
+    {
+        if (location < 0 || layout.buffer == 0)
+            return;
+        state->BindBuffer(GL_ARRAY_BUFFER, layout.buffer);
+        glVertexAttribPointer(location, layout.components, layout.type, layout.normalized, layout.stride, (const void*)(intptr_t)layout.offset);
+        glEnableVertexAttribArray(location);
+    }
+
+    void SubMesh::Render()
+    {
+        if (m_prototype != nullptr)
+        {
+            m_prototype->Draw(m_mesh, 0, 0, 0);
+            return;
+        }
+        Draw(m_mesh, 0, 0, 0);
+    }
+
+    void SubMesh::Draw(Mesh* mesh, GLuint instance_buffer, size_t instance_offset, int instance_count)
+    {
+        if (this->m_material == nullptr)
+        {
+            //VLOG("error: failed to render submesh. no material found.")
+            return;
+        }
+
+        GLStateCache* state = m_mesh->GetRenderer()->GetGLStateCache();
+
+        // 第一次绘制时按顶点格式上传. 需在Apply之前, 因为可能会设置matPosDequant
+        if (m_position_layout.buffer == 0)
+        {
+            if (m_positions != nullptr)
+                UploadVertices();
+            else
+                SetupSeparateStreamLayouts();
+            state->InvalidateBuffers();
+        }
+
+        // apply material
+        this->m_material->Apply(mesh);
+        
+        // bind vao
+        Program* program = this->m_material->GetProgram();
+        if (m_vao == 0 || m_dymc)
+        {
+            // create vao. 动态mesh每次都在默认VAO上重新设置属性
+            if (!m_dymc)
+            {
+                glGenVertexArrays(1, &m_vao);
+            }
+            state->BindVertexArray(m_vao);
+            
+            BindVertexAttrib(state, program->GetAttribLocation(VERTEX_ATTRIB_POSITION), m_position_layout);
+            BindVertexAttrib(state, program->GetAttribLocation(VERTEX_ATTRIB_TEXCOORD), m_texcoord_layout);
+            BindVertexAttrib(state, program->GetAttribLocation(VERTEX_ATTRIB_NORMAL), m_normal_layout);
+            
+            if (this->m_ibo <= 0)
+            {
+                UploadIndices();
+            }
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo);
+            state->InvalidateBuffers();
+        }
+        else
+        {
+            state->BindVertexArray(m_vao);
+        }
+        
+        // do rendering
+        int instance_loc = program->GetAttribLocation(VERTEX_ATTRIB_INSTANCE_WORLD);
+        if (instance_loc >= 0 && instance_count > 0)
+        {
+            // 逐实例的mat4按4个vec4列属性指定. 画完关掉, VAO里这几个属性平时保持关闭
+            state->BindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+            for (int c=0; c<4; c++)
+            {
+                glEnableVertexAttribArray(instance_loc + c);
+                glVertexAttribPointer(instance_loc + c, 4, GL_FLOAT, GL_FALSE, sizeof(float) * 16, (const void*)(instance_offset + sizeof(float) * 4 * c));
+                glVertexAttribDivisor(instance_loc + c, 1);
+            }
+            glDrawElementsInstanced(GL_TRIANGLES, m_index_count, m_index_type, nullptr, instance_count);
+            for (int c=0; c<4; c++)
+            {
+                glDisableVertexAttribArray(instance_loc + c);
+            }
+        }
+        else
+        {
+            // 单个实例: 属性数组关闭时用常量属性值
+            if (instance_loc >= 0)
+            {
+                const Matrix4f& world = mesh->GetObjectConstants().world;
+                for (int c=0; c<4; c++)
+                {
+                    glVertexAttrib4fv(instance_loc + c, world.col(c).data());
+                }
+            }
+            glDrawElements(GL_TRIANGLES, m_index_count, m_index_type, nullptr);
+        }
+        
+        // 属性开关是VAO的状态, 只有用默认VAO的动态mesh需要关掉
+        if (m_dymc)
+        {
+            if (this->m_position_layout.buffer != 0)
+            {
+                glDisableVertexAttribArray(program->GetAttribLocation(VERTEX_ATTRIB_POSITION));
+            }
+            
+            if (this->m_texcoord_layout.buffer != 0)
+            {
+                glDisableVertexAttribArray(program->GetAttribLocation(VERTEX_ATTRIB_TEXCOORD));
+            }
+            
+            if (this->m_normal_layout.buffer != 0)
+            {
+                glDisableVertexAttribArray(program->GetAttribLocation(VERTEX_ATTRIB_NORMAL));
+            }
+        }
+    }
+
+    // ---- vertex format ----
+    static uint16_t FloatToHalf(float value)
+    {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        uint32_t sign = (bits >> 16) & 0x8000;
+        int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+        uint32_t mantissa = bits & 0x7fffff;
+        if (exponent >= 31)
+        {
+            // 溢出/inf/nan
+            return (uint16_t)(sign | 0x7c00 | ((bits & 0x7fffffff) > 0x7f800000 ? 0x200 : 0));
+        }
+        if (exponent <= 0)
+        {
+            // 非规格化数或0
+            if (exponent < -10)
+                return (uint16_t)sign;
+            mantissa |= 0x800000;
+            uint32_t shift = 14 - exponent;
+            uint32_t half = mantissa >> shift;
+            if ((mantissa >> (shift - 1)) & 1)
+                half++;
+            return (uint16_t)(sign | half);
+        }
+        uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+        if (mantissa & 0x1000)
+            half++; // 四舍五入, 进位到指数也是正确的结果
+        return (uint16_t)half;
+    }
+
+    static int16_t FloatToSnorm16(float value)
+    {
+        value = std::max(-1.0f, std::min(1.0f, value));
+        return (int16_t)std::lround(value * 32767.0f);
+    }
+
+    // 八面体映射: 单位向量 -> [-1, 1]^2
+    static Vector2f OctEncode(const Vector3f& n)
+    {
+        float l1 = std::fabs(n.x()) + std::fabs(n.y()) + std::fabs(n.z());
+        if (l1 <= 0.0f)
+            return Vector2f(0.0f, 0.0f);
+        Vector2f e(n.x() / l1, n.y() / l1);
+        if (n.z() < 0.0f)
+        {
+            float x = e.x();
+            e.x() = (1.0f - std::fabs(e.y())) * (x >= 0.0f ? 1.0f : -1.0f);
+            e.y() = (1.0f - std::fabs(x)) * (e.y() >= 0.0f ? 1.0f : -1.0f);
+        }
+        return e;
+    }
+
+    std::string GetVertexFormatMacros(int vertex_format)
+    {
+        return GetShaderFeatureMacros(GetVertexFormatShaderFeatures(vertex_format));
+    }
+
+    int GetVertexFormatShaderFeatures(int vertex_format)
+    {
+        int features = 0;
+        if (vertex_format & VERTEX_QUANTIZE_POSITION)
+            features |= SHADER_FEATURE_QUANTIZED_POSITION;
+        if (vertex_format & VERTEX_OCT_NORMAL)
+            features |= SHADER_FEATURE_OCT_NORMAL;
+        return features;
+    }
+
+    std::string GetShaderFeatureMacros(int features)
+    {
+        static const char* FEATURE_MACROS[SHADER_FEATURE_COUNT] =
+        {
+            "#define R3D_QUANTIZED_POSITION\n",
+            "#define R3D_OCT_NORMAL\n",
+            "#define USE_NORMAL_MAP\n",
+            "#define USE_EMISSIVE_MAP\n",
+            "#define R3D_INSTANCED\n",
+        };
+        std::string macros;
+        for (int i=0; i<SHADER_FEATURE_COUNT; i++)
+        {
+            if (features & (1 << i))
+                macros += FEATURE_MACROS[i];
+        }
+        return macros;
+    }
+
+    void SubMesh::UploadVertices()
+    {
+        // 动态mesh的位置每帧整体更新, 单独放一个float的buffer
+        bool quantize_position = (m_vertex_format & VERTEX_QUANTIZE_POSITION) != 0 && !m_dymc;
+        bool oct_normal = (m_vertex_format & VERTEX_OCT_NORMAL) != 0 && m_normals != nullptr;
+
+        // unorm16只能表示[0, 1], 有平铺uv时退回half float
+        GLenum texcoord_type = GL_FLOAT;
+        if (m_texcoords != nullptr && (m_vertex_format & (VERTEX_HALF_TEXCOORD | VERTEX_UNORM16_TEXCOORD)) != 0)
+        {
+            texcoord_type = GL_HALF_FLOAT;
+            if ((m_vertex_format & VERTEX_UNORM16_TEXCOORD) != 0)
+            {
+                bool in_unit_range = true;
+                for (int i=0; i<m_vertex_count && in_unit_range; i++)
+                {
+                    in_unit_range = m_texcoords[i].x() >= 0.0f && m_texcoords[i].x() <= 1.0f && m_texcoords[i].y() >= 0.0f && m_texcoords[i].y() <= 1.0f;
+                }
+                if (in_unit_range)
+                    texcoord_type = GL_UNSIGNED_SHORT;
+            }
+        }
+
+        // 交错布局: [position][texcoord][normal], 每个属性4字节对齐
+        int stride = 0;
+        int position_offset = stride;
+        if (!m_dymc)
+            stride += quantize_position ? 4 * sizeof(uint16_t) : sizeof(Vector3f);
+        int texcoord_offset = stride;
+        if (m_texcoords != nullptr)
+            stride += texcoord_type == GL_FLOAT ? sizeof(Vector2f) : 2 * sizeof(uint16_t);
+        int normal_offset = stride;
+        if (m_normals != nullptr)
+            stride += oct_normal ? 2 * sizeof(int16_t) : sizeof(Vector3f);
+
+        Vector3f extent = m_bounds_max - m_bounds_min;
+        Vector3f inv_extent(extent.x() > 0.0f ? 1.0f / extent.x() : 0.0f, extent.y() > 0.0f ? 1.0f / extent.y() : 0.0f, extent.z() > 0.0f ? 1.0f / extent.z() : 0.0f);
+
+        if (stride > 0)
+        {
+            std::vector<uint8_t> vertices((size_t)stride * m_vertex_count);
+            for (int i=0; i<m_vertex_count; i++)
+            {
+                uint8_t* vertex = vertices.data() + (size_t)stride * i;
+                if (!m_dymc)
+                {
+                    if (quantize_position)
+                    {
+                        Vector3f p = (m_positions[i] - m_bounds_min).cwiseProduct(inv_extent);
+                        uint16_t q[4] = {
+                            (uint16_t)std::lround(std::max(0.0f, std::min(1.0f, p.x())) * 65535.0f),
+                            (uint16_t)std::lround(std::max(0.0f, std::min(1.0f, p.y())) * 65535.0f),
+                            (uint16_t)std::lround(std::max(0.0f, std::min(1.0f, p.z())) * 65535.0f),
+                            0,
+                        };
+                        memcpy(vertex + position_offset, q, sizeof(q));
+                    }
+                    else
+                    {
+                        memcpy(vertex + position_offset, m_positions[i].data(), sizeof(Vector3f));
+                    }
+                }
+
+                if (m_texcoords != nullptr)
+                {
+                    const Vector2f& uv = m_texcoords[i];
+                    if (texcoord_type == GL_FLOAT)
+                    {
+                        memcpy(vertex + texcoord_offset, uv.data(), sizeof(Vector2f));
+                    }
+                    else
+                    {
+                        uint16_t q[2];
+                        if (texcoord_type == GL_HALF_FLOAT)
+                        {
+                            q[0] = FloatToHalf(uv.x());
+                            q[1] = FloatToHalf(uv.y());
+                        }
+                        else
+                        {
+                            q[0] = (uint16_t)std::lround(uv.x() * 65535.0f);
+                            q[1] = (uint16_t)std::lround(uv.y() * 65535.0f);
+                        }
+                        memcpy(vertex + texcoord_offset, q, sizeof(q));
+                    }
+                }
+
+                if (m_normals != nullptr)
+                {
+                    if (oct_normal)
+                    {
+                        Vector2f e = OctEncode(m_normals[i]);
+                        int16_t q[2] = { FloatToSnorm16(e.x()), FloatToSnorm16(e.y()) };
+                        memcpy(vertex + normal_offset, q, sizeof(q));
+                    }
+                    else
+                    {
+                        memcpy(vertex + normal_offset, m_normals[i].data(), sizeof(Vector3f));
+                    }
+                }
+            }
+
+            glGenBuffers(1, &m_vbo_vertices);
+            glBindBuffer(GL_ARRAY_BUFFER, m_vbo_vertices);
+            glBufferData(GL_ARRAY_BUFFER, vertices.size(), vertices.data(), GL_STATIC_DRAW);
+        }
+
+        if (m_dymc)
+        {
+            glGenBuffers(1, &m_vbo_position);
+            glBindBuffer(GL_ARRAY_BUFFER, m_vbo_position);
+            glBufferData(GL_ARRAY_BUFFER, sizeof(Vector3f) * m_vertex_count, m_positions, GL_DYNAMIC_DRAW);
+            m_position_layout = { m_vbo_position, 3, GL_FLOAT, false, 0, 0 };
+        }
+        else if (quantize_position)
+        {
+            m_position_layout = { m_vbo_vertices, 3, GL_UNSIGNED_SHORT, true, stride, position_offset };
+        }
+        else
+        {
+            m_position_layout = { m_vbo_vertices, 3, GL_FLOAT, false, stride, position_offset };
+        }
+
+        if (m_texcoords != nullptr)
+        {
+            m_texcoord_layout = { m_vbo_vertices, 2, texcoord_type, texcoord_type == GL_UNSIGNED_SHORT, stride, texcoord_offset };
+        }
+        if (m_normals != nullptr)
+        {
+            m_normal_layout = oct_normal ? VertexAttribLayout{ m_vbo_vertices, 2, GL_SHORT, true, stride, normal_offset }
+                                         : VertexAttribLayout{ m_vbo_vertices, 3, GL_FLOAT, false, stride, normal_offset };
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        // 量化位置的反量化矩阵: [0,1] -> AABB. 未实际量化(动态mesh)时为单位阵, 同一个shader变体都能用
+        if ((m_vertex_format & VERTEX_QUANTIZE_POSITION) != 0)
+        {
+            Matrix4f dequant = Matrix4f::Identity();
+            if (quantize_position)
+            {
+                dequant.block<3, 3>(0, 0) = extent.asDiagonal();
+                dequant.block<3, 1>(0, 3) = m_bounds_min;
+            }
+            m_material->SetMatrix4fParam("matPosDequant", dequant);
+        }
+
+        VLOG(2) << "submesh vertex format " << m_vertex_format << ": " << stride << " bytes per vertex";
+
+        _SafeDeleteArray_(m_positions);
+        _SafeDeleteArray_(m_texcoords);
+        _SafeDeleteArray_(m_normals);
+    }
+
+    void SubMesh::SetupSeparateStreamLayouts()
+    {
+        // .r3dmesh和流式加载直接上传了分开的float顶点流
+        m_position_layout = { m_vbo_position, 3, GL_FLOAT, false, 0, 0 };
+        m_texcoord_layout = { m_vbo_texcoords, 2, GL_FLOAT, false, 0, 0 };
+        m_normal_layout = { m_vbo_normals, 3, GL_FLOAT, false, 0, 0 };
+    }
+
+    int SubMesh::GetVertexFormat() const
+    {
+        return m_vertex_format;
+    }
+
+    // ---- mesh optimization ----
+    // 加载期对索引/顶点顺序做的优化, 参考Tipsify(Sander et al. 2007):
+    // 1. 顶点缓存: Tipsify重排三角形, 提高post-transform cache命中
+    // 2. overdraw: 把结果切成簇, 外侧朝外的簇先画, 让early-z挡掉更多片元
+    // 3. 顶点获取: 按首次使用的顺序重排顶点, 提高顶点获取的局部性
+    static const int VERTEX_CACHE_SIZE = 16;
+
+    // 模拟FIFO顶点缓存, 返回未命中次数
+    static size_t SimulateVertexCacheMisses(const uint32_t* indices, size_t index_count, int vertex_count)
+    {
+        std::vector<int> cache_time(vertex_count, -VERTEX_CACHE_SIZE - 1);
+        int timestamp = 0;
+        size_t misses = 0;
+        for (size_t i=0; i<index_count; i++)
+        {
+            uint32_t v = indices[i];
+            if (timestamp - cache_time[v] > VERTEX_CACHE_SIZE)
+            {
+                cache_time[v] = timestamp++;
+                misses++;
+            }
+        }
+        return misses;
+    }
+
+    static void TipsifyIndices(std::vector<uint32_t>* indices, int vertex_count, std::vector<uint32_t>* out_indices)
+    {
+        const size_t triangle_count = indices->size() / 3;
+
+        // 顶点 -> 三角形邻接表(CSR)
+        std::vector<uint32_t> live(vertex_count, 0);
+        for (uint32_t v : *indices)
+        {
+            live[v]++;
+        }
+        std::vector<uint32_t> offsets(vertex_count + 1, 0);
+        for (int v=0; v<vertex_count; v++)
+        {
+            offsets[v + 1] = offsets[v] + live[v];
+        }
+        std::vector<uint32_t> adjacency(indices->size());
+        {
+            std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+            for (size_t i=0; i<indices->size(); i++)
+            {
+                adjacency[fill[(*indices)[i]]++] = (uint32_t)(i / 3);
+            }
+        }
+
+        std::vector<int> cache_time(vertex_count, -VERTEX_CACHE_SIZE - 1);
+        std::vector<bool> emitted(triangle_count, false);
+        std::vector<uint32_t> dead_end;
+        std::vector<uint32_t> candidates;
+        out_indices->clear();
+        out_indices->reserve(indices->size());
+
+        int timestamp = VERTEX_CACHE_SIZE + 1;
+        int cursor = 0;
+        int fanning = vertex_count > 0 ? 0 : -1;
+        while (fanning >= 0)
+        {
+            candidates.clear();
+            for (uint32_t a=offsets[fanning]; a<offsets[fanning + 1]; a++)
+            {
+                uint32_t t = adjacency[a];
+                if (emitted[t])
+                    continue;
+                emitted[t] = true;
+                for (int c=0; c<3; c++)
+                {
+                    uint32_t v = (*indices)[t * 3 + c];
+                    out_indices->push_back(v);
+                    dead_end.push_back(v);
+                    candidates.push_back(v);
+                    live[v]--;
+                    if (timestamp - cache_time[v] > VERTEX_CACHE_SIZE)
+                    {
+                        cache_time[v] = timestamp++;
+                    }
+                }
+            }
+
+            // 下一个扇心: 候选里仍在缓存中且最老的顶点
+            fanning = -1;
+            int best_priority = -1;
+            for (uint32_t v : candidates)
+            {
+                if (live[v] == 0)
+                    continue;
+                int priority = 0;
+                if (timestamp - cache_time[v] + 2 * (int)live[v] <= VERTEX_CACHE_SIZE)
+                {
+                    priority = timestamp - cache_time[v];
+                }
+                if (priority > best_priority)
+                {
+                    best_priority = priority;
+                    fanning = v;
+                }
+            }
+
+            // 死胡同: 回退到最近用过的顶点, 再不行就顺序找下一个
+            while (fanning < 0 && !dead_end.empty())
+            {
+                uint32_t v = dead_end.back();
+                dead_end.pop_back();
+                if (live[v] > 0)
+                    fanning = v;
+            }
+            while (fanning < 0 && cursor < vertex_count)
+            {
+                if (live[cursor] > 0)
+                    fanning = cursor;
+                cursor++;
+            }
+        }
+    }
+
+    // 按簇重排三角形以减少overdraw. 簇边界取顶点缓存被完全刷新的位置(硬边界),
+    // 簇内再在局部ACMR不超过整簇threshold倍的位置细分(软边界), 尽量不损失缓存命中.
+    static void OptimizeOverdraw(std::vector<uint32_t>* indices, const Vector3f* positions, int vertex_count, float threshold)
+    {
+        const size_t triangle_count = indices->size() / 3;
+        if (triangle_count == 0)
+            return;
+
+        // 硬边界, 同时记下每个三角形的未命中数
+        std::vector<uint8_t> triangle_misses(triangle_count);
+        std::vector<size_t> hard_boundaries;
+        std::vector<int> cache_time(vertex_count, -VERTEX_CACHE_SIZE - 1);
+        int timestamp = 0;
+        for (size_t t=0; t<triangle_count; t++)
+        {
+            int misses = 0;
+            for (int c=0; c<3; c++)
+            {
+                uint32_t v = (*indices)[t * 3 + c];
+                if (timestamp - cache_time[v] > VERTEX_CACHE_SIZE)
+                {
+                    cache_time[v] = timestamp++;
+                    misses++;
+                }
+            }
+            triangle_misses[t] = (uint8_t)misses;
+            if (t == 0 || misses == 3)
+            {
+                hard_boundaries.push_back(t);
+            }
+        }
+        hard_boundaries.push_back(triangle_count);
+
+        // 软边界. 新开一个簇时把时间戳推过缓存大小, 相当于清空缓存
+        std::vector<size_t> clusters;
+        for (size_t h=0; h+1<hard_boundaries.size(); h++)
+        {
+            size_t begin = hard_boundaries[h];
+            size_t end = hard_boundaries[h + 1];
+            size_t hard_misses = 0;
+            for (size_t t=begin; t<end; t++)
+            {
+                hard_misses += triangle_misses[t];
+            }
+            float cluster_acmr = (float)hard_misses / (end - begin);
+
+            timestamp += VERTEX_CACHE_SIZE + 1;
+            size_t misses = 0;
+            size_t cluster_begin = begin;
+            clusters.push_back(begin);
+            for (size_t t=begin; t<end; t++)
+            {
+                for (int c=0; c<3; c++)
+                {
+                    uint32_t v = (*indices)[t * 3 + c];
+                    if (timestamp - cache_time[v] > VERTEX_CACHE_SIZE)
+                    {
+                        cache_time[v] = timestamp++;
+                        misses++;
+                    }
+                }
+                size_t count = t + 1 - cluster_begin;
+                if (t + 1 < end && count >= VERTEX_CACHE_SIZE && (float)misses / count <= cluster_acmr * threshold)
+                {
+                    clusters.push_back(t + 1);
+                    cluster_begin = t + 1;
+                    misses = 0;
+                    timestamp += VERTEX_CACHE_SIZE + 1;
+                }
+            }
+        }
+        clusters.push_back(triangle_count);
+
+        // 每个簇: 面积加权的中心和法线, 用 dot(中心 - mesh中心, 法线) 作为排序依据
+        Vector3f mesh_center = Vector3f::Zero();
+        float mesh_area = 0.0f;
+        std::vector<float> sort_keys(clusters.size() - 1);
+        std::vector<Vector3f> centers(clusters.size() - 1);
+        std::vector<Vector3f> normals(clusters.size() - 1);
+        for (size_t k=0; k+1<clusters.size(); k++)
+        {
+            Vector3f center = Vector3f::Zero();
+            Vector3f normal = Vector3f::Zero();
+            float area = 0.0f;
+            for (size_t t=clusters[k]; t<clusters[k + 1]; t++)
+            {
+                const Vector3f& p0 = positions[(*indices)[t * 3 + 0]];
+                const Vector3f& p1 = positions[(*indices)[t * 3 + 1]];
+                const Vector3f& p2 = positions[(*indices)[t * 3 + 2]];
+                Vector3f n = (p1 - p0).cross(p2 - p0);
+                float a = n.norm();
+                center += (p0 + p1 + p2) * (a / 3.0f);
+                normal += n;
+                area += a;
+            }
+            centers[k] = area > 0.0f ? Vector3f(center / area) : positions[(*indices)[clusters[k] * 3]];
+            normals[k] = normal;
+            mesh_center += center;
+            mesh_area += area;
+        }
+        if (mesh_area > 0.0f)
+        {
+            mesh_center /= mesh_area;
+        }
+        for (size_t k=0; k<sort_keys.size(); k++)
+        {
+            float len = normals[k].norm();
+            sort_keys[k] = len > 0.0f ? (centers[k] - mesh_center).dot(normals[k]) / len : 0.0f;
+        }
+
+        std::vector<size_t> order(sort_keys.size());
+        for (size_t k=0; k<order.size(); k++)
+        {
+            order[k] = k;
+        }
+        std::stable_sort(order.begin(), order.end(), [&sort_keys](size_t a, size_t b) {
+            return sort_keys[a] > sort_keys[b];
+        });
+
+        std::vector<uint32_t> sorted;
+        sorted.reserve(indices->size());
+        for (size_t k : order)
+        {
+            sorted.insert(sorted.end(), indices->begin() + clusters[k] * 3, indices->begin() + clusters[k + 1] * 3);
+        }
+        indices->swap(sorted);
+    }
+
+    template<typename T>
+    static void RemapVertexStream(T*& stream, const std::vector<uint32_t>& remap, int vertex_count)
+    {
+        if (stream == nullptr)
+            return;
+        T* remapped = new T[vertex_count];
+        for (int v=0; v<vertex_count; v++)
+        {
+            remapped[remap[v]] = stream[v];
+        }
+        delete[] stream;
+        stream = remapped;
+    }
+
+    void SubMesh::Optimize()
+    {
+        if (m_indices.empty() || m_positions == nullptr)
+            return;
+
+        size_t misses = SimulateVertexCacheMisses(m_indices.data(), m_indices.size(), m_vertex_count);
+        m_optimize_stats.acmr_before = (float)misses / (m_index_count / 3);
+        m_optimize_stats.atvr_before = (float)misses / m_vertex_count;
+
+        std::vector<uint32_t> optimized;
+        TipsifyIndices(&m_indices, m_vertex_count, &optimized);
+        m_indices.swap(optimized);
+        OptimizeOverdraw(&m_indices, m_positions, m_vertex_count, 1.05f);
+
+        // 按首次使用顺序重排顶点. 顶点都被引用过(焊接结果), 所以remap是一一映射
+        std::vector<uint32_t> remap(m_vertex_count, UINT32_MAX);
+        uint32_t next_vertex = 0;
+        for (auto& index : m_indices)
+        {
+            if (remap[index] == UINT32_MAX)
+            {
+                remap[index] = next_vertex++;
+            }
+            index = remap[index];
+        }
+        RemapVertexStream(m_positions, remap, m_vertex_count);
+        RemapVertexStream(m_texcoords, remap, m_vertex_count);
+        RemapVertexStream(m_normals, remap, m_vertex_count);
+        if (!m_vertex_sources.empty())
+        {
+            std::vector<int> sources(m_vertex_count);
+            for (int v=0; v<m_vertex_count; v++)
+            {
+                sources[remap[v]] = m_vertex_sources[v];
+            }
+            m_vertex_sources.swap(sources);
+        }
+
+        misses = SimulateVertexCacheMisses(m_indices.data(), m_indices.size(), m_vertex_count);
+        m_optimize_stats.acmr_after = (float)misses / (m_index_count / 3);
+        m_optimize_stats.atvr_after = (float)misses / m_vertex_count;
+        VLOG(2) << "submesh optimized: ACMR " << m_optimize_stats.acmr_before << " -> " << m_optimize_stats.acmr_after
+                << ", ATVR " << m_optimize_stats.atvr_before << " -> " << m_optimize_stats.atvr_after;
+    }
+
+    const MeshOptimizeStats& SubMesh::GetOptimizeStats() const
+    {
+        return m_optimize_stats;
+    }
+
+    void SubMesh::UploadIndices()
+    {
+        // 顶点数不超过65536时用16位索引, 省一半带宽
+        glGenBuffers(1, &m_ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo);
+        if (m_vertex_count <= 65536)
+        {
+            std::vector<uint16_t> indices16(m_indices.begin(), m_indices.end());
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint16_t) * m_index_count, indices16.data(), GL_STATIC_DRAW);
+            m_index_type = GL_UNSIGNED_SHORT;
+        }
+        else
+        {
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint32_t) * m_index_count, m_indices.data(), GL_STATIC_DRAW);
+            m_index_type = GL_UNSIGNED_INT;
+        }
+        std::vector<uint32_t>().swap(m_indices);
+    }
+
+    int SubMesh::GetVertexCount() const
+    {
+        return m_vertex_count;
+    }
+
+    int SubMesh::GetIndexCount() const
+    {
+        return m_index_count;
+    }
+
+    Vector3f SubMesh::GetBoundsMin() const
+    {
+        return m_bounds_min;
+    }
+
+    Vector3f SubMesh::GetBoundsMax() const
+    {
+        return m_bounds_max;
+    }
+
+    Vector3f SubMesh::GetBoundingSphereCenter() const
+    {
+        return m_sphere_center;
+    }
+
+    float SubMesh::GetBoundingSphereRadius() const
+    {
+        return m_sphere_radius;
+    }
+
+    void SubMesh::UpdateBoundingSphere(const Vector3f* positions, int count)
+    {
+        // 球心取AABB中心. 有顶点时半径取到最远顶点的距离, 比AABB外接球紧
+        m_sphere_center = (m_bounds_min + m_bounds_max) * 0.5f;
+        if (positions == nullptr)
+        {
+            m_sphere_radius = (m_bounds_max - m_bounds_min).norm() * 0.5f;
+            return;
+        }
+        float radius_sq = 0.0f;
+        for (int i=0; i<count; i++)
+        {
+            radius_sq = std::max(radius_sq, (positions[i] - m_sphere_center).squaredNorm());
+        }
+        m_sphere_radius = std::sqrt(radius_sq);
+    }
+
+    bool SubMesh::CopyOccluderGeometry()
+    {
+        if (m_positions != nullptr && !m_indices.empty())
+        {
+            m_occluder_positions.assign(m_positions, m_positions + m_vertex_count);
+            m_occluder_indices = m_indices;
+            return true;
+        }
+        // .r3dmesh和流式加载的mesh直接上传了float位置, 一次性读回
+        if (m_vbo_position == 0 || m_ibo == 0 || m_vertex_count == 0 || m_index_count == 0)
+            return false;
+
+        m_occluder_positions.resize(m_vertex_count);
+        glBindBuffer(GL_COPY_READ_BUFFER, m_vbo_position);
+        const void* mapped = glMapBufferRange(GL_COPY_READ_BUFFER, 0, sizeof(Vector3f) * m_vertex_count, GL_MAP_READ_BIT);
+        if (mapped == nullptr)
+        {
+            glBindBuffer(GL_COPY_READ_BUFFER, 0);
+            m_occluder_positions.clear();
+            return false;
+        }
+        memcpy(reinterpret_cast<float*>(m_occluder_positions.data()), mapped, sizeof(Vector3f) * m_vertex_count);
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+
+        size_t index_size = m_index_type == GL_UNSIGNED_SHORT ? 2 : 4;
+        glBindBuffer(GL_COPY_READ_BUFFER, m_ibo);
+        mapped = glMapBufferRange(GL_COPY_READ_BUFFER, 0, index_size * m_index_count, GL_MAP_READ_BIT);
+        if (mapped == nullptr)
+        {
+            glBindBuffer(GL_COPY_READ_BUFFER, 0);
+            m_occluder_positions.clear();
+            return false;
+        }
+        m_occluder_indices.resize(m_index_count);
+        for (int i=0; i<m_index_count; i++)
+        {
+            m_occluder_indices[i] = index_size == 2 ? ((const uint16_t*)mapped)[i] : ((const uint32_t*)mapped)[i];
+        }
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        return true;
+    }
+
+    float SubMesh::GetVertexReductionRatio() const
+    {
+        if (m_vertex_count <= 0)
+            return 1.0f;
+        return (float)m_index_count / (float)m_vertex_count;
+    }
+
+    std::vector<Vector3f> SubMesh::GetOriPositionData()
+    {
+        return m_ori_positions;
+    }
+    
+    std::vector<ObjTri> SubMesh::GetOriTriangleData()
+    {
+        return m_ori_triangles;
+    }
+    
+    Material* SubMesh::GetMaterial() const
+    {
+        return m_prototype != nullptr ? m_prototype->m_material : m_material;
+    }
+
+    bool SubMesh::IsDymc() const
+    {
+        return m_prototype != nullptr ? m_prototype->m_dymc : m_dymc;
+    }
+
+    void SubMesh::MarkDymc(bool dymc)
+    {
+        m_dymc = dymc;
+        if (m_mesh != nullptr)
+        {
+            m_mesh->MarkBoundsDirty();
+            // 实例的包围盒同样要重新计算(动态时不进BVH)
+            for (auto& instance : m_mesh->m_instances)
+            {
+                instance->MarkBoundsDirty();
+            }
+        }
+    }
+
+    void SubMesh::UpdatePositions(Vector3f *positions)
+    {
+        if (m_dymc && m_vbo_position > 0)
+        {
+            // 输入仍按三角形角点排列, 取每个焊接顶点第一次出现的角点.
+            // 流式加载的submesh没有角点映射, 输入直接按顶点顺序
+            const Vector3f* vertex_positions = positions;
+            if (!m_vertex_sources.empty())
+            {
+                m_dymc_positions.resize(m_vertex_count);
+                for (int i=0; i<m_vertex_count; i++)
+                {
+                    m_dymc_positions[i] = positions[m_vertex_sources[i]];
+                }
+                vertex_positions = m_dymc_positions.data();
+            }
+            // 作为遮挡物时CPU侧几何也要跟着变, 否则遮挡缓冲里还是加载时的形状
+            if (!m_occluder_positions.empty())
+            {
+                m_occluder_positions.assign(vertex_positions, vertex_positions + m_vertex_count);
+            }
+            glBindBuffer(GL_ARRAY_BUFFER, m_vbo_position);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(Vector3f) * m_vertex_count, vertex_positions);
+        }
+    }
+
+    // 把used字节的buffer扩容到至少required字节. 用COPY_READ/COPY_WRITE目标, 不影响VAO绑定
+    static void GrowStreamBuffer(GLuint* buffer, size_t* capacity, size_t used, size_t required)
+    {
+        if (*buffer > 0 && required <= *capacity)
+            return;
+
+        size_t new_capacity = std::max(required, *capacity * 2);
+        GLuint new_buffer = 0;
+        glGenBuffers(1, &new_buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, new_buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, new_capacity, nullptr, GL_STATIC_DRAW);
+        if (*buffer > 0)
+        {
+            if (used > 0)
+            {
+                glBindBuffer(GL_COPY_READ_BUFFER, *buffer);
+                glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used);
+            }
+            glDeleteBuffers(1, buffer);
+        }
+        *buffer = new_buffer;
+        *capacity = new_capacity;
+    }
+
+    static void AppendStreamBuffer(GLuint* buffer, size_t* capacity, size_t used, const void* data, size_t size)
+    {
+        GrowStreamBuffer(buffer, capacity, used, used + size);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, *buffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, used, size, data);
+    }
+
+    void SubMesh::AppendStreamBatch(SubMesh* batch)
+    {
+        // 第一批决定有哪些顶点流
+        if (m_stream_capacity == nullptr)
+        {
+            m_stream_capacity = new StreamCapacity();
+            m_stream_has_texcoords = batch->m_texcoords != nullptr;
+            m_stream_has_normals = batch->m_normals != nullptr;
+            m_bounds_min = batch->m_bounds_min;
+            m_bounds_max = batch->m_bounds_max;
+        }
+        else if (batch->m_vertex_count > 0)
+        {
+            m_bounds_min = m_bounds_min.cwiseMin(batch->m_bounds_min);
+            m_bounds_max = m_bounds_max.cwiseMax(batch->m_bounds_max);
+        }
+        // 流式加载拿不到全部顶点, 用AABB的外接球
+        UpdateBoundingSphere(nullptr, 0);
+
+        size_t vertex_offset = m_vertex_count;
+        size_t vertex_count = batch->m_vertex_count;
+        AppendStreamBuffer(&m_vbo_position, &m_stream_capacity->positions, sizeof(Vector3f) * vertex_offset, batch->m_positions, sizeof(Vector3f) * vertex_count);
+        if (m_stream_has_texcoords && batch->m_texcoords != nullptr)
+        {
+            AppendStreamBuffer(&m_vbo_texcoords, &m_stream_capacity->texcoords, sizeof(Vector2f) * vertex_offset, batch->m_texcoords, sizeof(Vector2f) * vertex_count);
+        }
+        if (m_stream_has_normals && batch->m_normals != nullptr)
+        {
+            AppendStreamBuffer(&m_vbo_normals, &m_stream_capacity->normals, sizeof(Vector3f) * vertex_offset, batch->m_normals, sizeof(Vector3f) * vertex_count);
+        }
+
+        // 批内索引转为submesh内的索引. 总顶点数事先未知, 统一用32位
+        for (auto& index : batch->m_indices)
+        {
+            index += (uint32_t)vertex_offset;
+        }
+        AppendStreamBuffer(&m_ibo, &m_stream_capacity->indices, sizeof(uint32_t) * m_index_count, batch->m_indices.data(), sizeof(uint32_t) * batch->m_indices.size());
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+        m_vertex_count += batch->m_vertex_count;
+        m_index_count += batch->m_index_count;
+        m_index_type = GL_UNSIGNED_INT;
+    }
+
+    void SubMesh::FinishStream()
+    {
+        if (m_stream_capacity == nullptr)
+            return;
+
+        // 去掉扩容留下的余量
+        GLuint* buffers[4] = { &m_vbo_position, &m_vbo_texcoords, &m_vbo_normals, &m_ibo };
+        size_t* capacities[4] = { &m_stream_capacity->positions, &m_stream_capacity->texcoords, &m_stream_capacity->normals, &m_stream_capacity->indices };
+        size_t used[4] = { sizeof(Vector3f) * m_vertex_count, sizeof(Vector2f) * m_vertex_count, sizeof(Vector3f) * m_vertex_count, sizeof(uint32_t) * m_index_count };
+        for (int i=0; i<4; i++)
+        {
+            if (*buffers[i] == 0 || used[i] == 0 || *capacities[i] <= used[i] + used[i] / 4)
+                continue;
+            GLuint old_buffer = *buffers[i];
+            *buffers[i] = 0;
+            *capacities[i] = 0;
+            GrowStreamBuffer(buffers[i], capacities[i], 0, used[i]);
+            glBindBuffer(GL_COPY_READ_BUFFER, old_buffer);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used[i]);
+            glDeleteBuffers(1, &old_buffer);
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+        delete m_stream_capacity;
+        m_stream_capacity = nullptr;
+    }
+
+    ObjStreamParser::ObjStreamParser(Mesh* mesh, size_t memory_budget)
+    : m_mesh(mesh), m_memory_budget(memory_budget), m_batch_parser(mesh, nullptr, 0)
+    {
+        // 预算的1/4给读取窗口, 其余给三角形批次.
+        // 一个三角形在批次里大约占 ObjTri + 3个索引 + 焊接后的顶点和哈希表 ~ 200字节
+        m_window_bytes = std::min<size_t>(std::max<size_t>(memory_budget / 4, 64 * 1024), 64 * 1024 * 1024);
+        m_batch_triangles = std::max<size_t>(memory_budget / 2 / 200, 1024);
+        m_chunk = new ObjChunk();
+    }
+
+    ObjStreamParser::~ObjStreamParser()
+    {
+        // 解析失败时未完成的submesh还没交给mesh
+        if (m_current)
+        {
+            delete m_current;
+            m_current = nullptr;
+        }
+        delete m_chunk;
+        m_chunk = nullptr;
+    }
+
+    std::vector<std::string> ObjStreamParser::Parse(const std::string& obj_file, bool* succ)
+    {
+        auto parse_start = std::chrono::steady_clock::now();
+        m_stats = ObjParseStats();
+        m_names.clear();
+        m_failed = false;
+
+        std::vector<std::string> empty_names;
+        if (succ) {
+            *succ = false;
+        }
+
+        auto statusOr = PathToResourceAsFile(obj_file);
+        if (statusOr.status() != render3d::OkStatus())
+        {
+            return empty_names;
+        }
+        int fd = open(statusOr.ValueOrDie().c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return empty_names;
+        }
+
+        std::vector<char> window(m_window_bytes);
+        size_t carry = 0;
+        off_t file_offset = 0;
+        while (!m_failed)
+        {
+            ssize_t n = read(fd, window.data() + carry, window.size() - carry);
+            if (n < 0)
+            {
+                m_failed = true;
+                break;
+            }
+            bool eof = (n == 0);
+            size_t data_end = carry + n;
+            m_stats.bytes += n;
+
+            // 只处理完整的行, 行尾残片挪到下一个窗口的开头
+            size_t process_end = data_end;
+            if (!eof)
+            {
+                while (process_end > 0 && !IsNewlineChar(window[process_end - 1]))
+                {
+                    process_end--;
+                }
+                if (process_end == 0)
+                {
+                    // 一行比整个窗口还长, 只能扩大窗口
+                    carry = data_end;
+                    window.resize(window.size() * 2);
+                    continue;
+                }
+            }
+
+            ProcessWindow(window.data(), window.data() + process_end);
+            carry = data_end - process_end;
+            memmove(window.data(), window.data() + process_end, carry);
+
+#ifdef POSIX_FADV_DONTNEED
+            // 已经读过的部分不再需要留在page cache里(容器的内存限制也会算上page cache)
+            posix_fadvise(fd, file_offset, n, POSIX_FADV_DONTNEED);
+#endif
+            file_offset += n;
+            if (eof)
+                break;
+        }
+        close(fd);
+
+        if (!m_failed)
+        {
+            FlushBatch();
+            // 和ObjMeshParser一致: 最后一个submesh总会生成
+            FinishSubMesh(true);
+        }
+
+        m_stats.positions = m_positions.size();
+        m_stats.texcoords = m_texcoords.size();
+        m_stats.normals = m_normals.size();
+        std::vector<Vector3f>().swap(m_positions);
+        std::vector<Vector2f>().swap(m_texcoords);
+        std::vector<Vector3f>().swap(m_normals);
+        m_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - parse_start).count();
+
+        if (m_failed)
+        {
+            return empty_names;
+        }
+
+        VLOG(2) << "obj streamed: " << m_stats.bytes << " bytes, " << m_stats.triangles << " triangles, peak resident " << m_stats.peak_resident_bytes << " bytes, " << m_stats.GetMBPerSecond() << " MB/s";
+        if (succ) {
+            *succ = true;
+        }
+        return m_names;
+    }
+
+    void ObjStreamParser::ProcessWindow(const char* begin, const char* end)
+    {
+        m_chunk->positions.clear();
+        m_chunk->texcoords.clear();
+        m_chunk->normals.clear();
+        m_chunk->triangles.clear();
+        m_chunk->markers.clear();
+        TokenizeObjChunk(begin, end, m_chunk);
+        if (m_chunk->has_neg_index)
+        {
+            m_failed = true;
+            return;
+        }
+
+        // 顶点属性表需要常驻: 面可以引用之前任意位置的顶点
+        m_positions.insert(m_positions.end(), m_chunk->positions.begin(), m_chunk->positions.end());
+        m_texcoords.insert(m_texcoords.end(), m_chunk->texcoords.begin(), m_chunk->texcoords.end());
+        m_normals.insert(m_normals.end(), m_chunk->normals.begin(), m_chunk->normals.end());
+
+        size_t consumed = 0;
+        for (size_t i=0; i<=m_chunk->markers.size() && !m_failed; i++)
+        {
+            size_t triangle_end = i < m_chunk->markers.size() ? m_chunk->markers[i].triangle_count : m_chunk->triangles.size();
+            for (size_t t=consumed; t<triangle_end && !m_failed; t++)
+            {
+                m_batch.push_back(m_chunk->triangles[t]);
+                if (m_batch.size() >= m_batch_triangles)
+                {
+                    FlushBatch();
+                }
+            }
+            consumed = triangle_end;
+
+            if (i < m_chunk->markers.size() && !m_failed)
+            {
+                // usemtl
+                FlushBatch();
+                FinishSubMesh(false);
+                m_names.push_back(m_chunk->markers[i].material_name);
+            }
+        }
+    }
+
+    void ObjStreamParser::FlushBatch()
+    {
+        if (m_batch.empty() || m_failed)
+            return;
+
+        // 流式时面可能引用到还没读到的顶点(不合法的obj), 不能交给GenerateSubMesh越界访问
+        int position_count = (int)m_positions.size();
+        int texcoord_count = (int)m_texcoords.size();
+        int normal_count = (int)m_normals.size();
+        for (auto& tri : m_batch)
+        {
+            if (tri.v0 > position_count || tri.v1 > position_count || tri.v2 > position_count
+                || tri.t0 > texcoord_count || tri.t1 > texcoord_count || tri.t2 > texcoord_count
+                || tri.n0 > normal_count || tri.n1 > normal_count || tri.n2 > normal_count)
+            {
+                m_failed = true;
+                return;
+            }
+        }
+
+        if (m_current == nullptr)
+        {
+            m_current = new SubMesh(m_mesh);
+        }
+
+        size_t resident = sizeof(Vector3f) * m_positions.capacity() + sizeof(Vector2f) * m_texcoords.capacity() + sizeof(Vector3f) * m_normals.capacity()
+            + m_window_bytes + sizeof(ObjTri) * m_batch.capacity();
+        SubMesh* batch = m_batch_parser.GenerateSubMesh(&m_positions, &m_texcoords, &m_normals, &m_batch);
+        resident += (sizeof(Vector3f) * 2 + sizeof(Vector2f) + sizeof(int)) * batch->m_vertex_count + sizeof(uint32_t) * batch->m_indices.size();
+        m_stats.peak_resident_bytes = std::max(m_stats.peak_resident_bytes, resident);
+        if (resident > m_memory_budget && !m_over_budget_logged)
+        {
+            VLOG(2) << "obj stream exceeds memory budget: " << resident << " > " << m_memory_budget << " bytes (vertex attribute tables must stay resident)";
+            m_over_budget_logged = true;
+        }
+
+        m_current->AppendStreamBatch(batch);
+        delete batch;
+        m_stats.triangles += m_batch.size();
+        m_group_triangles += m_batch.size();
+        m_batch.clear();
+    }
+
+    void ObjStreamParser::FinishSubMesh(bool force)
+    {
+        if (m_group_triangles == 0 && !force)
+            return;
+
+        if (m_current == nullptr)
+        {
+            m_current = new SubMesh(m_mesh);
+        }
+        m_current->FinishStream();
+        m_stats.vertices += m_current->m_vertex_count;
+        m_mesh->m_submeshes.push_back(m_current);
+        m_current = nullptr;
+        m_group_triangles = 0;
+    }
+
+    const ObjParseStats& ObjStreamParser::GetStats() const
+    {
+        return m_stats;
+    }
+    
+    Mesh::Mesh(Renderer* renderer)
+    : m_renderer(renderer)
+    {
+    }
+    
+    Mesh::~Mesh()
+    {
+        if (m_in_renderer)
+        {
+            m_renderer->RemoveMesh(this);
+        }
+
+        if (m_instance_of != nullptr)
+        {
+            auto& instances = m_instance_of->m_instances;
+            instances.erase(std::remove(instances.begin(), instances.end(), this), instances.end());
+        }
+        // 原型先析构: 实例的几何和material随之失效, 清掉引用, 之后没有material的submesh不会绘制
+        for (auto& instance : m_instances)
+        {
+            instance->m_instance_of = nullptr;
+            instance->m_occluder = false;
+            for (auto& submesh : instance->m_submeshes)
+            {
+                submesh->m_prototype = nullptr;
+                submesh->m_vertex_count = 0;
+                submesh->m_index_count = 0;
+            }
+        }
+        m_instances.clear();
+
+        for (auto& submesh : m_submeshes)
+        {
+            delete submesh;
+        }
+        m_submeshes.clear();
+        
+        if (m_object_ubo != 0)
+        {
+            glDeleteBuffers(1, &m_object_ubo);
+            m_object_ubo = 0;
+        }
+        
+        for (auto& texture_path : m_associated_textures)
+        {
+            m_renderer->ReleaseTexture(texture_path);
+        }
+    }
+    
+    Renderer* Mesh::GetRenderer() const
+    {
+        return m_renderer;
+    }
+
+    const ObjectConstants& Mesh::GetObjectConstants()
+    {
+        uint64_t frame_index = m_renderer->GetFrameIndex();
+        if (m_object_constants_frame != frame_index)
+        {
+            const FrameConstants& frame = m_renderer->GetFrameConstants();
+            m_object_constants.world = GetTransform();
+            m_object_constants.world_view = frame.view * m_object_constants.world;
+            m_object_constants.wvp = frame.view_projection * m_object_constants.world;
+            m_object_constants_frame = frame_index;
+        }
+        return m_object_constants;
+    }
+
+    void Mesh::BindObjectConstants()
+    {
+        // 不透明和半透明两趟共用同一帧的数据, 只上传一次
+        uint64_t frame_index = m_renderer->GetFrameIndex();
+        GLStateCache* state = m_renderer->GetGLStateCache();
+        if (m_object_ubo == 0)
+        {
+            glGenBuffers(1, &m_object_ubo);
+            state->BindBuffer(GL_UNIFORM_BUFFER, m_object_ubo);
+            glBufferData(GL_UNIFORM_BUFFER, sizeof(Matrix4f) * 3, nullptr, GL_DYNAMIC_DRAW);
+        }
+        if (m_object_ubo_frame != frame_index)
+        {
+            state->BindBuffer(GL_UNIFORM_BUFFER, m_object_ubo);
+            const ObjectConstants& constants = GetObjectConstants();
+            glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Matrix4f), constants.world.data());
+            glBufferSubData(GL_UNIFORM_BUFFER, sizeof(Matrix4f), sizeof(Matrix4f), constants.world_view.data());
+            glBufferSubData(GL_UNIFORM_BUFFER, sizeof(Matrix4f) * 2, sizeof(Matrix4f), constants.wvp.data());
+            m_object_ubo_frame = frame_index;
+        }
+        state->BindUniformBuffer(OBJECT_UNIFORM_BINDING, m_object_ubo);
+    }
+
+    void Mesh::RenderOpaqueSubMeshes()
+    {
+        BindObjectConstants();
+        for (auto& submesh : m_submeshes)
+        {
+            auto material = submesh->GetMaterial();
+            if (material && material->IsTranslucent() == false)
+                submesh->Render();
+        }
+    }
+
+    void Mesh::RenderTranslucentSubMeshes()
+    {
+        BindObjectConstants();
+        for (auto& submesh : m_submeshes)
+        {
+            auto material = submesh->GetMaterial();
+            if (material && material->IsTranslucent() == true)
+                submesh->Render();
+        }
+    }
+
+    void Mesh::replaceTexture(Texture* new_tex) {
+        // 实例的material是原型的, 会一起改
+        for (int i = 0; i < m_submeshes.size(); ++i) {
+            auto submesh = m_submeshes[i];
+            if (submesh->GetMaterial() != nullptr)
+                submesh->GetMaterial()->SetTextureParam("baseMap", new_tex);
+        }
+    }
+
+    void Mesh::SetPosition(const Vector3f& position)
+    {
+        this->m_position = position;
+        this->m_transform_dirty = true;
+        // 同一帧里改了变换, 按帧号缓存的对象常量要重新计算
+        this->m_object_constants_frame = ~0ULL;
+        this->m_object_ubo_frame = ~0ULL;
+        MarkBoundsDirty();
+    }
+
+    void Mesh::SetRotation(const Eigen::Quaternionf& rotation)
+    {
+        this->m_rotation = rotation;
+        this->m_transform_dirty = true;
+        this->m_object_constants_frame = ~0ULL;
+        this->m_object_ubo_frame = ~0ULL;
+        MarkBoundsDirty();
+    }
+
+    void Mesh::SetScale(const Vector3f& scale)
+    {
+        this->m_scale = scale;
+        this->m_transform_dirty = true;
+        this->m_object_constants_frame = ~0ULL;
+        this->m_object_ubo_frame = ~0ULL;
+        MarkBoundsDirty();
+    }
+
+    Vector3f Mesh::GetPosition() const
+    {
+        return this->m_position;
+    }
+
+    Eigen::Quaternionf Mesh::GetRotation() const
+    {
+        return this->m_rotation;
+    }
+
+    Vector3f Mesh::GetScale() const
+    {
+        return this->m_scale;
+    }
+
+    SubMesh* Mesh::GetSubMesh(int index) const
+    {
+        if (index >= 0 && index < m_submeshes.size())
+            return m_submeshes[index];
+        return nullptr;
+    }
+
+    void Mesh::SetTransform(const Matrix4f& Matrix4f)
+    {
+        this->m_transform = Matrix4f;
+        this->m_transform_dirty = false;
+        this->m_object_constants_frame = ~0ULL;
+        this->m_object_ubo_frame = ~0ULL;
+        MarkBoundsDirty();
+    }
+
+    void Mesh::MarkBoundsDirty()
+    {
+        if (m_in_renderer && !m_bounds_dirty)
+        {
+            m_bounds_dirty = true;
+            m_renderer->m_dirty_meshes.push_back(this);
+        }
+    }
+
+    bool Mesh::ComputeWorldBounds(Vector3f* out_min, Vector3f* out_max)
+    {
+        if (m_submeshes.empty())
+            return false;
+        Vector3f local_min = Vector3f::Constant(FLT_MAX);
+        Vector3f local_max = Vector3f::Constant(-FLT_MAX);
+        for (auto& submesh : m_submeshes)
+        {
+            if (submesh->IsDymc())
+                return false;
+            local_min = local_min.cwiseMin(submesh->m_bounds_min);
+            local_max = local_max.cwiseMax(submesh->m_bounds_max);
+        }
+        // 中心直接变换, 半边长按|M|变换(Arvo)
+        Matrix4f transform = GetTransform();
+        Vector3f center = (transform * ((local_min + local_max) * 0.5f).homogeneous()).head<3>();
+        Vector3f extent = transform.block<3, 3>(0, 0).cwiseAbs() * ((local_max - local_min) * 0.5f);
+        *out_min = center - extent;
+        *out_max = center + extent;
+        return true;
+    }
+
+    Matrix4f Mesh::GetTransform()
+    {
+        if (m_transform_dirty)
+        {
+            Eigen::Translation3f translation(m_position);
+            Eigen::AlignedScaling3f scale(m_scale);
+            m_transform = (translation * m_rotation * scale).matrix();
+            m_transform_dirty = false;
+        }
+        
+        return this->m_transform;
+    }
+    
+    Camera::Camera(Renderer* renderer)
+    : m_renderer(renderer)
+    {
+        // 必须设置初始位置, 同时间接初始化view matrix
+        // eigen的矩阵是没有初始值的, 会是随机的数
+        SetPosition(Vector3f(0, 0, 1000));
+        SetRotation(Quaternion(0, 0, 0, 0));
+        
+        int width = m_renderer->GetScreenWidth();
+        int height = m_renderer->GetScreenHeight();
+        //MakeOrthographic(width, height, (float)width / (float)height, 0.1f, 5000.0f);
+        MakePerspective(60, (float)width/(float)height, 0.1f, 5000.0f);
+    }
+    
+    Camera::~Camera()
+    {
+
+    }
+    
+    Vector3f Camera::GetPosition() const
+    {
+        return m_position;
+    }
+    
+    void Camera::SetPosition(Vector3f position)
+    {
+        m_position = position;
+        m_view_matrix_dirty = true;
+        m_view_projection_matrix_dirty = true;
+    }
+    
+    Quaternion Camera::GetRotation() const
+    {
+        return m_rotation;
+    }
+    
+    void Camera::SetRotation(Quaternion rotation)
+    {
+        m_rotation = rotation;
+        m_view_matrix_dirty = true;
+        m_view_projection_matrix_dirty = true;
+    }
+    
+    Matrix4f Camera::GetViewMatrix()
+    {
+        if (!m_view_matrix_dirty)
+            return m_view_matrix;
+        else
+        {
+            Eigen::Translation3f translation(m_position);
+            Matrix4f camera_transform = (translation * m_rotation).matrix();
+            m_view_matrix = camera_transform.inverse();
+            m_view_matrix_dirty = false;
+            return m_view_matrix;
+        }
+    }
+    
+    void Camera::SetViewMatrix(Matrix4f matrix)
+    {
+        m_view_matrix = matrix;
+        m_view_matrix_dirty = false;
+        m_view_projection_matrix_dirty = true;
+    }
+    
+    Matrix4f Camera::GetProjectionMatrix() const
+    {
+        return m_projection_matrix;
+    }
+    
+    void Camera::SetProjectionMatrix(Matrix4f matrix)
+    {
+        m_projection_matrix = matrix;
+        m_view_projection_matrix_dirty = true;
+    }
+    
+    Matrix4f Camera::GetViewProjectionMatrix()
+    {
+        if (!m_view_projection_matrix_dirty)
+            return m_view_projection_matrix;
+        else
+        {
+            GetViewMatrix();  // manually update if it's dirty
+            m_view_projection_matrix =  m_projection_matrix * m_view_matrix;
+            return m_view_projection_matrix;
+        }
+    }
+    
+    void Camera::MakeOrthographic(float width, float height, float ratio, float near, float far)
+    {
+        float half_width = width * 0.5f;
+        float half_height = height * 0.5f;
+        float left = -half_width;
+        float right = half_width;
+        float bottom = -half_height;
+        float top = half_height;
+        
+        if (m_flip_y)
+        {
+            bottom = half_height;
+            top = -half_height;
+            left = half_width;
+            right = -half_width;
+        }
+        
+        memset(&m_projection_matrix, 0, sizeof(m_projection_matrix));
+        float* dst = (float*)&m_projection_matrix;
+        dst[0] = 2 / (right - left);
+        dst[5] = 2 / (top - bottom);
+        dst[12] = (left + right) / (left - right);
+        dst[10] = 1 / (near - far);
+        dst[13] = (top + bottom) / (bottom - top);
+        dst[14] = near / (near - far);
+        dst[15] = 1;
+        
+        m_view_projection_matrix_dirty = true;
+    }
+    
+    void Camera::MakePerspective(float fov, float ratio, float near, float far)
+    {
+        float f_n = 1.0f / (far - near);
+        float theta = fov * 3.141592657 / 360.0f;
+        float divisor = tan(theta);
+        float factor = 1.0f / divisor;
+        
+        if (m_flip_y)
+        {
+            factor = -factor;
+        }
+        
+//        memset(&m_projection_matrix, 0, sizeof(m_projection_matrix));
+        m_projection_matrix.setZero();
+        float* dst = (float*)&m_projection_matrix;
+        dst[0] = (1.0f / ratio) * factor;
+        dst[5] = factor;
+        dst[10] = (-(far + near)) * f_n;
+        dst[11] = -1.0f;
+        dst[14] = -2.0f * far * near * f_n;
+        
+        m_view_projection_matrix_dirty = true;
+    }
+
+    void Camera::MakePNPProjection(float width, float height, float fx, float fy, float near, float far)
+    {
+        float factor = m_flip_y ? -1.0f : 1.0f;
+//        memset(&m_projection_matrix, 0, sizeof(m_projection_matrix));
+        m_projection_matrix.setZero();
+        float* dst = (float*)&m_projection_matrix;
+#ifdef __ANDROID__
+        dst[0] = 2.0f *  fx / width;
+#else
+        dst[0] = 2.0f *  fx / width * factor;
+#endif
+        dst[5] = 2.0f * fy / height * factor;
+        dst[10] = -(far + near) / (far - near);
+        dst[11] = -1.0f;
+        dst[14] = -2.0f * far * near / (far - near);
+        
+        m_view_projection_matrix_dirty = true;
+    }
+
+    
+    // PBR贴图的文件名后缀, 顺序同PBRTextureSlot
+    enum PBRTextureSlot
+    {
+        PBR_TEXTURE_BASE,
+        PBR_TEXTURE_RMA,
+        PBR_TEXTURE_NORMAL,
+        PBR_TEXTURE_EMISSIVE,
+        PBR_TEXTURE_COUNT,
+    };
+    static const char* PBR_TEXTURE_SUFFIXES[PBR_TEXTURE_COUNT] = { "Base.png", "RMA.png", "Normal.png", "Emissive.png" };
+
+    // 去掉4个字符的扩展名(.obj/.r3z)
+    static std::string GetMeshPathWithoutExt(const std::string& mesh_file_path)
+    {
+        return mesh_file_path.substr(0, mesh_file_path.length() >= 4 ? mesh_file_path.length() - 4 : 0);
+    }
+
+    // 贴图优先从mirrorPath子目录加载
+    static std::string GetMirroredMeshPath(const std::string& mesh_file_path_without_ext, const char* mirrorPath)
+    {
+        if (mirrorPath == nullptr)
+        {
+            return mesh_file_path_without_ext;
+        }
+        int div_pos = mesh_file_path_without_ext.rfind("/");
+        std::string obj_name = mesh_file_path_without_ext.substr(div_pos);
+        std::string dir = mesh_file_path_without_ext.substr(0, div_pos);
+        return dir + "/" + mirrorPath + obj_name;
+    }
+
+    // ---- image analysis ----
+    // 一行RGBA8像素的统计, 累加到stats. alpha_sum单独返回, 最后统一换算成coverage
+    static uint64_t AnalyzeImageRow(const uint8* row, int width, ImageStats* stats)
+    {
+        uint64_t alpha_sum = 0;
+        int x = 0;
+#if defined(R3D_SIMD_SSE2)
+        // 每次4个像素. 16字节里同一通道的位置固定, 按字节求min/max最后再按通道归约
+        __m128i vmin = _mm_set1_epi8((char)0xff);
+        __m128i vmax = _mm_setzero_si128();
+        __m128i vpartial = _mm_setzero_si128();
+        __m128i vsum = _mm_setzero_si128();
+        const __m128i ones = _mm_set1_epi8(1);
+        const __m128i limit = _mm_set1_epi8((char)253);
+        for (; x + 4 <= width; x += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(row + x * 4));
+            vmin = _mm_min_epu8(vmin, v);
+            vmax = _mm_max_epu8(vmax, v);
+            // a-1 <= 253 (无符号) 等价于 0 < a < 255
+            __m128i shifted = _mm_sub_epi8(v, ones);
+            vpartial = _mm_or_si128(vpartial, _mm_cmpeq_epi8(_mm_min_epu8(shifted, limit), shifted));
+            vsum = _mm_add_epi32(vsum, _mm_srli_epi32(v, 24));
+        }
+        alignas(16) uint8 bytes_min[16], bytes_max[16], bytes_partial[16];
+        alignas(16) uint32_t sums[4];
+        _mm_store_si128((__m128i*)bytes_min, vmin);
+        _mm_store_si128((__m128i*)bytes_max, vmax);
+        _mm_store_si128((__m128i*)bytes_partial, vpartial);
+        _mm_store_si128((__m128i*)sums, vsum);
+#elif defined(R3D_SIMD_NEON)
+        uint8x16_t vmin = vdupq_n_u8(0xff);
+        uint8x16_t vmax = vdupq_n_u8(0);
+        uint8x16_t vpartial = vdupq_n_u8(0);
+        uint32x4_t vsum = vdupq_n_u32(0);
+        const uint8x16_t ones = vdupq_n_u8(1);
+        const uint8x16_t limit = vdupq_n_u8(253);
+        for (; x + 4 <= width; x += 4)
+        {
+            uint8x16_t v = vld1q_u8(row + x * 4);
+            vmin = vminq_u8(vmin, v);
+            vmax = vmaxq_u8(vmax, v);
+            vpartial = vorrq_u8(vpartial, vcleq_u8(vsubq_u8(v, ones), limit));
+            vsum = vaddq_u32(vsum, vshrq_n_u32(vreinterpretq_u32_u8(v), 24));
+        }
+        uint8 bytes_min[16], bytes_max[16], bytes_partial[16];
+        uint32_t sums[4];
+        vst1q_u8(bytes_min, vmin);
+        vst1q_u8(bytes_max, vmax);
+        vst1q_u8(bytes_partial, vpartial);
+        vst1q_u32(sums, vsum);
+#endif
+#if defined(R3D_SIMD_SSE2) || defined(R3D_SIMD_NEON)
+        if (x > 0)
+        {
+            for (int i=0; i<16; i++)
+            {
+                int channel = i & 3;
+                stats->channel_min[channel] = std::min(stats->channel_min[channel], bytes_min[i]);
+                stats->channel_max[channel] = std::max(stats->channel_max[channel], bytes_max[i]);
+                if (channel == 3 && bytes_partial[i] != 0)
+                    stats->has_partial_alpha = true;
+            }
+            alpha_sum += (uint64_t)sums[0] + sums[1] + sums[2] + sums[3];
+        }
+#endif
+        for (; x < width; x++)
+        {
+            const uint8* pixel = row + x * 4;
+            for (int channel=0; channel<4; channel++)
+            {
+                stats->channel_min[channel] = std::min(stats->channel_min[channel], pixel[channel]);
+                stats->channel_max[channel] = std::max(stats->channel_max[channel], pixel[channel]);
+            }
+            uint8 alpha = pixel[3];
+            if (alpha > 0 && alpha < 255)
+                stats->has_partial_alpha = true;
+            alpha_sum += alpha;
+        }
+        return alpha_sum;
+    }
+
+    void AnalyzeImage(const uint8* pixels, int width, int height, int row_stride, ImageStats* stats)
+    {
+        *stats = ImageStats();
+        if (width <= 0 || height <= 0)
+        {
+            return;
+        }
+        for (int c=0; c<4; c++)
+        {
+            stats->channel_min[c] = 255;
+            stats->channel_max[c] = 0;
+        }
+
+        uint64_t alpha_sum = 0;
+        for (int row=0; row<height; row++)
+        {
+            alpha_sum += AnalyzeImageRow(pixels + (size_t)row * row_stride, width, stats);
+        }
+        stats->opaque = stats->channel_min[3] == 255;
+        stats->alpha_coverage = (float)((double)alpha_sum / (255.0 * (double)width * (double)height));
+    }
+
+    // 解码并分析好的贴图像素, 可以在后台线程准备, 渲染线程上传
+    struct DecodedTexture
+    {
+        ImageFrame* image_frame = nullptr;
+        ImageStats stats;
+        TextureFormat format = RGBA;
+        // 完全不透明时去掉alpha后的紧凑RGB像素
+        std::vector<uint8> rgb_pixels;
+
+        const uint8* GetPixels() const
+        {
+            return format == RGB ? rgb_pixels.data() : image_frame->PixelData();
+        }
+    };
+
+    static bool DecodeTexture(const std::string& texture_file, DecodedTexture* decoded)
+    {
+        decoded->image_frame = getImageFrameFromPath(texture_file, ImageFormat_SRGBA);
+        if (decoded->image_frame == nullptr)
+        {
+            return false;
+        }
+
+        const ImageFrame* image_frame = decoded->image_frame;
+        if (image_frame->Format() != ImageFormat_SRGBA && image_frame->Format() != ImageFormat_SBGRA)
+        {
+            return true;
+        }
+        AnalyzeImage(image_frame->PixelData(), image_frame->Width(), image_frame->Height(), image_frame->WidthStep(), &decoded->stats);
+
+        // 完全不透明的图不需要alpha通道, 以RGB上传
+        if (decoded->stats.opaque)
+        {
+            int width = image_frame->Width();
+            int height = image_frame->Height();
+            decoded->rgb_pixels.resize((size_t)width * height * 3);
+            uint8* dst = decoded->rgb_pixels.data();
+            for (int row=0; row<height; row++)
+            {
+                const uint8* src = image_frame->PixelData() + (size_t)row * image_frame->WidthStep();
+                for (int col=0; col<width; col++)
+                {
+                    dst[0] = src[0];
+                    dst[1] = src[1];
+                    dst[2] = src[2];
+                    dst += 3;
+                    src += 4;
+                }
+            }
+            decoded->format = RGB;
+        }
+        return true;
+    }
+
+    // 2x2盒式滤波生成下一级mip, 紧凑的RGB或RGBA
+    static void DownsampleImage(const std::vector<uint8>& src, int width, int height, int channels, std::vector<uint8>* dst)
+    {
+        int dst_width = std::max(width / 2, 1);
+        int dst_height = std::max(height / 2, 1);
+        dst->resize((size_t)dst_width * dst_height * channels);
+        for (int y=0; y<dst_height; y++)
+        {
+            int y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+            for (int x=0; x<dst_width; x++)
+            {
+                int x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+                for (int c=0; c<channels; c++)
+                {
+                    int sum = src[((size_t)y0 * width + x0) * channels + c] + src[((size_t)y0 * width + x1) * channels + c]
+                            + src[((size_t)y1 * width + x0) * channels + c] + src[((size_t)y1 * width + x1) * channels + c];
+                    (*dst)[((size_t)y * dst_width + x) * channels + c] = (uint8)((sum + 2) / 4);
+                }
+            }
+        }
+    }
+
+    // ---- KTX2 ----
+    // 只支持无supercompression的2D/cube贴图, 不支持数组和3D.
+    // sRGB的vkFormat按对应的UNORM格式上传, 和png路径一样把gamma留给shader处理
+#ifndef GL_COMPRESSED_RGB8_ETC2
+#define GL_COMPRESSED_RGB8_ETC2 0x9274
+#define GL_COMPRESSED_RGBA8_ETC2_EAC 0x9278
+#endif
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+#define GL_COMPRESSED_RGBA_BPTC_UNORM 0x8E8C
+#endif
+#ifndef GL_COMPRESSED_RGBA_ASTC_4x4_KHR
+#define GL_COMPRESSED_RGBA_ASTC_4x4_KHR 0x93B0
+#define GL_COMPRESSED_RGBA_ASTC_6x6_KHR 0x93B4
+#define GL_COMPRESSED_RGBA_ASTC_8x8_KHR 0x93B7
+#endif
+
+    static const uint8 KTX2_IDENTIFIER[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+    // 自定义的key/value, 记录png是否有半透明像素
+    static const char* KTX2_TRANSLUCENT_KEY = "R3DTranslucent";
+
+    struct Ktx2Header
+    {
+        uint8 identifier[12];
+        uint32_t vk_format;
+        uint32_t type_size;
+        uint32_t pixel_width;
+        uint32_t pixel_height;
+        uint32_t pixel_depth;
+        uint32_t layer_count;
+        uint32_t face_count;
+        uint32_t level_count;
+        uint32_t supercompression_scheme;
+        uint32_t dfd_byte_offset;
+        uint32_t dfd_byte_length;
+        uint32_t kvd_byte_offset;
+        uint32_t kvd_byte_length;
+        uint64_t sgd_byte_offset;
+        uint64_t sgd_byte_length;
+    };
+
+    struct Ktx2Level
+    {
+        uint64_t byte_offset;
+        uint64_t byte_length;
+        uint64_t uncompressed_byte_length;
+    };
+
+    typedef void (*DecodeBlockFunc)(const uint8* block, uint8* rgba);
+
+    struct CompressedFormatInfo
+    {
+        uint32_t vk_format;
+        uint32_t vk_format_srgb;
+        GLenum gl_format;
+        int block_width;
+        int block_height;
+        int block_bytes;
+        // 格式本身能存alpha
+        bool has_alpha;
+        // 软件解码回退, 为空表示只能靠GL
+        DecodeBlockFunc decode;
+    };
+
+    static inline uint8 ClampToByte(int value)
+    {
+        return (uint8)(value < 0 ? 0 : (value > 255 ? 255 : value));
+    }
+
+    static const int ETC1_MODIFIERS[8][4] = {
+        { 2, 8, -2, -8 }, { 5, 17, -5, -17 }, { 9, 29, -9, -29 }, { 13, 42, -13, -42 },
+        { 18, 60, -18, -60 }, { 24, 80, -24, -80 }, { 33, 106, -33, -106 }, { 47, 183, -47, -183 },
+    };
+    static const int ETC2_DISTANCES[8] = { 3, 6, 11, 16, 23, 32, 41, 64 };
+    static const int EAC_MODIFIERS[16][8] = {
+        { -3, -6, -9, -15, 2, 5, 8, 14 }, { -3, -7, -10, -13, 2, 6, 9, 12 }, { -2, -5, -8, -13, 1, 4, 7, 12 }, { -2, -4, -6, -13, 1, 3, 5, 12 },
+        { -3, -6, -8, -12, 2, 5, 7, 11 }, { -3, -7, -9, -11, 2, 6, 8, 10 }, { -4, -7, -8, -11, 3, 6, 7, 10 }, { -3, -5, -8, -11, 2, 4, 7, 10 },
+        { -2, -6, -8, -10, 1, 5, 7, 9 }, { -2, -5, -8, -10, 1, 4, 7, 9 }, { -2, -4, -8, -10, 1, 3, 7, 9 }, { -2, -5, -7, -10, 1, 4, 6, 9 },
+        { -3, -4, -7, -10, 2, 3, 6, 9 }, { -1, -2, -3, -10, 0, 1, 2, 9 }, { -4, -6, -8, -9, 3, 5, 7, 8 }, { -3, -5, -7, -9, 2, 4, 6, 8 },
+    };
+
+    static inline int Extend4(int x) { return (x << 4) | x; }
+    static inline int Extend5(int x) { return (x << 3) | (x >> 2); }
+    static inline int Extend6(int x) { return (x << 2) | (x >> 4); }
+    static inline int Extend7(int x) { return (x << 1) | (x >> 6); }
+
+    // T/H模式: 每个像素直接取4个paint color之一
+    static void WriteEtc2PaintColors(uint32_t pixel_bits, const int paint[4][3], uint8* rgba)
+    {
+        for (int i=0; i<16; i++)
+        {
+            int index = (((pixel_bits >> (16 + i)) & 1) << 1) | ((pixel_bits >> i) & 1);
+            uint8* out = rgba + ((i & 3) * 4 + (i >> 2)) * 4;
+            out[0] = (uint8)paint[index][0];
+            out[1] = (uint8)paint[index][1];
+            out[2] = (uint8)paint[index][2];
+            out[3] = 255;
+        }
+    }
+
+    // ETC2 RGB块(含ETC1的individual/differential和ETC2的T/H/planar模式). 像素按列优先编号: i = x*4 + y
+    static void DecodeEtc2RgbBlock(const uint8* block, uint8* rgba)
+    {
+        uint32_t pixel_bits = ((uint32_t)block[4] << 24) | ((uint32_t)block[5] << 16) | ((uint32_t)block[6] << 8) | block[7];
+        bool diff = (block[3] & 2) != 0;
+        bool flip = (block[3] & 1) != 0;
+        int base[2][3];
+        if (diff)
+        {
+            int base5[3], delta[3], second[3];
+            for (int c=0; c<3; c++)
+            {
+                base5[c] = block[c] >> 3;
+                delta[c] = ((int)(block[c] & 7) ^ 4) - 4;
+                second[c] = base5[c] + delta[c];
+            }
+
+            int paint[4][3];
+            if (second[0] < 0 || second[0] > 31)
+            {
+                // T模式
+                int c1[3] = { Extend4((((block[0] >> 3) & 3) << 2) | (block[0] & 3)), Extend4(block[1] >> 4), Extend4(block[1] & 15) };
+                int c2[3] = { Extend4(block[2] >> 4), Extend4(block[2] & 15), Extend4(block[3] >> 4) };
+                int d = ETC2_DISTANCES[(((block[3] >> 2) & 3) << 1) | (block[3] & 1)];
+                for (int c=0; c<3; c++)
+                {
+                    paint[0][c] = c1[c];
+                    paint[1][c] = ClampToByte(c2[c] + d);
+                    paint[2][c] = c2[c];
+                    paint[3][c] = ClampToByte(c2[c] - d);
+                }
+                WriteEtc2PaintColors(pixel_bits, paint, rgba);
+                return;
+            }
+            if (second[1] < 0 || second[1] > 31)
+            {
+                // H模式
+                int r1 = (block[0] >> 3) & 15, g1 = ((block[0] & 7) << 1) | ((block[1] >> 4) & 1), b1 = (block[1] & 8) | ((block[1] & 3) << 1) | (block[2] >> 7);
+                int r2 = (block[2] >> 3) & 15, g2 = ((block[2] & 7) << 1) | (block[3] >> 7), b2 = (block[3] >> 3) & 15;
+                int order = ((r1 << 8) | (g1 << 4) | b1) >= ((r2 << 8) | (g2 << 4) | b2) ? 1 : 0;
+                int d = ETC2_DISTANCES[(((block[3] >> 2) & 1) << 2) | ((block[3] & 1) << 1) | order];
+                int c1[3] = { Extend4(r1), Extend4(g1), Extend4(b1) };
+                int c2[3] = { Extend4(r2), Extend4(g2), Extend4(b2) };
+                for (int c=0; c<3; c++)
+                {
+                    paint[0][c] = ClampToByte(c1[c] + d);
+                    paint[1][c] = ClampToByte(c1[c] - d);
+                    paint[2][c] = ClampToByte(c2[c] + d);
+                    paint[3][c] = ClampToByte(c2[c] - d);
+                }
+                WriteEtc2PaintColors(pixel_bits, paint, rgba);
+                return;
+            }
+            if (second[2] < 0 || second[2] > 31)
+            {
+                // planar模式: 三个角点颜色双线性外插
+                int o[3] = { Extend6((block[0] >> 1) & 63), Extend7(((block[0] & 1) << 6) | ((block[1] >> 1) & 63)),
+                             Extend6(((block[1] & 1) << 5) | (((block[2] >> 3) & 3) << 3) | ((block[2] & 3) << 1) | (block[3] >> 7)) };
+                int h[3] = { Extend6((((block[3] >> 2) & 31) << 1) | (block[3] & 1)), Extend7(block[4] >> 1), Extend6(((block[4] & 1) << 5) | (block[5] >> 3)) };
+                int v[3] = { Extend6(((block[5] & 7) << 3) | (block[6] >> 5)), Extend7(((block[6] & 31) << 2) | (block[7] >> 6)), Extend6(block[7] & 63) };
+                for (int y=0; y<4; y++)
+                {
+                    for (int x=0; x<4; x++)
+                    {
+                        uint8* out = rgba + (y * 4 + x) * 4;
+                        for (int c=0; c<3; c++)
+                            out[c] = ClampToByte((x * (h[c] - o[c]) + y * (v[c] - o[c]) + 4 * o[c] + 2) >> 2);
+                        out[3] = 255;
+                    }
+                }
+                return;
+            }
+
+            for (int c=0; c<3; c++)
+            {
+                base[0][c] = Extend5(base5[c]);
+                base[1][c] = Extend5(second[c]);
+            }
+        }
+        else
+        {
+            for (int c=0; c<3; c++)
+            {
+                base[0][c] = Extend4(block[c] >> 4);
+                base[1][c] = Extend4(block[c] & 15);
+            }
+        }
+
+        int tables[2] = { (block[3] >> 5) & 7, (block[3] >> 2) & 7 };
+        for (int i=0; i<16; i++)
+        {
+            int x = i >> 2, y = i & 3;
+            int sub = flip ? (y >= 2) : (x >= 2);
+            int modifier = ETC1_MODIFIERS[tables[sub]][(((pixel_bits >> (16 + i)) & 1) << 1) | ((pixel_bits >> i) & 1)];
+            uint8* out = rgba + (y * 4 + x) * 4;
+            for (int c=0; c<3; c++)
+                out[c] = ClampToByte(base[sub][c] + modifier);
+            out[3] = 255;
+        }
+    }
+
+    // EAC alpha块, 只写rgba的alpha
+    static void DecodeEacAlphaBlock(const uint8* block, uint8* rgba)
+    {
+        int base = block[0];
+        int multiplier = block[1] >> 4;
+        const int* modifiers = EAC_MODIFIERS[block[1] & 15];
+        uint64_t bits = 0;
+        for (int i=2; i<8; i++)
+            bits = (bits << 8) | block[i];
+        for (int i=0; i<16; i++)
+        {
+            int index = (int)((bits >> (45 - 3 * i)) & 7);
+            rgba[((i & 3) * 4 + (i >> 2)) * 4 + 3] = ClampToByte(base + modifiers[index] * multiplier);
+        }
+    }
+
+    static void DecodeEtc2Rgb8(const uint8* block, uint8* rgba)
+    {
+        DecodeEtc2RgbBlock(block, rgba);
+    }
+
+    static void DecodeEtc2Rgba8(const uint8* block, uint8* rgba)
+    {
+        DecodeEtc2RgbBlock(block + 8, rgba);
+        DecodeEacAlphaBlock(block, rgba);
+    }
+
+    static void DecodeRgb565(uint16_t color, int* rgb)
+    {
+        rgb[0] = Extend5(color >> 11);
+        rgb[1] = Extend6((color >> 5) & 63);
+        rgb[2] = Extend5(color & 31);
+    }
+
+    // BC1颜色块. 像素按行优先编号: i = y*4 + x
+    static void DecodeBc1ColorBlock(const uint8* block, uint8* rgba, bool force_four_colors)
+    {
+        uint16_t color0 = block[0] | (block[1] << 8);
+        uint16_t color1 = block[2] | (block[3] << 8);
+        int palette[4][4];
+        DecodeRgb565(color0, palette[0]);
+        DecodeRgb565(color1, palette[1]);
+        palette[0][3] = palette[1][3] = palette[2][3] = palette[3][3] = 255;
+        for (int c=0; c<3; c++)
+        {
+            if (color0 > color1 || force_four_colors)
+            {
+                palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+                palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+            }
+            else
+            {
+                palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+                palette[3][c] = 0;
+            }
+        }
+        if (color0 <= color1 && !force_four_colors)
+            palette[3][3] = 0;
+
+        uint32_t bits = block[4] | (block[5] << 8) | (block[6] << 16) | ((uint32_t)block[7] << 24);
+        for (int i=0; i<16; i++)
+        {
+            const int* color = palette[(bits >> (2 * i)) & 3];
+            for (int c=0; c<4; c++)
+                rgba[i * 4 + c] = (uint8)color[c];
+        }
+    }
+
+    static void DecodeBc1(const uint8* block, uint8* rgba)
+    {
+        DecodeBc1ColorBlock(block, rgba, false);
+    }
+
+    static void DecodeBc3(const uint8* block, uint8* rgba)
+    {
+        DecodeBc1ColorBlock(block + 8, rgba, true);
+        int alpha0 = block[0], alpha1 = block[1];
+        int palette[8] = { alpha0, alpha1 };
+        for (int i=2; i<8; i++)
+        {
+            if (alpha0 > alpha1)
+                palette[i] = ((8 - i) * alpha0 + (i - 1) * alpha1) / 7;
+            else
+                palette[i] = i < 6 ? ((6 - i) * alpha0 + (i - 1) * alpha1) / 5 : (i == 6 ? 0 : 255);
+        }
+        uint64_t bits = 0;
+        for (int i=7; i>=2; i--)
+            bits = (bits << 8) | block[i];
+        for (int i=0; i<16; i++)
+            rgba[i * 4 + 3] = (uint8)palette[(bits >> (3 * i)) & 7];
+    }
+
+    static const CompressedFormatInfo COMPRESSED_FORMATS[] = {
+        { 147, 148, GL_COMPRESSED_RGB8_ETC2, 4, 4, 8, false, DecodeEtc2Rgb8 },
+        { 151, 152, GL_COMPRESSED_RGBA8_ETC2_EAC, 4, 4, 16, true, DecodeEtc2Rgba8 },
+        { 131, 132, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, 4, 4, 8, false, DecodeBc1 },
+        { 137, 138, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, 4, 4, 16, true, DecodeBc3 },
+        { 145, 146, GL_COMPRESSED_RGBA_BPTC_UNORM, 4, 4, 16, true, nullptr },
+        { 157, 158, GL_COMPRESSED_RGBA_ASTC_4x4_KHR, 4, 4, 16, true, nullptr },
+        { 165, 166, GL_COMPRESSED_RGBA_ASTC_6x6_KHR, 6, 6, 16, true, nullptr },
+        { 171, 172, GL_COMPRESSED_RGBA_ASTC_8x8_KHR, 8, 8, 16, true, nullptr },
+    };
+
+    static const CompressedFormatInfo* FindCompressedFormat(uint32_t vk_format)
+    {
+        for (auto& info : COMPRESSED_FORMATS)
+        {
+            if (info.vk_format == vk_format || info.vk_format_srgb == vk_format)
+                return &info;
+        }
+        return nullptr;
+    }
+
+    static size_t GetCompressedLevelSize(const CompressedFormatInfo& info, int width, int height)
+    {
+        size_t blocks_x = (width + info.block_width - 1) / info.block_width;
+        size_t blocks_y = (height + info.block_height - 1) / info.block_height;
+        return blocks_x * blocks_y * info.block_bytes;
+    }
+
+    // 软件解码一层到紧凑的RGBA8
+    static void DecompressLevel(const CompressedFormatInfo& info, const uint8* blocks, int width, int height, std::vector<uint8>* rgba)
+    {
+        rgba->resize((size_t)width * height * 4);
+        uint8 texels[4 * 4 * 4];
+        int blocks_x = (width + 3) / 4;
+        int blocks_y = (height + 3) / 4;
+        for (int by=0; by<blocks_y; by++)
+        {
+            for (int bx=0; bx<blocks_x; bx++)
+            {
+                info.decode(blocks, texels);
+                blocks += info.block_bytes;
+                for (int y=0; y<4 && by * 4 + y < height; y++)
+                {
+                    int copy_width = std::min(4, width - bx * 4);
+                    memcpy(rgba->data() + ((size_t)(by * 4 + y) * width + bx * 4) * 4, texels + y * 16, copy_width * 4);
+                }
+            }
+        }
+    }
+
+    // 解析并校验KTX2, levels按mip层级从大到小
+    // 没有R3DTranslucent的ktx2(其他工具生成的): 看DFD里有没有alpha通道的sample.
+    // BC7/ASTC的DFD只有一个sample, 不区分通道, 这时和DFD无效时一样按格式能否存alpha判断
+    static bool IsKtx2DfdTranslucent(const char* data, size_t size, const Ktx2Header* header)
+    {
+        const CompressedFormatInfo* info = FindCompressedFormat(header->vk_format);
+        bool format_alpha = info != nullptr && info->has_alpha;
+        // dfdTotalSize + basic descriptor的6个字
+        const size_t basic_size = 4 + 24;
+        if (header->dfd_byte_length < basic_size || !IsMeshCacheBlockValid(header->dfd_byte_offset, header->dfd_byte_length, size))
+            return format_alpha;
+
+        uint32_t words[7];
+        memcpy(words, data + header->dfd_byte_offset, sizeof(words));
+        uint32_t descriptor_type = words[1] & 0x7FFF;
+        uint32_t block_size = words[2] >> 16;
+        uint32_t color_model = words[3] & 0xFF;
+        // KHR_DF_MODEL_BC7 / KHR_DF_MODEL_ASTC
+        if (descriptor_type != 0 || block_size < 24 || block_size > header->dfd_byte_length - 4 || color_model == 134 || color_model == 162)
+            return format_alpha;
+
+        int sample_count = (int)(block_size - 24) / 16;
+        const char* samples = data + header->dfd_byte_offset + basic_size;
+        for (int i=0; i<sample_count; i++)
+        {
+            uint32_t sample;
+            memcpy(&sample, samples + i * 16, sizeof(sample));
+            // channelType低4位是通道, 15为KHR_DF_CHANNEL_*_ALPHA
+            if (((sample >> 24) & 0xF) == 15)
+                return true;
+        }
+        return sample_count == 0 && format_alpha;
+    }
+
+    static bool ParseKtx2(const char* data, size_t size, const Ktx2Header** out_header, std::vector<Ktx2Level>* levels, bool* out_translucent)
+    {
+        if (size < sizeof(Ktx2Header) || memcmp(data, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER)) != 0)
+        {
+            return false;
+        }
+        const Ktx2Header* header = (const Ktx2Header*)data;
+        if (header->pixel_width == 0 || header->pixel_height == 0 || header->pixel_depth > 1 || header->layer_count > 1
+            || (header->face_count != 1 && header->face_count != 6) || header->supercompression_scheme != 0)
+        {
+            return false;
+        }
+        uint32_t level_count = std::max<uint32_t>(header->level_count, 1);
+        if (level_count > 32 || !IsMeshCacheBlockValid(sizeof(Ktx2Header), sizeof(Ktx2Level) * level_count, size))
+        {
+            return false;
+        }
+        const Ktx2Level* level_index = (const Ktx2Level*)(data + sizeof(Ktx2Header));
+        levels->assign(level_index, level_index + level_count);
+        for (auto& level : *levels)
+        {
+            if (level.byte_offset > size || level.byte_length > size - level.byte_offset)
+                return false;
+        }
+
+        bool has_translucent_key = false;
+        *out_translucent = false;
+        if (header->kvd_byte_length > 0 && IsMeshCacheBlockValid(header->kvd_byte_offset, header->kvd_byte_length, size))
+        {
+            const char* kvd = data + header->kvd_byte_offset;
+            const char* kvd_end = kvd + header->kvd_byte_length;
+            while (kvd_end - kvd >= 4)
+            {
+                uint32_t length = 0;
+                memcpy(&length, kvd, sizeof(length));
+                kvd += sizeof(length);
+                if ((size_t)(kvd_end - kvd) < length)
+                    break;
+                size_t key_length = strnlen(kvd, length);
+                // 值紧跟在键的结尾0之后, 至少要有1字节
+                if (key_length + 1 < length && strcmp(kvd, KTX2_TRANSLUCENT_KEY) == 0)
+                {
+                    *out_translucent = kvd[key_length + 1] == '1';
+                    has_translucent_key = true;
+                }
+                kvd += (length + 3) & ~3u;
+            }
+        }
+        if (!has_translucent_key)
+        {
+            *out_translucent = IsKtx2DfdTranslucent(data, size, header);
+        }
+        *out_header = header;
+        return true;
+    }
+
+    std::string TextureTranscoder::GetKtx2Path(const std::string& texture_file)
+    {
+        size_t dot = texture_file.rfind('.');
+        size_t slash = texture_file.rfind('/');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        {
+            return texture_file + ".ktx2";
+        }
+        return texture_file.substr(0, dot) + ".ktx2";
+    }
+
+    static void UploadKtx2Level(GLenum target, const CompressedFormatInfo& info, bool hardware, const uint8* data, int level, int width, int height, std::vector<uint8>* scratch)
+    {
+        if (hardware)
+        {
+            glCompressedTexImage2D(target, level, info.gl_format, width, height, 0, (GLsizei)GetCompressedLevelSize(info, width, height), data);
+        }
+        else
+        {
+            DecompressLevel(info, data, width, height, scratch);
+            glTexImage2D(target, level, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, scratch->data());
+        }
+    }
+
+    // 渐进式流送, 见Renderer::ProcessTextureStreams
+    // 不超过这个尺寸的mip在创建贴图时直接上传, 保证马上可以绘制
+    static const int TEXTURE_STREAM_INITIAL_SIZE = 64;
+
+    // 一张正在渐进上传的2D贴图. 已上传[next_level+1, level_count-1], 下一次上传next_level,
+    // 上传到target_level为止. GL_TEXTURE_BASE_LEVEL始终指向已上传的最精细一层
+    struct TextureStream
+    {
+        Texture* texture = nullptr;
+        int level_count = 0;
+        int next_level = 0;
+        int target_level = 0;
+
+        // png: CPU上生成的mip链, 上传后释放
+        TextureFormat format = RGBA;
+        std::vector<std::vector<uint8>> mip_pixels;
+
+        // ktx2: 直接从映射的文件上传
+        std::unique_ptr<FileView> ktx2_view;
+        std::vector<Ktx2Level> ktx2_levels;
+        const CompressedFormatInfo* ktx2_format = nullptr;
+        bool ktx2_hardware = false;
+
+        int GetLevelWidth(int level) const { return std::max(texture->m_width >> level, 1); }
+        int GetLevelHeight(int level) const { return std::max(texture->m_height >> level, 1); }
+
+        size_t GetLevelBytes(int level) const
+        {
+            if (ktx2_format != nullptr)
+                return ktx2_hardware ? ktx2_levels[level].byte_length : (size_t)GetLevelWidth(level) * GetLevelHeight(level) * 4;
+            return mip_pixels[level].size();
+        }
+
+        void UploadNextLevel(std::vector<uint8>* scratch)
+        {
+            int level = next_level;
+            int width = GetLevelWidth(level);
+            int height = GetLevelHeight(level);
+            glBindTexture(GL_TEXTURE_2D, texture->m_gl_texture);
+            if (ktx2_format != nullptr)
+            {
+                const uint8* data = (const uint8*)ktx2_view->GetData() + ktx2_levels[level].byte_offset;
+                UploadKtx2Level(GL_TEXTURE_2D, *ktx2_format, ktx2_hardware, data, level, width, height, scratch);
+            }
+            else if (format == RGB)
+            {
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+                glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, mip_pixels[level].data());
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            }
+            else
+            {
+                glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, mip_pixels[level].data());
+            }
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+            if (ktx2_format == nullptr)
+            {
+                std::vector<uint8>().swap(mip_pixels[level]);
+            }
+            next_level--;
+        }
+
+        bool IsDone() const
+        {
+            return next_level < target_level;
+        }
+    };
+
+    // 不超过max_size的最精细mip. max_size<=0表示不限制
+    static int GetStreamTargetLevel(int width, int height, int level_count, int max_size)
+    {
+        int level = 0;
+        while (max_size > 0 && level < level_count - 1 && std::max(std::max(width >> level, 1), std::max(height >> level, 1)) > max_size)
+        {
+            level++;
+        }
+        return level;
+    }
+
+    bool Renderer::IsCompressedFormatSupported(GLenum format)
+    {
+        if (!m_compressed_texture_formats_queried)
+        {
+            GLint count = 0;
+            glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &count);
+            std::vector<GLint> formats(std::max(count, 0));
+            if (count > 0)
+            {
+                glGetIntegerv(GL_COMPRESSED_TEXTURE_FORMATS, formats.data());
+            }
+            m_compressed_texture_formats.insert(formats.begin(), formats.end());
+            m_compressed_texture_formats_queried = true;
+        }
+        return m_compressed_texture_formats.count(format) > 0;
+    }
+
+    Texture* Renderer::LoadKtx2Texture(const std::string& cache_key, const std::string& ktx2_file, TextureType type, bool* out_translucent_flag)
+    {
+        // 流送时映射要一直保留到最后一层上传
+        std::unique_ptr<FileView> view(new FileView());
+        if (!view->Open(ktx2_file))
+        {
+            return nullptr;
+        }
+
+        const Ktx2Header* header = nullptr;
+        std::vector<Ktx2Level> levels;
+        bool translucent = false;
+        if (!ParseKtx2(view->GetData(), view->GetSize(), &header, &levels, &translucent)
+            || (header->face_count == 6) != (type == TEXTURE_CUBE))
+        {
+            VLOG(1) << "invalid ktx2: " << ktx2_file;
+            return nullptr;
+        }
+        const CompressedFormatInfo* info = FindCompressedFormat(header->vk_format);
+        if (info == nullptr)
+        {
+            VLOG(1) << "unsupported ktx2 format " << header->vk_format << ": " << ktx2_file;
+            return nullptr;
+        }
+        bool hardware = IsCompressedFormatSupported(info->gl_format);
+        if (!hardware && info->decode == nullptr)
+        {
+            VLOG(1) << "ktx2 format " << header->vk_format << " is not supported by GL and cannot be decoded: " << ktx2_file;
+            return nullptr;
+        }
+
+        // 先校验每层的大小
+        int faces = header->face_count;
+        for (size_t level=0; level<levels.size(); level++)
+        {
+            int width = std::max<int>(header->pixel_width >> level, 1);
+            int height = std::max<int>(header->pixel_height >> level, 1);
+            if (levels[level].byte_length != GetCompressedLevelSize(*info, width, height) * faces)
+            {
+                VLOG(1) << "invalid ktx2 level size: " << ktx2_file;
+                return nullptr;
+            }
+        }
+
+        GLenum target = type == TEXTURE_CUBE ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+        Texture* texture = new Texture();
+        texture->m_width = header->pixel_width;
+        texture->m_height = header->pixel_height;
+        texture->m_format = RGBA;
+        texture->m_type = type;
+        glGenTextures(1, &texture->m_gl_texture);
+        glBindTexture(target, texture->m_gl_texture);
+
+        bool mipmapped = levels.size() > 1;
+        glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(target, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+        glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, (GLint)levels.size() - 1);
+        glTexParameteri(target, GL_TEXTURE_WRAP_S, type == TEXTURE_CUBE ? GL_CLAMP_TO_EDGE : GL_REPEAT);
+        glTexParameteri(target, GL_TEXTURE_WRAP_T, type == TEXTURE_CUBE ? GL_CLAMP_TO_EDGE : GL_REPEAT);
+
+        size_t byte_size = 0;
+        if (type == TEXTURE_2D && mipmapped && m_texture_stream_budget > 0)
+        {
+            std::shared_ptr<TextureStream> stream = std::make_shared<TextureStream>();
+            stream->texture = texture;
+            stream->level_count = (int)levels.size();
+            stream->ktx2_format = info;
+            stream->ktx2_hardware = hardware;
+            stream->ktx2_levels = levels;
+            stream->ktx2_view = std::move(view);
+            byte_size = StartTextureStream(stream);
+        }
+        else
+        {
+            std::vector<uint8> scratch;
+            for (size_t level=0; level<levels.size(); level++)
+            {
+                int width = std::max<int>(header->pixel_width >> level, 1);
+                int height = std::max<int>(header->pixel_height >> level, 1);
+                size_t face_size = GetCompressedLevelSize(*info, width, height);
+                byte_size += hardware ? face_size * faces : (size_t)width * height * 4 * faces;
+                const uint8* level_data = (const uint8*)view->GetData() + levels[level].byte_offset;
+                for (int face=0; face<faces; face++)
+                {
+                    GLenum face_target = type == TEXTURE_CUBE ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : GL_TEXTURE_2D;
+                    UploadKtx2Level(face_target, *info, hardware, level_data + face_size * face, (int)level, width, height, &scratch);
+                }
+            }
+        }
+
+        VLOG(2) << "loaded " << ktx2_file << (hardware ? "" : " (software decoded)") << ", " << levels.size() << " levels";
+
+        if (out_translucent_flag != nullptr)
+        {
+            *out_translucent_flag = translucent;
+        }
+        AddTextureToCache(cache_key, texture, translucent, byte_size);
+        return texture;
+    }
+
+    // ---- KTX2 transcoder ----
+    // 离线编码器, 追求简单正确而不是最优质量: ETC1子集(individual/differential)+EAC, BC1/BC3按包围盒取端点
+
+    // 8个像素的一个ETC1子块在给定基色下的最优表, 返回误差
+    static int EncodeEtc1SubBlock(const uint8* pixels, const int* sub_pixels, const int* base, int* out_table, int* out_indices)
+    {
+        int best_error = INT32_MAX;
+        for (int table=0; table<8; table++)
+        {
+            int error = 0;
+            int indices[8];
+            for (int p=0; p<8; p++)
+            {
+                const uint8* pixel = pixels + sub_pixels[p] * 4;
+                int best_pixel_error = INT32_MAX;
+                for (int m=0; m<4; m++)
+                {
+                    int modifier = ETC1_MODIFIERS[table][m];
+                    int pixel_error = 0;
+                    for (int c=0; c<3; c++)
+                    {
+                        int d = ClampToByte(base[c] + modifier) - pixel[c];
+                        pixel_error += d * d;
+                    }
+                    if (pixel_error < best_pixel_error)
+                    {
+                        best_pixel_error = pixel_error;
+                        indices[p] = m;
+                    }
+                }
+                error += best_pixel_error;
+            }
+            if (error < best_error)
+            {
+                best_error = error;
+                *out_table = table;
+                memcpy(out_indices, indices, sizeof(indices));
+            }
+        }
+        return best_error;
+    }
+
+    // pixels: 4x4 RGBA, 行优先
+    static void EncodeEtc1Block(const uint8* pixels, uint8* block)
+    {
+        int best_error = INT32_MAX;
+        for (int flip=0; flip<2; flip++)
+        {
+            // 两个子块的像素(行优先序号)
+            int sub_pixels[2][8];
+            int counts[2] = { 0, 0 };
+            for (int y=0; y<4; y++)
+            {
+                for (int x=0; x<4; x++)
+                {
+                    int sub = flip ? (y >= 2) : (x >= 2);
+                    sub_pixels[sub][counts[sub]++] = y * 4 + x;
+                }
+            }
+
+            float average[2][3] = { { 0 } };
+            for (int sub=0; sub<2; sub++)
+                for (int p=0; p<8; p++)
+                    for (int c=0; c<3; c++)
+                        average[sub][c] += pixels[sub_pixels[sub][p] * 4 + c] / 8.0f;
+
+            int q5[2][3];
+            bool diff = true;
+            for (int c=0; c<3; c++)
+            {
+                q5[0][c] = (int)std::lround(average[0][c] * 31.0f / 255.0f);
+                q5[1][c] = (int)std::lround(average[1][c] * 31.0f / 255.0f);
+                int delta = q5[1][c] - q5[0][c];
+                diff = diff && delta >= -4 && delta <= 3;
+            }
+
+            uint8 candidate[8] = { 0 };
+            int base[2][3];
+            if (diff)
+            {
+                for (int c=0; c<3; c++)
+                {
+                    base[0][c] = Extend5(q5[0][c]);
+                    base[1][c] = Extend5(q5[1][c]);
+                    candidate[c] = (uint8)((q5[0][c] << 3) | ((q5[1][c] - q5[0][c]) & 7));
+                }
+            }
+            else
+            {
+                for (int c=0; c<3; c++)
+                {
+                    int q0 = (int)std::lround(average[0][c] * 15.0f / 255.0f);
+                    int q1 = (int)std::lround(average[1][c] * 15.0f / 255.0f);
+                    base[0][c] = Extend4(q0);
+                    base[1][c] = Extend4(q1);
+                    candidate[c] = (uint8)((q0 << 4) | q1);
+                }
+            }
+
+            int tables[2];
+            int indices[2][8];
+            int error = EncodeEtc1SubBlock(pixels, sub_pixels[0], base[0], &tables[0], indices[0])
+                      + EncodeEtc1SubBlock(pixels, sub_pixels[1], base[1], &tables[1], indices[1]);
+            if (error >= best_error)
+                continue;
+            best_error = error;
+
+            candidate[3] = (uint8)((tables[0] << 5) | (tables[1] << 2) | (diff ? 2 : 0) | flip);
+            uint32_t pixel_bits = 0;
+            for (int sub=0; sub<2; sub++)
+            {
+                for (int p=0; p<8; p++)
+                {
+                    int pixel = sub_pixels[sub][p];
+                    int i = (pixel & 3) * 4 + (pixel >> 2);
+                    pixel_bits |= (uint32_t)(indices[sub][p] >> 1) << (16 + i);
+                    pixel_bits |= (uint32_t)(indices[sub][p] & 1) << i;
+                }
+            }
+            candidate[4] = (uint8)(pixel_bits >> 24);
+            candidate[5] = (uint8)(pixel_bits >> 16);
+            candidate[6] = (uint8)(pixel_bits >> 8);
+            candidate[7] = (uint8)pixel_bits;
+            memcpy(block, candidate, sizeof(candidate));
+        }
+    }
+
+    static void EncodeEacAlphaBlock(const uint8* pixels, uint8* block)
+    {
+        int min_alpha = 255, max_alpha = 0;
+        for (int i=0; i<16; i++)
+        {
+            min_alpha = std::min<int>(min_alpha, pixels[i * 4 + 3]);
+            max_alpha = std::max<int>(max_alpha, pixels[i * 4 + 3]);
+        }
+
+        int best_error = INT32_MAX;
+        int best_base = min_alpha, best_multiplier = 1, best_table = 13;
+        int best_indices[16] = { 0 };
+        for (int table=0; table<16 && best_error > 0; table++)
+        {
+            const int* modifiers = EAC_MODIFIERS[table];
+            int range = modifiers[7] - modifiers[3];
+            int multiplier0 = std::max(1, (max_alpha - min_alpha + range - 1) / range);
+            for (int multiplier=multiplier0-1; multiplier<=multiplier0+1; multiplier++)
+            {
+                if (multiplier < 1 || multiplier > 15)
+                    continue;
+                int bases[2] = { min_alpha - modifiers[3] * multiplier, (min_alpha + max_alpha + 1) / 2 };
+                for (int b=0; b<2; b++)
+                {
+                    int base = std::max(0, std::min(255, bases[b]));
+                    int error = 0;
+                    int indices[16];
+                    for (int i=0; i<16 && error < best_error; i++)
+                    {
+                        int alpha = pixels[i * 4 + 3];
+                        int best_pixel_error = INT32_MAX;
+                        for (int m=0; m<8; m++)
+                        {
+                            int d = ClampToByte(base + modifiers[m] * multiplier) - alpha;
+                            if (d * d < best_pixel_error)
+                            {
+                                best_pixel_error = d * d;
+                                indices[i] = m;
+                            }
+                        }
+                        error += best_pixel_error;
+                    }
+                    if (error < best_error)
+                    {
+                        best_error = error;
+                        best_base = base;
+                        best_multiplier = multiplier;
+                        best_table = table;
+                        memcpy(best_indices, indices, sizeof(indices));
+                    }
+                }
+            }
+        }
+
+        block[0] = (uint8)best_base;
+        block[1] = (uint8)((best_multiplier << 4) | best_table);
+        uint64_t bits = 0;
+        for (int i=0; i<16; i++)
+        {
+            // 列优先
+            int pixel = (i & 3) * 4 + (i >> 2);
+            bits |= (uint64_t)best_indices[pixel] << (45 - 3 * i);
+        }
+        for (int i=0; i<6; i++)
+            block[2 + i] = (uint8)(bits >> (40 - 8 * i));
+    }
+
+    static uint16_t ToRgb565(const int* rgb)
+    {
+        int r = (rgb[0] * 31 + 127) / 255, g = (rgb[1] * 63 + 127) / 255, b = (rgb[2] * 31 + 127) / 255;
+        return (uint16_t)((r << 11) | (g << 5) | b);
+    }
+
+    static void EncodeBc1ColorBlock(const uint8* pixels, uint8* block)
+    {
+        int min_color[3] = { 255, 255, 255 }, max_color[3] = { 0, 0, 0 };
+        for (int i=0; i<16; i++)
+        {
+            for (int c=0; c<3; c++)
+            {
+                min_color[c] = std::min<int>(min_color[c], pixels[i * 4 + c]);
+                max_color[c] = std::max<int>(max_color[c], pixels[i * 4 + c]);
+            }
+        }
+        // 端点向内收1/16, 减小包围盒对角线的误差
+        for (int c=0; c<3; c++)
+        {
+            int inset = (max_color[c] - min_color[c]) / 16;
+            min_color[c] += inset;
+            max_color[c] -= inset;
+        }
+        uint16_t color0 = ToRgb565(max_color);
+        uint16_t color1 = ToRgb565(min_color);
+        if (color0 < color1)
+            std::swap(color0, color1);
+
+        int palette[4][3];
+        DecodeRgb565(color0, palette[0]);
+        DecodeRgb565(color1, palette[1]);
+        for (int c=0; c<3; c++)
+        {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+        uint32_t bits = 0;
+        if (color0 != color1)
+        {
+            for (int i=0; i<16; i++)
+            {
+                int best = 0, best_error = INT32_MAX;
+                for (int m=0; m<4; m++)
+                {
+                    int error = 0;
+                    for (int c=0; c<3; c++)
+                    {
+                        int d = palette[m][c] - pixels[i * 4 + c];
+                        error += d * d;
+                    }
+                    if (error < best_error)
+                    {
+                        best_error = error;
+                        best = m;
+                    }
+                }
+                bits |= (uint32_t)best << (2 * i);
+            }
+        }
+        block[0] = (uint8)color0;
+        block[1] = (uint8)(color0 >> 8);
+        block[2] = (uint8)color1;
+        block[3] = (uint8)(color1 >> 8);
+        for (int i=0; i<4; i++)
+            block[4 + i] = (uint8)(bits >> (8 * i));
+    }
+
+    static void EncodeBc3AlphaBlock(const uint8* pixels, uint8* block)
+    {
+        int alpha0 = 0, alpha1 = 255;
+        for (int i=0; i<16; i++)
+        {
+            alpha0 = std::max<int>(alpha0, pixels[i * 4 + 3]);
+            alpha1 = std::min<int>(alpha1, pixels[i * 4 + 3]);
+        }
+        int palette[8] = { alpha0, alpha1 };
+        for (int i=2; i<8; i++)
+            palette[i] = ((8 - i) * alpha0 + (i - 1) * alpha1) / 7;
+
+        uint64_t bits = 0;
+        if (alpha0 != alpha1)
+        {
+            for (int i=0; i<16; i++)
+            {
+                int best = 0, best_error = INT32_MAX;
+                for (int m=0; m<8; m++)
+                {
+                    int error = std::abs(palette[m] - pixels[i * 4 + 3]);
+                    if (error < best_error)
+                    {
+                        best_error = error;
+                        best = m;
+                    }
+                }
+                bits |= (uint64_t)best << (3 * i);
+            }
+        }
+        block[0] = (uint8)alpha0;
+        block[1] = (uint8)alpha1;
+        for (int i=0; i<6; i++)
+            block[2 + i] = (uint8)(bits >> (8 * i));
+    }
+
+    typedef void (*EncodeBlockFunc)(const uint8* pixels, uint8* block);
+
+    static void EncodeEtc2Rgb8(const uint8* pixels, uint8* block)
+    {
+        EncodeEtc1Block(pixels, block);
+    }
+
+    static void EncodeEtc2Rgba8(const uint8* pixels, uint8* block)
+    {
+        EncodeEacAlphaBlock(pixels, block);
+        EncodeEtc1Block(pixels, block + 8);
+    }
+
+    static void EncodeBc1(const uint8* pixels, uint8* block)
+    {
+        EncodeBc1ColorBlock(pixels, block);
+    }
+
+    static void EncodeBc3(const uint8* pixels, uint8* block)
+    {
+        EncodeBc3AlphaBlock(pixels, block);
+        EncodeBc1ColorBlock(pixels, block + 8);
+    }
+
+    // 紧凑RGBA8的一层按4x4块编码, 边缘块复制边界像素
+    static void CompressLevel(const uint8* rgba, int width, int height, int block_bytes, EncodeBlockFunc encode, std::string* out)
+    {
+        uint8 pixels[4 * 4 * 4];
+        uint8 block[16];
+        for (int by=0; by<(height + 3) / 4; by++)
+        {
+            for (int bx=0; bx<(width + 3) / 4; bx++)
+            {
+                for (int y=0; y<4; y++)
+                {
+                    int sy = std::min(by * 4 + y, height - 1);
+                    for (int x=0; x<4; x++)
+                    {
+                        int sx = std::min(bx * 4 + x, width - 1);
+                        memcpy(pixels + (y * 4 + x) * 4, rgba + ((size_t)sy * width + sx) * 4, 4);
+                    }
+                }
+                encode(pixels, block);
+                out->append((const char*)block, block_bytes);
+            }
+        }
+    }
+
+
+    // 最小的basic data format descriptor, 只描述块格式本身
+    static std::string BuildKtx2Dfd(bool etc2, bool has_alpha, int block_bytes)
+    {
+        // KHR_DF_MODEL_ETC2 / BC1A / BC3
+        uint32_t color_model = etc2 ? 161 : (has_alpha ? 130 : 128);
+        uint32_t color_channel = etc2 ? 2 : 0;
+        int sample_count = has_alpha ? 2 : 1;
+        uint32_t block_size = 24 + 16 * sample_count;
+
+        std::vector<uint32_t> words;
+        words.push_back(4 + block_size);
+        words.push_back(0);                         // vendorId=KHR, descriptorType=basic
+        words.push_back(2 | (block_size << 16));    // versionNumber=2, descriptorBlockSize
+        words.push_back(color_model | (1 << 8) | (1 << 16)); // BT709 primaries, linear transfer, straight alpha
+        words.push_back(3 | (3 << 8));              // 4x4 texel block
+        words.push_back((uint32_t)block_bytes);     // bytesPlane0
+        words.push_back(0);
+        for (int s=0; s<sample_count; s++)
+        {
+            bool alpha_sample = has_alpha && s == 0;
+            uint32_t channel = alpha_sample ? 15 : color_channel;
+            uint32_t bit_offset = has_alpha && !alpha_sample ? 64 : 0;
+            words.push_back(bit_offset | (63 << 16) | (channel << 24));
+            words.push_back(0);
+            words.push_back(0);
+            words.push_back(UINT32_MAX);
+        }
+        return std::string((const char*)words.data(), words.size() * sizeof(uint32_t));
+    }
+
+    bool TextureTranscoder::WriteKtx2FromPng(const std::string& png_file, const std::string& ktx2_file, TextureCompressionFamily family)
+    {
+        DecodedTexture decoded;
+        if (!DecodeTexture(png_file, &decoded))
+        {
+            return false;
+        }
+        int width = decoded.image_frame->Width();
+        int height = decoded.image_frame->Height();
+        std::vector<uint8> rgba((size_t)width * height * 4);
+        for (int row=0; row<height; row++)
+        {
+            memcpy(rgba.data() + (size_t)row * width * 4, decoded.image_frame->PixelData() + (size_t)row * decoded.image_frame->WidthStep(), (size_t)width * 4);
+        }
+        bool has_alpha = !decoded.stats.opaque;
+        bool translucent = decoded.stats.has_partial_alpha;
+        delete decoded.image_frame;
+
+        bool etc2 = family == TEXTURE_COMPRESSION_ETC2;
+        uint32_t vk_format = etc2 ? (has_alpha ? 151 : 147) : (has_alpha ? 137 : 131);
+        EncodeBlockFunc encode = etc2 ? (has_alpha ? EncodeEtc2Rgba8 : EncodeEtc2Rgb8) : (has_alpha ? EncodeBc3 : EncodeBc1);
+        int block_bytes = has_alpha ? 16 : 8;
+
+        // 完整mip链, 从大到小
+        std::vector<std::string> level_data;
+        std::vector<uint8> next;
+        int level_width = width, level_height = height;
+        while (true)
+        {
+            level_data.emplace_back();
+            CompressLevel(rgba.data(), level_width, level_height, block_bytes, encode, &level_data.back());
+            if (level_width == 1 && level_height == 1)
+                break;
+            DownsampleImage(rgba, level_width, level_height, 4, &next);
+            rgba.swap(next);
+            level_width = std::max(level_width / 2, 1);
+            level_height = std::max(level_height / 2, 1);
+        }
+
+        Ktx2Header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.identifier, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER));
+        header.vk_format = vk_format;
+        header.type_size = 1;
+        header.pixel_width = width;
+        header.pixel_height = height;
+        header.face_count = 1;
+        header.level_count = (uint32_t)level_data.size();
+
+        std::string dfd = BuildKtx2Dfd(etc2, has_alpha, block_bytes);
+        std::string kvd;
+        {
+            std::string entry = std::string(KTX2_TRANSLUCENT_KEY) + '\0' + (translucent ? "1" : "0") + '\0';
+            uint32_t length = (uint32_t)entry.size();
+            kvd.append((const char*)&length, sizeof(length));
+            kvd.append(entry);
+            kvd.resize((kvd.size() + 3) & ~(size_t)3, 0);
+        }
+
+        std::vector<Ktx2Level> levels(level_data.size());
+        std::string blob(sizeof(Ktx2Header) + sizeof(Ktx2Level) * levels.size(), 0);
+        header.dfd_byte_offset = (uint32_t)blob.size();
+        header.dfd_byte_length = (uint32_t)dfd.size();
+        blob.append(dfd);
+        header.kvd_byte_offset = (uint32_t)blob.size();
+        header.kvd_byte_length = (uint32_t)kvd.size();
+        blob.append(kvd);
+        // 规范要求按从小到大的顺序存放各层
+        for (size_t i=level_data.size(); i-- > 0;)
+        {
+            WriteMeshCacheBlock(&blob, &levels[i].byte_offset, level_data[i].data(), level_data[i].size());
+            levels[i].byte_length = level_data[i].size();
+            levels[i].uncompressed_byte_length = level_data[i].size();
+        }
+        memcpy(&blob[0], &header, sizeof(header));
+        memcpy(&blob[sizeof(header)], levels.data(), sizeof(Ktx2Level) * levels.size());
+
+        VLOG(1) << "transcoded " << png_file << " -> " << ktx2_file << ": " << level_data.size() << " levels, " << blob.size() << " bytes";
+        return WriteFileAtomically(ktx2_file, blob);
+    }
+
+    int TextureTranscoder::TranscodePBRTextures(const std::string& mesh_file_path, TextureCompressionFamily family)
+    {
+        FileView text;
+        if (!text.Open(mesh_file_path))
+        {
+            return 0;
+        }
+        Mesh mesh(nullptr);
+        ObjMeshParser parser(&mesh, text.GetData(), text.GetSize());
+        parser.SetOptimizeSubMeshes(false);
+        bool succ = false;
+        std::vector<std::string> submesh_material_names = parser.Parse(&succ);
+        if (!succ)
+        {
+            return 0;
+        }
+
+        std::string prefix = GetMeshPathWithoutExt(mesh_file_path);
+        std::set<std::string> done;
+        int written = 0;
+        for (auto& name : submesh_material_names)
+        {
+            for (int slot=0; slot<PBR_TEXTURE_COUNT; slot++)
+            {
+                std::string png_file = prefix + "_" + name + "_" + PBR_TEXTURE_SUFFIXES[slot];
+                if (!done.insert(png_file).second || GetResourceFileSize(png_file) == 0)
+                    continue;
+                if (WriteKtx2FromPng(png_file, GetKtx2Path(png_file), family))
+                    written++;
+            }
+        }
+        return written;
+    }
+
+    // ---- texture cache ----
+    // 上传的完整mip链字节数, 每层按1x1截断
+    static size_t GetMipChainBytes(int width, int height, int bytes_per_pixel, bool mipmapped)
+    {
+        size_t bytes = 0;
+        for (int level=0; ; level++)
+        {
+            int level_width = std::max(width >> level, 1);
+            int level_height = std::max(height >> level, 1);
+            bytes += (size_t)level_width * level_height * bytes_per_pixel;
+            if (!mipmapped || (level_width == 1 && level_height == 1))
+            {
+                break;
+            }
+        }
+        return bytes;
+    }
+
+    void Renderer::AddTextureToCache(const std::string& key, Texture* texture, bool translucent, size_t byte_size)
+    {
+        TextureInfo& ti = m_texture_cache[key];
+        ti.texture = texture;
+        ti.translucent = translucent;
+        ti.byte_size = byte_size;
+        ti.lru_iter = m_texture_lru.end();
+        m_texture_memory += byte_size;
+        EvictTextures();
+    }
+
+    void Renderer::TouchCachedTexture(TextureInfo& ti)
+    {
+        if (ti.lru_iter != m_texture_lru.end())
+        {
+            m_texture_lru.splice(m_texture_lru.end(), m_texture_lru, ti.lru_iter);
+        }
+    }
+
+    void Renderer::RetainTexture(const std::string& texture_file)
+    {
+        auto iter = m_texture_cache.find(texture_file);
+        if (iter == m_texture_cache.end())
+        {
+            return;
+        }
+        TextureInfo& ti = iter->second;
+        if (ti.ref_count++ == 0 && ti.lru_iter != m_texture_lru.end())
+        {
+            m_texture_lru.erase(ti.lru_iter);
+            ti.lru_iter = m_texture_lru.end();
+        }
+    }
+
+    void Renderer::ReleaseTexture(const std::string& texture_file)
+    {
+        auto iter = m_texture_cache.find(texture_file);
+        if (iter == m_texture_cache.end() || iter->second.ref_count == 0)
+        {
+            return;
+        }
+        TextureInfo& ti = iter->second;
+        if (--ti.ref_count == 0)
+        {
+            ti.lru_iter = m_texture_lru.insert(m_texture_lru.end(), texture_file);
+            EvictTextures();
+        }
+    }
+
+    void Renderer::EvictTextures()
+    {
+        while (m_texture_memory > m_texture_cache_budget && !m_texture_lru.empty())
+        {
+            auto iter = m_texture_cache.find(m_texture_lru.front());
+            m_texture_lru.pop_front();
+            VLOG(2) << "evict texture " << iter->first << ", " << iter->second.byte_size << " bytes";
+            CancelTextureStream(iter->second.texture);
+            m_texture_memory -= iter->second.byte_size;
+            delete iter->second.texture;
+            m_texture_cache.erase(iter);
+        }
+    }
+
+    void Renderer::SetTextureCacheBudget(size_t bytes)
+    {
+        m_texture_cache_budget = bytes;
+        EvictTextures();
+    }
+
+    size_t Renderer::GetTextureMemoryUsage() const
+    {
+        return m_texture_memory;
+    }
+
+    // ---- texture streaming ----
+    size_t Renderer::StartTextureStream(std::shared_ptr<TextureStream> stream)
+    {
+        stream->next_level = stream->level_count - 1;
+        stream->target_level = GetStreamTargetLevel(stream->texture->m_width, stream->texture->m_height, stream->level_count, m_texture_stream_max_size);
+        size_t resident_bytes = 0;
+        for (int level=stream->target_level; level<stream->level_count; level++)
+        {
+            resident_bytes += stream->GetLevelBytes(level);
+        }
+
+        // 小mip立刻上传, 至少一层
+        std::vector<uint8> scratch;
+        do
+        {
+            stream->UploadNextLevel(&scratch);
+        } while (!stream->IsDone()
+                 && std::max(stream->GetLevelWidth(stream->next_level), stream->GetLevelHeight(stream->next_level)) <= TEXTURE_STREAM_INITIAL_SIZE);
+
+        if (!stream->IsDone())
+        {
+            m_texture_streams.push_back(stream);
+        }
+        return resident_bytes;
+    }
+
+    void Renderer::SetTextureStreamingBudget(size_t bytes_per_frame, int max_resident_size)
+    {
+        m_texture_stream_budget = bytes_per_frame;
+        m_texture_stream_max_size = max_resident_size;
+    }
+
+    size_t Renderer::ProcessTextureStreams()
+    {
+        size_t uploaded = 0;
+        std::vector<uint8> scratch;
+        for (auto iter=m_texture_streams.begin(); iter!=m_texture_streams.end();)
+        {
+            TextureStream* stream = iter->get();
+            while (!stream->IsDone())
+            {
+                // 每帧至少上传一层, 否则超过预算的大mip永远传不上去
+                size_t bytes = stream->GetLevelBytes(stream->next_level);
+                if (uploaded > 0 && uploaded + bytes > m_texture_stream_budget)
+                {
+                    return uploaded;
+                }
+                stream->UploadNextLevel(&scratch);
+                uploaded += bytes;
+            }
+            iter = m_texture_streams.erase(iter);
+        }
+        return uploaded;
+    }
+
+    void Renderer::CancelTextureStream(Texture* texture)
+    {
+        m_texture_streams.remove_if([texture](const std::shared_ptr<TextureStream>& stream) { return stream->texture == texture; });
+    }
+
+    // ---- async loading ----
+    // 固定线程数的后台任务队列. 析构时丢弃还没开始的任务, 等待正在执行的任务结束
+    class AssetLoadPool
+    {
+    public:
+        AssetLoadPool(int thread_count)
+        {
+            for (int i=0; i<thread_count; i++)
+            {
+                m_threads.emplace_back([this]() { WorkerLoop(); });
+            }
+        }
+
+        ~AssetLoadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopped = true;
+                m_jobs.clear();
+            }
+            m_condition.notify_all();
+            for (auto& thread : m_threads)
+            {
+                thread.join();
+            }
+        }
+
+        void Submit(std::function<void()> job)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_stopped)
+                    return;
+                m_jobs.push_back(std::move(job));
+            }
+            m_condition.notify_one();
+        }
+
+    private:
+        void WorkerLoop()
+        {
+            while (true)
+            {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_condition.wait(lock, [this]() { return m_stopped || !m_jobs.empty(); });
+                    if (m_stopped)
+                        return;
+                    job = std::move(m_jobs.front());
+                    m_jobs.pop_front();
+                }
+                job();
+            }
+        }
+
+    private:
+        std::vector<std::thread> m_threads;
+        std::deque<std::function<void()>> m_jobs;
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+        bool m_stopped = false;
+    };
+
+    // 一次CreatePBRMeshAsync的中间状态. 后台任务和Renderer各持有一份引用
+    struct AsyncPBRLoad
+    {
+        std::shared_ptr<MeshLoadHandle> handle;
+        std::string mesh_file_path;
+        std::string mirror_path;
+        bool has_mirror_path = false;
+        int vertex_format = VERTEX_FORMAT_FLOAT;
+
+        Mesh* mesh = nullptr;
+        std::vector<std::string> submesh_material_names;
+        std::mutex mutex;
+        std::map<std::string, DecodedTexture> textures;
+        std::atomic<int> pending_jobs{0};
+        // 几何和所有贴图都处理完(成功或失败), 渲染线程可以接手
+        std::atomic<bool> ready{false};
+
+        ~AsyncPBRLoad()
+        {
+            // 没交给调用方的mesh和没上传的图片
+            delete mesh;
+            for (auto& texture : textures)
+            {
+                delete texture.second.image_frame;
+            }
+        }
+
+        void FinishJob()
+        {
+            if (pending_jobs.fetch_sub(1) == 1)
+            {
+                ready = true;
+            }
+        }
+    };
+
+    MeshLoadHandle::State MeshLoadHandle::GetState() const
+    {
+        return m_state;
+    }
+
+    bool MeshLoadHandle::IsDone() const
+    {
+        return m_state != LOADING;
+    }
+
+    Mesh* MeshLoadHandle::GetMesh() const
+    {
+        return m_mesh;
+    }
+
+    Renderer::Renderer(int screen_width, int screen_height, std::string resource_dir)
+    : m_screen_width(screen_width), m_screen_height(screen_height), m_resource_dir(resource_dir)
+    {
+        // 创建FBO
+        glGenFramebuffers(1, &m_standalone_fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, m_standalone_fbo);
+        
+        glGenTextures(1, &m_standalone_color_texture);
+        glBindTexture(GL_TEXTURE_2D, m_standalone_color_texture);
+        
+        uint* colors = new uint[screen_width * screen_height];
+        memset(colors, 0, sizeof(uint) * screen_width * screen_height);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, screen_width, screen_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, colors);
+        delete[] colors;
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_standalone_color_texture, 0);
+        
+        glGenBuffers(1, &m_standalone_depth_buffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, m_standalone_depth_buffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16, screen_width, screen_height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_standalone_depth_buffer);
+        
+        if (m_use_msaa)
+        {
+            glGenFramebuffers(1, &m_msaa_fbo);
+            glBindFramebuffer(GL_FRAMEBUFFER, m_msaa_fbo);
+            
+            glGenBuffers(1, &m_msaa_color_buffer);
+            glBindRenderbuffer(GL_RENDERBUFFER, m_msaa_color_buffer);
+            glRenderbufferStorageMultisample(GL_RENDERBUFFER, m_msaa_samples, GL_RGBA8, screen_width, screen_height);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_msaa_color_buffer);
+            
+            glGenBuffers(1, &m_msaa_depth_buffer);
+            glBindRenderbuffer(GL_RENDERBUFFER, m_msaa_depth_buffer);
+            glRenderbufferStorageMultisample(GL_RENDERBUFFER, m_msaa_samples, GL_DEPTH_COMPONENT16, screen_width, screen_height);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_msaa_depth_buffer);
+        }
+        
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        if (status != GL_FRAMEBUFFER_COMPLETE) {
+          VLOG(2) << "error: standalone framebuffer is not completed: " << status;
+        }
+        
+        // 创建相机
+        m_camera = new Camera(this);
+    }
+    
+    Renderer::~Renderer()
+    {
+        // 先停掉后台任务, 未完成的异步加载随m_async_loads一起释放
+        delete m_load_pool;
+        m_load_pool = nullptr;
+        m_async_loads.clear();
+        m_texture_streams.clear();
+
+        if (m_frame_ubo != 0)
+        {
+            glDeleteBuffers(1, &m_frame_ubo);
+            m_frame_ubo = 0;
+        }
+
+        if (m_instance_vbo != 0)
+        {
+            glDeleteBuffers(1, &m_instance_vbo);
+            m_instance_vbo = 0;
+        }
+
+        if (m_occlusion_debug_texture != 0)
+        {
+            glDeleteTextures(1, &m_occlusion_debug_texture);
+            m_occlusion_debug_texture = 0;
+        }
+
+        for (auto iter=m_pending_variants.begin(); iter!=m_pending_variants.end(); ++iter)
+        {
+            delete iter->second.program;
+        }
+        m_pending_variants.clear();
+        m_queued_variants.clear();
+        m_program_variants.clear();
+
+        for (auto iter=m_program_cache.begin(); iter!=m_program_cache.end(); ++iter)
+        {
+            delete iter->second;
+        }
+        m_program_cache.clear();
+        
+        for (auto iter=m_texture_cache.begin(); iter!=m_texture_cache.end(); ++iter)
+        {
+            delete iter->second.texture;
+        }
+        m_texture_cache.clear();
+        m_texture_lru.clear();
+        m_texture_memory = 0;
+        
+        if (m_camera != nullptr)
+        {
+            delete m_camera;
+            m_camera = nullptr;
+        }
+        
+        // remove all render meshes
+        for (auto& mesh : m_mesh_list)
+        {
+            mesh->m_in_renderer = false;
+            mesh->m_bvh_leaf = -1;
+            mesh->m_bounds_dirty = false;
+        }
+        m_mesh_list.clear();
+        m_mesh_bvh.Clear();
+        m_unbounded_meshes.clear();
+        m_dirty_meshes.clear();
+        
+        // clear gl resources
+        if (m_standalone_fbo > 0)
+        {
+            glDeleteFramebuffers(1, &m_standalone_fbo);
+        }
+        
+        if (m_standalone_color_texture > 0)
+        {
+            glDeleteTextures(1, &m_standalone_color_texture);
+        }
+        
+        if (m_standalone_depth_buffer > 0)
+        {
+            glDeleteRenderbuffers(1, &m_standalone_depth_buffer);
+        }
+        
+        if (m_use_msaa)
+        {
+            if (m_msaa_fbo)
+            {
+                glDeleteFramebuffers(1, &m_msaa_fbo);
+            }
+            
+            if (m_msaa_color_buffer)
+            {
+                glDeleteRenderbuffers(1, &m_msaa_color_buffer);
+            }
+            
+            if (m_msaa_depth_buffer)
+            {
+                glDeleteRenderbuffers(1, &m_msaa_depth_buffer);
+            }
+        }
+        
+        if (m_background_program > 0)
+        {
+            glDeleteProgram(m_background_program);
+            m_background_program = 0;
+            m_background_uniform_loc = -1;
+        }
+    }
+
+    GLuint Renderer::GetStandaloneColorTextureId() const
+    {
+        return m_standalone_color_texture;
+    }
+
+    void Renderer::BeginRenderNoClear() {
+        ProcessAsyncLoads();
+        ProcessTextureStreams();
+        ProcessShaderPrecompile();
+        if (m_standalone_fbo > 0)
+        {
+            if (m_use_msaa && m_msaa_fbo > 0)
+            {
+                //glEnable(GL_MULTISAMPLE);
+                glBindFramebuffer(GL_FRAMEBUFFER, m_msaa_fbo);
+                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_msaa_color_buffer);
+                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_msaa_depth_buffer);
+            }
+            else
+            {
+                glBindFramebuffer(GL_FRAMEBUFFER, m_standalone_fbo);
+                glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_standalone_color_texture, 0);
+                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_standalone_depth_buffer);
+            }
+        }
+    }
+    void Renderer::BeginRender()
+    {
+        ProcessAsyncLoads();
+        ProcessTextureStreams();
+        ProcessShaderPrecompile();
+        if (m_standalone_fbo > 0)
+        {
+            if (m_use_msaa && m_msaa_fbo > 0)
+            {
+                //glEnable(GL_MULTISAMPLE);
+                glBindFramebuffer(GL_FRAMEBUFFER, m_msaa_fbo);
+                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_msaa_color_buffer);
+                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_msaa_depth_buffer);
+            }
+            else
+            {
+                glBindFramebuffer(GL_FRAMEBUFFER, m_standalone_fbo);
+                glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_standalone_color_texture, 0);
+                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_standalone_depth_buffer);
+            }
+            
+            glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+            glClearDepthf(1.0f);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        }
+    }
+
+    enum { ATTRIB_VERTEX, ATTRIB_TEXTURE_POSITION, NUM_ATTRIBUTES };
+    void Renderer::RenderBackground(GLuint background_texture_id)
+    {
+        glDisable(GL_DEPTH_TEST);
+        glDepthMask(GL_FALSE);
+        glDisable(GL_BLEND);
+        if (m_background_program == 0)
+        {
+            // Load vertex and fragment shaders
+            const GLint attr_location[2] = {
+                ATTRIB_VERTEX,
+                ATTRIB_TEXTURE_POSITION,
+            };
+            const GLchar* attr_name[2] = {
+                "position",
+                "texture_coordinate",
+            };
+                
+            // shader program
+            GlhCreateProgram(kBasicVertexShader, kBasicTexturedFragmentShader, 2,
+                             (const GLchar**)&attr_name[0], attr_location, &m_background_program);
+            m_background_uniform_loc = glGetUniformLocation(m_background_program, "video_frame");
+        }
+        
+        
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, background_texture_id);
+        
+        // render background
+        {
+            static const GLfloat square_vertices[] = {
+                -1.0f, -1.0f,  // bottom left
+                1.0f,  -1.0f,  // bottom right
+                -1.0f, 1.0f,   // top left
+                1.0f,  1.0f,   // top right
+            };
+            static const GLfloat texture_vertices[] = {
+                0.0f, 0.0f,  // bottom left
+                1.0f, 0.0f,  // bottom right
+                0.0f, 1.0f,  // top left
+                1.0f, 1.0f,  // top right
+            };
+            
+            glDisable(GL_DEPTH_TEST);
+            glDisable(GL_BLEND);
+            
+            // program
+            glUseProgram(m_background_program);
+            glUniform1i(m_background_uniform_loc, 0);
+            
+            // vertex storage
+            GLuint vbo[2];
+            glGenBuffers(2, vbo);
+            GLuint vao;
+            glGenVertexArrays(1, &vao);
+            glBindVertexArray(vao);
+            
+            // vbo 0
+            glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
+            glBufferData(GL_ARRAY_BUFFER, 4 * 2 * sizeof(GLfloat), square_vertices,
+                         GL_STATIC_DRAW);
+            glEnableVertexAttribArray(ATTRIB_VERTEX);
+            glVertexAttribPointer(ATTRIB_VERTEX, 2, GL_FLOAT, 0, 0, nullptr);
+            
+            // vbo 1
+            glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
+            glBufferData(GL_ARRAY_BUFFER, 4 * 2 * sizeof(GLfloat), texture_vertices,
+                         GL_STATIC_DRAW);
+            glEnableVertexAttribArray(ATTRIB_TEXTURE_POSITION);
+            glVertexAttribPointer(ATTRIB_TEXTURE_POSITION, 2, GL_FLOAT, 0, 0, nullptr);
+            
+            // draw
+            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            
+            // cleanup
+            glDisableVertexAttribArray(ATTRIB_VERTEX);
+            glDisableVertexAttribArray(ATTRIB_TEXTURE_POSITION);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glBindVertexArray(0);
+            glDeleteVertexArrays(1, &vao);
+            glDeleteBuffers(2, vbo);
+        }
+        glEnable(GL_DEPTH_TEST);
+        glDepthMask(GL_TRUE);
+        glDisable(GL_BLEND);
+    }
+
+    void Renderer::UpdateFrameConstants()
+    {
+        m_frame_index++;
+        m_frame_constants.view = m_camera->GetViewMatrix();
+        m_frame_constants.projection = m_camera->GetProjectionMatrix();
+        m_frame_constants.view_projection = m_camera->GetViewProjectionMatrix();
+        Vector3f camera_position = m_camera->GetPosition();
+        m_frame_constants.camera_position = Vector4f(camera_position.x(), camera_position.y(), camera_position.z(), 1.0f);
+
+        // std140下mat4是4个vec4列, 与eigen默认的列主序一致, 可以直接拷贝
+        float block[16 * 3 + 4];
+        memcpy(block, m_frame_constants.view.data(), sizeof(float) * 16);
+        memcpy(block + 16, m_frame_constants.projection.data(), sizeof(float) * 16);
+        memcpy(block + 32, m_frame_constants.view_projection.data(), sizeof(float) * 16);
+        memcpy(block + 48, m_frame_constants.camera_position.data(), sizeof(float) * 4);
+        if (m_frame_ubo == 0)
+        {
+            glGenBuffers(1, &m_frame_ubo);
+            m_gl_state.BindBuffer(GL_UNIFORM_BUFFER, m_frame_ubo);
+            glBufferData(GL_UNIFORM_BUFFER, sizeof(block), block, GL_DYNAMIC_DRAW);
+        }
+        else
+        {
+            m_gl_state.BindBuffer(GL_UNIFORM_BUFFER, m_frame_ubo);
+            glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), block);
+        }
+        m_gl_state.BindUniformBuffer(FRAME_UNIFORM_BINDING, m_frame_ubo);
+    }
+
+    const FrameConstants& Renderer::GetFrameConstants() const
+    {
+        return m_frame_constants;
+    }
+
+    uint64_t Renderer::GetFrameIndex() const
+    {
+        return m_frame_index;
+    }
+
+    GLStateCache* Renderer::GetGLStateCache()
+    {
+        return &m_gl_state;
+    }
+
+    const GLStateStats& Renderer::GetGLStateStats() const
+    {
+        return m_gl_state_stats;
+    }
+
+    // ---- frustum culling ----
+    // 从view_projection提取6个裁剪面(Gribb-Hartmann), 法线朝内并归一化, 点到面的距离 = dot(n, p) + w
+    static void ExtractFrustumPlanes(const Matrix4f& view_projection, Vector4f planes[6])
+    {
+        Vector4f row0 = view_projection.row(0).transpose();
+        Vector4f row1 = view_projection.row(1).transpose();
+        Vector4f row2 = view_projection.row(2).transpose();
+        Vector4f row3 = view_projection.row(3).transpose();
+        planes[0] = row3 + row0;
+        planes[1] = row3 - row0;
+        planes[2] = row3 + row1;
+        planes[3] = row3 - row1;
+        planes[4] = row3 + row2;
+        planes[5] = row3 - row2;
+        for (int i=0; i<6; i++)
+        {
+            float length = planes[i].head<3>().norm();
+            if (length > 0.0f)
+                planes[i] /= length;
+        }
+    }
+
+    // 球与视锥求交, 结果写入visible(1可见). 球按SoA存放, count需要补齐到4的倍数
+    static void CullSpheres(const Vector4f planes[6], const float* xs, const float* ys, const float* zs, const float* radii, int count, uint8_t* visible)
+    {
+        int i = 0;
+#if defined(R3D_SIMD_SSE2)
+        // 每次4个球. 只要在某个面外侧(距离 < -半径)就不可见
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128 x = _mm_loadu_ps(xs + i);
+            __m128 y = _mm_loadu_ps(ys + i);
+            __m128 z = _mm_loadu_ps(zs + i);
+            __m128 neg_radius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radii + i));
+            __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            for (int p=0; p<6; p++)
+            {
+                __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(planes[p].x())), _mm_mul_ps(y, _mm_set1_ps(planes[p].y()))),
+                                      _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(planes[p].z())), _mm_set1_ps(planes[p].w())));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(d, neg_radius));
+            }
+            int mask = _mm_movemask_ps(inside);
+            for (int k=0; k<4; k++)
+            {
+                visible[i + k] = (mask >> k) & 1;
+            }
+        }
+#elif defined(R3D_SIMD_NEON)
+        for (; i + 4 <= count; i += 4)
+        {
+            float32x4_t x = vld1q_f32(xs + i);
+            float32x4_t y = vld1q_f32(ys + i);
+            float32x4_t z = vld1q_f32(zs + i);
+            float32x4_t neg_radius = vnegq_f32(vld1q_f32(radii + i));
+            uint32x4_t inside = vdupq_n_u32(0xffffffff);
+            for (int p=0; p<6; p++)
+            {
+                float32x4_t d = vdupq_n_f32(planes[p].w());
+                d = vmlaq_n_f32(d, x, planes[p].x());
+                d = vmlaq_n_f32(d, y, planes[p].y());
+                d = vmlaq_n_f32(d, z, planes[p].z());
+                inside = vandq_u32(inside, vcgeq_f32(d, neg_radius));
+            }
+            uint32_t lanes[4];
+            vst1q_u32(lanes, inside);
+            for (int k=0; k<4; k++)
+            {
+                visible[i + k] = lanes[k] != 0 ? 1 : 0;
+            }
+        }
+#endif
+        for (; i<count; i++)
+        {
+            uint8_t inside = 1;
+            for (int p=0; p<6; p++)
+            {
+                float d = planes[p].x() * xs[i] + planes[p].y() * ys[i] + planes[p].z() * zs[i] + planes[p].w();
+                if (d < -radii[i])
+                {
+                    inside = 0;
+                    break;
+                }
+            }
+            visible[i] = inside;
+        }
+    }
+
+    // ---- mesh bvh ----
+    static float GetSurfaceArea(const Vector3f& bounds_min, const Vector3f& bounds_max)
+    {
+        Vector3f d = bounds_max - bounds_min;
+        return 2.0f * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+
+    int MeshBVH::AllocateNode()
+    {
+        if (m_free_list < 0)
+        {
+            m_nodes.emplace_back();
+            return (int)m_nodes.size() - 1;
+        }
+        int node = m_free_list;
+        m_free_list = m_nodes[node].parent;
+        m_nodes[node] = Node();
+        return node;
+    }
+
+    void MeshBVH::FreeNode(int node)
+    {
+        m_nodes[node].parent = m_free_list;
+        m_nodes[node].height = -1;
+        m_nodes[node].mesh = nullptr;
+        m_free_list = node;
+    }
+
+    int MeshBVH::Insert(Mesh* mesh, const Vector3f& bounds_min, const Vector3f& bounds_max)
+    {
+        // 每边加宽10%, 小幅移动时不用重插
+        Vector3f margin = (bounds_max - bounds_min) * 0.1f;
+        int leaf = AllocateNode();
+        m_nodes[leaf].bounds_min = bounds_min - margin;
+        m_nodes[leaf].bounds_max = bounds_max + margin;
+        m_nodes[leaf].mesh = mesh;
+        InsertLeaf(leaf);
+        return leaf;
+    }
+
+    void MeshBVH::Remove(int leaf)
+    {
+        RemoveLeaf(leaf);
+        FreeNode(leaf);
+    }
+
+    bool MeshBVH::Move(int leaf, const Vector3f& bounds_min, const Vector3f& bounds_max)
+    {
+        const Node& node = m_nodes[leaf];
+        if ((node.bounds_min.array() <= bounds_min.array()).all() && (bounds_max.array() <= node.bounds_max.array()).all())
+            return false;
+        Mesh* mesh = node.mesh;
+        RemoveLeaf(leaf);
+        Vector3f margin = (bounds_max - bounds_min) * 0.1f;
+        m_nodes[leaf].bounds_min = bounds_min - margin;
+        m_nodes[leaf].bounds_max = bounds_max + margin;
+        m_nodes[leaf].mesh = mesh;
+        InsertLeaf(leaf);
+        return true;
+    }
+
+    void MeshBVH::Clear()
+    {
+        m_nodes.clear();
+        m_root = -1;
+        m_free_list = -1;
+    }
+
+    int MeshBVH::GetHeight() const
+    {
+        return m_root < 0 ? 0 : m_nodes[m_root].height;
+    }
+
+    void MeshBVH::InsertLeaf(int leaf)
+    {
+        m_nodes[leaf].parent = -1;
+        m_nodes[leaf].child[0] = -1;
+        m_nodes[leaf].child[1] = -1;
+        m_nodes[leaf].height = 0;
+        if (m_root < 0)
+        {
+            m_root = leaf;
+            return;
+        }
+
+        // 沿代价小的一侧往下找兄弟节点: 代价 = 新父节点的表面积 + 祖先因此增加的表面积
+        Vector3f leaf_min = m_nodes[leaf].bounds_min;
+        Vector3f leaf_max = m_nodes[leaf].bounds_max;
+        int index = m_root;
+        while (!m_nodes[index].IsLeaf())
+        {
+            const Node& node = m_nodes[index];
+            float area = GetSurfaceArea(node.bounds_min, node.bounds_max);
+            float combined_area = GetSurfaceArea(node.bounds_min.cwiseMin(leaf_min), node.bounds_max.cwiseMax(leaf_max));
+            float cost = 2.0f * combined_area;
+            float inheritance_cost = 2.0f * (combined_area - area);
+
+            float child_costs[2];
+            for (int i=0; i<2; i++)
+            {
+                const Node& child = m_nodes[node.child[i]];
+                float child_area = GetSurfaceArea(child.bounds_min.cwiseMin(leaf_min), child.bounds_max.cwiseMax(leaf_max));
+                if (!child.IsLeaf())
+                {
+                    child_area -= GetSurfaceArea(child.bounds_min, child.bounds_max);
+                }
+                child_costs[i] = child_area + inheritance_cost;
+            }
+            if (cost < child_costs[0] && cost < child_costs[1])
+                break;
+            index = child_costs[0] < child_costs[1] ? node.child[0] : node.child[1];
+        }
+
+        int sibling = index;
+        int old_parent = m_nodes[sibling].parent;
+        int new_parent = AllocateNode();
+        Node& parent = m_nodes[new_parent];
+        parent.parent = old_parent;
+        parent.bounds_min = m_nodes[sibling].bounds_min.cwiseMin(leaf_min);
+        parent.bounds_max = m_nodes[sibling].bounds_max.cwiseMax(leaf_max);
+        parent.height = m_nodes[sibling].height + 1;
+        parent.child[0] = sibling;
+        parent.child[1] = leaf;
+        if (old_parent >= 0)
+        {
+            Node& grand = m_nodes[old_parent];
+            grand.child[grand.child[0] == sibling ? 0 : 1] = new_parent;
+        }
+        else
+        {
+            m_root = new_parent;
+        }
+        m_nodes[sibling].parent = new_parent;
+        m_nodes[leaf].parent = new_parent;
+
+        Refit(m_nodes[leaf].parent);
+    }
+
+    void MeshBVH::RemoveLeaf(int leaf)
+    {
+        if (leaf == m_root)
+        {
+            m_root = -1;
+            return;
+        }
+        int parent = m_nodes[leaf].parent;
+        int grand = m_nodes[parent].parent;
+        int sibling = m_nodes[parent].child[0] == leaf ? m_nodes[parent].child[1] : m_nodes[parent].child[0];
+        if (grand >= 0)
+        {
+            Node& grand_node = m_nodes[grand];
+            grand_node.child[grand_node.child[0] == parent ? 0 : 1] = sibling;
+            m_nodes[sibling].parent = grand;
+            FreeNode(parent);
+            Refit(grand);
+        }
+        else
+        {
+            m_root = sibling;
+            m_nodes[sibling].parent = -1;
+            FreeNode(parent);
+        }
+    }
+
+    void MeshBVH::Refit(int index)
+    {
+        while (index >= 0)
+        {
+            index = Balance(index);
+            Node& node = m_nodes[index];
+            const Node& child0 = m_nodes[node.child[0]];
+            const Node& child1 = m_nodes[node.child[1]];
+            node.height = 1 + std::max(child0.height, child1.height);
+            node.bounds_min = child0.bounds_min.cwiseMin(child1.bounds_min);
+            node.bounds_max = child0.bounds_max.cwiseMax(child1.bounds_max);
+            index = node.parent;
+        }
+    }
+
+    // a的两个子树高度差超过1时, 把高的子节点旋转上来. 返回旋转后该位置的节点
+    int MeshBVH::Balance(int index_a)
+    {
+        Node& a = m_nodes[index_a];
+        if (a.IsLeaf() || a.height < 2)
+            return index_a;
+
+        int balance = m_nodes[a.child[1]].height - m_nodes[a.child[0]].height;
+        if (balance >= -1 && balance <= 1)
+            return index_a;
+
+        // up: 要旋转上来的高子节点, keep: a保留的另一个子节点
+        int side = balance > 1 ? 1 : 0;
+        int index_up = a.child[side];
+        int index_keep = a.child[1 - side];
+        Node& up = m_nodes[index_up];
+        // up的两个子节点中高的留在up下, 矮的交给a
+        int index_tall = up.child[0];
+        int index_short = up.child[1];
+        if (m_nodes[index_tall].height < m_nodes[index_short].height)
+        {
+            std::swap(index_tall, index_short);
+        }
+
+        up.child[0] = index_a;
+        up.child[1] = index_tall;
+        up.parent = a.parent;
+        a.parent = index_up;
+        if (up.parent >= 0)
+        {
+            Node& parent = m_nodes[up.parent];
+            parent.child[parent.child[0] == index_a ? 0 : 1] = index_up;
+        }
+        else
+        {
+            m_root = index_up;
+        }
+
+        a.child[side] = index_short;
+        m_nodes[index_short].parent = index_a;
+        const Node& keep = m_nodes[index_keep];
+        const Node& shorter = m_nodes[index_short];
+        const Node& taller = m_nodes[index_tall];
+        a.bounds_min = keep.bounds_min.cwiseMin(shorter.bounds_min);
+        a.bounds_max = keep.bounds_max.cwiseMax(shorter.bounds_max);
+        a.height = 1 + std::max(keep.height, shorter.height);
+        up.bounds_min = a.bounds_min.cwiseMin(taller.bounds_min);
+        up.bounds_max = a.bounds_max.cwiseMax(taller.bounds_max);
+        up.height = 1 + std::max(a.height, taller.height);
+        return index_up;
+    }
+
+    void MeshBVH::CollectSubtree(int index, std::vector<Mesh*>* out_meshes)
+    {
+        const Node& node = m_nodes[index];
+        if (node.IsLeaf())
+        {
+            out_meshes->push_back(node.mesh);
+            return;
+        }
+        CollectSubtree(node.child[0], out_meshes);
+        CollectSubtree(node.child[1], out_meshes);
+    }
+
+    int MeshBVH::QueryFrustum(const Vector4f planes[6], std::vector<Mesh*>* out_meshes)
+    {
+        if (m_root < 0)
+            return 0;
+        int visited = 0;
+        m_stack.clear();
+        m_stack.emplace_back(m_root, 0x3F);
+        while (!m_stack.empty())
+        {
+            int index = m_stack.back().first;
+            int mask = m_stack.back().second;
+            m_stack.pop_back();
+            visited++;
+
+            const Node& node = m_nodes[index];
+            Vector3f center = (node.bounds_min + node.bounds_max) * 0.5f;
+            Vector3f extent = (node.bounds_max - node.bounds_min) * 0.5f;
+            bool outside = false;
+            for (int p=0; p<6; p++)
+            {
+                if ((mask & (1 << p)) == 0)
+                    continue;
+                float d = planes[p].head<3>().dot(center) + planes[p].w();
+                float r = planes[p].head<3>().cwiseAbs().dot(extent);
+                if (d < -r)
+                {
+                    outside = true;
+                    break;
+                }
+                // 整个在这个面内侧, 子节点不用再测
+                if (d >= r)
+                {
+                    mask &= ~(1 << p);
+                }
+            }
+            if (outside)
+                continue;
+            if (mask == 0)
+            {
+                CollectSubtree(index, out_meshes);
+            }
+            else if (node.IsLeaf())
+            {
+                out_meshes->push_back(node.mesh);
+            }
+            else
+            {
+                m_stack.emplace_back(node.child[0], mask);
+                m_stack.emplace_back(node.child[1], mask);
+            }
+        }
+        return visited;
+    }
+
+    // ---- occlusion culling ----
+    static const int OCCLUSION_TILE_SIZE = 8;
+
+    // 遮挡光栅化的常驻线程. Run时调用线程做第0份, 其余分给工作线程, 全部做完才返回
+    class OcclusionWorkers
+    {
+    public:
+        OcclusionWorkers(int thread_count)
+        {
+            for (int i=0; i<thread_count; i++)
+            {
+                m_threads.emplace_back([this, i]() { WorkerLoop(i + 1); });
+            }
+        }
+
+        ~OcclusionWorkers()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopped = true;
+            }
+            m_start.notify_all();
+            for (auto& thread : m_threads)
+            {
+                thread.join();
+            }
+        }
+
+        int GetThreadCount() const
+        {
+            return (int)m_threads.size();
+        }
+
+        // job(i), i在[0, count)内各调用一次. count不超过GetThreadCount() + 1
+        void Run(int count, const std::function<void(int)>& job)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_job = &job;
+                m_count = count;
+                m_pending = count - 1;
+                m_generation++;
+            }
+            m_start.notify_all();
+            job(0);
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_done.wait(lock, [this]() { return m_pending == 0; });
+            m_job = nullptr;
+        }
+
+    private:
+        void WorkerLoop(int index)
+        {
+            uint64_t generation = 0;
+            while (true)
+            {
+                const std::function<void(int)>* job = nullptr;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_start.wait(lock, [this, generation]() { return m_stopped || m_generation != generation; });
+                    if (m_stopped)
+                        return;
+                    generation = m_generation;
+                    if (index >= m_count)
+                        continue;
+                    job = m_job;
+                }
+                (*job)(index);
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_pending--;
+                }
+                m_done.notify_one();
+            }
+        }
+
+    private:
+        std::vector<std::thread> m_threads;
+        std::mutex m_mutex;
+        std::condition_variable m_start;
+        std::condition_variable m_done;
+        const std::function<void(int)>* m_job = nullptr;
+        int m_count = 0;
+        int m_pending = 0;
+        uint64_t m_generation = 0;
+        bool m_stopped = false;
+    };
+
+    OcclusionBuffer::~OcclusionBuffer()
+    {
+        delete m_workers;
+    }
+
+    void OcclusionBuffer::Resize(int width, int height)
+    {
+        width = (std::max(width, OCCLUSION_TILE_SIZE) + OCCLUSION_TILE_SIZE - 1) & ~(OCCLUSION_TILE_SIZE - 1);
+        height = (std::max(height, OCCLUSION_TILE_SIZE) + OCCLUSION_TILE_SIZE - 1) & ~(OCCLUSION_TILE_SIZE - 1);
+        if (width == m_width && height == m_height)
+            return;
+        m_width = width;
+        m_height = height;
+        m_tiles_x = width / OCCLUSION_TILE_SIZE;
+        m_tiles_y = height / OCCLUSION_TILE_SIZE;
+        m_depth.assign((size_t)width * height, 1.0f);
+        m_coverage.assign((size_t)width * height, 1.0f);
+        m_tile_max.assign((size_t)m_tiles_x * m_tiles_y, 1.0f);
+    }
+
+    void OcclusionBuffer::Clear()
+    {
+        std::fill(m_depth.begin(), m_depth.end(), 1.0f);
+        std::fill(m_coverage.begin(), m_coverage.end(), 1.0f);
+        std::fill(m_tile_max.begin(), m_tile_max.end(), 1.0f);
+        m_triangles.clear();
+    }
+
+    void OcclusionBuffer::AddOccluder(const Matrix4f& wvp, const std::vector<Vector3f>& positions, const std::vector<uint32_t>& indices)
+    {
+        // 超过这个范围(NDC)的顶点精度不够, 整个三角形不画
+        const float GUARD_BAND = 64.0f;
+        const float NEAR_W = 1e-5f;
+        for (size_t i=0; i+2<indices.size(); i+=3)
+        {
+            ScreenTriangle tri;
+            bool valid = true;
+            for (int k=0; k<3; k++)
+            {
+                Vector4f clip = wvp * positions[indices[i + k]].homogeneous();
+                if (clip.w() <= NEAR_W)
+                {
+                    valid = false;
+                    break;
+                }
+                float inv_w = 1.0f / clip.w();
+                float nx = clip.x() * inv_w;
+                float ny = clip.y() * inv_w;
+                float nz = clip.z() * inv_w;
+                if (std::abs(nx) > GUARD_BAND || std::abs(ny) > GUARD_BAND || nz < -1.0f || nz > 1.0f)
+                {
+                    valid = false;
+                    break;
+                }
+                tri.x[k] = (nx * 0.5f + 0.5f) * m_width;
+                tri.y[k] = (ny * 0.5f + 0.5f) * m_height;
+                tri.z[k] = nz * 0.5f + 0.5f;
+            }
+            if (!valid)
+                continue;
+            tri.min_y = std::min(tri.y[0], std::min(tri.y[1], tri.y[2]));
+            tri.max_y = std::max(tri.y[0], std::max(tri.y[1], tri.y[2]));
+            if (tri.max_y < 0.0f || tri.min_y > m_height)
+                continue;
+            float min_x = std::min(tri.x[0], std::min(tri.x[1], tri.x[2]));
+            float max_x = std::max(tri.x[0], std::max(tri.x[1], tri.x[2]));
+            if (max_x < 0.0f || min_x > m_width)
+                continue;
+            m_triangles.push_back(tri);
+        }
+    }
+
+    void OcclusionBuffer::Rasterize(int thread_count)
+    {
+        // 三角形太少时开线程不划算
+        int band_count = std::max(1, std::min(thread_count, m_tiles_y));
+        if (m_triangles.size() < 256)
+        {
+            band_count = 1;
+        }
+        if (band_count == 1)
+        {
+            RasterizeBand(0, m_tiles_y * OCCLUSION_TILE_SIZE);
+            ErodeBand(0, m_tiles_y * OCCLUSION_TILE_SIZE);
+            return;
+        }
+
+        if (m_workers == nullptr || m_workers->GetThreadCount() < band_count - 1)
+        {
+            delete m_workers;
+            m_workers = new OcclusionWorkers(band_count - 1);
+        }
+        m_workers->Run(band_count, [this, band_count](int band) {
+            int y_begin = m_tiles_y * band / band_count * OCCLUSION_TILE_SIZE;
+            int y_end = m_tiles_y * (band + 1) / band_count * OCCLUSION_TILE_SIZE;
+            RasterizeBand(y_begin, y_end);
+        });
+        // 腐蚀要读相邻行带的边界行, 等所有行带光栅化完再做
+        m_workers->Run(band_count, [this, band_count](int band) {
+            int y_begin = m_tiles_y * band / band_count * OCCLUSION_TILE_SIZE;
+            int y_end = m_tiles_y * (band + 1) / band_count * OCCLUSION_TILE_SIZE;
+            ErodeBand(y_begin, y_end);
+        });
+    }
+
+    void OcclusionBuffer::RasterizeBand(int y_begin, int y_end)
+    {
+        for (const ScreenTriangle& tri : m_triangles)
+        {
+            if (tri.max_y < y_begin || tri.min_y > y_end)
+                continue;
+            // 按像素中心采样, 统一成逆时针(面积为正), 正反面都画
+            float x0 = tri.x[0], y0 = tri.y[0];
+            float x1 = tri.x[1], y1 = tri.y[1];
+            float x2 = tri.x[2], y2 = tri.y[2];
+            float z0 = tri.z[0], z1 = tri.z[1], z2 = tri.z[2];
+            float area = (x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0);
+            if (area == 0.0f)
+                continue;
+            if (area < 0.0f)
+            {
+                std::swap(x1, x2);
+                std::swap(y1, y2);
+                std::swap(z1, z2);
+                area = -area;
+            }
+            // 像素中心落在包围矩形内的范围. 起点对齐到4方便SIMD, 多出的像素由边函数排除
+            int px_begin = std::max(0, (int)std::ceil(std::min(x0, std::min(x1, x2)) - 0.5f)) & ~3;
+            int px_end = std::min(m_width, (int)std::floor(std::max(x0, std::max(x1, x2)) - 0.5f) + 1);
+            int py_begin = std::max(y_begin, (int)std::ceil(tri.min_y - 0.5f));
+            int py_end = std::min(y_end, (int)std::floor(tri.max_y - 0.5f) + 1);
+            if (px_begin >= px_end || py_begin >= py_end)
+                continue;
+
+            // 边函数 e(x, y) = a * x + b * y + c, 三个都>=0时在三角形内. 深度 = sum(e_i * z_i) / area
+            float a0 = y1 - y2, b0 = x2 - x1, c0 = x1 * y2 - x2 * y1;
+            float a1 = y2 - y0, b1 = x0 - x2, c1 = x2 * y0 - x0 * y2;
+            float a2 = y0 - y1, b2 = x1 - x0, c2 = x0 * y1 - x1 * y0;
+            float inv_area = 1.0f / area;
+            float zs0 = z0 * inv_area, zs1 = z1 * inv_area, zs2 = z2 * inv_area;
+
+            for (int py=py_begin; py<py_end; py++)
+            {
+                float cy = py + 0.5f;
+                float* row = m_coverage.data() + (size_t)py * m_width;
+                float cx = px_begin + 0.5f;
+                float e0 = a0 * cx + b0 * cy + c0;
+                float e1 = a1 * cx + b1 * cy + c1;
+                float e2 = a2 * cx + b2 * cy + c2;
+                int px = px_begin;
+#if defined(R3D_SIMD_SSE2)
+                // 每次4个像素, px_begin对齐到4, 宽度是8的倍数, 不会越界
+                const __m128 lane = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+                __m128 ve0 = _mm_add_ps(_mm_set1_ps(e0), _mm_mul_ps(lane, _mm_set1_ps(a0)));
+                __m128 ve1 = _mm_add_ps(_mm_set1_ps(e1), _mm_mul_ps(lane, _mm_set1_ps(a1)));
+                __m128 ve2 = _mm_add_ps(_mm_set1_ps(e2), _mm_mul_ps(lane, _mm_set1_ps(a2)));
+                const __m128 step0 = _mm_set1_ps(a0 * 4.0f);
+                const __m128 step1 = _mm_set1_ps(a1 * 4.0f);
+                const __m128 step2 = _mm_set1_ps(a2 * 4.0f);
+                const __m128 vz0 = _mm_set1_ps(zs0);
+                const __m128 vz1 = _mm_set1_ps(zs1);
+                const __m128 vz2 = _mm_set1_ps(zs2);
+                const __m128 zero = _mm_setzero_ps();
+                for (; px<px_end; px+=4)
+                {
+                    __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(ve0, zero), _mm_cmpge_ps(ve1, zero)), _mm_cmpge_ps(ve2, zero));
+                    if (_mm_movemask_ps(inside) != 0)
+                    {
+                        __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ve0, vz0), _mm_mul_ps(ve1, vz1)), _mm_mul_ps(ve2, vz2));
+                        __m128 depth = _mm_loadu_ps(row + px);
+                        __m128 nearer = _mm_min_ps(depth, z);
+                        _mm_storeu_ps(row + px, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, depth)));
+                    }
+                    ve0 = _mm_add_ps(ve0, step0);
+                    ve1 = _mm_add_ps(ve1, step1);
+                    ve2 = _mm_add_ps(ve2, step2);
+                }
+#elif defined(R3D_SIMD_NEON)
+                const float lanes[4] = { 0.0f, 1.0f, 2.0f, 3.0f };
+                const float32x4_t lane = vld1q_f32(lanes);
+                float32x4_t ve0 = vmlaq_n_f32(vdupq_n_f32(e0), lane, a0);
+                float32x4_t ve1 = vmlaq_n_f32(vdupq_n_f32(e1), lane, a1);
+                float32x4_t ve2 = vmlaq_n_f32(vdupq_n_f32(e2), lane, a2);
+                const float32x4_t step0 = vdupq_n_f32(a0 * 4.0f);
+                const float32x4_t step1 = vdupq_n_f32(a1 * 4.0f);
+                const float32x4_t step2 = vdupq_n_f32(a2 * 4.0f);
+                const float32x4_t zero = vdupq_n_f32(0.0f);
+                for (; px<px_end; px+=4)
+                {
+                    uint32x4_t inside = vandq_u32(vandq_u32(vcgeq_f32(ve0, zero), vcgeq_f32(ve1, zero)), vcgeq_f32(ve2, zero));
+                    float32x4_t z = vmulq_n_f32(ve0, zs0);
+                    z = vmlaq_n_f32(z, ve1, zs1);
+                    z = vmlaq_n_f32(z, ve2, zs2);
+                    float32x4_t depth = vld1q_f32(row + px);
+                    vst1q_f32(row + px, vbslq_f32(inside, vminq_f32(depth, z), depth));
+                    ve0 = vaddq_f32(ve0, step0);
+                    ve1 = vaddq_f32(ve1, step1);
+                    ve2 = vaddq_f32(ve2, step2);
+                }
+#endif
+                for (; px<px_end; px++)
+                {
+                    float f = (float)(px - px_begin);
+                    float w0 = e0 + a0 * f;
+                    float w1 = e1 + a1 * f;
+                    float w2 = e2 + a2 * f;
+                    if (w0 >= 0.0f && w1 >= 0.0f && w2 >= 0.0f)
+                    {
+                        row[px] = std::min(row[px], w0 * zs0 + w1 * zs1 + w2 * zs2);
+                    }
+                }
+            }
+        }
+    }
+
+    void OcclusionBuffer::ErodeBand(int y_begin, int y_end)
+    {
+        // 3x3取最远: 只有自己和8个邻居的中心都被盖住时才算覆盖, 深度也取其中最远的.
+        // 9个中心围成的方形包含整个像素, 对单个三角形这是严格保守的. 边界像素缺邻居, 不算覆盖
+        for (int y=y_begin; y<y_end; y++)
+        {
+            float* out = m_depth.data() + (size_t)y * m_width;
+            if (y == 0 || y == m_height - 1)
+            {
+                std::fill(out, out + m_width, 1.0f);
+                continue;
+            }
+            const float* rows[3] = {
+                m_coverage.data() + (size_t)(y - 1) * m_width,
+                m_coverage.data() + (size_t)y * m_width,
+                m_coverage.data() + (size_t)(y + 1) * m_width,
+            };
+            out[0] = 1.0f;
+            out[m_width - 1] = 1.0f;
+            for (int x=1; x<m_width-1; x++)
+            {
+                float depth = 0.0f;
+                for (const float* row : rows)
+                {
+                    depth = std::max(depth, std::max(row[x - 1], std::max(row[x], row[x + 1])));
+                }
+                out[x] = depth;
+            }
+        }
+
+        // 更新本行带的HiZ
+        for (int ty=y_begin/OCCLUSION_TILE_SIZE; ty<y_end/OCCLUSION_TILE_SIZE; ty++)
+        {
+            for (int tx=0; tx<m_tiles_x; tx++)
+            {
+                float tile_max = 0.0f;
+                for (int y=0; y<OCCLUSION_TILE_SIZE; y++)
+                {
+                    const float* row = m_depth.data() + (size_t)(ty * OCCLUSION_TILE_SIZE + y) * m_width + tx * OCCLUSION_TILE_SIZE;
+                    for (int x=0; x<OCCLUSION_TILE_SIZE; x++)
+                    {
+                        tile_max = std::max(tile_max, row[x]);
+                    }
+                }
+                m_tile_max[ty * m_tiles_x + tx] = tile_max;
+            }
+        }
     }
-    
-    void Camera::MakePerspective(float fov, float ratio, float near, float far)
+
+    bool OcclusionBuffer::IsOccluded(const Matrix4f& wvp, const Vector3f& bounds_min, const Vector3f& bounds_max) const
     {
-        float f_n = 1.0f / (far - near);
-        float theta = fov * 3.141592657 / 360.0f;
-        float divisor = tan(theta);
-        float factor = 1.0f / divisor;
-        
-        if (m_flip_y)
+        if (m_width == 0)
+            return false;
+        // AABB的8个角投影到屏幕, 取覆盖矩形和最近深度
+        float min_x = FLT_MAX, min_y = FLT_MAX, max_x = -FLT_MAX, max_y = -FLT_MAX;
+        float min_z = FLT_MAX;
+        for (int i=0; i<8; i++)
         {
-            factor = -factor;
+            Vector3f corner((i & 1) ? bounds_max.x() : bounds_min.x(), (i & 2) ? bounds_max.y() : bounds_min.y(), (i & 4) ? bounds_max.z() : bounds_min.z());
+            Vector4f clip = wvp * corner.homogeneous();
+            if (clip.w() <= 1e-5f)
+                return false;
+            float inv_w = 1.0f / clip.w();
+            float sx = (clip.x() * inv_w * 0.5f + 0.5f) * m_width;
+            float sy = (clip.y() * inv_w * 0.5f + 0.5f) * m_height;
+            min_x = std::min(min_x, sx);
+            max_x = std::max(max_x, sx);
+            min_y = std::min(min_y, sy);
+            max_y = std::max(max_y, sy);
+            min_z = std::min(min_z, clip.z() * inv_w * 0.5f + 0.5f);
         }
-        
-//        memset(&m_projection_matrix, 0, sizeof(m_projection_matrix));
-        m_projection_matrix.setZero();
-        float* dst = (float*)&m_projection_matrix;
-        dst[0] = (1.0f / ratio) * factor;
-        dst[5] = factor;
-        dst[10] = (-(far + near)) * f_n;
-        dst[11] = -1.0f;
-        dst[14] = -2.0f * far * near * f_n;
-        
-        m_view_projection_matrix_dirty = true;
+        // 覆盖矩形向外取整, 包含所有可能被它覆盖的像素
+        int x_begin = std::max(0, (int)std::floor(min_x));
+        int x_end = std::min(m_width, (int)std::ceil(max_x) + 1);
+        int y_begin = std::max(0, (int)std::floor(min_y));
+        int y_end = std::min(m_height, (int)std::ceil(max_y) + 1);
+        if (x_begin >= x_end || y_begin >= y_end)
+            return false;
+
+        for (int ty=y_begin/OCCLUSION_TILE_SIZE; ty<=(y_end-1)/OCCLUSION_TILE_SIZE; ty++)
+        {
+            for (int tx=x_begin/OCCLUSION_TILE_SIZE; tx<=(x_end-1)/OCCLUSION_TILE_SIZE; tx++)
+            {
+                // 整块都比它近
+                if (min_z > m_tile_max[ty * m_tiles_x + tx])
+                    continue;
+                int y0 = std::max(y_begin, ty * OCCLUSION_TILE_SIZE);
+                int y1 = std::min(y_end, (ty + 1) * OCCLUSION_TILE_SIZE);
+                int x0 = std::max(x_begin, tx * OCCLUSION_TILE_SIZE);
+                int x1 = std::min(x_end, (tx + 1) * OCCLUSION_TILE_SIZE);
+                for (int y=y0; y<y1; y++)
+                {
+                    const float* row = m_depth.data() + (size_t)y * m_width;
+                    for (int x=x0; x<x1; x++)
+                    {
+                        if (row[x] >= min_z)
+                            return false;
+                    }
+                }
+            }
+        }
+        return true;
     }
 
-    void Camera::MakePNPProjection(float width, float height, float fx, float fy, float near, float far)
+    int OcclusionBuffer::GetWidth() const
     {
-        float factor = m_flip_y ? -1.0f : 1.0f;
-//        memset(&m_projection_matrix, 0, sizeof(m_projection_matrix));
-        m_projection_matrix.setZero();
-        float* dst = (float*)&m_projection_matrix;
-#ifdef __ANDROID__
-        dst[0] = 2.0f *  fx / width;
-#else
-        dst[0] = 2.0f *  fx / width * factor;
-#endif
-        dst[5] = 2.0f * fy / height * factor;
-        dst[10] = -(far + near) / (far - near);
-        dst[11] = -1.0f;
-        dst[14] = -2.0f * far * near / (far - near);
-        
-        m_view_projection_matrix_dirty = true;
+        return m_width;
     }
 
-    
-    Renderer::Renderer(int screen_width, int screen_height, std::string resource_dir)
-    : m_screen_width(screen_width), m_screen_height(screen_height), m_resource_dir(resource_dir)
+    int OcclusionBuffer::GetHeight() const
     {
-        // 创建FBO
-        glGenFramebuffers(1, &m_standalone_fbo);
-        glBindFramebuffer(GL_FRAMEBUFFER, m_standalone_fbo);
-        
-        glGenTextures(1, &m_standalone_color_texture);
-        glBindTexture(GL_TEXTURE_2D, m_standalone_color_texture);
-        
-        uint* colors = new uint[screen_width * screen_height];
-        memset(colors, 0, sizeof(uint) * screen_width * screen_height);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, screen_width, screen_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, colors);
-        delete[] colors;
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_standalone_color_texture, 0);
-        
-        glGenBuffers(1, &m_standalone_depth_buffer);
-        glBindRenderbuffer(GL_RENDERBUFFER, m_standalone_depth_buffer);
-        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16, screen_width, screen_height);
-        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_standalone_depth_buffer);
-        
-        if (m_use_msaa)
+        return m_height;
+    }
+
+    const float* OcclusionBuffer::GetDepth() const
+    {
+        return m_depth.data();
+    }
+
+    int OcclusionBuffer::GetTriangleCount() const
+    {
+        return (int)m_triangles.size();
+    }
+
+    void Renderer::SetOcclusionCulling(bool enabled, int width, int height, int thread_count)
+    {
+        m_occlusion_culling = enabled;
+        m_occlusion_width = width;
+        m_occlusion_height = height;
+        m_occlusion_thread_count = thread_count;
+    }
+
+    GLuint Renderer::GetOcclusionDebugTexture()
+    {
+        int width = m_occlusion_buffer.GetWidth();
+        int height = m_occlusion_buffer.GetHeight();
+        if (width == 0)
+            return 0;
+        const float* depth = m_occlusion_buffer.GetDepth();
+        m_occlusion_debug_pixels.resize((size_t)width * height * 4);
+        for (int i=0; i<width*height; i++)
         {
-            glGenFramebuffers(1, &m_msaa_fbo);
-            glBindFramebuffer(GL_FRAMEBUFFER, m_msaa_fbo);
-            
-            glGenBuffers(1, &m_msaa_color_buffer);
-            glBindRenderbuffer(GL_RENDERBUFFER, m_msaa_color_buffer);
-            glRenderbufferStorageMultisample(GL_RENDERBUFFER, m_msaa_samples, GL_RGBA8, screen_width, screen_height);
-            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_msaa_color_buffer);
-            
-            glGenBuffers(1, &m_msaa_depth_buffer);
-            glBindRenderbuffer(GL_RENDERBUFFER, m_msaa_depth_buffer);
-            glRenderbufferStorageMultisample(GL_RENDERBUFFER, m_msaa_samples, GL_DEPTH_COMPONENT16, screen_width, screen_height);
-            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_msaa_depth_buffer);
+            // 透视下深度集中在1附近, 开方拉开层次
+            float d = 1.0f - depth[i];
+            uint8 v = (uint8)(std::sqrt(std::max(d, 0.0f)) * 255.0f + 0.5f);
+            m_occlusion_debug_pixels[i * 4 + 0] = v;
+            m_occlusion_debug_pixels[i * 4 + 1] = v;
+            m_occlusion_debug_pixels[i * 4 + 2] = v;
+            m_occlusion_debug_pixels[i * 4 + 3] = 255;
         }
-        
-        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-        if (status != GL_FRAMEBUFFER_COMPLETE) {
-          VLOG(2) << "error: standalone framebuffer is not completed: " << status;
+        if (m_occlusion_debug_texture == 0)
+        {
+            glGenTextures(1, &m_occlusion_debug_texture);
         }
-        
-        // 创建相机
-        m_camera = new Camera(this);
+        glBindTexture(GL_TEXTURE_2D, m_occlusion_debug_texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, m_occlusion_debug_pixels.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        return m_occlusion_debug_texture;
     }
-    
-    Renderer::~Renderer()
+
+    void Renderer::UpdateMeshBounds(Mesh* mesh)
     {
-        for (auto iter=m_program_cache.begin(); iter!=m_program_cache.end(); ++iter)
+        Vector3f bounds_min, bounds_max;
+        if (!mesh->ComputeWorldBounds(&bounds_min, &bounds_max))
         {
-            delete iter->second;
+            if (mesh->m_bvh_leaf >= 0)
+            {
+                m_mesh_bvh.Remove(mesh->m_bvh_leaf);
+                mesh->m_bvh_leaf = -1;
+                m_unbounded_meshes.push_back(mesh);
+            }
+            else if (std::find(m_unbounded_meshes.begin(), m_unbounded_meshes.end(), mesh) == m_unbounded_meshes.end())
+            {
+                m_unbounded_meshes.push_back(mesh);
+            }
+            return;
         }
-        m_program_cache.clear();
-        
-        for (auto iter=m_texture_cache.begin(); iter!=m_texture_cache.end(); ++iter)
+        if (mesh->m_bvh_leaf >= 0)
         {
-            delete iter->second.texture;
+            m_mesh_bvh.Move(mesh->m_bvh_leaf, bounds_min, bounds_max);
+            return;
         }
-        m_texture_cache.clear();
-        
-        if (m_camera != nullptr)
+        auto iter = std::find(m_unbounded_meshes.begin(), m_unbounded_meshes.end(), mesh);
+        if (iter != m_unbounded_meshes.end())
         {
-            delete m_camera;
-            m_camera = nullptr;
+            m_unbounded_meshes.erase(iter);
         }
-        
-        // remove all render meshes
-        m_mesh_list.clear();
-        
-        // clear gl resources
-        if (m_standalone_fbo > 0)
+        mesh->m_bvh_leaf = m_mesh_bvh.Insert(mesh, bounds_min, bounds_max);
+    }
+
+    void Renderer::RemoveMeshBounds(Mesh* mesh)
+    {
+        if (mesh->m_bvh_leaf >= 0)
         {
-            glDeleteFramebuffers(1, &m_standalone_fbo);
+            m_mesh_bvh.Remove(mesh->m_bvh_leaf);
+            mesh->m_bvh_leaf = -1;
         }
-        
-        if (m_standalone_color_texture > 0)
+        else
         {
-            glDeleteTextures(1, &m_standalone_color_texture);
+            auto iter = std::find(m_unbounded_meshes.begin(), m_unbounded_meshes.end(), mesh);
+            if (iter != m_unbounded_meshes.end())
+            {
+                m_unbounded_meshes.erase(iter);
+            }
         }
-        
-        if (m_standalone_depth_buffer > 0)
+        if (mesh->m_bounds_dirty)
         {
-            glDeleteRenderbuffers(1, &m_standalone_depth_buffer);
+            m_dirty_meshes.erase(std::find(m_dirty_meshes.begin(), m_dirty_meshes.end(), mesh));
+            mesh->m_bounds_dirty = false;
         }
-        
-        if (m_use_msaa)
+    }
+
+    void Renderer::CullSubMeshes()
+    {
+        // 只更新变换过的mesh, 静止的mesh不碰
+        for (auto& mesh : m_dirty_meshes)
         {
-            if (m_msaa_fbo)
+            mesh->m_bounds_dirty = false;
+            UpdateMeshBounds(mesh);
+        }
+        m_dirty_meshes.clear();
+
+        Vector4f planes[6];
+        ExtractFrustumPlanes(m_frame_constants.view_projection, planes);
+        m_cull_stats = CullStats();
+        m_visible_meshes.clear();
+        if (m_frustum_culling)
+        {
+            m_cull_stats.bvh_nodes_visited = m_mesh_bvh.QueryFrustum(planes, &m_visible_meshes);
+            m_visible_meshes.insert(m_visible_meshes.end(), m_unbounded_meshes.begin(), m_unbounded_meshes.end());
+        }
+        else
+        {
+            m_visible_meshes.assign(m_mesh_list.begin(), m_mesh_list.end());
+        }
+        m_cull_stats.meshes_visible = (int)m_visible_meshes.size();
+
+        // 视锥内的遮挡物画到遮挡缓冲
+        bool occlusion = false;
+        if (m_occlusion_culling && m_frustum_culling)
+        {
+            for (auto& mesh : m_visible_meshes)
             {
-                glDeleteFramebuffers(1, &m_msaa_fbo);
+                if (!mesh->m_occluder)
+                    continue;
+                if (!occlusion)
+                {
+                    m_occlusion_buffer.Resize(m_occlusion_width, m_occlusion_height);
+                    m_occlusion_buffer.Clear();
+                    occlusion = true;
+                }
+                const Matrix4f& wvp = mesh->GetObjectConstants().wvp;
+                for (auto& submesh : mesh->m_submeshes)
+                {
+                    const SubMesh* source = submesh->m_prototype != nullptr ? submesh->m_prototype : submesh;
+                    m_occlusion_buffer.AddOccluder(wvp, source->m_occluder_positions, source->m_occluder_indices);
+                }
             }
-            
-            if (m_msaa_color_buffer)
+            if (occlusion)
             {
-                glDeleteRenderbuffers(1, &m_msaa_color_buffer);
+                int thread_count = m_occlusion_thread_count > 0 ? m_occlusion_thread_count : std::min(4, (int)std::thread::hardware_concurrency());
+                m_occlusion_buffer.Rasterize(thread_count);
+                m_cull_stats.occluder_triangles = m_occlusion_buffer.GetTriangleCount();
             }
-            
-            if (m_msaa_depth_buffer)
+        }
+
+        m_cull_candidates.clear();
+        m_cull_spheres.x.clear();
+        m_cull_spheres.y.clear();
+        m_cull_spheres.z.clear();
+        m_cull_spheres.radius.clear();
+        for (auto& mesh : m_visible_meshes)
+        {
+            const Matrix4f& world = mesh->GetObjectConstants().world;
+            // 非均匀缩放时半径按最大的轴缩放
+            float radius_scale = std::max(world.col(0).head<3>().norm(), std::max(world.col(1).head<3>().norm(), world.col(2).head<3>().norm()));
+            for (auto& submesh : mesh->m_submeshes)
             {
-                glDeleteRenderbuffers(1, &m_msaa_depth_buffer);
+                Material* material = submesh->GetMaterial();
+                if (material == nullptr || material->GetProgram() == nullptr)
+                    continue;
+                Vector3f center = (world * submesh->m_sphere_center.homogeneous()).head<3>();
+                // 动态mesh的顶点每帧在变, 包围体不可信, 总是可见
+                float radius = submesh->IsDymc() || !m_frustum_culling ? FLT_MAX : submesh->m_sphere_radius * radius_scale;
+                m_cull_candidates.push_back(submesh);
+                m_cull_spheres.x.push_back(center.x());
+                m_cull_spheres.y.push_back(center.y());
+                m_cull_spheres.z.push_back(center.z());
+                m_cull_spheres.radius.push_back(radius);
             }
         }
-        
-        if (m_background_program > 0)
+
+        int count = (int)m_cull_candidates.size();
+        int padded = (count + 3) & ~3;
+        m_cull_spheres.x.resize(padded, 0.0f);
+        m_cull_spheres.y.resize(padded, 0.0f);
+        m_cull_spheres.z.resize(padded, 0.0f);
+        m_cull_spheres.radius.resize(padded, 0.0f);
+        m_cull_visible.resize(padded);
+
+        CullSpheres(planes, m_cull_spheres.x.data(), m_cull_spheres.y.data(), m_cull_spheres.z.data(), m_cull_spheres.radius.data(), padded, m_cull_visible.data());
+
+        for (int i=0; i<count; i++)
         {
-            glDeleteProgram(m_background_program);
-            m_background_program = 0;
-            m_background_uniform_loc = -1;
+            if (m_cull_visible[i] == 0)
+                continue;
+            // 通过视锥测试的再测遮挡. 遮挡物自身和动态submesh不测
+            SubMesh* submesh = m_cull_candidates[i];
+            Mesh* mesh = submesh->GetMesh();
+            if (occlusion && !mesh->m_occluder && !submesh->IsDymc()
+                && m_occlusion_buffer.IsOccluded(mesh->GetObjectConstants().wvp, submesh->m_bounds_min, submesh->m_bounds_max))
+            {
+                m_cull_visible[i] = 0;
+                m_cull_stats.occluded++;
+                continue;
+            }
+            m_cull_stats.visible++;
         }
+        m_cull_stats.culled = m_submesh_count - m_cull_stats.visible;
     }
 
-    GLuint Renderer::GetStandaloneColorTextureId() const
+    void Renderer::SetFrustumCulling(bool enabled)
     {
-        return m_standalone_color_texture;
+        m_frustum_culling = enabled;
     }
 
-    void Renderer::BeginRenderNoClear() {
-        if (m_standalone_fbo > 0)
+    const CullStats& Renderer::GetCullStats() const
+    {
+        return m_cull_stats;
+    }
+
+    // ---- render queue ----
+    // 非负float的位模式与数值同序, 取高24位作为深度
+    static uint64_t QuantizeViewDepth(float depth)
+    {
+        depth = std::max(depth, 0.0f);
+        uint32_t bits;
+        memcpy(&bits, &depth, sizeof(bits));
+        return bits >> 7;
+    }
+
+    // 64位排序key:
+    //   不透明: [63]=0 | pass(1) | program(16) | 贴图组合(16) | 深度(24). pass 0是只写深度的遮罩, 总在最前;
+    //           同一pass内先按状态分组, 组内从前往后
+    //   半透明: [63]=1 | 反转深度(24) | program(16) | 贴图组合(16), 从后往前
+    static uint64_t MakeDrawKey(bool translucent, bool depth_only, GLuint program, uint16_t texture_set, float view_depth)
+    {
+        uint64_t depth = QuantizeViewDepth(view_depth) & 0xFFFFFF;
+        uint64_t state = ((uint64_t)(program & 0xFFFF) << 16) | texture_set;
+        if (translucent)
         {
-            if (m_use_msaa && m_msaa_fbo > 0)
+            return (1ULL << 63) | ((0xFFFFFF - depth) << 39) | (state << 7);
+        }
+        uint64_t pass = depth_only ? 0 : 1;
+        return (pass << 62) | (state << 30) | (depth << 6);
+    }
+
+    // LSD基数排序, 每次8位. 所有key在某个字节上都相同时跳过这一趟
+    static void RadixSortDrawItems(std::vector<DrawItem>* items, std::vector<DrawItem>* scratch)
+    {
+        scratch->resize(items->size());
+        for (int shift=0; shift<64; shift+=8)
+        {
+            size_t counts[256] = { 0 };
+            for (const DrawItem& item : *items)
             {
-                //glEnable(GL_MULTISAMPLE);
-                glBindFramebuffer(GL_FRAMEBUFFER, m_msaa_fbo);
-                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_msaa_color_buffer);
-                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_msaa_depth_buffer);
+                counts[(item.key >> shift) & 0xFF]++;
             }
-            else
+            if (counts[((*items)[0].key >> shift) & 0xFF] == items->size())
             {
-                glBindFramebuffer(GL_FRAMEBUFFER, m_standalone_fbo);
-                glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_standalone_color_texture, 0);
-                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_standalone_depth_buffer);
+                continue;
+            }
+            size_t offset = 0;
+            for (int i=0; i<256; i++)
+            {
+                size_t count = counts[i];
+                counts[i] = offset;
+                offset += count;
+            }
+            for (const DrawItem& item : *items)
+            {
+                (*scratch)[counts[(item.key >> shift) & 0xFF]++] = item;
             }
+            items->swap(*scratch);
         }
     }
-    void Renderer::BeginRender()
+
+    void Renderer::BuildRenderQueue()
     {
-        if (m_standalone_fbo > 0)
+        CullSubMeshes();
+
+        m_draw_items.clear();
+        for (size_t i=0; i<m_cull_candidates.size(); i++)
         {
-            if (m_use_msaa && m_msaa_fbo > 0)
-            {
-                //glEnable(GL_MULTISAMPLE);
-                glBindFramebuffer(GL_FRAMEBUFFER, m_msaa_fbo);
-                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_msaa_color_buffer);
-                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_msaa_depth_buffer);
-            }
-            else
+            if (m_cull_visible[i] == 0)
+                continue;
+            SubMesh* submesh = m_cull_candidates[i];
+            Material* material = submesh->GetMaterial();
+            // 相机看向-z, 用包围球中心的view空间深度
+            const Matrix4f& world_view = submesh->GetMesh()->GetObjectConstants().world_view;
+            float view_depth = -(world_view.row(2).head<3>().dot(submesh->m_sphere_center) + world_view(2, 3));
+            DrawItem item;
+            item.key = MakeDrawKey(material->IsTranslucent(), material->IsDepthOnly(), material->GetProgram()->GetGLProgramId(), material->GetTextureSetKey(), view_depth);
+            item.submesh = submesh;
+            m_draw_items.push_back(item);
+        }
+        if (!m_draw_items.empty())
+        {
+            RadixSortDrawItems(&m_draw_items, &m_draw_items_scratch);
+        }
+    }
+
+    void Renderer::BuildInstanceBatches()
+    {
+        m_instance_batches.clear();
+        m_instance_batch_lookup.clear();
+        m_draw_item_batches.assign(m_draw_items.size(), -1);
+        if (!m_instancing)
+            return;
+
+        // 只合并不透明的: 半透明要保持从后往前的顺序
+        for (size_t i=0; i<m_draw_items.size(); i++)
+        {
+            const DrawItem& item = m_draw_items[i];
+            if ((item.key >> 63) != 0)
+                break;
+            SubMesh* prototype = item.submesh->m_prototype != nullptr ? item.submesh->m_prototype : item.submesh;
+            if (prototype->m_dymc || prototype->m_material->GetProgram()->GetAttribLocation(VERTEX_ATTRIB_INSTANCE_WORLD) < 0)
+                continue;
+            auto result = m_instance_batch_lookup.emplace(prototype, (int)m_instance_batches.size());
+            if (result.second)
             {
-                glBindFramebuffer(GL_FRAMEBUFFER, m_standalone_fbo);
-                glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_standalone_color_texture, 0);
-                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_standalone_depth_buffer);
+                InstanceBatch batch;
+                batch.prototype = prototype;
+                m_instance_batches.push_back(batch);
             }
-            
-            glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-            glClearDepthf(1.0f);
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            m_instance_batches[result.first->second].count++;
+            m_draw_item_batches[i] = result.first->second;
+        }
+
+        // 只有一个实例的组按普通绘制, 不占矩阵
+        int matrix_count = 0;
+        for (auto& batch : m_instance_batches)
+        {
+            batch.first = matrix_count;
+            if (batch.count > 1)
+                matrix_count += batch.count;
         }
-    }
+        if (matrix_count == 0)
+            return;
 
-    enum { ATTRIB_VERTEX, ATTRIB_TEXTURE_POSITION, NUM_ATTRIBUTES };
-    void Renderer::RenderBackground(GLuint background_texture_id)
-    {
-        glDisable(GL_DEPTH_TEST);
-        glDepthMask(GL_FALSE);
-        glDisable(GL_BLEND);
-        if (m_background_program == 0)
+        m_instance_matrices.resize((size_t)matrix_count * 16);
+        for (size_t i=0; i<m_draw_items.size(); i++)
         {
-            // Load vertex and fragment shaders
-            const GLint attr_location[2] = {
-                ATTRIB_VERTEX,
-                ATTRIB_TEXTURE_POSITION,
-            };
-            const GLchar* attr_name[2] = {
-                "position",
-                "texture_coordinate",
-            };
-                
-            // shader program
-            GlhCreateProgram(kBasicVertexShader, kBasicTexturedFragmentShader, 2,
-                             (const GLchar**)&attr_name[0], attr_location, &m_background_program);
-            m_background_uniform_loc = glGetUniformLocation(m_background_program, "video_frame");
+            int batch_index = m_draw_item_batches[i];
+            if (batch_index < 0 || m_instance_batches[batch_index].count < 2)
+                continue;
+            InstanceBatch& batch = m_instance_batches[batch_index];
+            const Matrix4f& world = m_draw_items[i].submesh->GetMesh()->GetObjectConstants().world;
+            memcpy(&m_instance_matrices[(size_t)(batch.first + batch.filled++) * 16], world.data(), sizeof(float) * 16);
         }
-        
-        
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, background_texture_id);
-        
-        // render background
+
+        // 整块重新分配(orphan), 不等上一帧的绘制用完
+        if (m_instance_vbo == 0)
         {
-            static const GLfloat square_vertices[] = {
-                -1.0f, -1.0f,  // bottom left
-                1.0f,  -1.0f,  // bottom right
-                -1.0f, 1.0f,   // top left
-                1.0f,  1.0f,   // top right
-            };
-            static const GLfloat texture_vertices[] = {
-                0.0f, 0.0f,  // bottom left
-                1.0f, 0.0f,  // bottom right
-                0.0f, 1.0f,  // top left
-                1.0f, 1.0f,  // top right
-            };
-            
-            glDisable(GL_DEPTH_TEST);
-            glDisable(GL_BLEND);
-            
-            // program
-            glUseProgram(m_background_program);
-            glUniform1i(m_background_uniform_loc, 0);
-            
-            // vertex storage
-            GLuint vbo[2];
-            glGenBuffers(2, vbo);
-            GLuint vao;
-            glGenVertexArrays(1, &vao);
-            glBindVertexArray(vao);
-            
-            // vbo 0
-            glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-            glBufferData(GL_ARRAY_BUFFER, 4 * 2 * sizeof(GLfloat), square_vertices,
-                         GL_STATIC_DRAW);
-            glEnableVertexAttribArray(ATTRIB_VERTEX);
-            glVertexAttribPointer(ATTRIB_VERTEX, 2, GL_FLOAT, 0, 0, nullptr);
-            
-            // vbo 1
-            glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
-            glBufferData(GL_ARRAY_BUFFER, 4 * 2 * sizeof(GLfloat), texture_vertices,
-                         GL_STATIC_DRAW);
-            glEnableVertexAttribArray(ATTRIB_TEXTURE_POSITION);
-            glVertexAttribPointer(ATTRIB_TEXTURE_POSITION, 2, GL_FLOAT, 0, 0, nullptr);
-            
-            // draw
-            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-            
-            // cleanup
-            glDisableVertexAttribArray(ATTRIB_VERTEX);
-            glDisableVertexAttribArray(ATTRIB_TEXTURE_POSITION);
-            glBindBuffer(GL_ARRAY_BUFFER, 0);
-            glBindVertexArray(0);
-            glDeleteVertexArrays(1, &vao);
-            glDeleteBuffers(2, vbo);
+            glGenBuffers(1, &m_instance_vbo);
         }
-        glEnable(GL_DEPTH_TEST);
-        glDepthMask(GL_TRUE);
-        glDisable(GL_BLEND);
+        m_gl_state.BindBuffer(GL_ARRAY_BUFFER, m_instance_vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * m_instance_matrices.size(), m_instance_matrices.data(), GL_STREAM_DRAW);
     }
 
     void Renderer::RenderMeshes()
     {
+        // 两次RenderMeshes之间的上传, 背景绘制和外部代码都可能直接改过GL状态
+        m_gl_state.Invalidate();
+        m_gl_state.ResetStats();
+        UpdateFrameConstants();
+
+        BuildRenderQueue();
+        BuildInstanceBatches();
+        m_draw_stats = DrawStats();
+
         // 绘制不透明物体
-        glEnable(GL_DEPTH_TEST);
-        glDepthFunc(GL_LESS);
-        glDisable(GL_BLEND);
-        for (auto& mesh : m_mesh_list)
+        m_gl_state.SetCapability(GL_DEPTH_TEST, true);
+        m_gl_state.DepthFunc(GL_LESS);
+        m_gl_state.DepthMask(true);
+        m_gl_state.SetCapability(GL_BLEND, false);
+        bool translucent_pass = false;
+        Mesh* current_mesh = nullptr;
+        for (size_t i=0; i<m_draw_items.size(); i++)
         {
-            mesh->RenderOpaqueSubMeshes();
-        }
+            const DrawItem& item = m_draw_items[i];
+            int batch_index = m_draw_item_batches[i];
+            if (batch_index >= 0 && m_instance_batches[batch_index].count > 1)
+            {
+                // 整组在第一次出现的位置画完, 之后的跳过
+                InstanceBatch& batch = m_instance_batches[batch_index];
+                if (batch.drawn)
+                    continue;
+                batch.drawn = true;
+                batch.prototype->Draw(item.submesh->GetMesh(), m_instance_vbo, sizeof(float) * 16 * batch.first, batch.count);
+                m_draw_stats.draw_calls++;
+                m_draw_stats.instanced_draw_calls++;
+                m_draw_stats.instances += batch.count;
+                continue;
+            }
 
-        // 绘制半透明物体
-        // 一般需要对半透明物体从后往前排序. 这里先简化, 后续补上.
-        glDepthMask(GL_FALSE);
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-        for (auto& mesh : m_mesh_list)
-        {
-            mesh->RenderTranslucentSubMeshes();
+            // 绘制半透明物体, 已经按从后往前排好
+            if (!translucent_pass && (item.key >> 63) != 0)
+            {
+                m_gl_state.DepthMask(false);
+                m_gl_state.SetCapability(GL_BLEND, true);
+                m_gl_state.BlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+                translucent_pass = true;
+            }
+            Mesh* mesh = item.submesh->GetMesh();
+            if (mesh != current_mesh)
+            {
+                mesh->BindObjectConstants();
+                current_mesh = mesh;
+            }
+            item.submesh->Render();
+            m_draw_stats.draw_calls++;
         }
+
+        // 不把mesh的VAO留给之后直接调用GL的代码
+        m_gl_state.BindVertexArray(0);
+        m_gl_state.BindBuffer(GL_ARRAY_BUFFER, 0);
+        m_gl_state_stats = m_gl_state.GetStats();
     }
 
     void Renderer::EndRender()
@@ -1409,55 +7704,431 @@ namespace render3d
         return m_camera;
     }
 
-    Program* Renderer::LoadProgram(const std::string& vert_file, const std::string& frag_file, const std::string& macros)
+    // ---- program binary cache ----
+    // 文件格式: ProgramBinaryHeader + binary. 格式有变化时增加版本号, 旧文件会被当作损坏重新生成
+    static const uint32_t PROGRAM_BINARY_MAGIC = 0x50443352; // "R3DP"
+    static const uint32_t PROGRAM_BINARY_VERSION = 1;
+
+    struct ProgramBinaryHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t key;
+        uint32_t binary_format;
+        uint32_t binary_length;
+        uint64_t checksum;
+    };
+
+    static uint64_t Fnv1a64(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL)
+    {
+        const uint8* bytes = (const uint8*)data;
+        for (size_t i=0; i<size; i++)
+        {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    static uint64_t HashString(const std::string& str, uint64_t hash)
+    {
+        // 带上长度, 避免相邻字段拼接出相同的串
+        uint64_t length = str.length();
+        hash = Fnv1a64(&length, sizeof(length), hash);
+        return Fnv1a64(str.data(), str.length(), hash);
+    }
+
+    // 源码, 宏和驱动都参与hash, 任何一个变了都会换一个缓存文件
+    static bool GetProgramBinaryKey(const std::string& vert_file, const std::string& frag_file, const std::string& macros, uint64_t* out_key)
+    {
+        FileView vert_src, frag_src;
+        if (!vert_src.Open(vert_file) || !frag_src.Open(frag_file))
+        {
+            return false;
+        }
+        uint64_t hash = Fnv1a64(&PROGRAM_BINARY_VERSION, sizeof(PROGRAM_BINARY_VERSION));
+        const GLenum driver_strings[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+        for (GLenum name : driver_strings)
+        {
+            const char* value = (const char*)glGetString(name);
+            hash = HashString(value != nullptr ? value : "", hash);
+        }
+        hash = HashString(macros, hash);
+        hash = HashString(VERTEX_DECODE_GLSL, hash);
+        hash = HashString(std::string(vert_src.GetData(), vert_src.GetSize()), hash);
+        hash = HashString(std::string(frag_src.GetData(), frag_src.GetSize()), hash);
+        *out_key = hash;
+        return true;
+    }
+
+    static std::string GetProgramBinaryPath(const std::string& cache_dir, uint64_t key)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.r3dprog", (unsigned long long)key);
+        return cache_dir + name;
+    }
+
+    static bool LoadProgramBinary(Program* program, const std::string& binary_file, uint64_t key)
+    {
+        FileView view;
+        if (!view.Open(binary_file))
+        {
+            return false;
+        }
+        ProgramBinaryHeader header;
+        bool valid = view.GetSize() >= sizeof(header);
+        if (valid)
+        {
+            memcpy(&header, view.GetData(), sizeof(header));
+            const char* binary = view.GetData() + sizeof(header);
+            valid = header.magic == PROGRAM_BINARY_MAGIC && header.version == PROGRAM_BINARY_VERSION && header.key == key
+                && header.binary_length == view.GetSize() - sizeof(header)
+                && header.checksum == Fnv1a64(binary, header.binary_length)
+                && program->LoadFromBinary(header.binary_format, binary, (GLsizei)header.binary_length);
+        }
+        if (!valid)
+        {
+            // 损坏, 版本不对或者驱动不再接受, 删掉后重新编译
+            VLOG(1) << "discard program binary " << binary_file;
+            view.Close();
+            remove(binary_file.c_str());
+        }
+        return valid;
+    }
+
+    static void SaveProgramBinary(const Program* program, const std::string& binary_file, uint64_t key)
+    {
+        GLenum binary_format = 0;
+        std::string binary;
+        if (!program->GetBinary(&binary_format, &binary))
+        {
+            return;
+        }
+        ProgramBinaryHeader header;
+        header.magic = PROGRAM_BINARY_MAGIC;
+        header.version = PROGRAM_BINARY_VERSION;
+        header.key = key;
+        header.binary_format = binary_format;
+        header.binary_length = (uint32_t)binary.size();
+        header.checksum = Fnv1a64(binary.data(), binary.size());
+        std::string blob((const char*)&header, sizeof(header));
+        blob.append(binary);
+        if (!WriteFileAtomically(binary_file, blob))
+        {
+            VLOG(1) << "failed to write program binary " << binary_file;
+        }
+    }
+
+    void Renderer::SetProgramBinaryCacheDir(const std::string& cache_dir)
+    {
+        m_program_binary_cache_dir = cache_dir;
+        if (!cache_dir.empty())
+        {
+            mkdir(cache_dir.c_str(), 0755);
+        }
+    }
+
+    bool Renderer::IsProgramBinarySupported()
+    {
+        if (m_program_binary_supported < 0)
+        {
+            GLint format_count = 0;
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &format_count);
+            m_program_binary_supported = format_count > 0 ? 1 : 0;
+        }
+        return m_program_binary_supported > 0;
+    }
+
+    bool Renderer::BeginLoadProgram(const std::string& vert_file, const std::string& frag_file, const std::string& macros, PendingProgram* pending)
+    {
+        pending->cache_key = vert_file + frag_file + macros;
+        // LoadProgram已经加载过同样的组合, 直接共用
+        auto iter = m_program_cache.find(pending->cache_key);
+        if (iter != m_program_cache.end())
+        {
+            pending->cached = iter->second;
+            pending->linked = true;
+            return true;
+        }
+        pending->program = new Program();
+        if (!m_program_binary_cache_dir.empty() && IsProgramBinarySupported()
+            && GetProgramBinaryKey(vert_file, frag_file, macros, &pending->binary_key))
+        {
+            pending->binary_file = GetProgramBinaryPath(m_program_binary_cache_dir, pending->binary_key);
+            if (LoadProgramBinary(pending->program, pending->binary_file, pending->binary_key))
+            {
+                pending->linked = true;
+                return true;
+            }
+            pending->program->SetBinaryRetrievable(true);
+        }
+
+        if (!pending->program->BeginCompile(vert_file, frag_file, macros))
+        {
+            delete pending->program;
+            pending->program = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    Program* Renderer::FinishLoadProgram(PendingProgram* pending)
+    {
+        if (pending->cached != nullptr)
+        {
+            return pending->cached;
+        }
+        Program* program = pending->program;
+        pending->program = nullptr;
+        if (!pending->linked)
+        {
+            if (!program->FinishCompile())
+            {
+                delete program;
+                return nullptr;
+            }
+            if (!pending->binary_file.empty())
+            {
+                SaveProgramBinary(program, pending->binary_file, pending->binary_key);
+            }
+        }
+        // 编译期间同一组合可能已经由LoadProgram同步加载了, 保留先进缓存的那个
+        auto iter = m_program_cache.find(pending->cache_key);
+        if (iter != m_program_cache.end())
+        {
+            delete program;
+            return iter->second;
+        }
+        m_program_cache[pending->cache_key] = program;
+        return program;
+    }
+
+    Program* Renderer::LoadProgram(const std::string& vert_file, const std::string& frag_file, const std::string& macros)
+    {
+        auto program_key = vert_file + frag_file + macros;
+        auto iter = m_program_cache.find(program_key);
+        if (iter != m_program_cache.end())
+        {
+            return iter->second;
+        }
+
+        PendingProgram pending;
+        if (!BeginLoadProgram(vert_file, frag_file, macros, &pending))
+        {
+            return nullptr;
+        }
+        return FinishLoadProgram(&pending);
+    }
+
+    // ---- shader variants ----
+    static const char* SHADER_FILES[SHADER_COUNT][2] =
+    {
+        { "/shaders/pbr_kh.vert", "/shaders/pbr_kh.frag" },
+        { "/shaders/scan.vert", "/shaders/scan.frag" },
+        { "/shaders/unlit.vert", "/shaders/unlit.frag" },
+        { "/shaders/depth_mask.vert", "/shaders/depth_mask.frag" },
+        { "/shaders/occluder.vert", "/shaders/occluder.frag" },
+    };
+
+    static int GetShaderVariantKey(ShaderId shader, int features)
+    {
+        return ((int)shader << SHADER_FEATURE_COUNT) | (features & ((1 << SHADER_FEATURE_COUNT) - 1));
+    }
+
+    bool Renderer::BeginLoadProgramVariant(ShaderId shader, int features, PendingProgram* pending)
+    {
+        return BeginLoadProgram(CONCAT_RESOURCE_PATH(m_resource_dir, SHADER_FILES[shader][0]), CONCAT_RESOURCE_PATH(m_resource_dir, SHADER_FILES[shader][1]),
+                                GetShaderFeatureMacros(features), pending);
+    }
+
+    Program* Renderer::LoadProgramVariant(ShaderId shader, int features)
+    {
+        int key = GetShaderVariantKey(shader, features);
+        auto iter = m_program_variants.find(key);
+        if (iter != m_program_variants.end())
+        {
+            return iter->second;
+        }
+
+        // 正在预编译的直接等它完成, 不重复编译
+        Program* program = nullptr;
+        auto pending = m_pending_variants.find(key);
+        if (pending != m_pending_variants.end())
+        {
+            program = FinishLoadProgram(&pending->second);
+            m_pending_variants.erase(pending);
+        }
+        else
+        {
+            PendingProgram load;
+            if (BeginLoadProgramVariant(shader, features, &load))
+            {
+                program = FinishLoadProgram(&load);
+            }
+        }
+        if (program != nullptr)
+        {
+            m_program_variants[key] = program;
+        }
+        return program;
+    }
+
+    bool Renderer::IsParallelShaderCompileSupported()
+    {
+        if (m_parallel_shader_compile_supported < 0)
+        {
+            m_parallel_shader_compile_supported = 0;
+            GLint extension_count = 0;
+            glGetIntegerv(GL_NUM_EXTENSIONS, &extension_count);
+            for (GLint i=0; i<extension_count; i++)
+            {
+                const char* extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+                if (extension != nullptr && (strcmp(extension, "GL_KHR_parallel_shader_compile") == 0 || strcmp(extension, "GL_ARB_parallel_shader_compile") == 0))
+                {
+                    m_parallel_shader_compile_supported = 1;
+                    break;
+                }
+            }
+            if (m_parallel_shader_compile_supported > 0)
+            {
+                // 后台编译线程数的初始值由驱动决定, 有的默认不开. 入口不在核心头文件里, 运行时查找.
+                // 0xFFFFFFFF表示交给驱动决定上限
+                typedef void (*MaxShaderCompilerThreadsFunc)(GLuint count);
+                MaxShaderCompilerThreadsFunc max_threads = (MaxShaderCompilerThreadsFunc)dlsym(RTLD_DEFAULT, "glMaxShaderCompilerThreadsKHR");
+                if (max_threads == nullptr)
+                {
+                    max_threads = (MaxShaderCompilerThreadsFunc)dlsym(RTLD_DEFAULT, "glMaxShaderCompilerThreadsARB");
+                }
+                if (max_threads != nullptr)
+                {
+                    max_threads(0xFFFFFFFF);
+                }
+            }
+        }
+        return m_parallel_shader_compile_supported > 0;
+    }
+
+    void Renderer::PrecompileShaderVariants(const std::vector<ShaderVariant>& variants, int variants_per_frame)
+    {
+        bool parallel = IsParallelShaderCompileSupported();
+        m_variants_per_frame = variants_per_frame;
+        for (auto& variant : variants)
+        {
+            int key = GetShaderVariantKey(variant.shader, variant.features);
+            if (m_program_variants.count(key) || m_pending_variants.count(key))
+            {
+                continue;
+            }
+            if (parallel)
+            {
+                // 全部提交, 驱动在后台线程编译, ProcessShaderPrecompile里收取
+                PendingProgram pending;
+                if (BeginLoadProgramVariant(variant.shader, variant.features, &pending))
+                {
+                    m_pending_variants[key] = pending;
+                }
+            }
+            else if (variants_per_frame > 0)
+            {
+                m_queued_variants.push_back(variant);
+            }
+            else
+            {
+                LoadProgramVariant(variant.shader, variant.features);
+            }
+        }
+    }
+
+    int Renderer::ProcessShaderPrecompile()
     {
-        auto program_key = vert_file + frag_file + macros;
-        auto iter = m_program_cache.find(program_key);
-        if (iter != m_program_cache.end())
+        for (auto iter=m_pending_variants.begin(); iter!=m_pending_variants.end();)
         {
-            return iter->second;
+            PendingProgram& pending = iter->second;
+            if (!pending.linked && !pending.program->IsCompileComplete())
+            {
+                ++iter;
+                continue;
+            }
+            Program* program = FinishLoadProgram(&pending);
+            if (program != nullptr)
+            {
+                m_program_variants[iter->first] = program;
+            }
+            iter = m_pending_variants.erase(iter);
         }
 
-        Program* program = new Program();
-        if (program->LoadAndCompile(vert_file, frag_file, macros))
-        {
-            m_program_cache[program_key] = program;
-            return program;
-        }
-        else
+        // 没有并行编译时每帧同步编译几个, 把卡顿分散开
+        for (int i=0; i<m_variants_per_frame && !m_queued_variants.empty(); i++)
         {
-            delete program;
-            return nullptr;
+            ShaderVariant variant = m_queued_variants.front();
+            m_queued_variants.pop_front();
+            LoadProgramVariant(variant.shader, variant.features);
         }
+        return (int)(m_pending_variants.size() + m_queued_variants.size());
     }
 
-    Texture* Renderer::LoadTexture(const std::string& texture_file, bool* out_translucent_flag, bool generate_mipmap)
+    Texture* Renderer::CreateTextureFromPixels(const std::string& texture_file, int width, int height, const uint8* pixels, TextureFormat format, bool translucent, bool generate_mipmap)
     {
-        auto iter = m_texture_cache.find(texture_file);
-        if (iter != m_texture_cache.end())
+        Texture* texture = new Texture();
+        texture->m_width = width;
+        texture->m_height = height;
+        texture->m_format = format;
+        glGenTextures(1, &texture->m_gl_texture);
+        glBindTexture(GL_TEXTURE_2D, texture->m_gl_texture);
+        if (generate_mipmap && m_texture_stream_budget > 0)
         {
-            if (out_translucent_flag != nullptr)
+            // 流送: 在CPU上生成mip链, 先传小mip, 其余在ProcessTextureStreams里补齐
+            std::shared_ptr<TextureStream> stream = std::make_shared<TextureStream>();
+            stream->texture = texture;
+            stream->format = format;
+            int channels = format == RGB ? 3 : 4;
+            int level_count = 1;
+            while (std::max(width, height) >> level_count)
             {
-                *out_translucent_flag = iter->second.translucent;
+                level_count++;
             }
-            return iter->second.texture;
+            stream->level_count = level_count;
+            stream->mip_pixels.resize(level_count);
+            int target_level = GetStreamTargetLevel(width, height, level_count, m_texture_stream_max_size);
+
+            std::vector<uint8> level_pixels(pixels, pixels + (size_t)width * height * channels);
+            std::vector<uint8> next;
+            for (int level=0; level<level_count; level++)
+            {
+                int level_width = std::max(width >> level, 1);
+                int level_height = std::max(height >> level, 1);
+                if (level + 1 < level_count)
+                {
+                    DownsampleImage(level_pixels, level_width, level_height, channels, &next);
+                }
+                if (level >= target_level)
+                {
+                    stream->mip_pixels[level].swap(level_pixels);
+                }
+                level_pixels.swap(next);
+            }
+
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level_count - 1);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            size_t byte_size = StartTextureStream(stream);
+            AddTextureToCache(texture_file, texture, translucent, byte_size);
+            return texture;
         }
-        
-        ///TODO:image_frame可能为空,需要判空
-        // load png from file
-        ImageFrame* image_frame = getImageFrameFromPath(texture_file, ImageFormat_SRGBA);
-        if (image_frame == nullptr)
+
+        if (format == RGB)
         {
-            return nullptr;
+            // RGB的行不一定4字节对齐
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, texture->m_width, texture->m_height, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        }
+        else
+        {
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture->m_width, texture->m_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
         }
-
-        Texture* texture = new Texture();
-        texture->m_width = image_frame->Width();
-        texture->m_height = image_frame->Height();
-        texture->m_format = RGBA;
-        glGenTextures(1, &texture->m_gl_texture);
-        glBindTexture(GL_TEXTURE_2D, texture->m_gl_texture);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture->m_width, texture->m_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image_frame->PixelData());
         
         if (generate_mipmap)
         {
@@ -1468,48 +8139,51 @@ namespace render3d
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
         
-        
-        if (out_translucent_flag != nullptr)
+        int bytes_per_pixel = format == RGB ? 3 : 4;
+        AddTextureToCache(texture_file, texture, translucent, GetMipChainBytes(width, height, bytes_per_pixel, generate_mipmap));
+        return texture;
+    }
+
+    Texture* Renderer::LoadTexture(const std::string& texture_file, bool* out_translucent_flag, bool generate_mipmap)
+    {
+        auto iter = m_texture_cache.find(texture_file);
+        if (iter != m_texture_cache.end())
         {
-            *out_translucent_flag = false;
+            TouchCachedTexture(iter->second);
+            if (out_translucent_flag != nullptr)
+            {
+                *out_translucent_flag = iter->second.translucent;
+            }
+            return iter->second.texture;
         }
         
-        // extra steps: check if it has alpha less than 255
-        if ((image_frame->Format() == ImageFormat_SRGBA || image_frame->Format() == ImageFormat_SBGRA))
+        // 有同名的.ktx2时优先用预压缩的贴图
+        std::string ktx2_file = TextureTranscoder::GetKtx2Path(texture_file);
+        if (GetResourceFileSize(ktx2_file) > 0)
         {
-            
-            const uint8* pixels = image_frame->PixelData();
-            for (int row=0; row<image_frame->Height(); row++)
+            Texture* texture = LoadKtx2Texture(texture_file, ktx2_file, TEXTURE_2D, out_translucent_flag);
+            if (texture != nullptr)
             {
-                for (int col=0; col<image_frame->Width(); col++)
-                {
-                    int idx = row * image_frame->WidthStep() + col * 4;
-                    
-                    if (out_translucent_flag != nullptr)
-                    {
-                        uint8 alpha = pixels[idx + 3];
-                        if (alpha > 0 && alpha < 255)
-                        {
-                            *out_translucent_flag = true;
-                            break;
-                        }
-                    }
-                }
-                
-                if (out_translucent_flag != nullptr && *out_translucent_flag == true)
-                {
-                    break;
-                }
+                return texture;
             }
         }
+
+        // load png from file. 同时统计alpha, 不透明的图去掉alpha通道
+        DecodedTexture decoded;
+        if (!DecodeTexture(texture_file, &decoded))
+        {
+            return nullptr;
+        }
+
+        bool translucent = decoded.stats.has_partial_alpha;
+        if (out_translucent_flag != nullptr)
+        {
+            *out_translucent_flag = translucent;
+        }
         
-        // check it
-        delete image_frame;
-    
-        TextureInfo ti;
-        ti.texture = texture;
-        ti.translucent = out_translucent_flag ? *out_translucent_flag : false;
-        m_texture_cache[texture_file] = ti;
+        const ImageFrame* image_frame = decoded.image_frame;
+        Texture* texture = CreateTextureFromPixels(texture_file, image_frame->Width(), image_frame->Height(), decoded.GetPixels(), decoded.format, translucent, generate_mipmap);
+        delete decoded.image_frame;
         return texture;
     }
 
@@ -1547,9 +8221,21 @@ namespace render3d
         auto iter = m_texture_cache.find(cube_texture_file);
         if (iter != m_texture_cache.end())
         {
+            TouchCachedTexture(iter->second);
             return iter->second.texture;
         }
         
+        // 预压缩的cube: xxx.ktx2, 6个面和完整mip链在一个文件里
+        std::string ktx2_file = cube_texture_file + ".ktx2";
+        if (GetResourceFileSize(ktx2_file) > 0)
+        {
+            Texture* texture = LoadKtx2Texture(cube_texture_file, ktx2_file, TEXTURE_CUBE, nullptr);
+            if (texture != nullptr)
+            {
+                return texture;
+            }
+        }
+        
         Texture* texture = new Texture();
         texture->m_format = RGBA;
         texture->m_type = TEXTURE_CUBE;
@@ -1575,44 +8261,114 @@ namespace render3d
             }
         }
         
-        TextureInfo ti;
-        ti.texture = texture;
-        ti.translucent = false;
-        m_texture_cache[cube_texture_file] = ti;
+        AddTextureToCache(cube_texture_file, texture, false, GetMipChainBytes(face_size, face_size, 4, load_mipmap_chain) * 6);
         return texture;
     }
 
 
-    Mesh* Renderer::CreatePBRMesh(const std::string& mesh_file_path, const char* mirrorPath)
+    Mesh* Renderer::LoadMeshGeometry(const std::string& mesh_file_path, std::vector<std::string>* submesh_material_names, bool export_triangles, int thread_count)
     {
-        char temp[256];
-        memcpy(temp, mesh_file_path.c_str(), mesh_file_path.length() - 4);
-        temp[mesh_file_path.length()-4] = 0;
-        std::string mesh_file_path_without_ext = temp;
-        std::string bk_mesh_file_path_without_ext = mesh_file_path_without_ext;
-        if (mirrorPath) {
-            int div_pos = mesh_file_path_without_ext.rfind("/");
-            std::string obj_name = mesh_file_path_without_ext.substr(div_pos);
-            std::string dir = mesh_file_path_without_ext.substr(0, div_pos);
-            mesh_file_path_without_ext = dir + "/" + mirrorPath + obj_name;
+        // 优先使用同名的.r3dmesh, 不需要再解析文本.
+        // export_triangles需要原始的obj三角形, 只能走解析. 直接传入的.r3z也走解析(解码)
+        if (!export_triangles && !MeshCodec::IsCompressedPath(mesh_file_path))
+        {
+            std::string cache_file = MeshCache::GetCachePath(mesh_file_path);
+            if (MeshCache::IsFresh(mesh_file_path, cache_file))
+            {
+                Mesh* mesh = MeshCache::Load(this, cache_file, submesh_material_names);
+                if (mesh != nullptr)
+                {
+                    if (m_vertex_format != VERTEX_FORMAT_FLOAT)
+                        VLOG(1) << "vertex format ignored for cached mesh: " << mesh_file_path;
+                    return mesh;
+                }
+            }
         }
 
-        // load mesh
-        std::string text = ReadTextFile(mesh_file_path);
-        if (text.length() <= 0)
+        // 流式加载: 按窗口读取, 边解析边上传, 不需要整个文件和解析结果常驻内存
+        if (m_mesh_streaming_budget > 0 && !export_triangles && !MeshCodec::IsCompressedPath(mesh_file_path))
         {
-            return nullptr;
+            Mesh* mesh = new Mesh(this);
+            ObjStreamParser parser(mesh, m_mesh_streaming_budget);
+            bool succ = false;
+            *submesh_material_names = parser.Parse(mesh_file_path, &succ);
+            if (!succ) {
+                delete mesh;
+                return nullptr;
+            }
+            if (m_vertex_format != VERTEX_FORMAT_FLOAT)
+                VLOG(1) << "vertex format ignored for streamed mesh: " << mesh_file_path;
+            return mesh;
         }
-        
-        Mesh* mesh = new Mesh(this);
-        ObjMeshParser parser(mesh, (char*)text.c_str(), (int)text.length());
-        bool parse_succ = false;
-        std::vector<std::string> submesh_material_names = parser.Parse(&parse_succ);
-        if (!parse_succ) {
-            delete mesh;
+
+        return ParseMeshGeometry(mesh_file_path, submesh_material_names, export_triangles, thread_count, m_vertex_format);
+    }
+
+    Mesh* Renderer::ParseMeshGeometry(const std::string& mesh_file_path, std::vector<std::string>* submesh_material_names, bool export_triangles, int thread_count, int vertex_format)
+    {
+        Mesh* mesh = nullptr;
+        if (MeshCodec::IsCompressedPath(mesh_file_path))
+        {
+            // 直接传入的.r3z
+            if (export_triangles)
+            {
+                VLOG(1) << "export_triangles is not supported for " << mesh_file_path;
+            }
+            mesh = MeshCodec::Load(this, mesh_file_path, submesh_material_names);
+            if (mesh == nullptr)
+            {
+                return nullptr;
+            }
+        }
+        else
+        {
+            FileView text;
+            if (!text.Open(mesh_file_path))
+            {
+                return nullptr;
+            }
+            
+            mesh = new Mesh(this);
+            ObjMeshParser parser(mesh, text.GetData(), text.GetSize(), export_triangles);
+            parser.SetThreadCount(thread_count);
+            bool succ = false;
+            *submesh_material_names = parser.Parse(&succ);
+            if (!succ) {
+                delete mesh;
+                return nullptr;
+            }
+        }
+
+        // 只有CPU侧的顶点才能按格式重新打包, 缓存和流式加载的都是float
+        for (auto submesh : mesh->m_submeshes)
+        {
+            submesh->m_vertex_format = vertex_format;
+        }
+        return mesh;
+    }
+
+    Mesh* Renderer::CreatePBRMesh(const std::string& mesh_file_path, const char* mirrorPath)
+    {
+        // load mesh
+        std::vector<std::string> submesh_material_names;
+        Mesh* mesh = LoadMeshGeometry(mesh_file_path, &submesh_material_names);
+        if (mesh == nullptr)
+        {
             return nullptr;
         }
 
+        SetupPBRMaterials(mesh, submesh_material_names, mesh_file_path, mirrorPath, [this](const std::string& texture_file, bool* out_translucent_flag) {
+            return LoadTexture(texture_file, out_translucent_flag, true);
+        });
+        return mesh;
+    }
+
+    void Renderer::SetupPBRMaterials(Mesh* mesh, std::vector<std::string>& submesh_material_names, const std::string& mesh_file_path, const char* mirrorPath,
+                                     const std::function<Texture*(const std::string&, bool*)>& load_texture)
+    {
+        std::string bk_mesh_file_path_without_ext = GetMeshPathWithoutExt(mesh_file_path);
+        std::string mesh_file_path_without_ext = GetMirroredMeshPath(bk_mesh_file_path_without_ext, mirrorPath);
+
         if (submesh_material_names.size() == 0)
         {
             // obj只有一个material时可能不指定usemtl. 只好从 xxx.mtl 里读newmtl属性了
@@ -1643,14 +8399,11 @@ namespace render3d
                 // VLOG("error: no newmtl found in xxx.mtl")
             }
             
-            return mesh;
+            return;
         }
 
         assert(submesh_material_names.size() == mesh->m_submeshes.size() && "obj usemtl's count not equal to submesh count");
         
-        std::string vert_shader = "/shaders/pbr_kh.vert";
-        std::string frag_shader = "/shaders/pbr_kh.frag";
-        
 //        std::string mat_desc_file = mesh_file_path_without_ext + ".material";
 //        std::string mat_desc_content = ReadTextFile(mat_desc_file);
 //        if (mat_desc_content.size() > 1)
@@ -1667,51 +8420,46 @@ namespace render3d
         {
             auto submesh_material_name = submesh_material_names[i];
             std::string path_prefix = mesh_file_path_without_ext + "_" + submesh_material_name + "_";
-            std::string base_tex_path = path_prefix + "Base.png";
-            std::string rma_tex_path = path_prefix + "RMA.png";
-            std::string normal_tex_path = path_prefix + "Normal.png";
-            std::string emissive_tex_path = path_prefix + "Emissive.png";
-            
+            std::string tex_paths[PBR_TEXTURE_COUNT];
+            Texture* textures[PBR_TEXTURE_COUNT];
             bool is_translucent = false;
-            Texture* base_tex = LoadTexture(base_tex_path, &is_translucent, true);
-            Texture* rma_tex = LoadTexture(rma_tex_path, nullptr, true);
-            Texture* normal_tex = LoadTexture(normal_tex_path, nullptr, true);
-            Texture* emissive_tex = LoadTexture(emissive_tex_path, nullptr, true);
-            // if error, load from base path
-            if (!base_tex && mirrorPath) {
-                base_tex_path = bk_mesh_file_path_without_ext + "_" + submesh_material_name + "_Base.png";
-                base_tex = LoadTexture(base_tex_path, &is_translucent, true);
-            }
-            if (!rma_tex && mirrorPath) {
-                rma_tex_path = bk_mesh_file_path_without_ext + "_" + submesh_material_name + "_RMA.png";
-                rma_tex = LoadTexture(rma_tex_path, nullptr, true);
-            }
-            if (!normal_tex && mirrorPath) {
-                normal_tex_path = bk_mesh_file_path_without_ext + "_" + submesh_material_name + "_Normal.png";
-                normal_tex = LoadTexture(normal_tex_path, nullptr, true);
-            }
-            if (!emissive_tex && mirrorPath) {
-                emissive_tex_path = bk_mesh_file_path_without_ext + "_" + submesh_material_name + "_Emissive.png";
-                emissive_tex = LoadTexture(emissive_tex_path, nullptr, true);
+            for (int slot=0; slot<PBR_TEXTURE_COUNT; slot++)
+            {
+                bool* out_translucent_flag = slot == PBR_TEXTURE_BASE ? &is_translucent : nullptr;
+                tex_paths[slot] = path_prefix + PBR_TEXTURE_SUFFIXES[slot];
+                textures[slot] = load_texture(tex_paths[slot], out_translucent_flag);
+                // if error, load from base path
+                if (!textures[slot] && mirrorPath) {
+                    tex_paths[slot] = bk_mesh_file_path_without_ext + "_" + submesh_material_name + "_" + PBR_TEXTURE_SUFFIXES[slot];
+                    textures[slot] = load_texture(tex_paths[slot], out_translucent_flag);
+                }
+                // 加载后立刻引用, 避免加载后面几张时被淘汰
+                if (textures[slot] != nullptr && mesh->m_associated_textures.insert(tex_paths[slot]).second)
+                {
+                    RetainTexture(tex_paths[slot]);
+                }
             }
-            
-            mesh->m_associated_textures.emplace(base_tex_path);
-            mesh->m_associated_textures.emplace(rma_tex_path);
+            Texture* base_tex = textures[PBR_TEXTURE_BASE];
+            Texture* rma_tex = textures[PBR_TEXTURE_RMA];
+            Texture* normal_tex = textures[PBR_TEXTURE_NORMAL];
+            Texture* emissive_tex = textures[PBR_TEXTURE_EMISSIVE];
 
-            std::string macros = "";
+            int features = GetVertexFormatShaderFeatures(mesh->m_submeshes[i]->GetVertexFormat());
             if (normal_tex != nullptr)
             {
-                macros += "#define USE_NORMAL_MAP\n";
-                mesh->m_associated_textures.emplace(normal_tex_path);
+                features |= SHADER_FEATURE_NORMAL_MAP;
             }
             
             if (emissive_tex != nullptr)
             {
-                macros += "#define USE_EMISSIVE_MAP\n";
-                mesh->m_associated_textures.emplace(emissive_tex_path);
+                features |= SHADER_FEATURE_EMISSIVE_MAP;
             }
             
-            Program* program = LoadProgram(CONCAT_RESOURCE_PATH(m_resource_dir, vert_shader.c_str()), CONCAT_RESOURCE_PATH(m_resource_dir, frag_shader.c_str()), macros);
+            if (m_instancing)
+            {
+                features |= SHADER_FEATURE_INSTANCED;
+            }
+            Program* program = LoadProgramVariant(SHADER_PBR, features);
             
             if (program != nullptr)
             {
@@ -1732,8 +8480,142 @@ namespace render3d
                 }
             }
         }
-        
-        return mesh;
+    }
+
+    void Renderer::SetAsyncLoadThreadCount(int thread_count)
+    {
+        m_load_thread_count = thread_count;
+    }
+
+    std::shared_ptr<MeshLoadHandle> Renderer::CreatePBRMeshAsync(const std::string& mesh_file_path, const char* mirrorPath)
+    {
+        if (m_load_pool == nullptr)
+        {
+            int thread_count = m_load_thread_count > 0 ? m_load_thread_count : (int)std::thread::hardware_concurrency();
+            m_load_pool = new AssetLoadPool(std::max(1, thread_count));
+        }
+
+        std::shared_ptr<AsyncPBRLoad> load = std::make_shared<AsyncPBRLoad>();
+        load->handle = std::make_shared<MeshLoadHandle>();
+        load->mesh_file_path = mesh_file_path;
+        load->has_mirror_path = mirrorPath != nullptr;
+        load->mirror_path = mirrorPath ? mirrorPath : "";
+        load->vertex_format = m_vertex_format;
+        load->pending_jobs = 1;
+        m_async_loads.push_back(load);
+
+        AssetLoadPool* pool = m_load_pool;
+        pool->Submit([this, pool, load]() {
+            // 几何: 已经在池线程上, 多个mesh之间靠池并行, 单个解析不再开线程. 贴图任务等拿到材质名再派发
+            Mesh* mesh = ParseMeshGeometry(load->mesh_file_path, &load->submesh_material_names, false, 1, load->vertex_format);
+            load->mesh = mesh;
+            if (mesh != nullptr && load->submesh_material_names.size() == mesh->m_submeshes.size())
+            {
+                const char* mirror = load->has_mirror_path ? load->mirror_path.c_str() : nullptr;
+                std::string bk_prefix = GetMeshPathWithoutExt(load->mesh_file_path);
+                std::string prefix = GetMirroredMeshPath(bk_prefix, mirror);
+
+                // 每张贴图一个任务, 各submesh引用同一张图时只解码一次
+                std::set<std::string> scheduled;
+                for (auto& name : load->submesh_material_names)
+                {
+                    for (int slot=0; slot<PBR_TEXTURE_COUNT; slot++)
+                    {
+                        std::string texture_file = prefix + "_" + name + "_" + PBR_TEXTURE_SUFFIXES[slot];
+                        if (!scheduled.insert(texture_file).second)
+                            continue;
+                        std::string fallback_file = mirror ? bk_prefix + "_" + name + "_" + PBR_TEXTURE_SUFFIXES[slot] : "";
+                        load->pending_jobs++;
+                        pool->Submit([load, texture_file, fallback_file]() {
+                            std::string files[2] = { texture_file, fallback_file };
+                            for (auto& file : files)
+                            {
+                                if (file.empty())
+                                    continue;
+                                // 有.ktx2时由渲染线程直接上传压缩数据
+                                if (GetResourceFileSize(TextureTranscoder::GetKtx2Path(file)) > 0)
+                                    break;
+                                DecodedTexture decoded;
+                                if (!DecodeTexture(file, &decoded))
+                                    continue;
+                                std::lock_guard<std::mutex> lock(load->mutex);
+                                if (load->textures.count(file) == 0)
+                                    load->textures[file] = decoded;
+                                else
+                                    delete decoded.image_frame;
+                                break;
+                            }
+                            load->FinishJob();
+                        });
+                    }
+                }
+            }
+            load->FinishJob();
+        });
+        return load->handle;
+    }
+
+    int Renderer::ProcessAsyncLoads()
+    {
+        int finished = 0;
+        for (auto iter=m_async_loads.begin(); iter!=m_async_loads.end();)
+        {
+            std::shared_ptr<AsyncPBRLoad> load = *iter;
+            if (!load->ready)
+            {
+                ++iter;
+                continue;
+            }
+            iter = m_async_loads.erase(iter);
+            finished++;
+
+            if (load->mesh == nullptr)
+            {
+                load->handle->m_state = MeshLoadHandle::FAILED;
+                continue;
+            }
+
+            // 已经在缓存里的贴图直接复用, 其余用后台解码好的像素创建
+            const char* mirror = load->has_mirror_path ? load->mirror_path.c_str() : nullptr;
+            SetupPBRMaterials(load->mesh, load->submesh_material_names, load->mesh_file_path, mirror, [this, &load](const std::string& texture_file, bool* out_translucent_flag) -> Texture* {
+                auto cached = m_texture_cache.find(texture_file);
+                if (cached != m_texture_cache.end())
+                {
+                    TouchCachedTexture(cached->second);
+                    if (out_translucent_flag != nullptr)
+                    {
+                        *out_translucent_flag = cached->second.translucent;
+                    }
+                    return cached->second.texture;
+                }
+                auto decoded = load->textures.find(texture_file);
+                if (decoded == load->textures.end())
+                {
+                    // 预压缩的.ktx2上传本身很快, 直接走同步路径
+                    if (GetResourceFileSize(TextureTranscoder::GetKtx2Path(texture_file)) > 0)
+                    {
+                        return LoadTexture(texture_file, out_translucent_flag, true);
+                    }
+                    return nullptr;
+                }
+                const DecodedTexture& texture_data = decoded->second;
+                bool translucent = texture_data.stats.has_partial_alpha;
+                if (out_translucent_flag != nullptr)
+                {
+                    *out_translucent_flag = translucent;
+                }
+                Texture* texture = CreateTextureFromPixels(texture_file, texture_data.image_frame->Width(), texture_data.image_frame->Height(),
+                                                           texture_data.GetPixels(), texture_data.format, translucent, true);
+                delete texture_data.image_frame;
+                load->textures.erase(decoded);
+                return texture;
+            });
+
+            load->handle->m_mesh = load->mesh;
+            load->handle->m_state = MeshLoadHandle::READY;
+            load->mesh = nullptr;
+        }
+        return finished;
     }
 
     Mesh* Renderer::CreateScanMesh(const std::string& mesh_file_path, bool export_triangles)
@@ -1744,20 +8626,13 @@ namespace render3d
         std::string mesh_file_path_without_ext = temp;
 
         // load mesh
-        std::string text = ReadTextFile(mesh_file_path);
-        if (text.length() <= 0)
+        // 扫描模型通常很大, 用上所有核
+        std::vector<std::string> submesh_material_names;
+        Mesh* mesh = LoadMeshGeometry(mesh_file_path, &submesh_material_names, export_triangles, 0);
+        if (mesh == nullptr)
         {
             return nullptr;
         }
-        
-        Mesh* mesh = new Mesh(this);
-        ObjMeshParser parser(mesh, (char*)text.c_str(), (int)text.length(), export_triangles);
-        bool succ = false;
-        std::vector<std::string> submesh_material_names = parser.Parse(&succ);
-        if (!succ) {
-            delete mesh;
-            return nullptr;
-        }
 
         // load pbr material for submeshes
         for (int i=0; i<submesh_material_names.size(); i++)
@@ -1769,8 +8644,8 @@ namespace render3d
             bool is_translucent = false;
             Texture* base_tex = LoadTexture(base_tex_path, &is_translucent);
             
-            Program* program = LoadProgram(CONCAT_RESOURCE_PATH(m_resource_dir, "/shaders/scan.vert"), CONCAT_RESOURCE_PATH(m_resource_dir, "/shaders/scan.frag"), "");
             auto submesh = mesh->m_submeshes[i];
+            Program* program = LoadProgramVariant(SHADER_SCAN, GetVertexFormatShaderFeatures(submesh->GetVertexFormat()));
             submesh->m_material = new Material(submesh, program);
             submesh->m_material->SetTextureParam("baseMap", base_tex);
             submesh->m_material->SetTranslucent(is_translucent);
@@ -1787,20 +8662,12 @@ namespace render3d
         std::string mesh_file_path_without_ext = temp;
 
         // load mesh
-        std::string text = ReadTextFile(mesh_file_path);
-        if (text.length() <= 0)
+        std::vector<std::string> submesh_material_names;
+        Mesh* mesh = LoadMeshGeometry(mesh_file_path, &submesh_material_names);
+        if (mesh == nullptr)
         {
             return nullptr;
         }
-        
-        Mesh* mesh = new Mesh(this);
-        ObjMeshParser parser(mesh, (char*)text.c_str(), (int)text.length());
-        bool succ = false;
-        std::vector<std::string> submesh_material_names = parser.Parse(&succ);
-        if (!succ) {
-            delete mesh;
-            return nullptr;
-        }
 
         // load pbr material for submeshes
         for (int i=0; i<submesh_material_names.size(); i++)
@@ -1812,8 +8679,13 @@ namespace render3d
             bool is_translucent = false;
             Texture* base_tex = LoadTexture(base_tex_path, &is_translucent);
             
-            Program* program = LoadProgram(CONCAT_RESOURCE_PATH(m_resource_dir, "/shaders/unlit.vert"), CONCAT_RESOURCE_PATH(m_resource_dir, "/shaders/unlit.frag"), "");
             auto submesh = mesh->m_submeshes[i];
+            int features = GetVertexFormatShaderFeatures(submesh->GetVertexFormat());
+            if (m_instancing)
+            {
+                features |= SHADER_FEATURE_INSTANCED;
+            }
+            Program* program = LoadProgramVariant(SHADER_UNLIT, features);
             submesh->m_material = new Material(submesh, program);
             submesh->m_material->SetTextureParam("baseMap", base_tex);
             submesh->m_material->SetTranslucent(is_translucent);
@@ -1830,20 +8702,12 @@ namespace render3d
         std::string mesh_file_path_without_ext = temp;
 
         // load mesh
-        std::string text = ReadTextFile(mesh_file_path);
-        if (text.length() <= 0)
+        std::vector<std::string> submesh_material_names;
+        Mesh* mesh = LoadMeshGeometry(mesh_file_path, &submesh_material_names);
+        if (mesh == nullptr)
         {
             return nullptr;
         }
-        
-        Mesh* mesh = new Mesh(this);
-        ObjMeshParser parser(mesh, (char*)text.c_str(), (int)text.length());
-        bool succ = false;
-        std::vector<std::string> submesh_material_names = parser.Parse(&succ);
-        if (!succ) {
-            delete mesh;
-            return nullptr;
-        }
 
         // load pbr material for submeshes
         for (int i=0; i<submesh_material_names.size(); i++)
@@ -1851,9 +8715,10 @@ namespace render3d
             bool is_translucent = false;
             Texture* base_tex = LoadTexture(CONCAT_RESOURCE_PATH(m_resource_dir, "/textures/uv_0.jpg"), &is_translucent);
             
-            Program* program = LoadProgram(CONCAT_RESOURCE_PATH(m_resource_dir, "/shaders/depth_mask.vert"), CONCAT_RESOURCE_PATH(m_resource_dir, "/shaders/depth_mask.frag"), "");
             auto submesh = mesh->m_submeshes[i];
+            Program* program = LoadProgramVariant(SHADER_DEPTH_MASK, GetVertexFormatShaderFeatures(submesh->GetVertexFormat()));
             submesh->m_material = new Material(submesh, program);
+            submesh->m_material->SetDepthOnly(true);
             submesh->m_material->SetTextureParam("baseMap", base_tex);
             submesh->m_material->SetTranslucent(is_translucent);
         }
@@ -1869,42 +8734,89 @@ namespace render3d
         std::string mesh_file_path_without_ext = temp;
 
         // load mesh
-        std::string text = ReadTextFile(mesh_file_path);
-        if (text.length() <= 0)
+        std::vector<std::string> submesh_material_names;
+        Mesh* mesh = LoadMeshGeometry(mesh_file_path, &submesh_material_names);
+        if (mesh == nullptr)
         {
             return nullptr;
         }
-        
-        Mesh* mesh = new Mesh(this);
-        bool succ = false;
-        ObjMeshParser parser(mesh, (char*)text.c_str(), (int)text.length());
-        std::vector<std::string> submesh_material_names = parser.Parse(&succ);
-        if (!succ) {
-            delete mesh;
-            return nullptr;
-        }
-        m_mesh_list.push_back(mesh);
+        AddMesh(mesh);
 
         // load pbr material for submeshes
         for (int i=0; i<mesh->m_submeshes.size(); i++)
         {
-            Program* program = LoadProgram(CONCAT_RESOURCE_PATH(m_resource_dir, "/shaders/occluder.vert"), CONCAT_RESOURCE_PATH(m_resource_dir, "/shaders/occluder.frag"), "");
             auto submesh = mesh->m_submeshes[i];
+            Program* program = LoadProgramVariant(SHADER_OCCLUDER, GetVertexFormatShaderFeatures(submesh->GetVertexFormat()));
             submesh->m_material = new Material(submesh, program);
+            submesh->m_material->SetDepthOnly(true);
+            // 保留一份CPU几何用于遮挡剔除
+            mesh->m_occluder = submesh->CopyOccluderGeometry() || mesh->m_occluder;
         }
         
         return mesh;
     }
 
+    Mesh* Renderer::CreateMeshInstance(Mesh* prototype)
+    {
+        if (prototype == nullptr)
+            return nullptr;
+
+        Mesh* mesh = new Mesh(this);
+        Mesh* root_mesh = prototype->m_instance_of != nullptr ? prototype->m_instance_of : prototype;
+        mesh->m_instance_of = root_mesh;
+        root_mesh->m_instances.push_back(mesh);
+        for (auto& source : prototype->m_submeshes)
+        {
+            // 实例的实例直接指向最初的原型
+            SubMesh* root = source->m_prototype != nullptr ? source->m_prototype : source;
+            SubMesh* submesh = new SubMesh(mesh);
+            submesh->m_prototype = root;
+            submesh->m_vertex_count = root->m_vertex_count;
+            submesh->m_index_count = root->m_index_count;
+            submesh->m_vertex_format = root->m_vertex_format;
+            submesh->m_bounds_min = root->m_bounds_min;
+            submesh->m_bounds_max = root->m_bounds_max;
+            submesh->m_sphere_center = root->m_sphere_center;
+            submesh->m_sphere_radius = root->m_sphere_radius;
+            mesh->m_submeshes.push_back(submesh);
+        }
+        // 遮挡几何不复制, 画遮挡缓冲时直接用原型的(原型是dymc时也跟着更新)
+        mesh->m_occluder = prototype->m_occluder;
+        AddMesh(mesh);
+        return mesh;
+    }
+
+    void Renderer::SetInstancing(bool enabled)
+    {
+        m_instancing = enabled;
+    }
+
+    const DrawStats& Renderer::GetDrawStats() const
+    {
+        return m_draw_stats;
+    }
+
+    void Renderer::SetVertexFormat(int vertex_format)
+    {
+        m_vertex_format = vertex_format;
+    }
+
+    void Renderer::SetMeshStreamingBudget(size_t budget_bytes)
+    {
+        m_mesh_streaming_budget = budget_bytes;
+    }
+
     void Renderer::AddMesh(Mesh* mesh)
     {
         if (mesh == nullptr)
             return;
         
-        if (std::find(this->m_mesh_list.begin(), this->m_mesh_list.end(), mesh) == this->m_mesh_list.end())
-        {
-            this->m_mesh_list.push_back(mesh);
-        }
+        if (mesh->m_in_renderer)
+            return;
+        mesh->m_render_iter = m_mesh_list.insert(m_mesh_list.end(), mesh);
+        mesh->m_in_renderer = true;
+        m_submesh_count += (int)mesh->m_submeshes.size();
+        UpdateMeshBounds(mesh);
     }
 
     void Renderer::RemoveMesh(Mesh *mesh)
@@ -1912,11 +8824,12 @@ namespace render3d
         if (mesh == nullptr)
             return;
         
-        auto iter = std::find(this->m_mesh_list.begin(), this->m_mesh_list.end(), mesh);
-        if (iter != this->m_mesh_list.end())
-        {
-            this->m_mesh_list.erase(iter);
-        }
+        if (!mesh->m_in_renderer)
+            return;
+        RemoveMeshBounds(mesh);
+        m_mesh_list.erase(mesh->m_render_iter);
+        mesh->m_in_renderer = false;
+        m_submesh_count -= (int)mesh->m_submeshes.size();
     }
     
     Texture* Renderer::GetDiffuseEnvTexture()
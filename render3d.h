@@ -4,13 +4,19 @@
 #include <vector>
 #include <list>
 #include <map>
+#include <set>
 #include <unordered_map>
 #include <string>
 #include <iostream>
+#include <algorithm>
+#include <memory>
+#include <functional>
 #include <OpenGL/OpenGL.h>
 #include <GLUT/GLUT.h>
 #include "Eigen/Geometry"
 
+namespace render3d
+{
 typedef unsigned char uint8;
 
 #define _SafeDeleteArray_(p) {if (p) {delete[] p;}}
@@ -22,6 +28,41 @@ typedef Eigen::Matrix<float, 3, 3> Matrix3f;
 typedef Eigen::Matrix<float, 4, 4> Matrix4f;
 typedef Eigen::Quaternionf Quaternion;
 
+// 文件的内存映射只读视图, 替代把整个文件读进std::string的做法.
+// mmap失败时(例如文件系统不支持)回退为读入一块自有内存, 对调用方透明.
+class FileView
+{
+public:
+    enum MapMode
+    {
+        MAP_READ_ONLY,
+        // 私有写时复制映射, 可以修改内容但不会写回文件
+        MAP_COPY_ON_WRITE,
+    };
+
+    FileView();
+    ~FileView();
+    FileView(const FileView&) = delete;
+    FileView& operator=(const FileView&) = delete;
+
+    // file为资源路径, 内部会用PathToResourceAsFile转换
+    // sequential: 提示内核按顺序预读(madvise MADV_SEQUENTIAL)
+    bool Open(const std::string& file, MapMode mode = MAP_READ_ONLY, bool sequential = true);
+    void Close();
+
+    const char* GetData() const;
+    // 仅MAP_COPY_ON_WRITE模式下有效, 否则返回nullptr
+    char* GetMutableData();
+    size_t GetSize() const;
+    bool IsOpen() const;
+
+private:
+    char* m_data = nullptr;
+    size_t m_size = 0;
+    MapMode m_mode = MAP_READ_ONLY;
+    bool m_mapped = false;
+};
+
 struct Attrib
 {
     std::string name;
@@ -36,6 +77,36 @@ struct Uniform
     int location;
     int size;
     GLenum type;
+    // 在R3DMaterial block里时的字节偏移和数组步长, 否则为-1
+    int block_offset = -1;
+    int array_stride = -1;
+};
+
+// 顶点属性的固定slot, 链接时解析出location, 绘制时不再按名字查找
+enum VertexAttribSlot
+{
+    VERTEX_ATTRIB_POSITION, // a_position
+    VERTEX_ATTRIB_TEXCOORD, // a_texcoord
+    VERTEX_ATTRIB_NORMAL,   // a_normal
+    VERTEX_ATTRIB_INSTANCE_WORLD, // a_instance_world, mat4占4个连续location, 见SHADER_FEATURE_INSTANCED
+    VERTEX_ATTRIB_SLOT_COUNT
+};
+
+// 由系统在每次绘制时自动更新的uniform
+enum BuiltinUniform
+{
+    BUILTIN_MAT_WORLD,
+    BUILTIN_MAT_VIEW,
+    BUILTIN_MAT_PROJECTION,
+    BUILTIN_MAT_WORLD_VIEW,
+    BUILTIN_MAT_VIEW_PROJECTION,
+    BUILTIN_MAT_WVP,
+    BUILTIN_DIFFUSE_ENV_MAP,
+    BUILTIN_SPECULAR_ENV_MAP,
+    BUILTIN_IBL_BRDF_LUT_MAP,
+    BUILTIN_IBL_DIFFUSE_ENV_MAP,
+    BUILTIN_IBL_SPECULAR_ENV_MAP,
+    BUILTIN_UNIFORM_COUNT
 };
 
 class Program
@@ -45,20 +116,123 @@ public:
     ~Program();
 
     bool LoadAndCompile(const std::string& vert_file, const std::string& frag_file, const std::string& macros = "");
+    // LoadAndCompile拆成两步: BeginCompile只提交编译和链接, 不等待结果.
+    // 支持GL_KHR_parallel_shader_compile时可以用IsCompileComplete轮询, 再FinishCompile取结果
+    bool BeginCompile(const std::string& vert_file, const std::string& frag_file, const std::string& macros = "");
+    bool IsCompileComplete() const;
+    bool FinishCompile();
+    // 从glGetProgramBinary得到的binary创建, 驱动不接受时返回false
+    bool LoadFromBinary(GLenum binary_format, const void* binary, GLsizei length);
+    bool GetBinary(GLenum* out_binary_format, std::string* out_binary) const;
+    // 需要GetBinary时在LoadAndCompile之前设置
+    void SetBinaryRetrievable(bool retrievable);
     GLuint GetGLProgramId() const;
     int GetAttribLocation(const std::string& attrib_name);
+    int GetAttribLocation(VertexAttribSlot slot) const;
     int GetUniformLocation(const std::string& uniform_name);
     void Use();
 
 private:
+    struct BuiltinUniformSlot
+    {
+        BuiltinUniform id;
+        int location;
+    };
+    // 在uniform block里的内置uniform(location为-1)不会加入m_builtin_uniforms
+
     GLuint m_gl_program = 0;
     std::map<std::string, Attrib> m_attribs;;
     std::map<std::string, Uniform> m_uniforms;
-    std::list<std::string> m_builtin_uniforms; // wvp, vorld, view, projection.. etc
-    static std::list<std::string> AVAILABLE_BUILTIN_UNIFORMS;
+    int m_attrib_slot_locations[VERTEX_ATTRIB_SLOT_COUNT] = { -1, -1, -1, -1 };
+    std::vector<BuiltinUniformSlot> m_builtin_uniforms; // wvp, vorld, view, projection.. etc
+    GLint m_material_block_size = 0;
+    // 按location索引的uniform值影子副本, 供GLStateCache跳过没变的glUniform*
+    struct UniformShadow
+    {
+        int offset = -1;
+        int count = 0;
+        // 与GLStateCache当前的epoch相同时有效, 0表示从未写过
+        uint32_t epoch = 0;
+    };
+    std::vector<UniformShadow> m_uniform_shadows;
+    std::vector<float> m_uniform_shadow_values;
+    // 值与epoch内上次写入的相同时返回true, 否则记下新值
+    bool UpdateUniformShadow(uint32_t epoch, int location, const void* values, int count);
+    friend class GLStateCache;
+    bool m_binary_retrievable = false;
+    // BeginCompile到FinishCompile之间有效
+    GLuint m_vert_shader = 0;
+    GLuint m_frag_shader = 0;
+    void ExtractActiveVariables(GLuint program);
     friend class Material;
 };
 
+struct GLStateStats
+{
+    int issued = 0;
+    int elided = 0;
+};
+
+// GL状态的影子副本: program, 纹理单元, VAO, buffer, 深度/混合状态和uniform值.
+// 要设置的值与当前相同时跳过GL调用. 绘制mesh时的状态改动都经过它;
+// 其它代码直接调用GL改了状态(包括Program::Use后直接glUniform*)后需要Invalidate,
+// Renderer在每次RenderMeshes开始时会调用. Invalidate同时作废所有program的uniform影子
+class GLStateCache
+{
+public:
+    GLStateCache();
+
+    void Invalidate();
+    void UseProgram(GLuint program);
+    void BindTexture(int unit, GLenum target, GLuint texture);
+    // 切换VAO时同时失效GL_ELEMENT_ARRAY_BUFFER(它属于VAO状态)
+    void BindVertexArray(GLuint vao);
+    // GL_ARRAY_BUFFER, GL_ELEMENT_ARRAY_BUFFER, GL_UNIFORM_BUFFER
+    void BindBuffer(GLenum target, GLuint buffer);
+    // glBindBufferBase(GL_UNIFORM_BUFFER, ...), 同时会改变GL_UNIFORM_BUFFER的绑定
+    void BindUniformBuffer(GLuint index, GLuint buffer);
+    void InvalidateBuffers();
+    // GL_DEPTH_TEST, GL_BLEND
+    void SetCapability(GLenum capability, bool enabled);
+    void DepthMask(bool write);
+    void DepthFunc(GLenum func);
+    void BlendFunc(GLenum src, GLenum dst);
+
+    // 需要program已经是当前program
+    void Uniform1i(Program* program, int location, int value);
+    void Uniform1f(Program* program, int location, float value);
+    void Uniform3fv(Program* program, int location, int count, const float* values);
+    void UniformMatrix4fv(Program* program, int location, const float* matrix);
+
+    void ResetStats();
+    const GLStateStats& GetStats() const;
+
+private:
+    // 相同时记一次省掉的调用并返回true
+    bool Elide(bool same);
+
+    static const int MAX_TEXTURE_UNITS = 16;
+    static const int MAX_UNIFORM_BINDINGS = 4;
+    GLuint m_program;
+    int m_active_unit;
+    GLuint m_texture_2d[MAX_TEXTURE_UNITS];
+    GLuint m_texture_cube[MAX_TEXTURE_UNITS];
+    GLuint m_vao;
+    GLuint m_array_buffer;
+    GLuint m_element_buffer;
+    GLuint m_uniform_buffer;
+    GLuint m_uniform_bindings[MAX_UNIFORM_BINDINGS];
+    // -1: 未知
+    int m_depth_test;
+    int m_blend;
+    int m_depth_mask;
+    GLenum m_depth_func;
+    GLenum m_blend_src;
+    GLenum m_blend_dst;
+    uint32_t m_uniform_epoch = 0;
+    GLStateStats m_stats;
+};
+
 enum TextureFormat
 {
     RGB,
@@ -68,7 +242,7 @@ enum TextureFormat
 enum TextureType
 {
     TEXTURE_2D,
-    TEXTURE_CUBE_COMPACT
+    TEXTURE_CUBE
 };
 
 class Texture
@@ -81,7 +255,7 @@ public:
     int GetHeight() const;
     TextureFormat GetFormat() const;
     GLuint GetGlTextureId() const;
-    TextureType GetTextureType() const;
+    TextureType GetType() const;
 
 private:
     GLuint m_gl_texture = 0;
@@ -90,17 +264,63 @@ private:
     TextureFormat m_format = RGBA;
     TextureType m_type = TEXTURE_2D;
     friend class Renderer;
+    friend struct TextureStream;
+};
+
+// AnalyzeImage的结果
+struct ImageStats
+{
+    // 有介于0和255之间的alpha, 需要按半透明绘制
+    bool has_partial_alpha = false;
+    // 所有alpha都是255
+    bool opaque = true;
+    // alpha均值 / 255
+    float alpha_coverage = 1.0f;
+    uint8 channel_min[4] = { 0, 0, 0, 255 };
+    uint8 channel_max[4] = { 0, 0, 0, 255 };
+};
+
+// 一次遍历RGBA8像素得到ImageStats. x86用SSE2, ARM用NEON, 其他平台走标量
+void AnalyzeImage(const uint8* pixels, int width, int height, int row_stride, ImageStats* stats);
+
+// TextureTranscoder输出的块压缩格式族. 有无alpha按图片内容自动选择
+enum TextureCompressionFamily
+{
+    // ETC2 RGB8 / RGBA8(EAC), GLES3核心格式
+    TEXTURE_COMPRESSION_ETC2,
+    // BC1 / BC3, 桌面GL(S3TC)
+    TEXTURE_COMPRESSION_BC,
+};
+
+// 离线把png转成带完整mip链的KTX2(.ktx2, 无supercompression). 不需要GL上下文.
+// Renderer::LoadTexture遇到 xxx.png 时会优先加载同目录的 xxx.ktx2,
+// GL不支持该格式时用软件解码回退(ETC2/BC1/BC3), ASTC等无法软解的格式回退到png
+// 是否半透明记在自定义的R3DTranslucent键里; 其他工具生成的文件没有这个键, 按DFD的alpha通道或格式判断
+class TextureTranscoder
+{
+public:
+    static std::string GetKtx2Path(const std::string& texture_file);
+    static bool WriteKtx2FromPng(const std::string& png_file, const std::string& ktx2_file, TextureCompressionFamily family);
+    // 按 xxx_材质名_Base/RMA/Normal/Emissive.png 的规则转换mesh用到的全部贴图, 返回写出的文件数
+    static int TranscodePBRTextures(const std::string& mesh_file_path, TextureCompressionFamily family);
 };
 
-class MaterialParam;
+class Mesh;
 class SubMesh;
+// 3阶球谐, 每个系数是一个vec3
+static const int SH_COEFFICIENT_COUNT = 9;
+
+// 参数的存储在创建时按program的反射结果排好: float/mat4/SH放在一块连续的float数组里, 贴图单独一个数组.
+// shader可以把参数声明在 layout(std140) uniform R3DMaterial { ... }; 里, 这时参数写进block的镜像,
+// 只有修改过的范围会在下次Apply时上传. 不存在于shader里的参数直接忽略
 class Material
 {
 public:
     Material(SubMesh* submesh, Program* program);
     ~Material();
     
-    void Apply();
+    // mesh: 提供内置矩阵的mesh, 为空时取所属submesh的mesh(实例共用原型的material)
+    void Apply(Mesh* mesh = nullptr);
     void SetName(const std::string& name);
     std::string GetName() const;
     Program* GetProgram() const;
@@ -110,109 +330,312 @@ public:
     void SetSHParam(const std::string& name, const float* sh_params);
     bool IsTranslucent() const;
     void SetTranslucent(bool translucent);
+    // 只写深度的遮罩(CreateDepthMesh/CreateOccluderMesh). 不透明物体里最先画, 才能挡住后面画的颜色
+    bool IsDepthOnly() const;
+    void SetDepthOnly(bool depth_only);
+    // 贴图组合的16位摘要, 用于绘制排序
+    uint16_t GetTextureSetKey() const;
 
 private:
     void ResetIdleTextureUnit();
-    void UpdateBuiltinUniforms();
+    void UpdateBuiltinUniforms(Mesh* mesh);
+    void ApplyMatrix4f(int location, const Matrix4f& matrix);
+    // 绑定到下一个空闲的纹理单元
+    void ApplyTexture(int location, Texture* texture);
+
+    enum ParamType
+    {
+        PARAM_FLOAT,
+        PARAM_MATRIX4F,
+        PARAM_TEXTURE,
+        PARAM_SH,
+    };
+
+    struct ParamSlot
+    {
+        std::string name;
+        ParamType type = PARAM_FLOAT;
+        // -1表示在R3DMaterial block里
+        int location = -1;
+        // 普通uniform: m_param_data的下标(贴图为m_textures的下标); block成员: 字节偏移
+        int offset = 0;
+        int array_stride = -1;
+        // 没设置过的参数不提交, 与之前只提交设置过的参数一致
+        bool assigned = false;
+    };
+
+    void BuildParamLayout();
+    ParamSlot* FindParamSlot(const std::string& name, ParamType type);
+    void WriteParam(ParamSlot* slot, const float* values, int count, int stride_floats);
 
 private:
     SubMesh* m_submesh = nullptr;
     Program* m_program = nullptr;
-    std::map<std::string, MaterialParam*> m_params;
+    std::vector<ParamSlot> m_param_slots;
+    std::vector<float> m_param_data;
+    std::vector<Texture*> m_textures;
+    // R3DMaterial block的CPU镜像和待上传的范围
+    std::vector<uint8> m_block_data;
+    size_t m_block_dirty_begin = SIZE_MAX;
+    size_t m_block_dirty_end = 0;
+    GLuint m_block_ubo = 0;
     bool m_translucent = false;
+    bool m_depth_only = false;
     int m_idle_texture_unit = 0;
-    friend class TextureMaterialParam;
+    // Apply期间有效
+    GLStateCache* m_gl_state = nullptr;
+    uint16_t m_texture_set_key = 0;
+};
+
+// 默认为RGBA
+struct PngImage
+{
+    unsigned width = 0;
+    unsigned height = 0;
+    int bytesPerPixel = 4;
+    std::vector<unsigned char> pixels;
+    
+    bool LoadFromFile(const std::string& file_path);
 };
 
-class MaterialParam
+struct ObjTri
 {
-public:
-    MaterialParam(Material* material, const std::string& name);
-    virtual ~MaterialParam() {}
-    virtual void Apply() = 0;
+    int v0,t0,n0,v1,t1,n1,v2,t2,n2;
+};
 
-protected:
-    std::string m_name;
-    Material* m_material;
+// 一次Parse的统计信息, 用于衡量加载性能
+struct ObjParseStats
+{
+    size_t bytes = 0;
+    size_t positions = 0;
+    size_t texcoords = 0;
+    size_t normals = 0;
+    size_t triangles = 0;
+    // 焊接后所有submesh的唯一顶点数
+    size_t vertices = 0;
+    // 流式解析时估计的CPU内存峰值
+    size_t peak_resident_bytes = 0;
+    int threads = 1;
+    double seconds = 0.0;
+
+    double GetMBPerSecond() const;
 };
 
-class FloatMaterialParam : public MaterialParam
+class Mesh;
+class SubMesh;
+class ObjMeshParser
 {
 public:
-    FloatMaterialParam(Material* material, const std::string& name, float value);
-    virtual void Apply() override;
+    ObjMeshParser(Mesh* mesh, const char* data, size_t data_size, bool export_triangles = false);
+
+    // 加载一个obj模型, 返回它每个子mesh使用的material名称.
+    // 输入buffer只读, 不需要以'\0'结尾.
+    std::vector<std::string> Parse(bool* succ = nullptr);
+    const ObjParseStats& GetStats() const;
+
+    // 并行解析的线程数. 1为单线程(默认), 0为使用所有硬件线程.
+    // 实际线程数还受文件大小限制, 每块至少OBJ_MIN_CHUNK_BYTES.
+    void SetThreadCount(int thread_count);
+
+    static const int OBJ_MIN_CHUNK_BYTES = 1 << 20;
+
+    // 生成submesh后是否调用SubMesh::Optimize重排索引和顶点, 默认开启
+    void SetOptimizeSubMeshes(bool optimize);
 
 private:
-    float m_value;
-    friend class Material;
+    SubMesh* GenerateSubMesh(std::vector<Vector3f> *positions, std::vector<Vector2f> *texcoords, std::vector<Vector3f> *normals, std::vector<ObjTri> *triangles);
+
+private:
+    Mesh* m_mesh = nullptr;
+    const char* m_data = nullptr;
+    size_t m_data_size = 0;
+    bool m_export_triangles = false;
+    int m_thread_count = 1;
+    bool m_optimize_submeshes = true;
+    ObjParseStats m_stats;
+    friend class ObjStreamParser;
 };
 
-class Matrix4fMaterialParam : public MaterialParam
+// 流式obj解析: 以固定大小的窗口读文件, 三角形攒够一批就焊接, 优化并追加到submesh的GPU buffer里,
+// 文本, 面列表和展开后的顶点都不会整体驻留内存. 面可以引用之前任意顶点, 所以v/vt/vn表仍需常驻,
+// 超出预算时只打日志. 必须在GL线程调用; 不支持export_triangles.
+struct ObjChunk;
+class ObjStreamParser
 {
 public:
-    Matrix4fMaterialParam (Material* material, const std::string& name, Matrix4f matrix);
-    virtual void Apply() override;
+    ObjStreamParser(Mesh* mesh, size_t memory_budget);
+    ~ObjStreamParser();
+
+    // obj_file为资源路径. 返回每个submesh的material名称, 含义同ObjMeshParser::Parse
+    std::vector<std::string> Parse(const std::string& obj_file, bool* succ = nullptr);
+    const ObjParseStats& GetStats() const;
+
 private:
-    Matrix4f m_matrix;
-    friend class Material;
+    void ProcessWindow(const char* begin, const char* end);
+    void FlushBatch();
+    void FinishSubMesh(bool force);
+
+private:
+    Mesh* m_mesh = nullptr;
+    size_t m_memory_budget = 0;
+    size_t m_window_bytes = 0;
+    size_t m_batch_triangles = 0;
+    ObjMeshParser m_batch_parser;
+
+    std::vector<Vector3f> m_positions;
+    std::vector<Vector2f> m_texcoords;
+    std::vector<Vector3f> m_normals;
+    std::vector<ObjTri> m_batch;
+    ObjChunk* m_chunk = nullptr; // 当前窗口的解析结果, 复用以免反复分配
+
+    SubMesh* m_current = nullptr;
+    size_t m_group_triangles = 0;
+    std::vector<std::string> m_names;
+    bool m_failed = false;
+    bool m_over_budget_logged = false;
+    ObjParseStats m_stats;
 };
 
-class TextureMaterialParam : public MaterialParam
+// 预编译的二进制mesh(.r3dmesh): 每个submesh可以直接上传的顶点/索引流, 材质名和包围盒.
+// Renderer的Create*Mesh会优先加载obj同目录下不比obj旧的同名.r3dmesh.
+class Renderer;
+class MeshCache
 {
 public:
-    TextureMaterialParam(Material* material, const std::string& name, Texture* texture);
-    virtual void Apply() override;
+    // xxx.obj -> xxx.r3dmesh
+    static std::string GetCachePath(const std::string& mesh_file_path);
+    // 缓存存在且修改时间不早于obj(或obj不存在)
+    static bool IsFresh(const std::string& mesh_file_path, const std::string& cache_file);
 
-private:
-    Texture* m_texture;
-    friend class Material;
+    // 离线转换: 用ObjMeshParser解析obj并写出cache_file(普通文件路径). 不需要GL上下文
+    static bool WriteFromObj(const std::string& mesh_file_path, const std::string& cache_file);
+
+    // mmap缓存文件并直接上传到VBO. 文件无效时返回nullptr
+    static Mesh* Load(Renderer* renderer, const std::string& cache_file, std::vector<std::string>* submesh_material_names);
+};
+
+// MeshCodec::Benchmark的结果
+struct MeshCodecBenchmark
+{
+    size_t obj_bytes = 0;
+    size_t compressed_bytes = 0;
+    // 从打开文件到得到CPU侧submesh的时间, 不含GL上传
+    double obj_seconds = 0.0;
+    double decode_seconds = 0.0;
+    // 文件已在内存时纯解码的吞吐, 按解码输出的字节数计
+    size_t vertex_decode_bytes = 0;
+    double vertex_decode_seconds = 0.0;
+    size_t index_decode_bytes = 0;
+    double index_decode_seconds = 0.0;
+
+    double GetSizeRatio() const;
+    double GetSpeedup() const;
+    // MB/s
+    double GetVertexDecodeThroughput() const;
+    double GetIndexDecodeThroughput() const;
 };
 
-class SHMaterialParam : public MaterialParam
+// 压缩的mesh(.r3z): 和.r3dmesh内容相同, 但顶点流按字节做差分+zigzag后分组位打包,
+// 索引流做差分+zigzag+变长编码. 解码得到CPU侧数组, 因此同样支持Renderer::SetVertexFormat.
+// Create*Mesh可以直接传入.r3z路径, 贴图/材质命名规则和obj相同.
+class MeshCodec
 {
 public:
-    SHMaterialParam(Material* material, const std::string& name, const float* sh_params);
-    virtual void Apply() override;
-    
-private:
-    const float* m_sh_params = nullptr;
-    friend class Material;
+    // 任意stride的顶点流. 按字节通道差分, 每16个顶点一组选0/2/4/8位宽
+    static void EncodeVertexBuffer(std::string* out, const void* vertices, size_t vertex_count, size_t stride);
+    static bool DecodeVertexBuffer(void* vertices, size_t vertex_count, size_t stride, const char* data, size_t size);
+    // vertex_count个顶点编码后至少占的字节数(所有组都是0位宽). 分配前用来校验文件里的数量
+    static size_t GetMinVertexBufferSize(size_t vertex_count, size_t stride);
+    // 与前一个索引的差值zigzag后按LEB128写出. 经过SubMesh::Optimize的索引差值大多只需1字节
+    static void EncodeIndexBuffer(std::string* out, const uint32_t* indices, size_t index_count);
+    static bool DecodeIndexBuffer(uint32_t* indices, size_t index_count, const char* data, size_t size);
+
+    // xxx.obj -> xxx.r3z
+    static std::string GetCompressedPath(const std::string& mesh_file_path);
+    static bool IsCompressedPath(const std::string& mesh_file_path);
+
+    // 离线转换, 不需要GL上下文
+    static bool WriteFromObj(const std::string& mesh_file_path, const std::string& compressed_file);
+    // 解码成CPU侧的submesh, 第一次绘制时上传. 文件无效时返回nullptr
+    static Mesh* Load(Renderer* renderer, const std::string& compressed_file, std::vector<std::string>* submesh_material_names);
+
+    // 冷加载对比: 解析obj和解码.r3z各一次. 计时前尽量把两个文件踢出page cache. 不需要GL上下文
+    static bool Benchmark(const std::string& mesh_file_path, const std::string& compressed_file, MeshCodecBenchmark* result);
 };
 
-// 默认为RGBA
-struct PngImage
+// 顶点格式, 可组合. 默认VERTEX_FORMAT_FLOAT: 位置/uv/法线都是float.
+// 所有属性交错存放在一个VBO里. 量化格式需要shader里用R3D_DECODE_POSITION/R3D_DECODE_NORMAL解码,
+// 对应的宏由GetVertexFormatMacros生成, 解码函数会自动注入到顶点shader前面.
+enum VertexFormatFlags
 {
-    unsigned width = 0;
-    unsigned height = 0;
-    int bytesPerPixel = 4;
-    std::vector<unsigned char> pixels;
-    
-    bool LoadFromFile(const std::string& file_path);
+    VERTEX_FORMAT_FLOAT = 0,
+    // 位置按submesh的AABB量化为unorm16, 由matPosDequant还原
+    VERTEX_QUANTIZE_POSITION = 1 << 0,
+    // uv存为half float
+    VERTEX_HALF_TEXCOORD = 1 << 1,
+    // uv存为unorm16, 有超出[0, 1]的uv时自动退回half float
+    VERTEX_UNORM16_TEXCOORD = 1 << 2,
+    // 法线八面体编码为2个snorm16
+    VERTEX_OCT_NORMAL = 1 << 3,
 };
 
-struct ObjTri
+std::string GetVertexFormatMacros(int vertex_format);
+
+// shader变体的特性位, 代替宏字符串作为变体的key. 每一位对应一个#define
+enum ShaderFeature
 {
-    int v0,t0,n0,v1,t1,n1,v2,t2,n2;
+    SHADER_FEATURE_QUANTIZED_POSITION = 1 << 0,
+    SHADER_FEATURE_OCT_NORMAL = 1 << 1,
+    SHADER_FEATURE_NORMAL_MAP = 1 << 2,
+    SHADER_FEATURE_EMISSIVE_MAP = 1 << 3,
+    // 定义R3D_INSTANCED: 世界矩阵来自逐实例属性a_instance_world. shader用R3D_MAT_WORLD,
+    // R3D_MAT_WORLD_VIEW, R3D_MAT_WVP代替matWorld等即可同时支持两种情况.
+    // 没有用这些宏的shader里a_instance_world不活跃, 绘制时自动退回逐mesh绘制
+    SHADER_FEATURE_INSTANCED = 1 << 4,
+    SHADER_FEATURE_COUNT = 5,
 };
 
-class Mesh;
-class SubMesh;
-class ObjMeshParser
+// 内置的shader, 文件在资源目录的/shaders下
+enum ShaderId
 {
-public:
-    ObjMeshParser(Mesh* mesh, char* data, int data_size);
+    SHADER_PBR,
+    SHADER_SCAN,
+    SHADER_UNLIT,
+    SHADER_DEPTH_MASK,
+    SHADER_OCCLUDER,
+    SHADER_COUNT
+};
 
-    // 加载一个obj模型, 返回它每个子mesh使用的material名称.
-    std::vector<std::string> Parse();
+struct ShaderVariant
+{
+    ShaderId shader;
+    int features;
+};
 
-private:
-    SubMesh* GenerateSubMesh(std::vector<Vector3f> *positions, std::vector<Vector2f> *texcoords, std::vector<Vector3f> *normals, std::vector<ObjTri> *triangles);
+// 顶点格式对应的特性位(量化位置, 八面体法线)
+int GetVertexFormatShaderFeatures(int vertex_format);
+std::string GetShaderFeatureMacros(int features);
 
-private:
-    Mesh* m_mesh = nullptr;
-    int m_curr = 0;
-    char* m_data = nullptr;
-    int m_data_size = 0;
+// 一个顶点属性在buffer里的布局
+struct VertexAttribLayout
+{
+    GLuint buffer = 0;
+    int components = 0;
+    GLenum type = GL_FLOAT;
+    bool normalized = false;
+    int stride = 0;
+    int offset = 0;
+};
+
+// SubMesh::Optimize前后的顶点缓存指标(按16项FIFO缓存模拟)
+// ACMR: 平均每个三角形的缓存未命中数, 最优约0.5
+// ATVR: 未命中数 / 顶点数, 最优为1
+struct MeshOptimizeStats
+{
+    float acmr_before = 0.0f;
+    float acmr_after = 0.0f;
+    float atvr_before = 0.0f;
+    float atvr_after = 0.0f;
 };
 
 class SubMesh
@@ -223,17 +646,105 @@ public:
     
     Mesh* GetMesh() const;
     Material* GetMaterial() const;
+    // 焊接后的唯一顶点数
     int GetVertexCount() const;
+    // 索引数, 即三角形数 * 3
+    int GetIndexCount() const;
+    // 焊接前后的顶点数之比, 即每个顶点平均被多少个三角形角点共享
+    float GetVertexReductionRatio() const;
+    // 模型空间的AABB
+    Vector3f GetBoundsMin() const;
+    Vector3f GetBoundsMax() const;
+    // 模型空间的包围球, 用于视锥剔除
+    Vector3f GetBoundingSphereCenter() const;
+    float GetBoundingSphereRadius() const;
+    // VertexFormatFlags组合, 由Renderer::SetVertexFormat决定
+    int GetVertexFormat() const;
+    std::vector<Vector3f> GetOriPositionData();
+    std::vector<ObjTri> GetOriTriangleData();
+
+    // 标记为动态mesh, 顶点位置可通过UpdatePositions每帧更新
+    void MarkDymc(bool dymc);
+    // 实例跟随原型
+    bool IsDymc() const;
+    // positions按三角形角点排列, 共GetIndexCount()个
+    void UpdatePositions(Vector3f* positions);
+
+    // 加载期优化: 顶点缓存重排, 按簇减少overdraw, 顶点按使用顺序重排.
+    // 需要在第一次Render(上传到GPU)之前调用
+    void Optimize();
+    const MeshOptimizeStats& GetOptimizeStats() const;
 
     void Render();
 
+private:
+    // instance_count为0时画mesh这一个实例; 否则从instance_buffer的instance_offset字节处
+    // 取instance_count个世界矩阵, 一次instanced draw画完
+    void Draw(Mesh* mesh, GLuint instance_buffer, size_t instance_offset, int instance_count);
+    void UploadIndices();
+    // 根据AABB更新包围球. positions为空时用AABB的外接球
+    void UpdateBoundingSphere(const Vector3f* positions, int count);
+    // 复制一份焊接后的位置和索引用于软件光栅化. CPU侧已释放时从GPU buffer读回
+    bool CopyOccluderGeometry();
+    // 按m_vertex_format打包成一个交错VBO并释放CPU侧顶点
+    void UploadVertices();
+    void SetupSeparateStreamLayouts();
+    // 流式加载: 把一批焊接好的顶点/索引追加到GPU buffer末尾, 最后FinishStream收缩多余容量
+    void AppendStreamBatch(SubMesh* batch);
+    void FinishStream();
+
 private:
     int m_vertex_count = 0;
     Vector3f* m_positions = nullptr;
     Vector2f* m_texcoords = nullptr;
     Vector3f* m_normals = nullptr;
 
+    // 上传到m_ibo后释放
+    std::vector<uint32_t> m_indices;
+    int m_index_count = 0;
+    GLenum m_index_type = GL_UNSIGNED_INT;
+    // 每个焊接顶点第一次出现的角点序号, 用于UpdatePositions
+    std::vector<int> m_vertex_sources;
+    std::vector<Vector3f> m_dymc_positions;
+    MeshOptimizeStats m_optimize_stats;
+    Vector3f m_bounds_min = Vector3f::Zero();
+    Vector3f m_bounds_max = Vector3f::Zero();
+    Vector3f m_sphere_center = Vector3f::Zero();
+    float m_sphere_radius = 0.0f;
+    // 遮挡物的CPU几何, 见CopyOccluderGeometry
+    std::vector<Vector3f> m_occluder_positions;
+    std::vector<uint32_t> m_occluder_indices;
+    // Renderer::CreateMeshInstance创建的实例: 几何和material都用原型的, 自己不持有GL资源
+    SubMesh* m_prototype = nullptr;
+
+    // 流式加载期间各GPU buffer的容量(字节)
+    struct StreamCapacity
+    {
+        size_t positions = 0;
+        size_t texcoords = 0;
+        size_t normals = 0;
+        size_t indices = 0;
+    };
+    StreamCapacity* m_stream_capacity = nullptr;
+    bool m_stream_has_texcoords = false;
+    bool m_stream_has_normals = false;
+
+    // export_triangles时保留的原始数据
+    std::vector<Vector3f> m_ori_positions;
+    std::vector<ObjTri> m_ori_triangles;
+
     GLuint m_vao = 0;
+    GLuint m_vbo_position = 0;
+    GLuint m_vbo_texcoords = 0;
+    GLuint m_vbo_normals = 0;
+    GLuint m_ibo = 0;
+    // 交错的顶点buffer. 动态mesh的位置仍单独放在m_vbo_position
+    GLuint m_vbo_vertices = 0;
+    int m_vertex_format = VERTEX_FORMAT_FLOAT;
+    VertexAttribLayout m_position_layout;
+    VertexAttribLayout m_texcoord_layout;
+    VertexAttribLayout m_normal_layout;
+    bool m_dymc = false;
 
     Mesh* m_mesh = nullptr;
     
@@ -244,6 +755,62 @@ private:
     Material* m_material = nullptr;
     friend class ObjMeshParser;
     friend class Renderer;
+    friend class Mesh;
+    friend class MeshCache;
+    friend class MeshCodec;
+    friend class ObjStreamParser;
+};
+
+// 内置uniform block. shader里声明下面的block(成员名与普通uniform一致)即可共享, 不再逐次绘制设置;
+// 没有声明的shader仍然按普通uniform设置.
+//   layout(std140) uniform R3DFrame { mat4 matView; mat4 matProjection; mat4 matViewProjection; vec4 cameraPosition; };
+//   layout(std140) uniform R3DObject { mat4 matWorld; mat4 matWorldView; mat4 matWVP; };
+// 每帧在RenderMeshes开始时更新一次, 所有program共享
+struct FrameConstants
+{
+    Matrix4f view;
+    Matrix4f projection;
+    Matrix4f view_projection;
+    Vector4f camera_position;
+};
+
+// 每个mesh每帧计算一次, 所有submesh共享
+struct ObjectConstants
+{
+    Matrix4f world;
+    Matrix4f world_view;
+    Matrix4f wvp;
+};
+
+// 上一次RenderMeshes视锥剔除的结果. visible/culled以submesh计,
+// 被BVH整体剔除的mesh不逐个访问, 其submesh按总数计入culled(没有材质的submesh也算在内)
+struct CullStats
+{
+    int visible = 0;
+    int culled = 0;
+    // 通过BVH测试的mesh数和访问的BVH节点数
+    int meshes_visible = 0;
+    int bvh_nodes_visited = 0;
+    // 通过视锥测试但被遮挡物挡住的submesh数, 已计入culled
+    int occluded = 0;
+    int occluder_triangles = 0;
+};
+
+// 上一次RenderMeshes的绘制统计
+struct DrawStats
+{
+    // 实际发出的draw call数, instanced draw算一次
+    int draw_calls = 0;
+    int instanced_draw_calls = 0;
+    // 通过instanced draw画出的实例数
+    int instances = 0;
+};
+
+// 渲染队列中的一次绘制, 按key排序
+struct DrawItem
+{
+    uint64_t key;
+    SubMesh* submesh;
 };
 
 class Renderer;
@@ -263,13 +830,26 @@ public:
 
     void SetTransform(const Matrix4f& Matrix4f);
     Matrix4f GetTransform();
+    SubMesh* GetSubMesh(int index) const;
     
     void RenderOpaqueSubMeshes();
     void RenderTranslucentSubMeshes();
+    void replaceTexture(Texture* new_tex);
+    // 当前帧的变换矩阵, 第一次调用时计算
+    const ObjectConstants& GetObjectConstants();
 
 private:
+    // 更新并绑定R3DObject
+    void BindObjectConstants();
+    // 变换或包围体变化后调用, 已加入Renderer时排队到下一帧更新BVH
+    void MarkBoundsDirty();
+    // 所有submesh AABB的并集变换到世界空间. 含动态submesh(包围体不可信)或没有submesh时返回false
+    bool ComputeWorldBounds(Vector3f* out_min, Vector3f* out_max);
+
     Renderer* m_renderer;
     std::vector<SubMesh*> m_submeshes;
+    // 该mesh加载的贴图路径, 析构时从Renderer的m_texture_cache中释放
+    std::set<std::string> m_associated_textures;
 
     Vector3f m_position = Vector3f::Zero();
     Quaternion m_rotation   ;
@@ -280,8 +860,29 @@ private:
     Matrix4f m_transform;
     bool m_transform_dirty = true;
 
+    ObjectConstants m_object_constants;
+    uint64_t m_object_constants_frame = ~0ULL;
+    GLuint m_object_ubo = 0;
+    uint64_t m_object_ubo_frame = ~0ULL;
+
+    // 由Renderer::AddMesh/RemoveMesh维护
+    bool m_in_renderer = false;
+    std::list<Mesh*>::iterator m_render_iter;
+    // 在MeshBVH中的叶子, 没有可用包围体时为-1并放在Renderer的m_unbounded_meshes
+    int m_bvh_leaf = -1;
+    bool m_bounds_dirty = false;
+    // CreateOccluderMesh创建的mesh: 写入遮挡缓冲, 自身不做遮挡测试
+    bool m_occluder = false;
+    // CreateMeshInstance: 实例指向最初的原型, 原型记录它的所有实例
+    Mesh* m_instance_of = nullptr;
+    std::vector<Mesh*> m_instances;
+
     friend class Renderer;
+    friend class SubMesh;
     friend class ObjMeshParser;
+    friend class MeshCache;
+    friend class MeshCodec;
+    friend class ObjStreamParser;
 };
 
 class Renderer;
@@ -322,30 +923,197 @@ private:
     friend class TryonCalculator; //for test..
 };
 
+// Renderer::CreatePBRMeshAsync返回的句柄. 状态只在渲染线程的Renderer::ProcessAsyncLoads里推进,
+// 因此在渲染线程上查询不需要加锁
+class MeshLoadHandle
+{
+public:
+    enum State
+    {
+        LOADING,
+        READY,
+        FAILED,
+    };
+
+    State GetState() const;
+    bool IsDone() const;
+    // READY之后返回可以绘制的mesh, 和CreatePBRMesh一样由调用方负责delete
+    Mesh* GetMesh() const;
+
+private:
+    State m_state = LOADING;
+    Mesh* m_mesh = nullptr;
+
+    friend class Renderer;
+};
+
+// 按mesh世界空间AABB建的动态BVH. 叶子存放加宽过的AABB, mesh小幅移动时不用改树;
+// 超出后删除重插, 插入按表面积代价选兄弟节点并做AVL式旋转保持平衡
+class MeshBVH
+{
+public:
+    // 返回叶子节点id
+    int Insert(Mesh* mesh, const Vector3f& bounds_min, const Vector3f& bounds_max);
+    void Remove(int leaf);
+    // 新的AABB仍在叶子的加宽AABB内时什么都不做并返回false
+    bool Move(int leaf, const Vector3f& bounds_min, const Vector3f& bounds_max);
+    void Clear();
+    // 层次视锥剔除: 整个在某个面外的子树跳过, 整个在视锥内的子树不再逐面测试.
+    // planes见ExtractFrustumPlanes. 返回访问的节点数
+    int QueryFrustum(const Vector4f planes[6], std::vector<Mesh*>* out_meshes);
+    int GetHeight() const;
+
+private:
+    struct Node
+    {
+        Vector3f bounds_min;
+        Vector3f bounds_max;
+        // 空闲节点用parent串成链表
+        int parent = -1;
+        int child[2] = { -1, -1 };
+        // 叶子为0, 空闲为-1
+        int height = 0;
+        Mesh* mesh = nullptr;
+
+        bool IsLeaf() const { return child[0] < 0; }
+    };
+    int AllocateNode();
+    void FreeNode(int node);
+    void InsertLeaf(int leaf);
+    void RemoveLeaf(int leaf);
+    // 从node往上重新计算AABB和高度, 途中做旋转
+    void Refit(int node);
+    int Balance(int node);
+    void CollectSubtree(int node, std::vector<Mesh*>* out_meshes);
+
+    std::vector<Node> m_nodes;
+    int m_root = -1;
+    int m_free_list = -1;
+    // QueryFrustum的遍历栈: 节点id和还需要测试的面(位掩码)
+    std::vector<std::pair<int, int>> m_stack;
+};
+
+class OcclusionWorkers;
+
+// CPU软件光栅化的低分辨率深度缓冲, 用于遮挡剔除. 深度为NDC z映射到[0,1], 越小越近.
+// 遮挡物先按像素中心采样, 再做一次3x3腐蚀(取最远深度), 低分辨率下轮廓附近不会高估覆盖.
+// 每8x8像素块另存块内最远深度(一层HiZ), 测试时先看块, 块不能判定时再逐像素
+class OcclusionBuffer
+{
+public:
+    OcclusionBuffer() = default;
+    OcclusionBuffer(const OcclusionBuffer&) = delete;
+    OcclusionBuffer& operator=(const OcclusionBuffer&) = delete;
+    ~OcclusionBuffer();
+
+    // 宽高向上对齐到8
+    void Resize(int width, int height);
+    // 清空深度和收集的三角形
+    void Clear();
+    // 把遮挡物变换到屏幕空间收集起来. 跨近裁剪面或离屏幕太远的三角形直接丢弃
+    void AddOccluder(const Matrix4f& wvp, const std::vector<Vector3f>& positions, const std::vector<uint32_t>& indices);
+    // 光栅化收集的三角形, 按8行块对齐的行带分给thread_count个线程(调用线程算一个, 其余是常驻线程)
+    void Rasterize(int thread_count);
+    // 模型空间AABB在wvp下是否完全被遮挡. 跨近裁剪面时返回false
+    bool IsOccluded(const Matrix4f& wvp, const Vector3f& bounds_min, const Vector3f& bounds_max) const;
+
+    int GetWidth() const;
+    int GetHeight() const;
+    // 行优先, 第0行在底部(与GL贴图一致)
+    const float* GetDepth() const;
+    int GetTriangleCount() const;
+
+private:
+    struct ScreenTriangle
+    {
+        float x[3];
+        float y[3];
+        float z[3];
+        float min_y;
+        float max_y;
+    };
+    // 按像素中心光栅化[y_begin, y_end)行到m_coverage
+    void RasterizeBand(int y_begin, int y_end);
+    // m_coverage腐蚀后写入m_depth的[y_begin, y_end)行, 并更新这些行的HiZ
+    void ErodeBand(int y_begin, int y_end);
+
+    int m_width = 0;
+    int m_height = 0;
+    int m_tiles_x = 0;
+    int m_tiles_y = 0;
+    std::vector<float> m_depth;
+    // 腐蚀前的中心采样结果
+    std::vector<float> m_coverage;
+    std::vector<float> m_tile_max;
+    std::vector<ScreenTriangle> m_triangles;
+    // 第一次需要多线程时创建, 之后每帧复用
+    OcclusionWorkers* m_workers = nullptr;
+};
+
+class AssetLoadPool;
+struct AsyncPBRLoad;
+struct TextureStream;
+
 class Renderer
 {
 public:
-    Renderer(int screen_width, int screen_height);
+    Renderer(int screen_width, int screen_height, std::string resource_dir);
     ~Renderer();
 
     // 绘制已经加到列表里的mesh
     void BeginRender();
+    void BeginRenderNoClear();
     void RenderBackground(GLuint background_texture_id);
     void RenderMeshes();
     void EndRender();
     
     Camera* GetCamera() const;
+    const FrameConstants& GetFrameConstants() const;
+    GLStateCache* GetGLStateCache();
+    // 上一次RenderMeshes实际发出和省掉的状态调用数
+    const GLStateStats& GetGLStateStats() const;
+    // 默认开启. 只作用于RenderMeshes, 单独调用Mesh::RenderOpaqueSubMeshes等不剔除
+    void SetFrustumCulling(bool enabled);
+    const CullStats& GetCullStats() const;
+    // 遮挡剔除, 默认开启, 只在有遮挡物(CreateOccluderMesh)时生效. 遮挡物每帧在CPU上
+    // 光栅化到width x height的深度缓冲, submesh的AABB被完全挡住时不提交.
+    // thread_count为0时取min(hardware_concurrency, 4)
+    void SetOcclusionCulling(bool enabled, int width = 256, int height = 128, int thread_count = 0);
+    // 把上一帧的遮挡缓冲转成灰度贴图(越近越亮)并返回id, 可以用RenderBackground画出来调试
+    GLuint GetOcclusionDebugTexture();
+    // RenderMeshes每调用一次加一
+    uint64_t GetFrameIndex() const;
     int GetScreenWidth() const;
     int GetScreenHeight() const;
-    Texture* GetDiffuseEnvTexture() const;
-    Texture* GetSpecularEnvTexture() const;
-    Texture* GetIblDFGTexture() const;
-    Texture* GetIblIrradianceTexture() const;
-    Texture* GetIblSkyboxTexture() const;
+    Texture* GetDiffuseEnvTexture();
+    Texture* GetSpecularEnvTexture();
+    Texture* GetIblBrdfLutTexture();
+    Texture* GetIblDiffuseEnvTexture();
+    Texture* GetIblSpecularEnvTexture();
     const float* GetSHParams() const;
     
     Program* LoadProgram(const std::string& vert_file, const std::string& frag_file, const std::string& macros = "");
-    Texture* LoadTexture(const std::string& texture, bool* out_translucent_flag = nullptr, bool generate_mipmap = false, TextureType texture_type = TEXTURE_2D);
+    // 链接好的program binary缓存到该目录, 下次启动直接glProgramBinary跳过编译.
+    // 以源码, 宏和驱动字符串的hash为文件名, 损坏或驱动不接受时自动重新编译. 默认为空(关闭)
+    void SetProgramBinaryCacheDir(const std::string& cache_dir);
+    // 按shader和特性位取program变体, 没有预编译时在第一次使用时编译
+    Program* LoadProgramVariant(ShaderId shader, int features);
+    // 预编译变体, 避免第一次使用时卡顿. 驱动支持GL_KHR_parallel_shader_compile时全部提交并行编译,
+    // 之后每帧收取编译完的; 否则variants_per_frame>0时每帧编译这么多个, 0时立即全部编译完
+    void PrecompileShaderVariants(const std::vector<ShaderVariant>& variants, int variants_per_frame = 0);
+    // BeginRender/BeginRenderNoClear会自动调用. 返回还没编译完的变体数量
+    int ProcessShaderPrecompile();
+    Texture* LoadTexture(const std::string& texture_file, bool* out_translucent_flag = nullptr, bool generate_mipmap = false);
+    Texture* LoadCubeTexture(const std::string& cube_texture_file, bool load_mipmap_chain = false);
+
+    // 贴图缓存的引用计数. 引用过又全部释放的贴图进入LRU, 缓存总量超过预算时从最久没用的开始释放.
+    // 从来没有Retain过的贴图(环境贴图等)常驻到Renderer析构. Mesh析构时会Release它加载的贴图
+    void RetainTexture(const std::string& texture_file);
+    void ReleaseTexture(const std::string& texture_file);
+    // 默认0: 没有引用的贴图立刻释放
+    void SetTextureCacheBudget(size_t bytes);
+    // 缓存中所有贴图上传的字节数(含mip)
+    size_t GetTextureMemoryUsage() const;
     
     void LoadSHTextures(const std::string& sh_texture_name);
     
@@ -355,25 +1123,199 @@ public:
     void AddMesh(Mesh* mesh);
     void RemoveMesh(Mesh* mesh);
 
+    // 之后创建的mesh使用的顶点格式(VertexFormatFlags), 默认VERTEX_FORMAT_FLOAT.
+    // 只对解析obj得到的mesh生效, .r3dmesh和流式加载的mesh总是float
+    void SetVertexFormat(int vertex_format);
+
+    // 大于0时, 没有.r3dmesh的obj改用ObjStreamParser流式加载, CPU内存控制在该预算附近.
+    // 默认0(整文件解析)
+    void SetMeshStreamingBudget(size_t budget_bytes);
+
     // 加载好模型和贴图和Material, 并设置好对应的material params
-    Mesh* CreatePBRMesh(const std::string& mesh_file_path);
-    Mesh* CreateGlassesMesh(const std::string& mesh_file_path);
+    // mirrorPath: 贴图优先从同目录下的mirrorPath子目录加载, 找不到再回退到原路径
+    Mesh* CreatePBRMesh(const std::string& mesh_file_path, const char* mirrorPath = nullptr);
+    // 异步版CreatePBRMesh: 读文件, 解析obj(.r3z)和解码png都在后台线程池里并行,
+    // 只有GL对象的创建留给渲染线程的ProcessAsyncLoads.
+    // .r3dmesh和流式加载需要在GL线程上传, 异步路径不使用
+    std::shared_ptr<MeshLoadHandle> CreatePBRMeshAsync(const std::string& mesh_file_path, const char* mirrorPath = nullptr);
+    // 为后台已完成的异步加载创建贴图和材质. BeginRender/BeginRenderNoClear会自动调用. 返回本次完成的数量
+    int ProcessAsyncLoads();
+
+    // 渐进式贴图流送. bytes_per_frame>0时, 需要mipmap的贴图创建时只上传不超过64像素的小mip,
+    // 更精细的mip在之后每帧的预算内从小到大补齐(用GL_TEXTURE_BASE_LEVEL限制采样范围).
+    // max_resident_size>0时超过该尺寸的mip不上传, 用来按屏幕上的需要限制显存. 默认0(关闭)
+    void SetTextureStreamingBudget(size_t bytes_per_frame, int max_resident_size = 0);
+    // 推进贴图流送, BeginRender/BeginRenderNoClear会自动调用. 返回本次上传的字节数
+    size_t ProcessTextureStreams();
+    // 后台线程数, 0(默认)为hardware_concurrency. 在第一次CreatePBRMeshAsync之前设置才有效
+    void SetAsyncLoadThreadCount(int thread_count);
+    Mesh* CreateScanMesh(const std::string& mesh_file_path, bool export_triangles = false);
+    Mesh* createUnlitMesh(const std::string& mesh_file_path);
+    Mesh* CreateDepthMesh(const std::string& mesh_file_path);
     Mesh* CreateOccluderMesh(const std::string& mesh_file_path);
+    // 共用prototype几何和材质的实例, 只有变换是独立的, 并自动加入Renderer.
+    // 共用同一原型的不透明submesh在RenderMeshes里合并成一次instanced draw.
+    // 可以RemoveMesh(prototype)只让实例显示. delete prototype后它的实例不再绘制
+    Mesh* CreateMeshInstance(Mesh* prototype);
+    // 之后创建的PBR和unlit材质是否使用SHADER_FEATURE_INSTANCED变体, 默认关闭.
+    // 自带的shader没有用R3D_MAT_*, 只有换成支持实例化的shader后才值得开启, 否则只会多编译一套变体
+    void SetInstancing(bool enabled);
+    const DrawStats& GetDrawStats() const;
     GLuint GetStandaloneColorTextureId() const;
 
 private:
+    // 加载mesh几何: 优先用新鲜的.r3dmesh, 否则解析obj. thread_count见ObjMeshParser::SetThreadCount
+    Mesh* LoadMeshGeometry(const std::string& mesh_file_path, std::vector<std::string>* submesh_material_names, bool export_triangles = false, int thread_count = 1);
+    // 只在CPU上解析obj或.r3z, 不碰GL. 可以在后台线程调用
+    Mesh* ParseMeshGeometry(const std::string& mesh_file_path, std::vector<std::string>* submesh_material_names, bool export_triangles, int thread_count, int vertex_format);
+    // 按 xxx_材质名_Base/RMA/Normal/Emissive.png 的规则给submesh创建PBR材质. load_texture(路径, 半透明输出)
+    void SetupPBRMaterials(Mesh* mesh, std::vector<std::string>& submesh_material_names, const std::string& mesh_file_path, const char* mirrorPath,
+                           const std::function<Texture*(const std::string&, bool*)>& load_texture);
+    // 加载KTX2(2D或cube)并以cache_key加入m_texture_cache. 格式既不支持也无法软解时返回nullptr
+    Texture* LoadKtx2Texture(const std::string& cache_key, const std::string& ktx2_file, TextureType type, bool* out_translucent_flag);
+    bool IsCompressedFormatSupported(GLenum format);
+    bool IsProgramBinarySupported();
+    // 更新并绑定R3DFrame
+    void UpdateFrameConstants();
+    // 重新计算mesh的世界AABB并更新BVH(或m_unbounded_meshes)
+    void UpdateMeshBounds(Mesh* mesh);
+    void RemoveMeshBounds(Mesh* mesh);
+    // 把所有submesh的包围球变换到世界空间, 4个一组与视锥求交, 结果在m_cull_visible
+    void CullSubMeshes();
+    // 按原型把可以instanced draw的不透明绘制分组, 并上传所有组的世界矩阵
+    void BuildInstanceBatches();
+    // 收集所有submesh的绘制并排序: 不透明在前按状态分组, 半透明在后从后往前
+    void BuildRenderQueue();
+    bool IsParallelShaderCompileSupported();
+
+    // 提交编译(或者从binary缓存加载)和收取结果分开, 预编译时中间可以隔几帧
+    struct PendingProgram
+    {
+        Program* program = nullptr;
+        std::string cache_key;
+        std::string binary_file;
+        uint64_t binary_key = 0;
+        // 从binary缓存加载的已经链接好了
+        bool linked = false;
+        // m_program_cache里已有的, program为空
+        Program* cached = nullptr;
+    };
+    bool BeginLoadProgram(const std::string& vert_file, const std::string& frag_file, const std::string& macros, PendingProgram* pending);
+    bool BeginLoadProgramVariant(ShaderId shader, int features, PendingProgram* pending);
+    // 失败时释放program, 返回nullptr
+    Program* FinishLoadProgram(PendingProgram* pending);
+    // 上传初始的小mip, 没传完的加入m_texture_streams. 返回全部传完后占用的字节数
+    size_t StartTextureStream(std::shared_ptr<TextureStream> stream);
+    // 贴图释放前调用
+    void CancelTextureStream(Texture* texture);
+    // 从解码好的紧凑像素(RGBA或RGB)创建贴图并加入m_texture_cache
+    Texture* CreateTextureFromPixels(const std::string& texture_file, int width, int height, const uint8* pixels, TextureFormat format, bool translucent, bool generate_mipmap);
+    void FillCubeTextureFaces(Texture* texture, const std::string& cube_texture_file, bool load_mipmap_chain, int mip_level, int* out_face_size);
+
+private:
+    struct TextureInfo
+    {
+        Texture* texture = nullptr;
+        bool translucent = false;
+        size_t byte_size = 0;
+        int ref_count = 0;
+        // 没有引用时在m_texture_lru中的位置, 否则为m_texture_lru.end()
+        std::list<std::string>::iterator lru_iter;
+    };
+    void AddTextureToCache(const std::string& key, Texture* texture, bool translucent, size_t byte_size);
+    void TouchCachedTexture(TextureInfo& ti);
+    void EvictTextures();
+
     std::list<Mesh*> m_mesh_list;
     Camera* m_camera;
     std::map<std::string, Program*> m_program_cache;
-    std::map<std::string, Texture*> m_texture_cache;
-    Texture* m_diffuse_env_texture;
-    Texture* m_specular_env_texture;
-    Texture* m_ibl_dfg_texture;
-    Texture* m_ibl_irradiance_texture;
-    Texture* m_ibl_skybox_texture;
+    FrameConstants m_frame_constants;
+    GLStateCache m_gl_state;
+    // 每帧复用, 容量稳定后不再分配
+    std::vector<DrawItem> m_draw_items;
+    std::vector<DrawItem> m_draw_items_scratch;
+    // 同一原型的不透明绘制, 在第一次出现的位置一起画
+    struct InstanceBatch
+    {
+        SubMesh* prototype = nullptr;
+        int count = 0;
+        // 在m_instance_matrices中的起始矩阵序号
+        int first = 0;
+        // 已经写入的矩阵数
+        int filled = 0;
+        bool drawn = false;
+    };
+    bool m_instancing = false;
+    std::vector<InstanceBatch> m_instance_batches;
+    std::unordered_map<SubMesh*, int> m_instance_batch_lookup;
+    // 与m_draw_items一一对应, 不参与合并的为-1
+    std::vector<int> m_draw_item_batches;
+    std::vector<float> m_instance_matrices;
+    GLuint m_instance_vbo = 0;
+    DrawStats m_draw_stats;
+    // 世界空间包围球, SoA便于SIMD
+    struct CullSphereArrays
+    {
+        std::vector<float> x;
+        std::vector<float> y;
+        std::vector<float> z;
+        std::vector<float> radius;
+    };
+    CullSphereArrays m_cull_spheres;
+    MeshBVH m_mesh_bvh;
+    // 含动态submesh的mesh, 不进BVH, 每帧都参与submesh级的剔除
+    std::vector<Mesh*> m_unbounded_meshes;
+    // 自上一帧以来变换过的mesh
+    std::vector<Mesh*> m_dirty_meshes;
+    std::vector<Mesh*> m_visible_meshes;
+    // m_mesh_list中所有mesh的submesh总数
+    int m_submesh_count = 0;
+    std::vector<SubMesh*> m_cull_candidates;
+    std::vector<uint8_t> m_cull_visible;
+    CullStats m_cull_stats;
+    bool m_frustum_culling = true;
+    OcclusionBuffer m_occlusion_buffer;
+    bool m_occlusion_culling = true;
+    int m_occlusion_width = 256;
+    int m_occlusion_height = 128;
+    int m_occlusion_thread_count = 0;
+    GLuint m_occlusion_debug_texture = 0;
+    std::vector<uint8> m_occlusion_debug_pixels;
+    GLStateStats m_gl_state_stats;
+    uint64_t m_frame_index = 0;
+    GLuint m_frame_ubo = 0;
+    std::string m_program_binary_cache_dir;
+    int m_program_binary_supported = -1;
+    // key: shader << SHADER_FEATURE_COUNT | features. program由m_program_cache持有
+    std::unordered_map<int, Program*> m_program_variants;
+    std::map<int, PendingProgram> m_pending_variants;
+    std::list<ShaderVariant> m_queued_variants;
+    int m_variants_per_frame = 0;
+    int m_parallel_shader_compile_supported = -1;
+    std::map<std::string, TextureInfo> m_texture_cache;
+    // 可淘汰的贴图, 最近使用的在尾部
+    std::list<std::string> m_texture_lru;
+    size_t m_texture_memory = 0;
+    size_t m_texture_cache_budget = 0;
+    Texture* m_diffuse_env_texture = nullptr;
+    Texture* m_specular_env_texture = nullptr;
+    Texture* m_ibl_brdf_lut_texture = nullptr;
+    Texture* m_ibl_diffuse_env_texture = nullptr;
+    Texture* m_ibl_specular_env_texture = nullptr;
     float m_sh_params[9 * 3];
     int m_screen_width;
     int m_screen_height;
+    std::string m_resource_dir;
+    size_t m_mesh_streaming_budget = 0;
+    int m_vertex_format = VERTEX_FORMAT_FLOAT;
+    std::set<GLenum> m_compressed_texture_formats;
+    bool m_compressed_texture_formats_queried = false;
+    size_t m_texture_stream_budget = 0;
+    int m_texture_stream_max_size = 0;
+    std::list<std::shared_ptr<TextureStream>> m_texture_streams;
+    AssetLoadPool* m_load_pool = nullptr;
+    int m_load_thread_count = 0;
+    std::list<std::shared_ptr<AsyncPBRLoad>> m_async_loads;
     
     bool m_use_standalone_fbo = false;
     GLuint m_standalone_fbo = 0;
@@ -388,6 +1330,9 @@ private:
     
     GLuint m_background_program = 0;
     GLint m_background_uniform_loc = -1;
+    friend class Mesh;
 };
 
+} // namespace render3d
+
 #endif /* model_hpp */